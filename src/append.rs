@@ -0,0 +1,425 @@
+//! Incremental append of new documents from a CIFF delta to a PISA binary collection.
+//!
+//! The existing collection is streamed once, in term order, alongside the postings lists of
+//! the delta: lists of terms in both are concatenated, as all new document IDs follow the
+//! existing ones, and lists of new terms are inserted in order. Existing postings are copied as
+//! raw bytes, and only delta lists are decoded, so the time of an update depends on the size of
+//! the delta, plus one sequential copy of the collection.
+
+use crate::filter::{check_distinct_output, list_term_and_df};
+use crate::io_backend::copy_range;
+use crate::postings::map_file;
+use crate::{document_length, parallel, pb_style, read_document_count, read_raw_message};
+use crate::{encode_u32_sequence, Result};
+use crate::{BinaryCollection, BinarySequence, DocRecord, EncodedList, Header, PostingsList};
+use anyhow::{anyhow, bail, Context};
+use indicatif::ProgressBar;
+use protobuf::{CodedInputStream, Message};
+use std::cmp::Ordering;
+use std::convert::TryFrom;
+use std::fs::File;
+use std::io::{BufRead, BufReader, BufWriter, Read, Write};
+use std::path::{Path, PathBuf};
+
+/// Options of [`append_ciff`].
+#[derive(Debug, Clone)]
+pub struct AppendOptions {
+    /// Number of threads merging postings lists.
+    pub threads: usize,
+}
+
+impl Default for AppendOptions {
+    fn default() -> Self {
+        Self {
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+        }
+    }
+}
+
+/// Postings of a term in the existing collection, in the delta, or in both.
+struct MergedList<'a> {
+    term: String,
+    existing: Option<(BinarySequence<'a>, BinarySequence<'a>)>,
+    delta: Option<Vec<u8>>,
+}
+
+/// Stream of lists read by `read`, whose terms are checked to be in increasing order.
+struct SortedLists<T, F> {
+    next: Option<(String, T)>,
+    read: F,
+    name: &'static str,
+}
+
+impl<T, F> SortedLists<T, F>
+where
+    F: FnMut() -> Result<Option<(String, T)>>,
+{
+    fn new(mut read: F, name: &'static str) -> Result<Self> {
+        Ok(Self {
+            next: read()?,
+            read,
+            name,
+        })
+    }
+
+    fn peek(&self) -> Option<&str> {
+        self.next.as_ref().map(|(term, _)| term.as_str())
+    }
+
+    fn pop(&mut self) -> Result<(String, T)> {
+        let next = (self.read)()?;
+        if let (Some((previous, _)), Some((term, _))) = (&self.next, &next) {
+            if term <= previous {
+                bail!(
+                    "Terms of the {} are not sorted: {:?} follows {:?}",
+                    self.name,
+                    term,
+                    previous
+                );
+            }
+        }
+        std::mem::replace(&mut self.next, next).ok_or_else(|| anyhow!("No more lists"))
+    }
+}
+
+/// Returns a reader of the lists of the existing collection, with their terms.
+fn existing_lists<'a>(
+    terms: impl Iterator<Item = std::io::Result<String>>,
+    mut documents: BinaryCollection<'a>,
+    mut frequencies: BinaryCollection<'a>,
+) -> impl FnMut() -> Result<Option<(String, (BinarySequence<'a>, BinarySequence<'a>))>> {
+    let mut terms = terms.fuse();
+    move || {
+        let Some(term) = terms.next().transpose()? else {
+            if documents.next().is_some() || frequencies.next().is_some() {
+                bail!("The collection has more postings lists than terms");
+            }
+            return Ok(None);
+        };
+        let lists = documents.next().zip(frequencies.next());
+        let Some((documents, frequencies)) = lists else {
+            bail!("The collection has fewer postings lists than terms");
+        };
+        let (documents, frequencies) = (documents?, frequencies?);
+        if documents.len() != frequencies.len() {
+            bail!("Documents and frequencies of {} differ in length", term);
+        }
+        Ok(Some((term, (documents, frequencies))))
+    }
+}
+
+/// Concatenates the postings of a term in the existing collection with those in the delta,
+/// whose document IDs are shifted by `first_docid`, the number of existing documents.
+fn merge_list(
+    list: &MergedList<'_>,
+    first_docid: u32,
+    delta_documents: u32,
+) -> Result<EncodedList> {
+    let delta = list
+        .delta
+        .as_ref()
+        .map(|message| PostingsList::parse_from_bytes(message))
+        .transpose()?;
+    let postings = delta.as_ref().map_or(&[][..], PostingsList::get_postings);
+    let existing_length = list
+        .existing
+        .as_ref()
+        .map_or(0, |(documents, _)| documents.len());
+    let length = u32::try_from(existing_length + postings.len())?;
+
+    let mut encoded = EncodedList::default();
+    encoded.documents.extend_from_slice(&length.to_le_bytes());
+    encoded.frequencies.extend_from_slice(&length.to_le_bytes());
+    if let Some((documents, frequencies)) = &list.existing {
+        encoded.documents.extend_from_slice(documents.bytes());
+        encoded.frequencies.extend_from_slice(frequencies.bytes());
+    }
+    let mut docid = 0_u32;
+    for posting in postings {
+        let gap = u32::try_from(posting.get_docid()).context("Negative ID")?;
+        docid = docid
+            .checked_add(gap)
+            .filter(|&docid| docid < delta_documents)
+            .ok_or_else(|| anyhow!("Document ID out of bounds in {}", list.term))?;
+        let tf = u32::try_from(posting.get_tf()).context("Negative frequency")?;
+        encoded
+            .documents
+            .extend_from_slice(&(first_docid + docid).to_le_bytes());
+        encoded.frequencies.extend_from_slice(&tf.to_le_bytes());
+    }
+    encoded.term = format!("{}\n", list.term).into_bytes();
+    Ok(encoded)
+}
+
+/// Reads the next raw list of the delta, with its term, if any of the `remaining` lists is left.
+fn read_delta_list(
+    input: &mut CodedInputStream<'_>,
+    remaining: &mut u32,
+) -> Result<Option<(String, Vec<u8>)>> {
+    if *remaining == 0 {
+        return Ok(None);
+    }
+    *remaining -= 1;
+    let message = read_raw_message(input)?;
+    let (term, _) =
+        list_term_and_df(&message, true)?.ok_or_else(|| anyhow!("Truncated postings list"))?;
+    Ok(Some((term, message)))
+}
+
+/// Merges lists of the existing collection and of the delta by term.
+fn merge_by_term<'a, E, D>(
+    mut existing: SortedLists<(BinarySequence<'a>, BinarySequence<'a>), E>,
+    mut delta: SortedLists<Vec<u8>, D>,
+) -> impl Iterator<Item = Result<MergedList<'a>>>
+where
+    E: FnMut() -> Result<Option<(String, (BinarySequence<'a>, BinarySequence<'a>))>>,
+    D: FnMut() -> Result<Option<(String, Vec<u8>)>>,
+{
+    let mut next = move || -> Result<Option<MergedList<'a>>> {
+        let order = match (existing.peek(), delta.peek()) {
+            (None, None) => return Ok(None),
+            (Some(existing), Some(delta)) => existing.cmp(delta),
+            (Some(_), None) => Ordering::Less,
+            (None, Some(_)) => Ordering::Greater,
+        };
+        let mut list = MergedList {
+            term: String::new(),
+            existing: None,
+            delta: None,
+        };
+        if order != Ordering::Greater {
+            let (term, lists) = existing.pop()?;
+            list.term = term;
+            list.existing = Some(lists);
+        }
+        if order != Ordering::Less {
+            let (term, message) = delta.pop()?;
+            list.term = term;
+            list.delta = Some(message);
+        }
+        Ok(Some(list))
+    };
+    std::iter::from_fn(move || next().transpose())
+}
+
+fn create(path: &Path) -> Result<File> {
+    File::create(path).with_context(|| format!("Unable to create {}", path.display()))
+}
+
+fn open(path: &Path) -> Result<File> {
+    File::open(path).with_context(|| format!("Unable to open {}", path.display()))
+}
+
+/// Copies `.sizes` and `.documents` of the existing collection, and appends the documents of
+/// the delta.
+fn append_documents<F>(
+    collection: &Path,
+    output: &Path,
+    existing_documents: u32,
+    delta_documents: u32,
+    mut next_record: F,
+) -> Result<()>
+where
+    F: FnMut() -> Result<DocRecord>,
+{
+    let path =
+        |base: &Path, extension: &str| PathBuf::from(format!("{}.{}", base.display(), extension));
+    let existing_sizes = open(&path(collection, "sizes"))?;
+    let mut count = [0_u8; 4];
+    (&existing_sizes).read_exact(&mut count)?;
+    let sizes_length = existing_sizes.metadata()?.len();
+    if u32::from_le_bytes(count) != existing_documents
+        || sizes_length != 4 * (u64::from(existing_documents) + 1)
+    {
+        bail!("Document sizes do not match the number of documents");
+    }
+    let mut sizes = create(&path(output, "sizes"))?;
+    sizes.write_all(&(existing_documents + delta_documents).to_le_bytes())?;
+    copy_range(&existing_sizes, 4..sizes_length, &mut sizes)?;
+    let existing_titles = open(&path(collection, "documents"))?;
+    let mut titles = create(&path(output, "documents"))?;
+    copy_range(
+        &existing_titles,
+        0..existing_titles.metadata()?.len(),
+        &mut titles,
+    )?;
+
+    eprintln!("Appending {} documents", delta_documents);
+    let mut sizes = BufWriter::new(sizes);
+    let mut titles = BufWriter::new(titles);
+    for docid in 0..delta_documents {
+        let record = next_record()?;
+        let length = document_length(&record, docid)?;
+        sizes.write_all(&length.to_le_bytes())?;
+        writeln!(titles, "{}", record.get_collection_docid())?;
+    }
+    sizes.flush()?;
+    titles.flush()?;
+    Ok(())
+}
+
+/// Appends the documents of a CIFF `delta` to the PISA binary collection with basename
+/// `collection`, and writes the result to a new collection with basename `output`.
+///
+/// Documents of the delta, numbered from 0 as in any CIFF file, follow the existing documents:
+/// document `i` of the delta becomes document `n + i`, where `n` is the number of existing
+/// documents. Postings lists of both must be sorted by term, as CIFF exports and collections
+/// converted from them are. Only `.docs`, `.freqs`, `.terms`, `.sizes`, and `.documents` are
+/// written; other outputs, such as scores, depend on the whole collection and must be recomputed.
+///
+/// Lists are merged in parallel by [`AppendOptions::threads`] threads.
+///
+/// # Errors
+///
+/// Returns an error when:
+/// - an IO error occurs,
+/// - the collection or the delta is malformed,
+/// - terms of either are not sorted,
+/// - a file of `output` is the same as one of `collection`, which is read while writing the
+///   output,
+/// - the number of documents overflows.
+pub fn append_ciff(
+    collection: &Path,
+    delta: &Path,
+    output: &Path,
+    options: &AppendOptions,
+) -> Result<()> {
+    let path =
+        |base: &Path, extension: &str| PathBuf::from(format!("{}.{}", base.display(), extension));
+    for extension in &["docs", "freqs", "terms", "sizes", "documents"] {
+        check_distinct_output(&path(collection, extension), &path(output, extension))?;
+    }
+    let documents_mmap = map_file(&path(collection, "docs"))?;
+    let frequencies_mmap = map_file(&path(collection, "freqs"))?;
+    let mut documents = BinaryCollection::try_from(&documents_mmap[..])?;
+    let existing_documents = read_document_count(&mut documents)?;
+    let num_existing_lists = BinaryCollection::try_from(&documents_mmap[..])?.count() - 1;
+    let terms = BufReader::new(open(&path(collection, "terms"))?).lines();
+    let existing = SortedLists::new(
+        existing_lists(
+            terms,
+            documents,
+            BinaryCollection::try_from(&frequencies_mmap[..])?,
+        ),
+        "collection",
+    )?;
+
+    let mut delta_reader = BufReader::new(open(delta)?);
+    let mut input = CodedInputStream::from_buffered_reader(&mut delta_reader);
+    let header = Header::from_stream(&mut input)?;
+    println!("{}", header);
+    let num_documents = existing_documents
+        .checked_add(header.num_documents)
+        .ok_or_else(|| {
+            anyhow!(
+                "Too many documents: {} + {}",
+                existing_documents,
+                header.num_documents
+            )
+        })?;
+
+    let mut documents_out = BufWriter::new(create(&path(output, "docs"))?);
+    encode_u32_sequence(&mut documents_out, 1, [num_documents])?;
+    let mut frequencies_out = BufWriter::new(create(&path(output, "freqs"))?);
+    let mut terms_out = BufWriter::new(create(&path(output, "terms"))?);
+
+    eprintln!("Merging postings");
+    let progress =
+        ProgressBar::new(num_existing_lists as u64 + u64::from(header.num_postings_lists));
+    progress.set_style(pb_style());
+    progress.set_draw_delta(10);
+    let mut remaining = header.num_postings_lists;
+    let delta_input = &mut input;
+    let delta_lists = SortedLists::new(
+        move || read_delta_list(delta_input, &mut remaining),
+        "delta",
+    )?;
+    let threads = options.threads.max(1);
+    parallel::map_ordered(
+        threads,
+        4 * threads,
+        merge_by_term(existing, delta_lists),
+        |list| merge_list(&list, existing_documents, header.num_documents),
+        |encoded| {
+            documents_out.write_all(&encoded.documents)?;
+            frequencies_out.write_all(&encoded.frequencies)?;
+            terms_out.write_all(&encoded.term)?;
+            progress.inc(1);
+            Ok(())
+        },
+    )?;
+    progress.finish();
+    documents_out.flush()?;
+    frequencies_out.flush()?;
+    terms_out.flush()?;
+
+    append_documents(
+        collection,
+        output,
+        existing_documents,
+        header.num_documents,
+        || Ok(input.read_message::<DocRecord>()?),
+    )
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::Posting;
+
+    fn sequence(bytes: &[u8]) -> Vec<u32> {
+        BinarySequence::try_from(&bytes[4..])
+            .unwrap()
+            .iter()
+            .collect()
+    }
+
+    #[test]
+    fn test_merge_list() -> Result<()> {
+        let mut existing_documents = Vec::new();
+        encode_u32_sequence(&mut existing_documents, 2, [1, 4])?;
+        let mut existing_frequencies = Vec::new();
+        encode_u32_sequence(&mut existing_frequencies, 2, [3, 1])?;
+        let mut delta = PostingsList::default();
+        delta.set_term("term".to_string());
+        for &(gap, tf) in &[(0, 2), (2, 5)] {
+            let mut posting = Posting::default();
+            posting.set_docid(gap);
+            posting.set_tf(tf);
+            delta.mut_postings().push(posting);
+        }
+        let list = MergedList {
+            term: "term".to_string(),
+            existing: Some((
+                BinarySequence::try_from(&existing_documents[4..]).unwrap(),
+                BinarySequence::try_from(&existing_frequencies[4..]).unwrap(),
+            )),
+            delta: Some(delta.write_to_bytes()?),
+        };
+        let merged = merge_list(&list, 10, 3)?;
+        assert_eq!(sequence(&merged.documents), vec![1, 4, 10, 12]);
+        assert_eq!(sequence(&merged.frequencies), vec![3, 1, 2, 5]);
+        assert_eq!(merged.term, b"term\n");
+        assert!(merge_list(&list, 10, 2).is_err());
+
+        let new_term = MergedList {
+            existing: None,
+            ..list
+        };
+        assert_eq!(
+            sequence(&merge_list(&new_term, 10, 3)?.documents),
+            vec![10, 12]
+        );
+        Ok(())
+    }
+
+    #[test]
+    fn test_sorted_lists() -> Result<()> {
+        let mut terms = vec!["b", "a"].into_iter();
+        let read = || Ok(terms.next().map(|term| (term.to_string(), ())));
+        let mut lists = SortedLists::new(read, "test")?;
+        assert_eq!(lists.peek(), Some("b"));
+        assert!(lists.pop().is_err());
+        Ok(())
+    }
+}
@@ -0,0 +1,345 @@
+//! Drop-behind access to large files, so that conversions do not evict other data, such as
+//! indexes being served, from the page cache.
+//!
+//! Ranges are dropped with `posix_fadvise(POSIX_FADV_DONTNEED)` once they have been processed.
+//! Written ranges are first written back with `sync_file_range`: writeback of a window is
+//! started as soon as it is complete, and waited for only one window later, so that writing
+//! is not throttled by the disk more than necessary.
+
+use memmap::Mmap;
+use std::fs::File;
+use std::io::{self, Read, Seek, SeekFrom, Write};
+
+/// Size of ranges dropped at once.
+pub(crate) const WINDOW: u64 = 32 << 20;
+
+/// Page cache control; a no-op on platforms other than Linux.
+#[cfg(target_os = "linux")]
+mod sys {
+    use std::convert::TryFrom;
+    use std::fs::File;
+    use std::io;
+    use std::os::unix::io::{AsRawFd, RawFd};
+
+    pub(super) type Fd = RawFd;
+
+    pub(super) fn fd(file: &File) -> Fd {
+        file.as_raw_fd()
+    }
+
+    /// Drops a range of a file from the page cache; a length of 0 extends to the end.
+    pub(super) fn drop_range(fd: Fd, offset: u64, length: u64) -> io::Result<()> {
+        // SAFETY: no memory is passed to the kernel.
+        let result = unsafe {
+            libc::posix_fadvise(
+                fd,
+                offset as libc::off_t,
+                length as libc::off_t,
+                libc::POSIX_FADV_DONTNEED,
+            )
+        };
+        if result == 0 {
+            Ok(())
+        } else {
+            Err(io::Error::from_raw_os_error(result))
+        }
+    }
+
+    /// Starts writeback of a range of a file, and waits for it to complete if `wait` is set;
+    /// a length of 0 extends to the end.
+    pub(super) fn write_back(fd: Fd, offset: u64, length: u64, wait: bool) -> io::Result<()> {
+        let flags = if wait {
+            libc::SYNC_FILE_RANGE_WAIT_BEFORE
+                | libc::SYNC_FILE_RANGE_WRITE
+                | libc::SYNC_FILE_RANGE_WAIT_AFTER
+        } else {
+            libc::SYNC_FILE_RANGE_WRITE
+        };
+        // SAFETY: no memory is passed to the kernel.
+        let result = unsafe {
+            libc::sync_file_range(fd, offset as libc::off64_t, length as libc::off64_t, flags)
+        };
+        if result == 0 {
+            Ok(())
+        } else {
+            Err(io::Error::last_os_error())
+        }
+    }
+
+    /// Page size if `memory` starts at a page boundary, as mappings do.
+    pub(super) fn mapping_page_size(memory: &[u8]) -> Option<usize> {
+        // SAFETY: `sysconf` has no preconditions.
+        let page_size = usize::try_from(unsafe { libc::sysconf(libc::_SC_PAGESIZE) }).ok()?;
+        if page_size > 0 && memory.as_ptr() as usize % page_size == 0 {
+            Some(page_size)
+        } else {
+            None
+        }
+    }
+
+    pub(super) fn advise_sequential(memory: &[u8]) {
+        // SAFETY: advice only, on pages of a mapping.
+        unsafe {
+            libc::madvise(
+                memory.as_ptr() as *mut libc::c_void,
+                memory.len(),
+                libc::MADV_SEQUENTIAL,
+            );
+        }
+    }
+
+    /// Unmaps pages of a read-only, file-backed mapping; they are mapped again from the file if
+    /// accessed later.
+    pub(super) fn unmap_pages(memory: &[u8]) -> io::Result<()> {
+        // SAFETY: the pages belong to a read-only, file-backed mapping, so their contents do not
+        // change.
+        let result = unsafe {
+            libc::madvise(
+                memory.as_ptr() as *mut libc::c_void,
+                memory.len(),
+                libc::MADV_DONTNEED,
+            )
+        };
+        if result == 0 {
+            Ok(())
+        } else {
+            Err(io::Error::last_os_error())
+        }
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+mod sys {
+    use std::fs::File;
+    use std::io;
+
+    pub(super) type Fd = ();
+
+    pub(super) fn fd(_: &File) -> Fd {}
+
+    pub(super) fn drop_range(_: Fd, _: u64, _: u64) -> io::Result<()> {
+        Ok(())
+    }
+
+    pub(super) fn write_back(_: Fd, _: u64, _: u64, _: bool) -> io::Result<()> {
+        Ok(())
+    }
+
+    pub(super) fn mapping_page_size(_: &[u8]) -> Option<usize> {
+        None
+    }
+
+    pub(super) fn advise_sequential(_: &[u8]) {}
+
+    pub(super) fn unmap_pages(_: &[u8]) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+/// Tracks the processed prefix of a file, and drops it from the page cache window by window.
+#[derive(Debug)]
+pub(crate) struct DropBehind {
+    fd: sys::Fd,
+    /// Bytes before this offset have been dropped.
+    dropped: u64,
+    /// Bytes before this offset are being written back.
+    writeback: u64,
+}
+
+impl DropBehind {
+    /// Tracks `file`, which must outlive the returned value.
+    pub(crate) fn new(file: &File) -> Self {
+        Self {
+            fd: sys::fd(file),
+            dropped: 0,
+            writeback: 0,
+        }
+    }
+
+    /// Drops complete windows of the file before `offset`, which have been read.
+    pub(crate) fn read_to(&mut self, offset: u64) -> io::Result<()> {
+        if offset >= self.dropped + WINDOW {
+            sys::drop_range(self.fd, self.dropped, offset - self.dropped)?;
+            self.dropped = offset;
+        }
+        Ok(())
+    }
+
+    /// Starts writeback of the file before `offset`, which has been written, and drops the
+    /// window whose writeback was started previously.
+    pub(crate) fn written_to(&mut self, offset: u64) -> io::Result<()> {
+        if offset >= self.writeback + WINDOW {
+            sys::write_back(self.fd, self.writeback, offset - self.writeback, false)?;
+            if self.writeback > self.dropped {
+                let length = self.writeback - self.dropped;
+                sys::write_back(self.fd, self.dropped, length, true)?;
+                sys::drop_range(self.fd, self.dropped, length)?;
+                self.dropped = self.writeback;
+            }
+            self.writeback = offset;
+        }
+        Ok(())
+    }
+
+    /// Drops the rest of a file that has been read.
+    pub(crate) fn finish_read(&mut self) -> io::Result<()> {
+        sys::drop_range(self.fd, self.dropped, 0)
+    }
+
+    /// Writes back and drops the rest of a file that has been written.
+    pub(crate) fn finish_write(&mut self) -> io::Result<()> {
+        sys::write_back(self.fd, self.dropped, 0, true)?;
+        sys::drop_range(self.fd, self.dropped, 0)?;
+        self.writeback = self.dropped;
+        Ok(())
+    }
+}
+
+/// File read or written sequentially, and dropped from the page cache behind the current
+/// position if enabled.
+pub(crate) struct DropBehindFile {
+    file: File,
+    offset: u64,
+    drop_behind: Option<DropBehind>,
+    written: bool,
+}
+
+impl DropBehindFile {
+    pub(crate) fn new(file: File, enabled: bool) -> Self {
+        let drop_behind = if enabled {
+            Some(DropBehind::new(&file))
+        } else {
+            None
+        };
+        Self {
+            file,
+            offset: 0,
+            drop_behind,
+            written: false,
+        }
+    }
+}
+
+impl Read for DropBehindFile {
+    fn read(&mut self, buffer: &mut [u8]) -> io::Result<usize> {
+        let length = self.file.read(buffer)?;
+        self.offset += length as u64;
+        if let Some(drop_behind) = self.drop_behind.as_mut() {
+            drop_behind.read_to(self.offset)?;
+        }
+        Ok(length)
+    }
+}
+
+impl Seek for DropBehindFile {
+    fn seek(&mut self, position: SeekFrom) -> io::Result<u64> {
+        self.offset = self.file.seek(position)?;
+        if let Some(drop_behind) = self.drop_behind.as_mut() {
+            drop_behind.read_to(self.offset)?;
+        }
+        Ok(self.offset)
+    }
+}
+
+impl Write for DropBehindFile {
+    fn write(&mut self, data: &[u8]) -> io::Result<usize> {
+        let length = self.file.write(data)?;
+        self.offset += length as u64;
+        self.written = true;
+        if let Some(drop_behind) = self.drop_behind.as_mut() {
+            drop_behind.written_to(self.offset)?;
+        }
+        Ok(length)
+    }
+
+    /// Writes back and drops everything written so far, if enabled.
+    fn flush(&mut self) -> io::Result<()> {
+        self.file.flush()?;
+        match self.drop_behind.as_mut() {
+            Some(drop_behind) => drop_behind.finish_write(),
+            None => Ok(()),
+        }
+    }
+}
+
+impl Drop for DropBehindFile {
+    fn drop(&mut self) {
+        if let Some(drop_behind) = self.drop_behind.as_mut() {
+            let _ = if self.written {
+                drop_behind.finish_write()
+            } else {
+                drop_behind.finish_read()
+            };
+        }
+    }
+}
+
+/// Drops processed ranges of a memory-mapped input file, which is read sequentially.
+pub(crate) struct MappedDropBehind<'a> {
+    memory: &'a [u8],
+    drop_behind: DropBehind,
+    page_size: Option<usize>,
+}
+
+impl<'a> MappedDropBehind<'a> {
+    /// Tracks `memory` mapped from `file`.
+    pub(crate) fn new(memory: &'a Mmap, file: &File) -> Self {
+        let page_size = sys::mapping_page_size(memory);
+        if page_size.is_some() {
+            sys::advise_sequential(memory);
+        }
+        Self {
+            memory,
+            drop_behind: DropBehind::new(file),
+            page_size,
+        }
+    }
+
+    /// Drops complete windows of the mapping before `offset`, which have been read.
+    pub(crate) fn read_to(&mut self, offset: usize) -> io::Result<()> {
+        let Some(page_size) = self.page_size else {
+            return Ok(());
+        };
+        let dropped = self.drop_behind.dropped as usize;
+        if (offset as u64) < self.drop_behind.dropped + WINDOW {
+            return Ok(());
+        }
+        let end = offset.min(self.memory.len()) / page_size * page_size;
+        // Pages cannot be dropped from the cache while they are mapped.
+        sys::unmap_pages(&self.memory[dropped..end])?;
+        self.drop_behind.read_to(end as u64)
+    }
+}
+
+impl Drop for MappedDropBehind<'_> {
+    fn drop(&mut self) {
+        if self.page_size.is_some() {
+            let _ = sys::unmap_pages(&self.memory[self.drop_behind.dropped as usize..]);
+        }
+        let _ = self.drop_behind.finish_read();
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use tempfile::TempDir;
+
+    #[test]
+    fn test_drop_behind_file() -> io::Result<()> {
+        let temp = TempDir::new()?;
+        let path = temp.path().join("data");
+        let data: Vec<u8> = (0..3 * WINDOW + 5).map(|n| (n % 251) as u8).collect();
+        let mut writer = DropBehindFile::new(File::create(&path)?, true);
+        for chunk in data.chunks(1 << 20) {
+            writer.write_all(chunk)?;
+        }
+        writer.flush()?;
+        drop(writer);
+        let mut reader = DropBehindFile::new(File::open(&path)?, true);
+        let mut actual = Vec::new();
+        reader.read_to_end(&mut actual)?;
+        assert!(actual == data);
+        Ok(())
+    }
+}
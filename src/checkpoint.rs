@@ -0,0 +1,259 @@
+//! Checkpoints of [`ciff_to_pisa_with_options`](crate::ciff_to_pisa_with_options), from which a
+//! preempted conversion resumes instead of starting over.
+//!
+//! A checkpoint is written to `{output}.checkpoint` after all outputs have been flushed, so
+//! the lengths it records are on disk. It is replaced atomically, and removed once the
+//! conversion succeeds. It is only resumed by a conversion with the same [`Fingerprint`].
+
+use crate::{crc32c, CiffToPisaOptions, Result};
+use anyhow::{bail, Context};
+use serde::{Deserialize, Serialize};
+use std::collections::BTreeMap;
+use std::convert::TryFrom;
+use std::fs::{self, File};
+use std::io::Read;
+use std::path::{Path, PathBuf};
+use std::time::UNIX_EPOCH;
+
+/// Number of bytes at the start of the input covered by a fingerprint.
+const HEAD_LENGTH: u64 = 64 << 10;
+
+/// Identifies the input and the options of a conversion.
+#[derive(Debug, Clone, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub(crate) struct Fingerprint {
+    /// Length of the input.
+    pub(crate) input_length: u64,
+    /// Modification time of the input, in nanoseconds since the Unix epoch.
+    pub(crate) input_mtime: u64,
+    /// CRC32C of the first [`HEAD_LENGTH`] bytes of the input.
+    pub(crate) input_head: u32,
+    /// CRC32C of the options that change the outputs, including the deleted documents.
+    pub(crate) options: u32,
+}
+
+impl Fingerprint {
+    pub(crate) fn new(input: &Path, options: &CiffToPisaOptions) -> Result<Self> {
+        let file =
+            File::open(input).with_context(|| format!("Unable to open {}", input.display()))?;
+        let metadata = file.metadata()?;
+        let input_mtime = metadata
+            .modified()?
+            .duration_since(UNIX_EPOCH)
+            .map_or(0, |time| u64::try_from(time.as_nanos()).unwrap_or(u64::MAX));
+        let mut head = Vec::new();
+        file.take(HEAD_LENGTH).read_to_end(&mut head)?;
+        let deletions = options.deletions.as_ref().map(|deletions| {
+            (
+                crc32c(0, &deletions.bitmap),
+                deletions.bitmap.len(),
+                deletions.drop_empty,
+            )
+        });
+        let described = format!(
+            "{:?} {:?} {:?} {:?}",
+            options.scores, options.bitmaps, options.document_lengths, deletions
+        );
+        Ok(Self {
+            input_length: metadata.len(),
+            input_mtime,
+            input_head: crc32c(0, &head),
+            options: crc32c(0, described.as_bytes()),
+        })
+    }
+}
+
+/// Progress of a conversion.
+#[derive(Debug, Clone, PartialEq, Eq, Serialize, Deserialize)]
+pub(crate) struct Checkpoint {
+    /// Fingerprint of the input and options, to detect a different conversion; missing from
+    /// checkpoints of older versions, which are therefore not resumed.
+    #[serde(default)]
+    pub(crate) fingerprint: Fingerprint,
+    /// Byte offset of the first postings list not yet processed.
+    pub(crate) input_offset: u64,
+    /// Number of postings lists processed.
+    pub(crate) lists: u32,
+    /// Number of postings lists written, fewer than `lists` if lists left empty by deletions
+    /// were dropped.
+    pub(crate) terms: u32,
+    /// Number of documents in the collection.
+    pub(crate) documents: u32,
+    /// Length of each output at the checkpoint, by extension.
+    pub(crate) outputs: BTreeMap<String, u64>,
+}
+
+impl Checkpoint {
+    /// Position before the first postings list, at `input_offset`.
+    pub(crate) fn start(fingerprint: Fingerprint, input_offset: u64, documents: u32) -> Self {
+        Self {
+            fingerprint,
+            input_offset,
+            lists: 0,
+            terms: 0,
+            documents,
+            outputs: BTreeMap::new(),
+        }
+    }
+
+    /// Path of the checkpoint of a conversion to `output`.
+    pub(crate) fn path(output: &Path) -> PathBuf {
+        PathBuf::from(format!("{}.checkpoint", output.display()))
+    }
+
+    /// Reads a checkpoint, or returns `None` if there is none.
+    pub(crate) fn load(path: &Path) -> Result<Option<Self>> {
+        match fs::read_to_string(path) {
+            Ok(contents) => Ok(Some(
+                serde_json::from_str(&contents)
+                    .with_context(|| format!("Invalid checkpoint {}", path.display()))?,
+            )),
+            Err(error) if error.kind() == std::io::ErrorKind::NotFound => Ok(None),
+            Err(error) => Err(error.into()),
+        }
+    }
+
+    /// Writes the checkpoint to a temporary file, and renames it over `path`, so that a
+    /// preemption while saving leaves the previous checkpoint intact.
+    pub(crate) fn save(&self, path: &Path) -> Result<()> {
+        let temporary = PathBuf::from(format!("{}.tmp", path.display()));
+        fs::write(&temporary, serde_json::to_vec(self)?)?;
+        fs::rename(&temporary, path)?;
+        Ok(())
+    }
+
+    /// Removes the checkpoint at `path`, if any.
+    pub(crate) fn remove(path: &Path) -> Result<()> {
+        match fs::remove_file(path) {
+            Err(error) if error.kind() != std::io::ErrorKind::NotFound => Err(error.into()),
+            _ => Ok(()),
+        }
+    }
+
+    /// Checks that the checkpoint was written by a conversion of the same input, with the same
+    /// options and outputs, given by extension.
+    pub(crate) fn validate(
+        &self,
+        fingerprint: &Fingerprint,
+        documents: u32,
+        outputs: &[&str],
+    ) -> Result<()> {
+        if self.fingerprint.input_length != fingerprint.input_length
+            || self.fingerprint.input_mtime != fingerprint.input_mtime
+            || self.fingerprint.input_head != fingerprint.input_head
+            || self.documents != documents
+        {
+            bail!("Checkpoint was written for a different input");
+        }
+        if self.fingerprint.options != fingerprint.options {
+            bail!("Checkpoint was written with different options");
+        }
+        let mut outputs = outputs.to_vec();
+        outputs.sort_unstable();
+        if !self.outputs.keys().map(String::as_str).eq(outputs) {
+            bail!(
+                "Checkpoint was written with different outputs: {:?}",
+                self.outputs.keys().collect::<Vec<_>>()
+            );
+        }
+        Ok(())
+    }
+
+    /// Length of the output with `extension`.
+    pub(crate) fn output_length(&self, extension: &str) -> Result<u64> {
+        self.outputs
+            .get(extension)
+            .copied()
+            .with_context(|| format!("Checkpoint has no length for .{}", extension))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use tempfile::TempDir;
+
+    #[test]
+    fn test_save_and_load() -> Result<()> {
+        let temp = TempDir::new()?;
+        let path = Checkpoint::path(&temp.path().join("coll"));
+        assert_eq!(Checkpoint::load(&path)?, None);
+        let fingerprint = Fingerprint {
+            input_length: 1000,
+            input_mtime: 1_600_000_000,
+            input_head: 42,
+            options: 7,
+        };
+        let checkpoint = Checkpoint {
+            fingerprint: fingerprint.clone(),
+            input_offset: 500,
+            lists: 7,
+            terms: 6,
+            documents: 3,
+            outputs: vec![("docs".to_string(), 40), ("terms".to_string(), 20)]
+                .into_iter()
+                .collect(),
+        };
+        checkpoint.save(&path)?;
+        let loaded = Checkpoint::load(&path)?.unwrap();
+        assert_eq!(loaded, checkpoint);
+        assert!(loaded.validate(&fingerprint, 3, &["docs", "terms"]).is_ok());
+        assert!(loaded
+            .validate(&fingerprint, 4, &["docs", "terms"])
+            .is_err());
+        assert!(loaded
+            .validate(&fingerprint, 3, &["docs", "scores", "terms"])
+            .is_err());
+        for changed in &[
+            Fingerprint {
+                input_length: 1001,
+                ..fingerprint.clone()
+            },
+            Fingerprint {
+                input_mtime: 1_600_000_001,
+                ..fingerprint.clone()
+            },
+            Fingerprint {
+                input_head: 43,
+                ..fingerprint.clone()
+            },
+            Fingerprint {
+                options: 8,
+                ..fingerprint.clone()
+            },
+        ] {
+            assert!(loaded.validate(changed, 3, &["docs", "terms"]).is_err());
+        }
+        assert_eq!(loaded.output_length("docs")?, 40);
+        assert!(loaded.output_length("freqs").is_err());
+        Checkpoint::remove(&path)?;
+        assert_eq!(Checkpoint::load(&path)?, None);
+        Checkpoint::remove(&path)?;
+        Ok(())
+    }
+
+    #[test]
+    fn test_fingerprint() -> Result<()> {
+        let temp = TempDir::new()?;
+        let input = temp.path().join("input");
+        fs::write(&input, b"input")?;
+        let options = CiffToPisaOptions::default();
+        let fingerprint = Fingerprint::new(&input, &options)?;
+        assert_eq!(Fingerprint::new(&input, &options)?, fingerprint);
+        let with_deletions = CiffToPisaOptions {
+            deletions: Some(crate::Deletions::from_docids(vec![1])),
+            ..CiffToPisaOptions::default()
+        };
+        let other_deletions = CiffToPisaOptions {
+            deletions: Some(crate::Deletions::from_docids(vec![2])),
+            ..CiffToPisaOptions::default()
+        };
+        let with_deletions = Fingerprint::new(&input, &with_deletions)?;
+        assert_ne!(with_deletions.options, fingerprint.options);
+        assert_ne!(
+            Fingerprint::new(&input, &other_deletions)?.options,
+            with_deletions.options
+        );
+        assert_eq!(with_deletions.input_head, fingerprint.input_head);
+        Ok(())
+    }
+}
@@ -0,0 +1,477 @@
+//! CRC32C checksums of outputs, computed while they are written, and integrity manifests that
+//! can be verified later without a separate checksumming pass.
+//!
+//! Each file is checksummed as a whole and per block of [`BLOCK_SIZE`] bytes, so that
+//! verification can check blocks in parallel and point at corrupted ranges. Whole-file checksums
+//! are combined from block checksums, so every byte is checksummed once.
+//!
+//! CRC32C uses the SSE 4.2 `crc32` instruction on `x86_64` when available, and slicing-by-8
+//! tables otherwise.
+
+use crate::{parallel, pb_style, Result};
+use anyhow::{bail, Context};
+use indicatif::ProgressBar;
+use memmap::Mmap;
+use serde::{Deserialize, Serialize};
+use std::collections::BTreeMap;
+use std::convert::{TryFrom, TryInto};
+use std::fs::{self, File};
+use std::io::Read;
+use std::path::{Path, PathBuf};
+use std::sync::Mutex;
+
+/// Size of checksummed blocks.
+pub const BLOCK_SIZE: u64 = 4 << 20;
+
+/// CRC32C (Castagnoli) polynomial, reversed.
+const POLYNOMIAL: u32 = 0x82F6_3B78;
+
+const fn make_tables() -> [[u32; 256]; 8] {
+    let mut tables = [[0; 256]; 8];
+    let mut byte = 0;
+    while byte < 256 {
+        let mut crc = byte as u32;
+        let mut bit = 0;
+        while bit < 8 {
+            crc = if crc & 1 == 1 {
+                (crc >> 1) ^ POLYNOMIAL
+            } else {
+                crc >> 1
+            };
+            bit += 1;
+        }
+        tables[0][byte] = crc;
+        byte += 1;
+    }
+    let mut byte = 0;
+    while byte < 256 {
+        let mut table = 1;
+        while table < 8 {
+            let previous = tables[table - 1][byte];
+            tables[table][byte] = (previous >> 8) ^ tables[0][(previous & 0xFF) as usize];
+            table += 1;
+        }
+        byte += 1;
+    }
+    tables
+}
+
+static TABLES: [[u32; 256]; 8] = make_tables();
+
+/// Updates a CRC register, without the initial and final inversions, with slicing-by-8.
+fn update_software(mut crc: u32, data: &[u8]) -> u32 {
+    let table = |index: usize, value: u32| TABLES[index][(value & 0xFF) as usize];
+    let mut chunks = data.chunks_exact(8);
+    for chunk in &mut chunks {
+        let low = u32::from_le_bytes(chunk[..4].try_into().expect("4 bytes")) ^ crc;
+        let high = u32::from_le_bytes(chunk[4..].try_into().expect("4 bytes"));
+        crc = table(7, low)
+            ^ table(6, low >> 8)
+            ^ table(5, low >> 16)
+            ^ table(4, low >> 24)
+            ^ table(3, high)
+            ^ table(2, high >> 8)
+            ^ table(1, high >> 16)
+            ^ table(0, high >> 24);
+    }
+    for &byte in chunks.remainder() {
+        crc = (crc >> 8) ^ table(0, crc ^ u32::from(byte));
+    }
+    crc
+}
+
+/// Updates a CRC register, without the initial and final inversions, with SSE 4.2.
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "sse4.2")]
+unsafe fn update_sse42(crc: u32, data: &[u8]) -> u32 {
+    use std::arch::x86_64::{_mm_crc32_u64, _mm_crc32_u8};
+    let mut crc = u64::from(crc);
+    let mut chunks = data.chunks_exact(8);
+    for chunk in &mut chunks {
+        crc = _mm_crc32_u64(crc, u64::from_le_bytes(chunk.try_into().expect("8 bytes")));
+    }
+    // The register holds 32 bits.
+    #[allow(clippy::cast_possible_truncation)]
+    let mut crc = crc as u32;
+    for &byte in chunks.remainder() {
+        crc = _mm_crc32_u8(crc, byte);
+    }
+    crc
+}
+
+/// Extends the CRC32C checksum `crc` of some bytes to that of the bytes followed by `data`;
+/// the checksum of no bytes is 0.
+#[must_use]
+pub fn crc32c(crc: u32, data: &[u8]) -> u32 {
+    #[cfg(target_arch = "x86_64")]
+    {
+        if is_x86_feature_detected!("sse4.2") {
+            // SAFETY: the CPU supports SSE 4.2.
+            return !unsafe { update_sse42(!crc, data) };
+        }
+    }
+    !update_software(!crc, data)
+}
+
+fn gf2_matrix_times(matrix: &[u32; 32], mut vector: u32) -> u32 {
+    let mut sum = 0;
+    let mut row = 0;
+    while vector != 0 {
+        if vector & 1 == 1 {
+            sum ^= matrix[row];
+        }
+        vector >>= 1;
+        row += 1;
+    }
+    sum
+}
+
+fn gf2_matrix_square(matrix: &[u32; 32]) -> [u32; 32] {
+    let mut square = [0; 32];
+    for (row, value) in square.iter_mut().zip(matrix) {
+        *row = gf2_matrix_times(matrix, *value);
+    }
+    square
+}
+
+/// Returns the checksum of two byte sequences concatenated, given the checksum of each and the
+/// length of the second, as zlib's `crc32_combine` does.
+#[must_use]
+pub fn crc32c_combine(mut first: u32, second: u32, mut second_length: u64) -> u32 {
+    if second_length == 0 {
+        return first;
+    }
+    // Operator appending a single zero bit, then two, then four.
+    let mut odd = [0; 32];
+    odd[0] = POLYNOMIAL;
+    for (row, value) in odd.iter_mut().enumerate().skip(1) {
+        *value = 1 << (row - 1);
+    }
+    let mut even = gf2_matrix_square(&odd);
+    odd = gf2_matrix_square(&even);
+    // Appends `second_length` zero bytes to `first`, one bit of the length at a time.
+    loop {
+        even = gf2_matrix_square(&odd);
+        if second_length & 1 == 1 {
+            first = gf2_matrix_times(&even, first);
+        }
+        second_length >>= 1;
+        if second_length == 0 {
+            break;
+        }
+        odd = gf2_matrix_square(&even);
+        if second_length & 1 == 1 {
+            first = gf2_matrix_times(&odd, first);
+        }
+        second_length >>= 1;
+        if second_length == 0 {
+            break;
+        }
+    }
+    first ^ second
+}
+
+/// Checksums of a file.
+#[derive(Debug, Clone, PartialEq, Eq, Serialize, Deserialize)]
+pub struct FileChecksum {
+    /// Length in bytes.
+    pub length: u64,
+    /// CRC32C of the whole file.
+    pub crc32c: u32,
+    /// CRC32C of each block; the last one may be shorter.
+    pub blocks: Vec<u32>,
+}
+
+/// Combines the checksums of consecutive blocks of a file of `length` bytes.
+fn combine_blocks(blocks: &[u32], length: u64, block_size: u64) -> u32 {
+    blocks
+        .iter()
+        .enumerate()
+        .fold(0, |crc, (block, &block_crc)| {
+            let start = block as u64 * block_size;
+            crc32c_combine(crc, block_crc, (length - start).min(block_size))
+        })
+}
+
+/// Computes checksums of a file as it is written.
+#[derive(Debug, Default)]
+pub(crate) struct Checksummer {
+    blocks: Vec<u32>,
+    current: u32,
+    filled: u64,
+}
+
+impl Checksummer {
+    /// Checksums the first `length` bytes of an existing file.
+    pub(crate) fn of_prefix(path: &Path, length: u64) -> Result<Self> {
+        let mut checksummer = Self::default();
+        let mut file = File::open(path)
+            .with_context(|| format!("Unable to open {}", path.display()))?
+            .take(length);
+        let mut buffer = vec![0; 1 << 20];
+        loop {
+            let read = file.read(&mut buffer)?;
+            if read == 0 {
+                break;
+            }
+            checksummer.update(&buffer[..read]);
+        }
+        if checksummer.len() < length {
+            bail!("{} is shorter than expected", path.display());
+        }
+        Ok(checksummer)
+    }
+
+    /// Number of bytes checksummed.
+    pub(crate) fn len(&self) -> u64 {
+        self.blocks.len() as u64 * BLOCK_SIZE + self.filled
+    }
+
+    pub(crate) fn update(&mut self, mut data: &[u8]) {
+        while !data.is_empty() {
+            let take = usize::try_from(BLOCK_SIZE - self.filled)
+                .unwrap_or(usize::MAX)
+                .min(data.len());
+            self.current = crc32c(self.current, &data[..take]);
+            self.filled += take as u64;
+            data = &data[take..];
+            if self.filled == BLOCK_SIZE {
+                self.blocks.push(self.current);
+                self.current = 0;
+                self.filled = 0;
+            }
+        }
+    }
+
+    pub(crate) fn finish(mut self) -> FileChecksum {
+        let length = self.len();
+        if self.filled > 0 {
+            self.blocks.push(self.current);
+        }
+        FileChecksum {
+            length,
+            crc32c: combine_blocks(&self.blocks, length, BLOCK_SIZE),
+            blocks: self.blocks,
+        }
+    }
+}
+
+/// Checksums of the outputs of a conversion, stored next to them in `{output}.manifest`.
+#[derive(Debug, Clone, PartialEq, Eq, Serialize, Deserialize)]
+pub struct Manifest {
+    /// Checksum algorithm, `crc32c`.
+    pub algorithm: String,
+    /// Size of checksummed blocks.
+    pub block_size: u64,
+    /// Checksums by file name, relative to the directory of the manifest.
+    pub files: BTreeMap<String, FileChecksum>,
+}
+
+impl Manifest {
+    /// Path of the manifest of a conversion to `output`.
+    #[must_use]
+    pub fn path(output: &Path) -> PathBuf {
+        PathBuf::from(format!("{}.manifest", output.display()))
+    }
+
+    /// Reads a manifest.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the manifest cannot be read, or is invalid.
+    pub fn load(path: &Path) -> Result<Self> {
+        let contents = fs::read_to_string(path)
+            .with_context(|| format!("Unable to open {}", path.display()))?;
+        let manifest: Self = serde_json::from_str(&contents)
+            .with_context(|| format!("Invalid manifest {}", path.display()))?;
+        if manifest.algorithm != "crc32c" || manifest.block_size == 0 {
+            bail!(
+                "Unsupported manifest: {} with blocks of {} bytes",
+                manifest.algorithm,
+                manifest.block_size
+            );
+        }
+        Ok(manifest)
+    }
+}
+
+/// Collects checksums of outputs as they are completed.
+#[derive(Debug)]
+pub(crate) struct ManifestBuilder {
+    path: PathBuf,
+    files: Mutex<BTreeMap<String, FileChecksum>>,
+}
+
+impl ManifestBuilder {
+    pub(crate) fn new(path: PathBuf) -> Self {
+        Self {
+            path,
+            files: Mutex::new(BTreeMap::new()),
+        }
+    }
+
+    pub(crate) fn add(&self, file: &Path, checksum: FileChecksum) {
+        let name = file
+            .file_name()
+            .map_or_else(String::new, |name| name.to_string_lossy().into_owned());
+        self.files
+            .lock()
+            .expect("manifest lock")
+            .insert(name, checksum);
+    }
+
+    /// Checksums an output written by an earlier run.
+    pub(crate) fn add_existing(&self, file: &Path) -> Result<()> {
+        let length = fs::metadata(file)
+            .with_context(|| format!("Unable to open {}", file.display()))?
+            .len();
+        self.add(file, Checksummer::of_prefix(file, length)?.finish());
+        Ok(())
+    }
+
+    /// Writes the manifest, replacing it atomically.
+    pub(crate) fn save(&self) -> Result<()> {
+        let manifest = Manifest {
+            algorithm: "crc32c".to_string(),
+            block_size: BLOCK_SIZE,
+            files: self.files.lock().expect("manifest lock").clone(),
+        };
+        let temporary = PathBuf::from(format!("{}.tmp", self.path.display()));
+        fs::write(&temporary, serde_json::to_vec_pretty(&manifest)?)?;
+        fs::rename(&temporary, &self.path)?;
+        Ok(())
+    }
+}
+
+/// Verifies the files listed in a manifest against their checksums, checking blocks on
+/// `threads` threads, and returns the manifest.
+///
+/// # Errors
+///
+/// Returns an error if the manifest or any of its files cannot be read, and lists all files and
+/// blocks that do not match their checksums.
+pub fn verify_manifest(path: &Path, threads: usize) -> Result<Manifest> {
+    let manifest = Manifest::load(path)?;
+    let directory = path.parent().unwrap_or_else(|| Path::new(""));
+    let block_size = manifest.block_size;
+    let total_blocks: usize = manifest.files.values().map(|file| file.blocks.len()).sum();
+    let progress = ProgressBar::new(total_blocks as u64);
+    progress.set_style(pb_style());
+    progress.set_draw_delta(10);
+    let mut failures = Vec::new();
+    for (name, expected) in &manifest.files {
+        let file_path = directory.join(name);
+        let file = File::open(&file_path)
+            .with_context(|| format!("Unable to open {}", file_path.display()))?;
+        let length = file.metadata()?.len();
+        if length != expected.length {
+            failures.push(format!(
+                "{}: {} bytes instead of {}",
+                name, length, expected.length
+            ));
+            continue;
+        }
+        if expected.blocks.len() as u64 != length.div_ceil(block_size)
+            || combine_blocks(&expected.blocks, length, block_size) != expected.crc32c
+        {
+            failures.push(format!("{}: inconsistent checksums in manifest", name));
+            continue;
+        }
+        let mmap = if length > 0 {
+            // SAFETY: the file is not modified while verified.
+            Some(unsafe { Mmap::map(&file)? })
+        } else {
+            None
+        };
+        let data: &[u8] = mmap.as_deref().unwrap_or(&[]);
+        let threads = threads.max(1);
+        parallel::map_ordered(
+            threads,
+            4 * threads,
+            expected.blocks.iter().enumerate().map(Ok),
+            |(block, &expected)| {
+                let start = usize::try_from(block as u64 * block_size)?;
+                let end = usize::try_from((block as u64 + 1) * block_size)?.min(data.len());
+                Ok((block, crc32c(0, &data[start..end]) == expected))
+            },
+            |(block, valid)| {
+                if !valid {
+                    failures.push(format!(
+                        "{}: block {} (bytes {}..) does not match",
+                        name,
+                        block,
+                        block as u64 * block_size
+                    ));
+                }
+                progress.inc(1);
+                Ok(())
+            },
+        )?;
+    }
+    progress.finish();
+    if !failures.is_empty() {
+        bail!(
+            "{} checksum failures:\n{}",
+            failures.len(),
+            failures.join("\n")
+        );
+    }
+    Ok(manifest)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use tempfile::TempDir;
+
+    #[test]
+    fn test_crc32c() {
+        assert_eq!(crc32c(0, b""), 0);
+        assert_eq!(crc32c(0, b"123456789"), 0xE306_9283);
+        let data: Vec<u8> = (0..10_000_u32).map(|n| (n * 7 % 251) as u8).collect();
+        assert_eq!(!update_software(!0, &data), crc32c(0, &data));
+        assert_eq!(
+            crc32c(crc32c(0, &data[..333]), &data[333..]),
+            crc32c(0, &data)
+        );
+        assert_eq!(
+            crc32c_combine(
+                crc32c(0, &data[..333]),
+                crc32c(0, &data[333..]),
+                10_000 - 333
+            ),
+            crc32c(0, &data)
+        );
+    }
+
+    #[test]
+    fn test_manifest() -> Result<()> {
+        let temp = TempDir::new()?;
+        let output = temp.path().join("coll");
+        let data: Vec<u8> = (0..BLOCK_SIZE * 2 + 100).map(|n| (n % 253) as u8).collect();
+        let mut checksummer = Checksummer::default();
+        for chunk in data.chunks(1_000_000) {
+            checksummer.update(chunk);
+        }
+        let checksum = checksummer.finish();
+        assert_eq!(checksum.length, data.len() as u64);
+        assert_eq!(checksum.blocks.len(), 3);
+        assert_eq!(checksum.crc32c, crc32c(0, &data));
+
+        fs::write(temp.path().join("coll.docs"), &data)?;
+        fs::write(temp.path().join("coll.sizes"), b"")?;
+        let builder = ManifestBuilder::new(Manifest::path(&output));
+        builder.add(&temp.path().join("coll.docs"), checksum);
+        builder.add_existing(&temp.path().join("coll.sizes"))?;
+        builder.save()?;
+        let manifest = verify_manifest(&Manifest::path(&output), 2)?;
+        assert_eq!(manifest.files.len(), 2);
+
+        let mut corrupted = data;
+        corrupted[usize::try_from(BLOCK_SIZE)? + 5] ^= 1;
+        fs::write(temp.path().join("coll.docs"), &corrupted)?;
+        let error = verify_manifest(&Manifest::path(&output), 2).unwrap_err();
+        assert!(error.to_string().contains("block 1 "));
+        Ok(())
+    }
+}
@@ -0,0 +1,44 @@
+//! This program appends the documents of a Common Index Format (v1) delta to a PISA binary
+//! collection, without reconverting the collection.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use ciff::{append_ciff, AppendOptions};
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-append",
+    about = "Appends the documents of a Common Index Format [v1] delta to a PISA binary collection"
+)]
+struct Args {
+    #[structopt(short, long, help = "Basename of the existing PISA collection")]
+    collection: PathBuf,
+    #[structopt(short, long, help = "Path to ciff export file of the new documents")]
+    delta: PathBuf,
+    #[structopt(short, long, help = "Output basename")]
+    output: PathBuf,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+}
+
+fn main() {
+    let args = Args::from_args();
+    let defaults = AppendOptions::default();
+    let options = AppendOptions {
+        threads: args.threads.unwrap_or(defaults.threads),
+    };
+    if let Err(error) = append_ciff(&args.collection, &args.delta, &args.output, &options) {
+        eprintln!("ERROR: {}", error);
+        std::process::exit(1);
+    }
+}
@@ -0,0 +1,70 @@
+//! This program computes co-occurrence counts and PMI of terms of a PISA binary collection.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use ciff::{cooccurrence, CooccurrenceOptions, TermSelection};
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-cooccurrence",
+    about = "Computes term co-occurrence counts and PMI over a PISA binary collection"
+)]
+struct Args {
+    #[structopt(short, long, help = "Collection basename")]
+    collection: PathBuf,
+    #[structopt(
+        long,
+        help = "File with selected terms, one per line",
+        conflicts_with = "top-df"
+    )]
+    terms: Option<PathBuf>,
+    #[structopt(
+        long,
+        help = "Select this many terms with the highest document frequencies"
+    )]
+    top_df: Option<usize>,
+    #[structopt(short, long, help = "Output TSV file")]
+    output: PathBuf,
+    #[structopt(long, default_value = "1", help = "Minimum co-occurrence count")]
+    min_count: usize,
+    #[structopt(
+        long,
+        default_value = "0.03125",
+        help = "Fraction of documents above which lists are stored as bitmaps"
+    )]
+    bitmap_density: f64,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+}
+
+fn main() {
+    let args = Args::from_args();
+    let selection = match (args.terms, args.top_df) {
+        (Some(terms), None) => TermSelection::Terms(terms),
+        (None, Some(n)) => TermSelection::TopDf(n),
+        _ => {
+            eprintln!("ERROR: either --terms or --top-df must be given");
+            std::process::exit(1);
+        }
+    };
+    let defaults = CooccurrenceOptions::default();
+    let options = CooccurrenceOptions {
+        threads: args.threads.unwrap_or(defaults.threads),
+        min_count: args.min_count,
+        bitmap_density: args.bitmap_density,
+    };
+    if let Err(error) = cooccurrence(&args.collection, &selection, &args.output, &options) {
+        eprintln!("ERROR: {}", error);
+        std::process::exit(1);
+    }
+}
@@ -0,0 +1,105 @@
+//! This program finds near-duplicate documents of a Common Index Format (v1) file or a PISA
+//! binary collection, and writes the IDs of the documents to delete.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use ciff::{cgroup_memory_limit, find_duplicates, CollectionInput, DedupOptions};
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-dedup",
+    about = "Finds near-duplicate documents of a Common Index Format [v1] file or a PISA binary collection"
+)]
+struct Args {
+    #[structopt(
+        short,
+        long,
+        help = "Path to ciff export file",
+        required_unless = "collection",
+        conflicts_with = "collection"
+    )]
+    ciff: Option<PathBuf>,
+    #[structopt(short = "b", long, help = "Basename of a PISA binary collection")]
+    collection: Option<PathBuf>,
+    #[structopt(
+        short,
+        long,
+        help = "Output file of the IDs of duplicates, one per line, for --delete-docids"
+    )]
+    output: PathBuf,
+    #[structopt(
+        long,
+        help = "Minimum estimated Jaccard similarity of near-duplicates [default: 0.8]"
+    )]
+    threshold: Option<f64>,
+    #[structopt(long, help = "Number of LSH bands [default: 16]")]
+    bands: Option<usize>,
+    #[structopt(long, help = "Number of min-hash values per band [default: 8]")]
+    rows: Option<usize>,
+    #[structopt(
+        long,
+        help = "Minimum number of distinct terms of a candidate document [default: 5]"
+    )]
+    min_terms: Option<usize>,
+    #[structopt(long, help = "Seed of the hash functions", default_value = "0")]
+    seed: u64,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+    #[structopt(
+        long,
+        default_value = "1024",
+        help = "Memory budget for forward entries and bands in MiB"
+    )]
+    memory_budget: usize,
+    #[structopt(
+        long,
+        help = "Memory limit in MiB [default: cgroup memory limit, if any]"
+    )]
+    memory_limit: Option<u64>,
+    #[structopt(
+        long,
+        help = "Directory for temporary files [default: input directory]"
+    )]
+    temp_dir: Option<PathBuf>,
+}
+
+fn main() {
+    let args = Args::from_args();
+    let input = match (args.ciff, args.collection) {
+        (Some(path), _) => CollectionInput::Ciff(path),
+        (None, Some(basename)) => CollectionInput::Pisa(basename),
+        (None, None) => unreachable!("required by the arguments"),
+    };
+    let defaults = DedupOptions::default();
+    let options = DedupOptions {
+        bands: args.bands.unwrap_or(defaults.bands),
+        rows: args.rows.unwrap_or(defaults.rows),
+        threshold: args.threshold.unwrap_or(defaults.threshold),
+        min_terms: args.min_terms.unwrap_or(defaults.min_terms),
+        seed: args.seed,
+        threads: args.threads.unwrap_or(defaults.threads),
+        memory_budget: args.memory_budget << 20,
+        memory_limit: args
+            .memory_limit
+            .map(|mib| mib << 20)
+            .or_else(cgroup_memory_limit),
+        temp_dir: args.temp_dir,
+    };
+    let output = args.output;
+    let result =
+        find_duplicates(&input, &options).and_then(|duplicates| duplicates.write_docids(&output));
+    if let Err(error) = result {
+        eprintln!("ERROR: {}", error);
+        std::process::exit(1);
+    }
+}
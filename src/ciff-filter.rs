@@ -0,0 +1,84 @@
+//! This program filters a Common Index Format (v1) file into a smaller one, keeping postings
+//! lists by term and document frequency, and optionally a range of documents.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use anyhow::Context;
+use ciff::{filter_ciff, Deletions, FilterOptions};
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-filter",
+    about = "Filters a Common Index Format [v1] file by term, document frequency, and document range"
+)]
+struct Args {
+    #[structopt(short, long, help = "Path to ciff export file")]
+    input: PathBuf,
+    #[structopt(short, long, help = "Path to filtered ciff file")]
+    output: PathBuf,
+    #[structopt(long, help = "Keep only the terms in this file, one per line")]
+    terms: Option<PathBuf>,
+    #[structopt(long, help = "Keep only lists with at least this document frequency")]
+    min_df: Option<u32>,
+    #[structopt(long, help = "Keep only lists with at most this document frequency")]
+    max_df: Option<u32>,
+    #[structopt(long, help = "Keep only documents from this ID on, renumbered from 0")]
+    docid_start: Option<u32>,
+    #[structopt(long, help = "Keep only documents before this ID")]
+    docid_end: Option<u32>,
+    #[structopt(
+        long,
+        help = "Delete the documents with the IDs in this file, one per line"
+    )]
+    delete_docids: Option<PathBuf>,
+    #[structopt(long, help = "Index description [default: input description]")]
+    description: Option<String>,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+}
+
+fn main() {
+    let args = Args::from_args();
+    let terms = args.terms.map(|path| {
+        std::fs::read_to_string(&path)
+            .with_context(|| format!("Unable to read {}", path.display()))
+            .map(|terms| terms.lines().map(String::from).collect())
+    });
+    let deletions = args.delete_docids.as_deref().map(Deletions::read_docids);
+    let (terms, deletions) = match (terms.transpose(), deletions.transpose()) {
+        (Ok(terms), Ok(deletions)) => (terms, deletions),
+        (Err(error), _) | (_, Err(error)) => {
+            eprintln!("ERROR: {:#}", error);
+            std::process::exit(1);
+        }
+    };
+    let documents = if args.docid_start.is_some() || args.docid_end.is_some() {
+        Some(args.docid_start.unwrap_or(0)..args.docid_end.unwrap_or(u32::MAX))
+    } else {
+        None
+    };
+    let defaults = FilterOptions::default();
+    let options = FilterOptions {
+        terms,
+        min_df: args.min_df,
+        max_df: args.max_df,
+        documents,
+        deletions,
+        description: args.description,
+        threads: args.threads.unwrap_or(defaults.threads),
+    };
+    if let Err(error) = filter_ciff(&args.input, &args.output, &options) {
+        eprintln!("ERROR: {}", error);
+        std::process::exit(1);
+    }
+}
@@ -0,0 +1,58 @@
+//! This program writes postings lists of a Common Index Format (v1) file or a PISA binary
+//! collection in impact order, segmented by impact, for score-at-a-time query processing.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use ciff::{impact_order, ImpactInput, ImpactOrderOptions};
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-impact-order",
+    about = "Writes impact-ordered postings lists with per-segment metadata"
+)]
+struct Args {
+    #[structopt(long, help = "Path to ciff export file", conflicts_with_all = &["documents", "impacts"])]
+    ciff: Option<PathBuf>,
+    #[structopt(
+        long,
+        help = "Path to PISA documents collection (.docs)",
+        requires = "impacts"
+    )]
+    documents: Option<PathBuf>,
+    #[structopt(long, help = "Path to PISA impacts collection (.freqs or .scores)")]
+    impacts: Option<PathBuf>,
+    #[structopt(short, long, help = "Output basename")]
+    output: PathBuf,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+}
+
+fn main() {
+    let args = Args::from_args();
+    let input = match (args.ciff, args.documents, args.impacts) {
+        (Some(ciff), None, None) => ImpactInput::Ciff(ciff),
+        (None, Some(documents), Some(impacts)) => ImpactInput::Pisa { documents, impacts },
+        _ => {
+            eprintln!("ERROR: either --ciff or --documents with --impacts must be given");
+            std::process::exit(1);
+        }
+    };
+    let defaults = ImpactOrderOptions::default();
+    let options = ImpactOrderOptions {
+        threads: args.threads.unwrap_or(defaults.threads),
+    };
+    if let Err(error) = impact_order(&input, &args.output, &options) {
+        eprintln!("ERROR: {}", error);
+        std::process::exit(1);
+    }
+}
@@ -0,0 +1,101 @@
+//! This program inverts a forward index (PISA `.fwd` or JSON lines with term weights)
+//! into a Common Index Format (v1) file or a PISA binary collection.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use ciff::{
+    cgroup_memory_limit, invert, peak_rss, ForwardInput, InvertOptions, InvertedFormat,
+    Quantization, QuantizationScale,
+};
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-invert",
+    about = "Inverts a forward index into a Common Index Format [v1] or a PISA binary collection"
+)]
+struct Args {
+    #[structopt(long, help = "Path to JSON lines with document vectors", conflicts_with_all = &["forward", "terms", "documents"])]
+    jsonl: Option<PathBuf>,
+    #[structopt(long, help = "Path to PISA forward index (.fwd)", requires = "terms")]
+    forward: Option<PathBuf>,
+    #[structopt(long, help = "Path to terms text file of the forward index")]
+    terms: Option<PathBuf>,
+    #[structopt(long, help = "Path to documents text file of the forward index")]
+    documents: Option<PathBuf>,
+    #[structopt(short, long, help = "Output filename (ciff) or basename (pisa)")]
+    output: PathBuf,
+    #[structopt(long, default_value = "ciff", help = "Output format: ciff or pisa")]
+    format: InvertedFormat,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+    #[structopt(long, default_value = "1024", help = "Memory budget for runs in MiB")]
+    memory_budget: usize,
+    #[structopt(
+        long,
+        help = "Memory limit in MiB [default: cgroup memory limit, if any]"
+    )]
+    memory_limit: Option<u64>,
+    #[structopt(
+        long,
+        help = "Directory for temporary runs [default: output directory]"
+    )]
+    temp_dir: Option<PathBuf>,
+    #[structopt(long, help = "Index description")]
+    description: Option<String>,
+    #[structopt(long, help = "Quantize JSON weights into this many bits")]
+    quantize_bits: Option<u8>,
+    #[structopt(
+        long,
+        default_value = "linear",
+        help = "Quantization scale: linear or log"
+    )]
+    quantize_scale: QuantizationScale,
+}
+
+fn main() {
+    let args = Args::from_args();
+    let input = match (args.jsonl, args.forward, args.terms) {
+        (Some(jsonl), None, _) => ForwardInput::Jsonl(jsonl),
+        (None, Some(forward), Some(terms)) => ForwardInput::Pisa {
+            forward,
+            terms,
+            documents: args.documents,
+        },
+        _ => {
+            eprintln!("ERROR: either --jsonl or --forward with --terms must be given");
+            std::process::exit(1);
+        }
+    };
+    let scale = args.quantize_scale;
+    let defaults = InvertOptions::default();
+    let options = InvertOptions {
+        format: args.format,
+        threads: args.threads.unwrap_or(defaults.threads),
+        memory_budget: args.memory_budget << 20,
+        memory_limit: args
+            .memory_limit
+            .map(|mib| mib << 20)
+            .or_else(cgroup_memory_limit),
+        temp_dir: args.temp_dir,
+        description: args.description.unwrap_or_default(),
+        quantization: args.quantize_bits.map(|bits| Quantization { scale, bits }),
+        ..defaults
+    };
+    if let Err(error) = invert(&input, &args.output, &options) {
+        eprintln!("ERROR: {}", error);
+        std::process::exit(1);
+    }
+    if let Some(peak) = peak_rss() {
+        eprintln!("Peak RSS: {} MiB", peak >> 20);
+    }
+}
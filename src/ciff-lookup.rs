@@ -0,0 +1,85 @@
+//! This program prints postings lists of a Common Index Format (v1) file by term, reading
+//! each list directly from its position in the file.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use ciff::{CiffReader, CiffReaderOptions};
+use std::io::{BufRead, Write};
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-lookup",
+    about = "Prints postings lists of a Common Index Format [v1] file by term"
+)]
+struct Args {
+    #[structopt(short, long, help = "Path to ciff export file")]
+    ciff: PathBuf,
+    #[structopt(help = "Terms to look up [default: one per line from stdin]")]
+    terms: Vec<String>,
+    #[structopt(long, help = "Maximum number of postings printed per list")]
+    limit: Option<usize>,
+    #[structopt(
+        long,
+        default_value = "256",
+        help = "Memory budget for cached lists in MiB"
+    )]
+    cache_size: usize,
+    #[structopt(long, help = "Number of shards of the cache [default: 16]")]
+    cache_shards: Option<usize>,
+}
+
+/// Prints the list of `term` as `term<TAB>df<TAB>docid:tf ...`.
+fn print_list(reader: &CiffReader, term: &str, limit: Option<usize>) -> anyhow::Result<()> {
+    let stdout = std::io::stdout();
+    let mut out = stdout.lock();
+    let Some(list) = reader.list(term)? else {
+        writeln!(out, "{}\t0", term)?;
+        return Ok(());
+    };
+    write!(out, "{}\t{}\t", term, list.docids.len())?;
+    let postings = list.docids.iter().zip(&list.tfs);
+    for (position, (docid, tf)) in postings.take(limit.unwrap_or(usize::MAX)).enumerate() {
+        let separator = if position == 0 { "" } else { " " };
+        write!(out, "{}{}:{}", separator, docid, tf)?;
+    }
+    writeln!(out)?;
+    out.flush()?;
+    Ok(())
+}
+
+fn run(args: &Args) -> anyhow::Result<()> {
+    let defaults = CiffReaderOptions::default();
+    let options = CiffReaderOptions {
+        cache_bytes: args.cache_size << 20,
+        cache_shards: args.cache_shards.unwrap_or(defaults.cache_shards),
+    };
+    let reader = CiffReader::open(&args.ciff, &options)?;
+    if args.terms.is_empty() {
+        for line in std::io::stdin().lock().lines() {
+            print_list(&reader, line?.trim(), args.limit)?;
+        }
+    } else {
+        for term in &args.terms {
+            print_list(&reader, term, args.limit)?;
+        }
+    }
+    eprintln!("Cache: {}", reader.cache_stats());
+    Ok(())
+}
+
+fn main() {
+    if let Err(error) = run(&Args::from_args()) {
+        eprintln!("ERROR: {}", error);
+        std::process::exit(1);
+    }
+}
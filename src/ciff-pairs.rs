@@ -0,0 +1,47 @@
+//! This program precomputes intersections of postings lists of the most frequent query term
+//! pairs of a PISA binary collection.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use ciff::{build_pair_index, PairIndexOptions};
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-pairs",
+    about = "Precomputes intersections of frequent query term pairs"
+)]
+struct Args {
+    #[structopt(short, long, help = "Collection basename")]
+    collection: PathBuf,
+    #[structopt(short, long, help = "Query log, one query per line")]
+    queries: PathBuf,
+    #[structopt(short, long, help = "Output basename")]
+    output: PathBuf,
+    #[structopt(short = "n", long, default_value = "10000", help = "Number of pairs")]
+    pairs: usize,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+}
+
+fn main() {
+    let args = Args::from_args();
+    let defaults = PairIndexOptions::default();
+    let options = PairIndexOptions {
+        pairs: args.pairs,
+        threads: args.threads.unwrap_or(defaults.threads),
+    };
+    if let Err(error) = build_pair_index(&args.collection, &args.queries, &args.output, &options) {
+        eprintln!("ERROR: {}", error);
+        std::process::exit(1);
+    }
+}
@@ -0,0 +1,66 @@
+//! This program prunes a Common Index Format (v1) file into a smaller one, keeping the terms with
+//! the largest weights of each document.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use ciff::{prune_documents, PruneOptions};
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-prune",
+    about = "Prunes a Common Index Format [v1] file to the top-weighted terms of each document"
+)]
+struct Args {
+    #[structopt(short, long, help = "Path to ciff export file")]
+    input: PathBuf,
+    #[structopt(short, long, help = "Path to pruned ciff file")]
+    output: PathBuf,
+    #[structopt(
+        short = "k",
+        long,
+        help = "Number of terms kept per document, with ties at the last one"
+    )]
+    terms_per_document: usize,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+    #[structopt(
+        long,
+        default_value = "1024",
+        help = "Memory budget for forward entries and top weights of documents in MiB"
+    )]
+    memory_budget: usize,
+    #[structopt(
+        long,
+        help = "Directory for temporary partitions [default: output directory]"
+    )]
+    temp_dir: Option<PathBuf>,
+    #[structopt(long, help = "Index description [default: input description]")]
+    description: Option<String>,
+}
+
+fn main() {
+    let args = Args::from_args();
+    let defaults = PruneOptions::default();
+    let options = PruneOptions {
+        threads: args.threads.unwrap_or(defaults.threads),
+        memory_budget: args.memory_budget << 20,
+        temp_dir: args.temp_dir,
+        description: args.description,
+    };
+    if let Err(error) =
+        prune_documents(&args.input, &args.output, args.terms_per_document, &options)
+    {
+        eprintln!("ERROR: {}", error);
+        std::process::exit(1);
+    }
+}
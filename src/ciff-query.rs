@@ -0,0 +1,79 @@
+//! This program runs BM25 top-k queries over a PISA binary collection, e.g., one written by
+//! `ciff2pisa`, and reports query latencies.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use ciff::{run_queries, Bm25, QueryAlgorithm, QueryIndex, QueryOptions};
+use std::fs::File;
+use std::io::{BufReader, BufWriter, Write};
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-query",
+    about = "Runs BM25 top-k queries over a PISA binary collection"
+)]
+struct Args {
+    #[structopt(short, long, help = "Collection basename")]
+    index: PathBuf,
+    #[structopt(
+        short,
+        long,
+        help = "Queries, one per line, as `id:terms` or terms only"
+    )]
+    queries: PathBuf,
+    #[structopt(short, long, help = "Output TREC run file [default: stdout]")]
+    output: Option<PathBuf>,
+    #[structopt(short, default_value = "10", help = "Number of results per query")]
+    k: usize,
+    #[structopt(
+        long,
+        default_value = "maxscore",
+        help = "Algorithm: maxscore or exhaustive"
+    )]
+    algorithm: QueryAlgorithm,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+    #[structopt(long, default_value = "0.9", help = "BM25 k1 parameter")]
+    bm25_k1: f32,
+    #[structopt(long, default_value = "0.4", help = "BM25 b parameter")]
+    bm25_b: f32,
+}
+
+fn run(args: &Args) -> anyhow::Result<()> {
+    let bm25 = Bm25 {
+        k1: args.bm25_k1,
+        b: args.bm25_b,
+    };
+    let index = QueryIndex::open(&args.index, bm25)?;
+    let queries = BufReader::new(File::open(&args.queries)?);
+    let mut output: Box<dyn Write + Send> = match &args.output {
+        Some(path) => Box::new(BufWriter::new(File::create(path)?)),
+        None => Box::new(BufWriter::new(std::io::stdout())),
+    };
+    let defaults = QueryOptions::default();
+    let options = QueryOptions {
+        k: args.k,
+        algorithm: args.algorithm,
+        threads: args.threads.unwrap_or(defaults.threads),
+    };
+    let stats = run_queries(&index, queries, &mut output, &options)?;
+    eprintln!("{}", stats);
+    Ok(())
+}
+
+fn main() {
+    if let Err(error) = run(&Args::from_args()) {
+        eprintln!("ERROR: {}", error);
+        std::process::exit(1);
+    }
+}
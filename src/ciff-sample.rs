@@ -0,0 +1,104 @@
+//! This program extracts a sample or a subset of the documents of a Common Index Format (v1)
+//! file or a PISA binary collection into a smaller, valid collection of either format.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use anyhow::{anyhow, Context};
+use ciff::{read_docid_list, sample_collection, CollectionInput, DocumentSample};
+use ciff::{InvertedFormat, SampleOptions};
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-sample",
+    about = "Extracts a document sample or subset of a Common Index Format [v1] file or a PISA binary collection"
+)]
+struct Args {
+    #[structopt(
+        short,
+        long,
+        help = "Path to ciff export file",
+        required_unless = "collection",
+        conflicts_with = "collection"
+    )]
+    ciff: Option<PathBuf>,
+    #[structopt(short = "b", long, help = "Basename of a PISA binary collection")]
+    collection: Option<PathBuf>,
+    #[structopt(
+        short,
+        long,
+        help = "Path to ciff output file, or basename of the binary collection output"
+    )]
+    output: PathBuf,
+    #[structopt(long, help = "Output format: ciff or pisa", default_value = "ciff")]
+    format: InvertedFormat,
+    #[structopt(
+        long,
+        help = "Keep each document with this probability, by a hash of its ID",
+        required_unless = "docids",
+        conflicts_with = "docids",
+        parse(try_from_str = parse_fraction)
+    )]
+    fraction: Option<f64>,
+    #[structopt(long, help = "Seed of the sample", default_value = "0")]
+    seed: u64,
+    #[structopt(
+        long,
+        help = "Keep the documents with the IDs in this file, one per line"
+    )]
+    docids: Option<PathBuf>,
+    #[structopt(long, help = "Index description [default: input description]")]
+    description: Option<String>,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+}
+
+fn parse_fraction(value: &str) -> anyhow::Result<f64> {
+    let fraction = value
+        .parse::<f64>()
+        .with_context(|| format!("Invalid fraction: {}", value))?;
+    if (0.0..=1.0).contains(&fraction) {
+        Ok(fraction)
+    } else {
+        Err(anyhow!("Fraction out of [0, 1]: {}", value))
+    }
+}
+
+fn main() {
+    let args = Args::from_args();
+    let output = args.output;
+    let input = match (args.ciff, args.collection) {
+        (Some(path), _) => CollectionInput::Ciff(path),
+        (None, Some(basename)) => CollectionInput::Pisa(basename),
+        (None, None) => unreachable!("required by the arguments"),
+    };
+    let sample = match (args.fraction, args.docids) {
+        (Some(fraction), _) => Ok(DocumentSample::Fraction {
+            fraction,
+            seed: args.seed,
+        }),
+        (None, Some(path)) => read_docid_list(&path).map(DocumentSample::Docids),
+        (None, None) => unreachable!("required by the arguments"),
+    };
+    let defaults = SampleOptions::default();
+    let options = SampleOptions {
+        format: args.format,
+        threads: args.threads.unwrap_or(defaults.threads),
+        description: args.description,
+    };
+    if let Err(error) =
+        sample.and_then(|sample| sample_collection(&input, &output, &sample, &options))
+    {
+        eprintln!("ERROR: {:#}", error);
+        std::process::exit(1);
+    }
+}
@@ -0,0 +1,89 @@
+//! This program clusters the documents of a Common Index Format (v1) file or a PISA binary
+//! collection into topical shards for selective search.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use ciff::{shard_collection, CollectionInput, ShardOptions};
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-shard",
+    about = "Clusters a Common Index Format [v1] file or a PISA binary collection into topical shards"
+)]
+struct Args {
+    #[structopt(
+        short,
+        long,
+        help = "Path to ciff export file",
+        required_unless = "collection",
+        conflicts_with = "collection"
+    )]
+    ciff: Option<PathBuf>,
+    #[structopt(short = "b", long, help = "Basename of a PISA binary collection")]
+    collection: Option<PathBuf>,
+    #[structopt(
+        short,
+        long,
+        help = "Output basename of the shards, document map, summary, and centroids"
+    )]
+    output: PathBuf,
+    #[structopt(short = "k", long, help = "Number of shards")]
+    shards: u32,
+    #[structopt(
+        long,
+        help = "Number of documents sampled for clustering [default: 10000]"
+    )]
+    sample_size: Option<u32>,
+    #[structopt(long, help = "Maximum number of k-means iterations [default: 10]")]
+    iterations: Option<u32>,
+    #[structopt(long, help = "Number of terms kept per centroid [default: 1000]")]
+    centroid_terms: Option<usize>,
+    #[structopt(long, help = "Seed of the sample", default_value = "0")]
+    seed: u64,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+    #[structopt(
+        long,
+        default_value = "1024",
+        help = "Memory budget for forward entries in MiB"
+    )]
+    memory_budget: usize,
+    #[structopt(
+        long,
+        help = "Directory for temporary partitions [default: output directory]"
+    )]
+    temp_dir: Option<PathBuf>,
+}
+
+fn main() {
+    let args = Args::from_args();
+    let input = match (args.ciff, args.collection) {
+        (Some(path), _) => CollectionInput::Ciff(path),
+        (None, Some(basename)) => CollectionInput::Pisa(basename),
+        (None, None) => unreachable!("required by the arguments"),
+    };
+    let defaults = ShardOptions::default();
+    let options = ShardOptions {
+        sample_size: args.sample_size.unwrap_or(defaults.sample_size),
+        iterations: args.iterations.unwrap_or(defaults.iterations),
+        centroid_terms: args.centroid_terms.unwrap_or(defaults.centroid_terms),
+        seed: args.seed,
+        threads: args.threads.unwrap_or(defaults.threads),
+        memory_budget: args.memory_budget << 20,
+        temp_dir: args.temp_dir,
+    };
+    if let Err(error) = shard_collection(&input, &args.output, args.shards, &options) {
+        eprintln!("ERROR: {}", error);
+        std::process::exit(1);
+    }
+}
@@ -0,0 +1,106 @@
+//! This program splits a Common Index Format (v1) file or a PISA binary collection into a hot
+//! tier, of top-ranked documents or high-impact postings, and a cold tier with all postings.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use anyhow::Context;
+use ciff::{split_tiers, CollectionInput, TierOptions, TierSplit};
+use std::path::{Path, PathBuf};
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-tiers",
+    about = "Splits a Common Index Format [v1] file or a PISA binary collection into hot and cold tiers"
+)]
+struct Args {
+    #[structopt(
+        short,
+        long,
+        help = "Path to ciff export file",
+        required_unless = "collection",
+        conflicts_with = "collection"
+    )]
+    ciff: Option<PathBuf>,
+    #[structopt(short = "b", long, help = "Basename of a PISA binary collection")]
+    collection: Option<PathBuf>,
+    #[structopt(
+        short,
+        long,
+        help = "Output basename of the tiers (.hot and .cold) and document map (.docmap)"
+    )]
+    output: PathBuf,
+    #[structopt(
+        long,
+        help = "Path to static ranks of documents, one per line",
+        requires = "hot-documents"
+    )]
+    static_ranks: Option<PathBuf>,
+    #[structopt(long, help = "Number of top-ranked documents in the hot tier")]
+    hot_documents: Option<u32>,
+    #[structopt(
+        long,
+        help = "Put postings with at least this weight in the hot tier",
+        conflicts_with_all = &["static-ranks", "max-df"]
+    )]
+    min_weight: Option<u32>,
+    #[structopt(
+        long,
+        help = "Put lists with at most this document frequency in the hot tier",
+        conflicts_with = "static-ranks"
+    )]
+    max_df: Option<u32>,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+}
+
+fn read_ranks(path: &Path) -> anyhow::Result<Vec<f64>> {
+    std::fs::read_to_string(path)
+        .with_context(|| format!("Unable to read {}", path.display()))?
+        .lines()
+        .map(|line| {
+            line.trim()
+                .parse::<f64>()
+                .with_context(|| format!("Invalid static rank: {}", line))
+        })
+        .collect()
+}
+
+fn main() {
+    let args = Args::from_args();
+    let hot_documents = args.hot_documents.unwrap_or(0);
+    let output = args.output;
+    let input = match (args.ciff, args.collection) {
+        (Some(path), _) => CollectionInput::Ciff(path),
+        (None, Some(basename)) => CollectionInput::Pisa(basename),
+        (None, None) => unreachable!("required by the arguments"),
+    };
+    let split = match (args.static_ranks, args.min_weight, args.max_df) {
+        (Some(path), _, _) => read_ranks(&path).map(|ranks| TierSplit::StaticRank {
+            ranks,
+            count: hot_documents,
+        }),
+        (None, Some(min_weight), _) => Ok(TierSplit::MinWeight(min_weight)),
+        (None, None, Some(max_df)) => Ok(TierSplit::MaxDf(max_df)),
+        (None, None, None) => {
+            eprintln!("ERROR: one of --static-ranks, --min-weight, or --max-df is required");
+            std::process::exit(1);
+        }
+    };
+    let defaults = TierOptions::default();
+    let options = TierOptions {
+        threads: args.threads.unwrap_or(defaults.threads),
+    };
+    if let Err(error) = split.and_then(|split| split_tiers(&input, &output, &split, &options)) {
+        eprintln!("ERROR: {:#}", error);
+        std::process::exit(1);
+    }
+}
@@ -0,0 +1,49 @@
+//! This program verifies files against the checksums of a manifest written by `ciff2pisa` or
+//! `pisa2ciff` with `--manifest`.
+
+#![warn(
+    missing_docs,
+    trivial_casts,
+    trivial_numeric_casts,
+    unused_import_braces,
+    unused_qualifications
+)]
+#![warn(clippy::all, clippy::pedantic)]
+#![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
+
+use ciff::verify_manifest;
+use std::path::PathBuf;
+use structopt::StructOpt;
+
+#[derive(Debug, StructOpt)]
+#[structopt(
+    name = "ciff-verify",
+    about = "Verifies converted files against the checksums of their manifest"
+)]
+struct Args {
+    #[structopt(help = "Path to the manifest (<output>.manifest)")]
+    manifest: PathBuf,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+}
+
+fn main() {
+    let args = Args::from_args();
+    let threads = args
+        .threads
+        .unwrap_or_else(|| std::thread::available_parallelism().map_or(1, usize::from));
+    match verify_manifest(&args.manifest, threads) {
+        Ok(manifest) => {
+            for (name, file) in &manifest.files {
+                println!(
+                    "{}: OK ({} bytes, crc32c {:08x})",
+                    name, file.length, file.crc32c
+                );
+            }
+        }
+        Err(error) => {
+            eprintln!("ERROR: {}", error);
+            std::process::exit(1);
+        }
+    }
+}
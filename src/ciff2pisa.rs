@@ -12,11 +12,17 @@
 #![warn(clippy::all, clippy::pedantic)]
 #![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
 
-use ciff::ciff_to_pisa;
+use ciff::{
+    cgroup_memory_limit, ciff_to_pisa_with_options, find_duplicates, peak_rss, BitmapOptions, Bm25,
+    CiffToPisaOptions, CollectionInput, DedupOptions, Deletions, DocumentLengths, IoBackend,
+    ScoreQuantization, ThrottleOptions,
+};
 use std::path::PathBuf;
+use std::time::Duration;
 use structopt::StructOpt;
 
 #[derive(Debug, StructOpt)]
+#[allow(clippy::struct_excessive_bools)]
 #[structopt(
     name = "ciff2pisa",
     about = "Generates a PISA index from a Common Index Format [v1]"
@@ -26,12 +32,178 @@ struct Args {
     ciff_file: PathBuf,
     #[structopt(short, long, help = "Output basename")]
     output: PathBuf,
+    #[structopt(long, help = "Number of threads [default: all available]")]
+    threads: Option<usize>,
+    #[structopt(
+        long,
+        help = "Write BM25 scores quantized into this many bits to .scores"
+    )]
+    quantize_scores: Option<u8>,
+    #[structopt(long, default_value = "0.9", help = "BM25 k1 parameter")]
+    bm25_k1: f32,
+    #[structopt(long, default_value = "0.4", help = "BM25 b parameter")]
+    bm25_b: f32,
+    #[structopt(
+        long,
+        help = "Only write .sizes and .documents, skipping over postings"
+    )]
+    documents_only: bool,
+    #[structopt(
+        long,
+        help = "Also write lists covering this fraction of documents as bitmaps to .bitmaps"
+    )]
+    bitmap_density: Option<f64>,
+    #[structopt(
+        long,
+        requires = "bitmap-density",
+        help = "Write lists stored as bitmaps empty in .docs, .freqs, and .scores (not readable by PISA)"
+    )]
+    bitmaps_replace_lists: bool,
+    #[structopt(
+        long,
+        default_value = "blocking",
+        help = "I/O backend: blocking or uring (Linux io_uring)"
+    )]
+    io: IoBackend,
+    #[structopt(
+        long,
+        help = "Drop input and outputs from the page cache once processed"
+    )]
+    drop_behind: bool,
+    #[structopt(long, help = "Maximum read bandwidth in MB/s")]
+    max_read_mbps: Option<f64>,
+    #[structopt(long, help = "Maximum write bandwidth in MB/s")]
+    max_write_mbps: Option<f64>,
+    #[structopt(
+        long,
+        help = "File with lines `read <MB/s>` or `write <MB/s>` adjusting limits while running"
+    )]
+    throttle_control: Option<PathBuf>,
+    #[structopt(
+        long,
+        help = "Save progress to <output>.checkpoint every this many seconds"
+    )]
+    checkpoint_secs: Option<u64>,
+    #[structopt(long, help = "Resume from <output>.checkpoint if it exists")]
+    resume: bool,
+    #[structopt(
+        long,
+        help = "Memory limit in MiB [default: cgroup memory limit, if any]"
+    )]
+    memory_limit: Option<u64>,
+    #[structopt(
+        long,
+        help = "Write CRC32C checksums of the outputs to <output>.manifest"
+    )]
+    manifest: bool,
+    #[structopt(
+        long,
+        help = "Delete the documents with the IDs in this file, one per line"
+    )]
+    delete_docids: Option<PathBuf>,
+    #[structopt(
+        long,
+        conflicts_with = "delete-docids",
+        help = "Delete the documents set in this bitmap (bit i % 8 of byte i / 8)"
+    )]
+    delete_bitmap: Option<PathBuf>,
+    #[structopt(long, help = "Delete documents of length 0")]
+    drop_empty_documents: bool,
+    #[structopt(
+        long,
+        help = "Delete near-duplicate documents, keeping the first of each cluster"
+    )]
+    delete_duplicates: bool,
+    #[structopt(
+        long,
+        default_value = "0.8",
+        help = "Minimum estimated Jaccard similarity of near-duplicates"
+    )]
+    duplicate_threshold: f64,
+    #[structopt(
+        long,
+        default_value = "records",
+        help = "Document lengths: records, recompute (sums of term frequencies), or verify"
+    )]
+    document_lengths: DocumentLengths,
 }
 
 fn main() {
     let args = Args::from_args();
-    if let Err(error) = ciff_to_pisa(&args.ciff_file, &args.output) {
+    let memory_limit = args
+        .memory_limit
+        .map(|mib| mib << 20)
+        .or_else(cgroup_memory_limit);
+    let deletions = match (&args.delete_docids, &args.delete_bitmap) {
+        (Some(path), _) => Some(Deletions::read_docids(path)),
+        (None, Some(path)) => Some(Deletions::read_bitmap(path)),
+        (None, None) if args.drop_empty_documents || args.delete_duplicates => {
+            Some(Ok(Deletions::default()))
+        }
+        (None, None) => None,
+    };
+    let deletions = deletions.transpose().and_then(|deletions| {
+        if !args.delete_duplicates {
+            return Ok(deletions);
+        }
+        // Duplicates are found before converting, within the same memory limit.
+        let defaults = DedupOptions::default();
+        let options = DedupOptions {
+            threshold: args.duplicate_threshold,
+            threads: args.threads.unwrap_or(defaults.threads),
+            memory_limit,
+            ..defaults
+        };
+        let duplicates = find_duplicates(&CollectionInput::Ciff(args.ciff_file.clone()), &options)?;
+        Ok(deletions.map(|mut deletions| {
+            deletions.extend(&duplicates);
+            deletions
+        }))
+    });
+    let deletions = match deletions {
+        Ok(deletions) => deletions.map(|deletions| Deletions {
+            drop_empty: args.drop_empty_documents,
+            ..deletions
+        }),
+        Err(error) => {
+            eprintln!("ERROR: {:#}", error);
+            std::process::exit(1);
+        }
+    };
+    let defaults = CiffToPisaOptions::default();
+    let options = CiffToPisaOptions {
+        threads: args.threads.unwrap_or(defaults.threads),
+        scores: args.quantize_scores.map(|bits| ScoreQuantization {
+            bm25: Bm25 {
+                k1: args.bm25_k1,
+                b: args.bm25_b,
+            },
+            bits,
+        }),
+        documents_only: args.documents_only,
+        bitmaps: args.bitmap_density.map(|density| BitmapOptions {
+            density,
+            replace_lists: args.bitmaps_replace_lists,
+        }),
+        io: args.io,
+        drop_behind: args.drop_behind,
+        throttle: ThrottleOptions {
+            max_read_mbps: args.max_read_mbps,
+            max_write_mbps: args.max_write_mbps,
+            control_file: args.throttle_control.clone(),
+        },
+        checkpoint_interval: args.checkpoint_secs.map(Duration::from_secs),
+        resume: args.resume,
+        memory_limit,
+        manifest: args.manifest,
+        deletions,
+        document_lengths: args.document_lengths,
+    };
+    if let Err(error) = ciff_to_pisa_with_options(&args.ciff_file, &args.output, &options) {
         eprintln!("ERROR: {}", error);
         std::process::exit(1);
     }
+    if let Some(peak) = peak_rss() {
+        eprintln!("Peak RSS: {} MiB", peak >> 20);
+    }
 }
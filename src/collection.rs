@@ -0,0 +1,367 @@
+//! Collections in either format, CIFF files or PISA binary collections, read as decoded postings
+//! lists and documents, and PISA binary collections written from them.
+//!
+//! Lists are read on the calling thread but decoded separately, so that tools rewriting
+//! collections can decode and transform lists in parallel.
+
+use crate::io_backend::{InputFile, IoConfig};
+use crate::postings::{map_file, read_lines};
+use crate::scan::MessageScanner;
+use crate::{encode_u32_sequence, pb_style, read_document_count, sizes, BinaryCollection};
+use crate::{BinarySequence, EncodedList, Header, PostingsList, Result};
+use anyhow::{anyhow, bail, Context};
+use indicatif::ProgressBar;
+use memmap::Mmap;
+use protobuf::Message;
+use std::convert::TryFrom;
+use std::fs::File;
+use std::io::{BufRead, BufReader, BufWriter, Write};
+use std::path::{Path, PathBuf};
+
+/// Collection read by tools accepting either format.
+#[derive(Debug, Clone)]
+pub enum CollectionInput {
+    /// CIFF file.
+    Ciff(PathBuf),
+    /// Basename of a PISA binary collection, with `.docs`, `.freqs`, `.sizes`, `.terms`, and
+    /// `.documents`.
+    Pisa(PathBuf),
+}
+
+/// Path of the file of a binary collection with the given extension.
+pub(crate) fn collection_path(basename: &Path, extension: &str) -> PathBuf {
+    PathBuf::from(format!("{}.{}", basename.display(), extension))
+}
+
+/// Postings list with absolute document IDs.
+pub(crate) struct DecodedList {
+    pub(crate) term: String,
+    /// Document IDs and frequencies, in increasing order of document IDs.
+    pub(crate) postings: Vec<(u32, u32)>,
+}
+
+/// Postings list read but not decoded yet.
+pub(crate) enum RawList<'a> {
+    Ciff(Vec<u8>),
+    Pisa {
+        term: String,
+        documents: BinarySequence<'a>,
+        frequencies: BinarySequence<'a>,
+    },
+}
+
+impl RawList<'_> {
+    /// Decodes the list, checking that its document IDs are strictly increasing and below
+    /// `num_documents`.
+    pub(crate) fn decode(self, num_documents: u32) -> Result<DecodedList> {
+        let (term, postings) = match self {
+            Self::Ciff(message) => {
+                let list = PostingsList::parse_from_bytes(&message)?;
+                let mut docid = 0_u32;
+                let postings = list
+                    .get_postings()
+                    .iter()
+                    .map(|posting| {
+                        docid = u32::try_from(posting.get_docid())
+                            .ok()
+                            .and_then(|gap| docid.checked_add(gap))
+                            .ok_or_else(|| anyhow!("Invalid document ID in {}", list.get_term()))?;
+                        let frequency = u32::try_from(posting.get_tf()).with_context(|| {
+                            format!("Negative frequency in {}", list.get_term())
+                        })?;
+                        Ok((docid, frequency))
+                    })
+                    .collect::<Result<Vec<_>>>()?;
+                (list.get_term().to_string(), postings)
+            }
+            Self::Pisa {
+                term,
+                documents,
+                frequencies,
+            } => {
+                if documents.len() != frequencies.len() {
+                    bail!("Documents and frequencies of {} differ in length", term);
+                }
+                let postings = documents.iter().zip(frequencies.iter()).collect();
+                (term, postings)
+            }
+        };
+        if postings.windows(2).any(|pair| pair[0].0 >= pair[1].0) {
+            bail!("Document IDs of {} are not strictly increasing", term);
+        }
+        if postings
+            .last()
+            .is_some_and(|&(docid, _)| docid >= num_documents)
+        {
+            bail!("Document ID out of bounds in {}", term);
+        }
+        Ok(DecodedList { term, postings })
+    }
+}
+
+/// Title and length of a document.
+pub(crate) struct Document {
+    pub(crate) title: String,
+    pub(crate) length: u32,
+}
+
+/// Collection opened for reading its lists once, then its documents.
+pub(crate) enum CollectionReader {
+    Ciff {
+        scanner: MessageScanner<InputFile>,
+        header: Header,
+    },
+    Pisa {
+        basename: PathBuf,
+        documents: Mmap,
+        frequencies: Mmap,
+        sizes: Mmap,
+        terms: Vec<String>,
+        num_documents: u32,
+    },
+}
+
+impl CollectionReader {
+    pub(crate) fn open(input: &CollectionInput) -> Result<Self> {
+        match input {
+            CollectionInput::Ciff(path) => {
+                let mut scanner = MessageScanner::open(path, &IoConfig::default())?;
+                let header = Header::from_protobuf(scanner.read_message()?)?;
+                Ok(Self::Ciff { scanner, header })
+            }
+            CollectionInput::Pisa(basename) => {
+                let documents = map_file(&collection_path(basename, "docs"))?;
+                let frequencies = map_file(&collection_path(basename, "freqs"))?;
+                let terms = read_lines(&collection_path(basename, "terms"))?;
+                let mut document_lists = BinaryCollection::try_from(&documents[..])?;
+                let num_documents = read_document_count(&mut document_lists)?;
+                let num_document_lists = document_lists.count();
+                let num_frequency_lists = BinaryCollection::try_from(&frequencies[..])?.count();
+                if num_document_lists != terms.len() || num_frequency_lists != terms.len() {
+                    bail!(
+                        "The collection has {} terms, {} document lists, and {} frequency lists",
+                        terms.len(),
+                        num_document_lists,
+                        num_frequency_lists
+                    );
+                }
+                Ok(Self::Pisa {
+                    basename: basename.clone(),
+                    documents,
+                    frequencies,
+                    sizes: map_file(&collection_path(basename, "sizes"))?,
+                    terms,
+                    num_documents,
+                })
+            }
+        }
+    }
+
+    pub(crate) fn num_documents(&self) -> u32 {
+        match self {
+            Self::Ciff { header, .. } => header.num_documents,
+            Self::Pisa { num_documents, .. } => *num_documents,
+        }
+    }
+
+    fn num_lists(&self) -> u32 {
+        match self {
+            Self::Ciff { header, .. } => header.num_postings_lists,
+            Self::Pisa { terms, .. } => u32::try_from(terms.len()).unwrap_or(u32::MAX),
+        }
+    }
+
+    /// Reads all postings lists, with a progress bar after `message`.
+    pub(crate) fn lists<'a>(
+        &'a mut self,
+        message: &str,
+    ) -> Result<Box<dyn Iterator<Item = Result<RawList<'a>>> + 'a>> {
+        eprintln!("{}", message);
+        let num_lists = self.num_lists();
+        let progress = ProgressBar::new(u64::from(num_lists));
+        progress.set_style(pb_style());
+        progress.set_draw_delta(u64::from(num_lists) / 100);
+        let lists: Box<dyn Iterator<Item = Result<RawList<'a>>>> = match self {
+            Self::Ciff { scanner, .. } => Box::new((0..num_lists).map(move |_| {
+                let mut buffer = Vec::new();
+                scanner.read_message_bytes(&mut buffer)?;
+                Ok(RawList::Ciff(buffer))
+            })),
+            Self::Pisa {
+                documents,
+                frequencies,
+                terms,
+                ..
+            } => {
+                let mut documents = BinaryCollection::try_from(&documents[..])?;
+                read_document_count(&mut documents)?;
+                let frequencies = BinaryCollection::try_from(&frequencies[..])?;
+                Box::new(documents.zip(frequencies).zip(terms.drain(..)).map(
+                    |((documents, frequencies), term)| {
+                        Ok(RawList::Pisa {
+                            term,
+                            documents: documents?,
+                            frequencies: frequencies?,
+                        })
+                    },
+                ))
+            }
+        };
+        Ok(Box::new(lists.inspect(move |_| progress.inc(1))))
+    }
+
+    /// Reads all documents, once all lists have been read.
+    pub(crate) fn documents(&mut self) -> Result<Box<dyn Iterator<Item = Result<Document>> + '_>> {
+        match self {
+            Self::Ciff { scanner, header } => {
+                Ok(Box::new((0..header.num_documents).map(move |docid| {
+                    let record = scanner.read_document()?;
+                    if i64::from(record.get_docid()) != i64::from(docid) {
+                        bail!("Document records must come in order");
+                    }
+                    Ok(Document {
+                        title: record.get_collection_docid().to_string(),
+                        length: u32::try_from(record.get_doclength())
+                            .context("Negative document length")?,
+                    })
+                })))
+            }
+            Self::Pisa {
+                basename,
+                sizes: lengths,
+                ..
+            } => {
+                let path = collection_path(basename, "documents");
+                let titles = BufReader::new(
+                    File::open(&path)
+                        .with_context(|| format!("Unable to open {}", path.display()))?,
+                )
+                .lines();
+                let lengths = sizes(lengths)?;
+                Ok(Box::new((0..lengths.len()).zip(titles).map(
+                    move |(index, title)| {
+                        Ok(Document {
+                            title: title?,
+                            length: lengths.get(index).expect("index is in bounds"),
+                        })
+                    },
+                )))
+            }
+        }
+    }
+}
+
+fn create(path: &Path) -> Result<BufWriter<File>> {
+    Ok(BufWriter::new(File::create(path).with_context(|| {
+        format!("Unable to create {}", path.display())
+    })?))
+}
+
+/// PISA binary collection written list by list, then document by document.
+pub(crate) struct PisaWriter {
+    documents: BufWriter<File>,
+    frequencies: BufWriter<File>,
+    terms: BufWriter<File>,
+    sizes: BufWriter<File>,
+    titles: BufWriter<File>,
+    num_documents: u32,
+    written_documents: u32,
+}
+
+impl PisaWriter {
+    /// Creates the files of a collection of `num_documents` at `basename`.
+    pub(crate) fn create(basename: &Path, num_documents: u32) -> Result<Self> {
+        let mut documents = create(&collection_path(basename, "docs"))?;
+        encode_u32_sequence(&mut documents, 1, [num_documents])?;
+        let mut sizes = create(&collection_path(basename, "sizes"))?;
+        sizes.write_all(&num_documents.to_le_bytes())?;
+        Ok(Self {
+            documents,
+            frequencies: create(&collection_path(basename, "freqs"))?,
+            terms: create(&collection_path(basename, "terms"))?,
+            sizes,
+            titles: create(&collection_path(basename, "documents"))?,
+            num_documents,
+            written_documents: 0,
+        })
+    }
+
+    /// Encodes a list of a term, which must not be empty.
+    pub(crate) fn encode(term: &str, postings: &[(u32, u32)]) -> Result<EncodedList> {
+        let length = u32::try_from(postings.len())?;
+        let mut encoded = EncodedList::default();
+        encode_u32_sequence(
+            &mut encoded.documents,
+            length,
+            postings.iter().map(|&(docid, _)| docid),
+        )?;
+        encode_u32_sequence(
+            &mut encoded.frequencies,
+            length,
+            postings.iter().map(|&(_, frequency)| frequency),
+        )?;
+        encoded.term = format!("{}\n", term).into_bytes();
+        Ok(encoded)
+    }
+
+    pub(crate) fn write_list(&mut self, list: &EncodedList) -> Result<()> {
+        self.documents.write_all(&list.documents)?;
+        self.frequencies.write_all(&list.frequencies)?;
+        self.terms.write_all(&list.term)?;
+        Ok(())
+    }
+
+    pub(crate) fn write_document(&mut self, document: &Document) -> Result<()> {
+        self.sizes.write_all(&document.length.to_le_bytes())?;
+        writeln!(self.titles, "{}", document.title)?;
+        self.written_documents += 1;
+        Ok(())
+    }
+
+    /// Flushes all files, checking that all documents were written.
+    pub(crate) fn finish(mut self) -> Result<()> {
+        if self.written_documents != self.num_documents {
+            bail!(
+                "Expected {} documents but {} were written",
+                self.num_documents,
+                self.written_documents
+            );
+        }
+        self.documents.flush()?;
+        self.frequencies.flush()?;
+        self.terms.flush()?;
+        self.sizes.flush()?;
+        self.titles.flush()?;
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn pisa_list<'a>(documents: &'a [u8], frequencies: &'a [u8]) -> RawList<'a> {
+        RawList::Pisa {
+            term: String::from("term"),
+            documents: BinarySequence::try_from(documents).unwrap(),
+            frequencies: BinarySequence::try_from(frequencies).unwrap(),
+        }
+    }
+
+    #[test]
+    fn test_decode_checks_document_ids() -> Result<()> {
+        let frequencies = [1, 0, 0, 0, 1, 0, 0, 0];
+        let list = pisa_list(&[0, 0, 0, 0, 2, 0, 0, 0], &frequencies).decode(3)?;
+        assert_eq!(list.postings, vec![(0, 1), (2, 1)]);
+        assert!(pisa_list(&[2, 0, 0, 0, 1, 0, 0, 0], &frequencies)
+            .decode(3)
+            .is_err());
+        assert!(pisa_list(&[9, 0, 0, 0, 2, 0, 0, 0], &frequencies)
+            .decode(3)
+            .is_err());
+        assert!(pisa_list(&[0, 0, 0, 0, 3, 0, 0, 0], &frequencies)
+            .decode(3)
+            .is_err());
+        Ok(())
+    }
+}
@@ -0,0 +1,206 @@
+//! Term co-occurrence statistics over PISA binary collections.
+
+use crate::intersect::{intersection_size, Bitmap};
+use crate::postings::{read_lexicon, read_lines, DocumentLists};
+use crate::{parallel, pb_style, Result};
+use indicatif::ProgressBar;
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::path::{Path, PathBuf};
+
+/// Terms whose co-occurrences are computed.
+#[derive(Debug, Clone)]
+pub enum TermSelection {
+    /// Terms listed in a file, one per line.
+    Terms(PathBuf),
+    /// Terms with the highest document frequencies.
+    TopDf(usize),
+}
+
+/// Options of [`cooccurrence`].
+#[derive(Debug, Clone)]
+pub struct CooccurrenceOptions {
+    /// Number of threads counting co-occurrences.
+    pub threads: usize,
+    /// Pairs co-occurring in fewer documents are not written.
+    pub min_count: usize,
+    /// Lists covering at least this fraction of documents are represented as bitmaps.
+    pub bitmap_density: f64,
+}
+
+impl Default for CooccurrenceOptions {
+    fn default() -> Self {
+        Self {
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+            min_count: 1,
+            bitmap_density: 1.0 / 32.0,
+        }
+    }
+}
+
+/// Postings list of a selected term, in the cheaper representation for intersections.
+enum TermList {
+    Sparse(Vec<u32>),
+    Dense(Bitmap<'static>),
+}
+
+impl TermList {
+    fn cooccurrences(&self, other: &Self) -> usize {
+        match (self, other) {
+            (Self::Sparse(lhs), Self::Sparse(rhs)) => intersection_size(lhs, rhs),
+            (Self::Sparse(list), Self::Dense(bitmap))
+            | (Self::Dense(bitmap), Self::Sparse(list)) => bitmap.count_in(list),
+            (Self::Dense(lhs), Self::Dense(rhs)) => lhs.count_and(rhs),
+        }
+    }
+}
+
+/// Pointwise mutual information of two terms co-occurring in `count` out of `num_documents`
+/// documents, with document frequencies `lhs_df` and `rhs_df`.
+#[allow(clippy::cast_precision_loss)]
+fn pmi(count: usize, lhs_df: usize, rhs_df: usize, num_documents: u32) -> f64 {
+    (count as f64 * f64::from(num_documents) / (lhs_df as f64 * rhs_df as f64)).ln()
+}
+
+/// Returns IDs of the selected terms, in the order of selection.
+fn select_terms(
+    collection: &Path,
+    documents: &DocumentLists,
+    selection: &TermSelection,
+) -> Result<Vec<u32>> {
+    match selection {
+        TermSelection::Terms(path) => {
+            let lexicon = read_lexicon(
+                &PathBuf::from(format!("{}.terms", collection.display())),
+                documents,
+            )?;
+            let terms = read_lines(path)?;
+            let selected: Vec<u32> = terms
+                .iter()
+                .filter_map(|term| lexicon.get(term).copied())
+                .collect();
+            if selected.len() < terms.len() {
+                eprintln!(
+                    "Skipping {} terms missing from the collection",
+                    terms.len() - selected.len()
+                );
+            }
+            Ok(selected)
+        }
+        TermSelection::TopDf(n) => {
+            let mut term_ids: Vec<u32> = (0..documents.len() as u32).collect();
+            term_ids.sort_by_key(|&term_id| std::cmp::Reverse(documents.list(term_id).len()));
+            term_ids.truncate(*n);
+            Ok(term_ids)
+        }
+    }
+}
+
+/// Computes the number of documents in which each pair of selected terms co-occurs, and their
+/// pointwise mutual information (PMI), from `{collection}.docs` and `{collection}.terms`.
+///
+/// Lists of selected terms are loaded in memory, as bitmaps if they are dense enough
+/// (see [`CooccurrenceOptions::bitmap_density`]). Each selected term is then intersected with
+/// the terms selected after it, by [`CooccurrenceOptions::threads`] threads.
+///
+/// The output is a sparse, tab-separated matrix with a line per co-occurring pair:
+/// both terms, the number of documents containing both, and the natural-log PMI.
+///
+/// # Errors
+///
+/// Returns an error when an IO error occurs or the collection is malformed.
+pub fn cooccurrence(
+    collection: &Path,
+    selection: &TermSelection,
+    output: &Path,
+    options: &CooccurrenceOptions,
+) -> Result<()> {
+    let documents = DocumentLists::open(&PathBuf::from(format!("{}.docs", collection.display())))?;
+    let terms = read_lines(&PathBuf::from(format!("{}.terms", collection.display())))?;
+    let num_documents = documents.num_documents();
+    let mut selected = select_terms(collection, &documents, selection)?;
+    selected.sort_unstable();
+    selected.dedup();
+
+    eprintln!("Loading {} postings lists", selected.len());
+    #[allow(clippy::cast_precision_loss)]
+    let is_dense = |df: usize| df as f64 >= options.bitmap_density * f64::from(num_documents);
+    let lists: Vec<(u32, usize, TermList)> = selected
+        .iter()
+        .map(|&term_id| {
+            let list = documents.decode(term_id);
+            let df = list.len();
+            if is_dense(df) {
+                (
+                    term_id,
+                    df,
+                    TermList::Dense(Bitmap::from_sorted(&list, num_documents)),
+                )
+            } else {
+                (term_id, df, TermList::Sparse(list))
+            }
+        })
+        .collect();
+
+    eprintln!("Counting co-occurrences");
+    let mut output = BufWriter::new(File::create(output)?);
+    let progress = ProgressBar::new(lists.len() as u64);
+    progress.set_style(pb_style());
+    progress.set_draw_delta(lists.len() as u64 / 100);
+    let threads = options.threads.max(1);
+    parallel::map_ordered(
+        threads,
+        4 * threads,
+        (0..lists.len()).map(Ok),
+        |row| {
+            let (term_id, df, list) = &lists[row];
+            let mut encoded = Vec::new();
+            for (other_id, other_df, other) in &lists[row + 1..] {
+                let count = list.cooccurrences(other);
+                if count > 0 && count >= options.min_count {
+                    writeln!(
+                        encoded,
+                        "{}\t{}\t{}\t{}",
+                        terms[*term_id as usize],
+                        terms[*other_id as usize],
+                        count,
+                        pmi(count, *df, *other_df, num_documents)
+                    )?;
+                }
+            }
+            Ok(encoded)
+        },
+        |encoded| {
+            output.write_all(&encoded)?;
+            progress.inc(1);
+            Ok(())
+        },
+    )?;
+    progress.finish();
+    output.flush()?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_cooccurrences_of_representations() {
+        let lhs = vec![1, 3, 5, 7];
+        let rhs = vec![3, 4, 5];
+        let expected = 2;
+        let sparse = |list: &Vec<u32>| TermList::Sparse(list.clone());
+        let dense = |list: &Vec<u32>| TermList::Dense(Bitmap::from_sorted(list, 8));
+        assert_eq!(sparse(&lhs).cooccurrences(&sparse(&rhs)), expected);
+        assert_eq!(sparse(&lhs).cooccurrences(&dense(&rhs)), expected);
+        assert_eq!(dense(&lhs).cooccurrences(&sparse(&rhs)), expected);
+        assert_eq!(dense(&lhs).cooccurrences(&dense(&rhs)), expected);
+    }
+
+    #[test]
+    fn test_pmi() {
+        assert!((pmi(10, 10, 10, 100) - 10_f64.ln()).abs() < 1e-9);
+        assert!(pmi(1, 10, 10, 100).abs() < 1e-9);
+    }
+}
@@ -0,0 +1,457 @@
+//! Near-duplicate detection, to delete duplicated documents that inflate postings lists.
+//!
+//! Postings are transposed into forward partitions of documents, from which a min-hash signature
+//! of the set of terms of each document is computed in parallel and written to a temporary file
+//! in document order. Signatures are split into bands of rows: documents whose rows of a band
+//! hash to the same bucket are candidates, kept if their signatures agree on enough positions.
+//! Buckets are collected in parallel, in passes over ranges of keys of each band so that those
+//! in flight fit in the memory budget, and duplicates are merged into clusters, of which only
+//! the first document is kept.
+
+use crate::collection::{collection_path, CollectionReader};
+use crate::forward::{max_postings, ForwardPartitions};
+use crate::inverter::{temp_prefix, TempFiles};
+use crate::memory::MemoryBudget;
+use crate::postings::map_file;
+use crate::sample::hash;
+use crate::{parallel, CollectionInput, Deletions, Result};
+use anyhow::{bail, Context};
+use std::convert::TryFrom;
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::ops::Range;
+use std::path::{Path, PathBuf};
+
+/// Number of documents whose signatures are computed at once by a thread.
+const BATCH_SIZE: usize = 1024;
+
+/// Options of [`find_duplicates`].
+#[derive(Debug, Clone)]
+pub struct DedupOptions {
+    /// Number of bands of signatures.
+    pub bands: usize,
+    /// Number of rows, or hash values, per band.
+    pub rows: usize,
+    /// Minimum estimated Jaccard similarity of the term sets of near-duplicates.
+    pub threshold: f64,
+    /// Documents with fewer distinct terms are never considered duplicates.
+    pub min_terms: usize,
+    /// Seed of the hash functions.
+    pub seed: u64,
+    /// Number of threads decoding lists, computing signatures, and processing bands.
+    pub threads: usize,
+    /// Approximate number of bytes of forward entries, or of band buckets, kept in memory.
+    pub memory_budget: usize,
+    /// If set, the memory budget is reduced as needed to keep memory use under this many bytes,
+    /// see [`cgroup_memory_limit`](crate::cgroup_memory_limit).
+    pub memory_limit: Option<u64>,
+    /// Directory for temporary files. Defaults to the directory of the input.
+    pub temp_dir: Option<PathBuf>,
+}
+
+impl Default for DedupOptions {
+    fn default() -> Self {
+        Self {
+            bands: 16,
+            rows: 8,
+            threshold: 0.8,
+            min_terms: 5,
+            seed: 0,
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+            memory_budget: 1 << 30,
+            memory_limit: None,
+            temp_dir: None,
+        }
+    }
+}
+
+/// min-hash signature of a set of term IDs, with one hash function per seed.
+fn signature<I: Iterator<Item = u32> + Clone>(terms: &I, seeds: &[u64]) -> Vec<u32> {
+    seeds
+        .iter()
+        .map(|&seed| {
+            terms
+                .clone()
+                .map(|term| (hash(term, seed) >> 32) as u32)
+                .min()
+                .unwrap_or(u32::MAX)
+        })
+        .collect()
+}
+
+/// Fraction of positions on which two encoded signatures agree.
+#[allow(clippy::cast_precision_loss)]
+fn similarity(lhs: &[u8], rhs: &[u8]) -> f64 {
+    let equal = lhs
+        .chunks_exact(4)
+        .zip(rhs.chunks_exact(4))
+        .filter(|(lhs, rhs)| lhs == rhs)
+        .count();
+    equal as f64 / (lhs.len() / 4).max(1) as f64
+}
+
+/// Union-find forest of documents, whose roots are the smallest document IDs of their trees.
+struct Clusters {
+    parents: Vec<u32>,
+}
+
+impl Clusters {
+    fn new(num_documents: u32) -> Self {
+        Self {
+            parents: (0..num_documents).collect(),
+        }
+    }
+
+    fn find(&mut self, mut docid: u32) -> u32 {
+        while self.parents[docid as usize] != docid {
+            let parent = self.parents[docid as usize];
+            self.parents[docid as usize] = self.parents[parent as usize];
+            docid = parent;
+        }
+        docid
+    }
+
+    fn union(&mut self, lhs: u32, rhs: u32) {
+        let (lhs, rhs) = (self.find(lhs), self.find(rhs));
+        self.parents[lhs.max(rhs) as usize] = lhs.min(rhs);
+    }
+}
+
+/// Bucketing of the candidates of each band by the hash of their rows.
+struct Bands<'a> {
+    signatures: &'a [u8],
+    candidates: &'a [bool],
+    rows: usize,
+    signature_length: usize,
+    threshold: f64,
+}
+
+impl Bands<'_> {
+    fn signature(&self, docid: u32) -> &[u8] {
+        let start = docid as usize * self.signature_length;
+        &self.signatures[start..start + self.signature_length]
+    }
+
+    /// Key of the bucket of `docid` in `band`.
+    fn key(&self, docid: u32, band: usize) -> u64 {
+        let rows = 4 * band * self.rows..4 * (band + 1) * self.rows;
+        self.signature(docid)[rows]
+            .chunks_exact(4)
+            .fold(band as u64, |key, row| {
+                hash(u32::from_le_bytes([row[0], row[1], row[2], row[3]]), key)
+            })
+    }
+
+    /// Pairs of near-duplicates in the buckets of `band` whose keys are in range `pass` of
+    /// `num_passes` equal ranges.
+    #[allow(clippy::cast_possible_truncation)]
+    fn pairs(&self, band: usize, pass: usize, num_passes: usize) -> Vec<(u32, u32)> {
+        let mut buckets: Vec<(u64, u32)> = (0..)
+            .zip(self.candidates)
+            .filter(|(_, &candidate)| candidate)
+            .map(|(docid, _)| (self.key(docid, band), docid))
+            .filter(|&(key, _)| ((u128::from(key) * num_passes as u128) >> 64) as usize == pass)
+            .collect();
+        buckets.sort_unstable();
+        let mut pairs = Vec::new();
+        let mut representatives: Vec<u32> = Vec::new();
+        for bucket in buckets.chunk_by(|lhs, rhs| lhs.0 == rhs.0) {
+            // Each document is compared to the first similar documents of the bucket found so
+            // far, so that buckets of copies of the same document take linear time.
+            representatives.clear();
+            for &(_, docid) in bucket {
+                let signature = self.signature(docid);
+                let similar = representatives.iter().copied().find(|&representative| {
+                    similarity(self.signature(representative), signature) >= self.threshold
+                });
+                match similar {
+                    Some(representative) => pairs.push((representative, docid)),
+                    None => representatives.push(docid),
+                }
+            }
+        }
+        pairs
+    }
+}
+
+/// Signatures of all documents in a temporary file, and which documents have enough terms.
+struct Signatures {
+    path: PathBuf,
+    candidates: Vec<bool>,
+}
+
+/// Memory budget of forward entries and band buckets: at most the memory available under the
+/// limit, if any, once the candidates and clusters of `num_documents` documents are set aside.
+fn dedup_budget(options: &DedupOptions, num_documents: u32) -> Result<usize> {
+    let Some(limit) = options.memory_limit else {
+        return Ok(options.memory_budget);
+    };
+    let mut budget = MemoryBudget::new(limit);
+    // A candidate flag and a parent in the clusters per document.
+    budget.reserve(5 * u64::from(num_documents), "candidates and clusters")?;
+    let available = usize::try_from(budget.available()).unwrap_or(usize::MAX);
+    if available < options.memory_budget {
+        eprintln!(
+            "Memory limit of {} MiB: reducing the memory budget to {} MiB",
+            limit >> 20,
+            available >> 20
+        );
+    }
+    Ok(options.memory_budget.min(available))
+}
+
+/// Transposes the lists of `input` and writes the signature of each document, in order.
+fn write_signatures(
+    input: &CollectionInput,
+    seeds: &[u64],
+    options: &DedupOptions,
+    memory_budget: usize,
+    temp_files: &TempFiles,
+    prefix: &Path,
+) -> Result<Signatures> {
+    let mut reader = CollectionReader::open(input)?;
+    let num_documents = reader.num_documents();
+    let mut forward = ForwardPartitions::create(
+        num_documents,
+        max_postings(input)?,
+        memory_budget,
+        temp_files,
+        prefix,
+    )?;
+    let threads = options.threads.max(1);
+    let mut term_id = 0_u32;
+    parallel::map_ordered(
+        threads,
+        4 * threads,
+        reader.lists("Transposing postings lists")?,
+        |list| list.decode(num_documents),
+        |list| {
+            for (docid, _) in list.postings {
+                forward.push((docid, term_id, ()))?;
+            }
+            term_id += 1;
+            Ok(())
+        },
+    )?;
+
+    eprintln!("Computing signatures");
+    let path = temp_files.register(collection_path(prefix, "signatures"));
+    let mut writer = BufWriter::new(
+        File::create(&path).with_context(|| format!("Unable to create {}", path.display()))?,
+    );
+    let empty: Vec<u8> = std::iter::repeat_n(u32::MAX.to_le_bytes(), seeds.len())
+        .flatten()
+        .collect();
+    let mut candidates = vec![false; num_documents as usize];
+    let mut next_docid = 0;
+    forward.for_each(|documents, mut entries| {
+        entries.sort_unstable_by_key(|&(docid, _, ())| docid);
+        let mut groups: Vec<Range<usize>> = Vec::new();
+        for (position, &(docid, _, ())) in entries.iter().enumerate() {
+            match groups.last_mut() {
+                Some(last) if entries[last.start].0 == docid => last.end = position + 1,
+                _ => groups.push(position..position + 1),
+            }
+        }
+        let entries = &entries;
+        parallel::map_ordered(
+            threads,
+            4 * threads,
+            groups.chunks(BATCH_SIZE).map(Ok),
+            |batch| {
+                Ok(batch
+                    .iter()
+                    .filter(|group| group.len() >= options.min_terms)
+                    .map(|group| {
+                        let terms = entries[group.clone()].iter().map(|&(_, term, ())| term);
+                        (entries[group.start].0, signature(&terms, seeds))
+                    })
+                    .collect::<Vec<_>>())
+            },
+            |batch| {
+                for (docid, signature) in batch {
+                    while next_docid < docid {
+                        writer.write_all(&empty)?;
+                        next_docid += 1;
+                    }
+                    for value in signature {
+                        writer.write_all(&value.to_le_bytes())?;
+                    }
+                    candidates[docid as usize] = true;
+                    next_docid += 1;
+                }
+                Ok(())
+            },
+        )?;
+        while next_docid < documents.end {
+            writer.write_all(&empty)?;
+            next_docid += 1;
+        }
+        Ok(())
+    })?;
+    writer.flush()?;
+    Ok(Signatures { path, candidates })
+}
+
+/// Finds near-duplicate documents of `input`, and returns the deletions of all but the first
+/// document of each cluster of near-duplicates.
+///
+/// Documents are near-duplicates if the min-hash estimate of the Jaccard similarity of their
+/// term sets, from `bands * rows` hash functions, is at least [`DedupOptions::threshold`],
+/// and they share the bucket of at least one band. Memory holds the forward entries of a
+/// partition, or the buckets of the key ranges processed at once, within the memory budget, as
+/// well as five bytes per document; signatures take `4 * bands * rows` bytes per document on
+/// disk, and are mapped in memory. Under [`DedupOptions::memory_limit`], the five bytes per
+/// document are set aside before sizing partitions and passes.
+///
+/// # Errors
+///
+/// Returns an error when:
+/// - there are no bands or rows, or the threshold is not in [0, 1],
+/// - the memory limit cannot hold five bytes per document,
+/// - an IO error occurs,
+/// - the input is malformed.
+pub fn find_duplicates(input: &CollectionInput, options: &DedupOptions) -> Result<Deletions> {
+    if options.bands == 0 || options.rows == 0 {
+        bail!("At least one band and one row are required");
+    }
+    if !(0.0..=1.0).contains(&options.threshold) {
+        bail!("Invalid similarity threshold: {}", options.threshold);
+    }
+    let (CollectionInput::Ciff(path) | CollectionInput::Pisa(path)) = input;
+    let prefix = temp_prefix(options.temp_dir.as_deref(), path)?;
+    let num_hashes = options.bands * options.rows;
+    let seeds: Vec<u64> = (0..u32::try_from(num_hashes)?)
+        .map(|index| hash(index, options.seed))
+        .collect();
+    let memory_budget = dedup_budget(options, CollectionReader::open(input)?.num_documents())?;
+    let temp_files = TempFiles::default();
+    let signatures = write_signatures(
+        input,
+        &seeds,
+        options,
+        memory_budget,
+        &temp_files,
+        &collection_path(&prefix, "dedup"),
+    )?;
+    let num_documents = u32::try_from(signatures.candidates.len())?;
+    let num_candidates = signatures
+        .candidates
+        .iter()
+        .filter(|&&candidate| candidate)
+        .count();
+    if num_candidates == 0 {
+        eprintln!("No document has enough terms to be a near-duplicate");
+        return Ok(Deletions::default());
+    }
+    let bytes = map_file(&signatures.path)?;
+    let bands = Bands {
+        signatures: &bytes,
+        candidates: &signatures.candidates,
+        rows: options.rows,
+        signature_length: 4 * num_hashes,
+        threshold: options.threshold,
+    };
+
+    // Each bucket entry takes a key and a document ID; buckets of a band are collected in
+    // passes over ranges of keys, so that those in flight fit in the memory budget.
+    let threads = options.threads.max(1);
+    let entry_bytes = std::mem::size_of::<(u64, u32)>();
+    let pass_budget = (memory_budget / threads).max(entry_bytes);
+    let num_passes = (num_candidates * entry_bytes).div_ceil(pass_budget);
+    eprintln!(
+        "Finding near-duplicates among {} documents, in {} passes per band",
+        num_candidates, num_passes
+    );
+    let mut clusters = Clusters::new(num_documents);
+    parallel::map_ordered(
+        threads,
+        threads,
+        (0..options.bands).flat_map(|band| (0..num_passes).map(move |pass| Ok((band, pass)))),
+        |(band, pass)| Ok(bands.pairs(band, pass, num_passes)),
+        |pairs| {
+            for (lhs, rhs) in pairs {
+                clusters.union(lhs, rhs);
+            }
+            Ok(())
+        },
+    )?;
+    let duplicates: Vec<u32> = (0..num_documents)
+        .filter(|&docid| clusters.find(docid) != docid)
+        .collect();
+    eprintln!("Found {} near-duplicate documents", duplicates.len());
+    Ok(Deletions::from_docids(duplicates))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_signatures() {
+        let seeds: Vec<u64> = (0..256).map(|index| hash(index, 1)).collect();
+        let encode = |terms: &[u32]| -> Vec<u8> {
+            signature(&terms.iter().copied(), &seeds)
+                .into_iter()
+                .flat_map(u32::to_le_bytes)
+                .collect()
+        };
+        let base: Vec<u32> = (0..100).collect();
+        let near: Vec<u32> = (5..105).collect();
+        let far: Vec<u32> = (50..150).collect();
+        // Jaccard similarities are 95/105 and 50/150.
+        let near_similarity = similarity(&encode(&base), &encode(&near));
+        let far_similarity = similarity(&encode(&base), &encode(&far));
+        assert!(
+            (near_similarity - 0.905).abs() < 0.08,
+            "{}",
+            near_similarity
+        );
+        assert!((far_similarity - 0.333).abs() < 0.1, "{}", far_similarity);
+        assert!((similarity(&encode(&base), &encode(&base)) - 1.0).abs() < f64::EPSILON);
+    }
+
+    #[test]
+    fn test_band_pairs() {
+        let signatures: Vec<u8> = [[1, 9, 9, 9], [1, 2, 3, 4], [1, 2, 3, 5], [2, 2, 3, 4]]
+            .iter()
+            .flatten()
+            .flat_map(|&value: &u32| value.to_le_bytes())
+            .collect();
+        let bands = Bands {
+            signatures: &signatures,
+            candidates: &[true, true, true, true],
+            rows: 1,
+            signature_length: 16,
+            threshold: 0.75,
+        };
+        // Documents 1 and 2 match although the first document of their bucket does not.
+        assert_eq!(bands.pairs(0, 0, 1), vec![(1, 2)]);
+        let passes: Vec<_> = (0..3).flat_map(|pass| bands.pairs(0, pass, 3)).collect();
+        assert_eq!(passes, vec![(1, 2)]);
+    }
+
+    #[test]
+    fn test_dedup_budget() -> Result<()> {
+        let options = DedupOptions::default();
+        assert_eq!(dedup_budget(&options, 1 << 20)?, options.memory_budget);
+        let limited = DedupOptions {
+            memory_limit: Some(64 << 20),
+            ..options
+        };
+        // 28 MiB are available under the limit, of which 5 MiB go to per-document arrays.
+        assert_eq!(dedup_budget(&limited, 1 << 20)?, 23 << 20);
+        assert!(dedup_budget(&limited, 6 << 20).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_clusters() {
+        let mut clusters = Clusters::new(6);
+        clusters.union(4, 2);
+        clusters.union(5, 4);
+        clusters.union(3, 1);
+        let roots: Vec<u32> = (0..6).map(|docid| clusters.find(docid)).collect();
+        assert_eq!(roots, vec![0, 1, 2, 1, 2, 2]);
+    }
+}
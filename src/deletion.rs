@@ -0,0 +1,259 @@
+//! Deletion of documents while converting, such as spam or takedowns.
+//!
+//! Remaining documents are renumbered densely in their original order, through a table from
+//! old to new IDs built before postings are streamed. Postings of deleted documents are removed
+//! from each list, and lists left empty are dropped, so that no second pass over the converted
+//! collection is needed.
+
+use crate::{PostingsList, Result};
+use anyhow::{anyhow, Context};
+use protobuf::RepeatedField;
+use std::convert::TryFrom;
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::path::Path;
+
+/// Reads document IDs from a text file, one per line, ignoring blank lines.
+///
+/// # Errors
+///
+/// Returns an error if the file cannot be read, or a line is not a document ID.
+pub fn read_docid_list(path: &Path) -> Result<Vec<u32>> {
+    std::fs::read_to_string(path)
+        .with_context(|| format!("Unable to read {}", path.display()))?
+        .lines()
+        .map(str::trim)
+        .filter(|line| !line.is_empty())
+        .map(|line| {
+            line.parse::<u32>()
+                .with_context(|| format!("Invalid document ID: {}", line))
+        })
+        .collect()
+}
+
+/// Documents to delete.
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct Deletions {
+    /// Bitmap of deleted document IDs: document `i` is deleted if bit `i % 8` of byte `i / 8`
+    /// is set. Documents past the end of the bitmap are kept.
+    pub bitmap: Vec<u8>,
+    /// If set, documents of length 0 are deleted as well.
+    pub drop_empty: bool,
+}
+
+impl Deletions {
+    /// Deletes the documents with the given IDs.
+    pub fn from_docids<I: IntoIterator<Item = u32>>(docids: I) -> Self {
+        let mut bitmap = Vec::new();
+        for docid in docids {
+            let byte = docid as usize / 8;
+            if byte >= bitmap.len() {
+                bitmap.resize(byte + 1, 0);
+            }
+            bitmap[byte] |= 1 << (docid % 8);
+        }
+        Self {
+            bitmap,
+            drop_empty: false,
+        }
+    }
+
+    /// Reads IDs of deleted documents from a text file, one per line.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the file cannot be read, or a line is not a document ID.
+    pub fn read_docids(path: &Path) -> Result<Self> {
+        Ok(Self::from_docids(read_docid_list(path)?))
+    }
+
+    /// Writes IDs of deleted documents to a text file, one per line, in increasing order.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the file cannot be written.
+    pub fn write_docids(&self, path: &Path) -> Result<()> {
+        let mut writer = BufWriter::new(
+            File::create(path).with_context(|| format!("Unable to create {}", path.display()))?,
+        );
+        for (byte, &bits) in (0_u32..).zip(&self.bitmap) {
+            for bit in (0..8).filter(|bit| bits & (1 << bit) != 0) {
+                writeln!(writer, "{}", byte * 8 + bit)?;
+            }
+        }
+        writer.flush()?;
+        Ok(())
+    }
+
+    /// Reads a bitmap of deleted documents, in the layout of [`Deletions::bitmap`].
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the file cannot be read.
+    pub fn read_bitmap(path: &Path) -> Result<Self> {
+        Ok(Self {
+            bitmap: std::fs::read(path)
+                .with_context(|| format!("Unable to read {}", path.display()))?,
+            drop_empty: false,
+        })
+    }
+
+    /// Also deletes the documents deleted by `other`.
+    pub fn extend(&mut self, other: &Self) {
+        if other.bitmap.len() > self.bitmap.len() {
+            self.bitmap.resize(other.bitmap.len(), 0);
+        }
+        for (byte, other_byte) in self.bitmap.iter_mut().zip(&other.bitmap) {
+            *byte |= other_byte;
+        }
+        self.drop_empty |= other.drop_empty;
+    }
+
+    /// Checks if document `docid` is in the deletion bitmap.
+    #[must_use]
+    pub fn is_deleted(&self, docid: u32) -> bool {
+        self.bitmap
+            .get(docid as usize / 8)
+            .is_some_and(|byte| byte & (1 << (docid % 8)) != 0)
+    }
+}
+
+/// Table from old to new IDs of the remaining documents.
+#[derive(Debug, Clone)]
+pub(crate) struct DocumentRemap {
+    ids: Vec<u32>,
+    num_kept: u32,
+}
+
+impl DocumentRemap {
+    const DELETED: u32 = u32::MAX;
+
+    /// Builds the table of `num_documents` documents, whose lengths must be given if empty
+    /// documents are dropped.
+    pub(crate) fn new(
+        deletions: &Deletions,
+        num_documents: u32,
+        lengths: Option<&[u32]>,
+    ) -> Result<Self> {
+        if deletions.drop_empty && lengths.is_none() {
+            return Err(anyhow!(
+                "Document lengths are required to drop empty documents"
+            ));
+        }
+        Ok(Self::from_kept(num_documents, |docid| {
+            let empty = deletions.drop_empty
+                && lengths.and_then(|lengths| lengths.get(docid as usize)) == Some(&0);
+            !deletions.is_deleted(docid) && !empty
+        }))
+    }
+
+    /// Builds the table of `num_documents` documents, keeping those for which `keep` is true.
+    pub(crate) fn from_kept<F: Fn(u32) -> bool>(num_documents: u32, keep: F) -> Self {
+        let mut ids = Vec::with_capacity(num_documents as usize);
+        let mut num_kept = 0;
+        for docid in 0..num_documents {
+            if keep(docid) {
+                ids.push(num_kept);
+                num_kept += 1;
+            } else {
+                ids.push(Self::DELETED);
+            }
+        }
+        Self { ids, num_kept }
+    }
+
+    /// Number of remaining documents.
+    pub(crate) fn num_kept(&self) -> u32 {
+        self.num_kept
+    }
+
+    /// New ID of document `docid`, or `None` if it is deleted or out of bounds.
+    pub(crate) fn get(&self, docid: u32) -> Option<u32> {
+        self.ids
+            .get(docid as usize)
+            .copied()
+            .filter(|&id| id != Self::DELETED)
+    }
+
+    /// Removes postings of deleted documents from `list`, renumbers the others, and updates
+    /// its frequencies. Returns `false` if no posting is left.
+    pub(crate) fn remap_list(&self, list: &mut PostingsList) -> Result<bool> {
+        let mut docid = 0_u32;
+        let mut previous = 0_u32;
+        let mut cf = 0;
+        let mut postings = Vec::with_capacity(list.get_postings().len());
+        for mut posting in list.take_postings().into_vec() {
+            let gap = u32::try_from(posting.get_docid()).context("Negative ID")?;
+            docid = docid
+                .checked_add(gap)
+                .filter(|&docid| (docid as usize) < self.ids.len())
+                .ok_or_else(|| anyhow!("Document ID out of bounds in {}", list.get_term()))?;
+            if let Some(id) = self.get(docid) {
+                posting.set_docid(i32::try_from(id - previous)?);
+                cf += i64::from(posting.get_tf());
+                previous = id;
+                postings.push(posting);
+            }
+        }
+        list.set_df(postings.len() as i64);
+        list.set_cf(cf);
+        let kept = !postings.is_empty();
+        list.set_postings(RepeatedField::from_vec(postings));
+        Ok(kept)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::Posting;
+
+    #[test]
+    fn test_deletions() {
+        let deletions = Deletions::from_docids(vec![1, 9]);
+        assert_eq!(deletions.bitmap, vec![0b10, 0b10]);
+        assert!(deletions.is_deleted(1));
+        assert!(deletions.is_deleted(9));
+        assert!(!deletions.is_deleted(2));
+        assert!(!deletions.is_deleted(100));
+        let mut extended = Deletions::from_docids(vec![2]);
+        extended.extend(&deletions);
+        assert_eq!(extended.bitmap, vec![0b110, 0b10]);
+    }
+
+    #[test]
+    fn test_remap() -> Result<()> {
+        let deletions = Deletions {
+            drop_empty: true,
+            ..Deletions::from_docids(vec![1])
+        };
+        assert!(DocumentRemap::new(&deletions, 5, None).is_err());
+        let remap = DocumentRemap::new(&deletions, 5, Some(&[3, 4, 0, 2, 1]))?;
+        assert_eq!(remap.num_kept(), 3);
+        let ids: Vec<_> = (0..6).map(|docid| remap.get(docid)).collect();
+        assert_eq!(ids, vec![Some(0), None, None, Some(1), Some(2), None]);
+
+        let mut list = PostingsList::default();
+        for &(gap, tf) in &[(0, 2), (1, 3), (3, 4)] {
+            let mut posting = Posting::default();
+            posting.set_docid(gap);
+            posting.set_tf(tf);
+            list.mut_postings().push(posting);
+        }
+        let mut remapped = list.clone();
+        assert!(remap.remap_list(&mut remapped)?);
+        let postings: Vec<_> = remapped
+            .get_postings()
+            .iter()
+            .map(|posting| (posting.get_docid(), posting.get_tf()))
+            .collect();
+        assert_eq!(postings, vec![(0, 2), (2, 4)]);
+        assert_eq!((remapped.get_df(), remapped.get_cf()), (2, 6));
+
+        let remap = DocumentRemap::new(&Deletions::from_docids(vec![0, 1, 4]), 5, None)?;
+        assert!(!remap.remap_list(&mut list.clone())?);
+        let remap = DocumentRemap::new(&Deletions::default(), 4, None)?;
+        assert!(remap.remap_list(&mut list).is_err());
+        Ok(())
+    }
+}
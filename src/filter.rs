@@ -0,0 +1,493 @@
+//! Filtering of CIFF files into smaller CIFF files, copying kept messages as raw bytes.
+//!
+//! Postings lists are selected by term and document frequency, which lead each encoded list, so
+//! only the first bytes of every list are read and the rest is skipped. Kept lists and document
+//! records are then copied with `copy_file_range`, without passing through user space where the
+//! kernel supports it, behind a header with updated counts.
+//!
+//! Only a selection of documents, by range or by deletions, requires decoding: kept lists are
+//! rewritten in parallel with the postings of selected documents, which are renumbered densely.
+//! The result is a new collection, whose header totals describe the selected documents.
+
+use crate::deletion::DocumentRemap;
+use crate::inverter::TempFiles;
+use crate::io_backend::{copy_range, IoConfig};
+use crate::scan::MessageScanner;
+use crate::{parallel, pb_style, proto, Deletions, DocRecord, Header, PostingsList, Result};
+use anyhow::{anyhow, bail, Context};
+use indicatif::ProgressBar;
+use protobuf::{CodedOutputStream, Message};
+use std::collections::HashSet;
+use std::convert::TryFrom;
+use std::fs::File;
+use std::io::{BufWriter, Read, Seek, Write};
+use std::ops::Range;
+use std::path::{Path, PathBuf};
+
+/// Number of bytes read from the start of each list to find its term and document frequency.
+const PREFIX_LENGTH: u32 = 256;
+
+/// Options of [`filter_ciff`].
+#[derive(Debug, Clone)]
+pub struct FilterOptions {
+    /// If set, only lists of these terms are kept.
+    pub terms: Option<HashSet<String>>,
+    /// If set, only lists with at least this document frequency are kept.
+    pub min_df: Option<u32>,
+    /// If set, only lists with at most this document frequency are kept.
+    pub max_df: Option<u32>,
+    /// If set, only documents with IDs in this range are kept, renumbered from 0, and lists are
+    /// restricted to them; lists left empty are dropped.
+    pub documents: Option<Range<u32>>,
+    /// If set, these documents are removed, and the remaining ones are renumbered densely;
+    /// lists left empty are dropped.
+    pub deletions: Option<Deletions>,
+    /// If set, replaces the description of the header.
+    pub description: Option<String>,
+    /// Number of threads rewriting postings lists when documents are selected.
+    pub threads: usize,
+}
+
+impl Default for FilterOptions {
+    fn default() -> Self {
+        Self {
+            terms: None,
+            min_df: None,
+            max_df: None,
+            documents: None,
+            deletions: None,
+            description: None,
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+        }
+    }
+}
+
+impl FilterOptions {
+    fn keeps(&self, term: &str, df: i64) -> bool {
+        self.terms.as_ref().is_none_or(|terms| terms.contains(term))
+            && self.min_df.is_none_or(|min_df| df >= i64::from(min_df))
+            && self.max_df.is_none_or(|max_df| df <= i64::from(max_df))
+    }
+
+    /// Table of selected documents out of `num_documents`, if documents are selected.
+    fn document_remap(&self, num_documents: u32) -> Option<DocumentRemap> {
+        if self.documents.is_none() && self.deletions.is_none() {
+            return None;
+        }
+        Some(DocumentRemap::from_kept(num_documents, |docid| {
+            self.documents
+                .as_ref()
+                .is_none_or(|documents| documents.contains(&docid))
+                && self
+                    .deletions
+                    .as_ref()
+                    .is_none_or(|deletions| !deletions.is_deleted(docid))
+        }))
+    }
+}
+
+fn read_varint(bytes: &[u8], position: &mut usize) -> Option<u64> {
+    let mut value = 0;
+    for shift in (0..64).step_by(7) {
+        let byte = *bytes.get(*position)?;
+        *position += 1;
+        value |= u64::from(byte & 0x7F) << shift;
+        if byte & 0x80 == 0 {
+            return Some(value);
+        }
+    }
+    None
+}
+
+/// Reads the term and document frequency of an encoded postings list from its first bytes.
+/// Returns `None` if they are not all in `bytes`, unless `complete` is set.
+pub(crate) fn list_term_and_df(bytes: &[u8], complete: bool) -> Result<Option<(String, i64)>> {
+    let mut position = 0;
+    let mut term = String::new();
+    let mut df = 0;
+    loop {
+        if position == bytes.len() && complete {
+            return Ok(Some((term, df)));
+        }
+        let field_end = |position: usize, length: u64| {
+            usize::try_from(length)
+                .ok()
+                .and_then(|length| position.checked_add(length))
+                .filter(|&end| end <= bytes.len())
+        };
+        let Some(tag) = read_varint(bytes, &mut position) else {
+            break;
+        };
+        let end = match (tag >> 3, tag & 7) {
+            // Postings follow the term and frequencies.
+            (4, _) => return Ok(Some((term, df))),
+            (field, 0) => {
+                let Some(value) = read_varint(bytes, &mut position) else {
+                    break;
+                };
+                if field == 2 {
+                    // Negative values are encoded in two's complement.
+                    df = i64::from_le_bytes(value.to_le_bytes());
+                }
+                position
+            }
+            (field, 2) => {
+                let Some(length) = read_varint(bytes, &mut position) else {
+                    break;
+                };
+                let Some(end) = field_end(position, length) else {
+                    break;
+                };
+                if field == 1 {
+                    term = std::str::from_utf8(&bytes[position..end])
+                        .context("Invalid term")?
+                        .to_string();
+                }
+                end
+            }
+            (_, 1) => match field_end(position, 8) {
+                Some(end) => end,
+                None => break,
+            },
+            (_, 5) => match field_end(position, 4) {
+                Some(end) => end,
+                None => break,
+            },
+            (_, wire_type) => bail!("Invalid wire type {} in postings list", wire_type),
+        };
+        position = end;
+    }
+    if complete {
+        bail!("Truncated postings list");
+    }
+    Ok(None)
+}
+
+/// Reads the start of the next postings list, and returns its offset, term, and document
+/// frequency, with the number of bytes of its body left to read after those in `buffer`.
+pub(crate) fn read_list_start<R: Read + Seek>(
+    scanner: &mut MessageScanner<R>,
+    buffer: &mut Vec<u8>,
+) -> Result<(u64, String, i64, u32)> {
+    let start = scanner.offset();
+    let length = scanner.read_message_start(PREFIX_LENGTH, buffer)?;
+    let remaining = length - u32::try_from(buffer.len())?;
+    let prefix = list_term_and_df(buffer, remaining == 0)
+        .with_context(|| format!("Invalid postings list at byte {}", start))?;
+    if let Some((term, df)) = prefix {
+        return Ok((start, term, df, remaining));
+    }
+    // The term is longer than the prefix.
+    scanner.read_bytes(remaining, buffer)?;
+    let (term, df) = list_term_and_df(buffer, true)?.ok_or_else(|| anyhow!("Truncated list"))?;
+    Ok((start, term, df, 0))
+}
+
+fn list_progress(header: &Header) -> ProgressBar {
+    eprintln!("Filtering postings lists");
+    let progress = ProgressBar::new(u64::from(header.num_postings_lists));
+    progress.set_style(pb_style());
+    progress.set_draw_delta(u64::from(header.num_postings_lists) / 100);
+    progress
+}
+
+/// Returns the byte ranges of the postings lists of `scanner` kept with `options`, skipping
+/// the others, with adjacent ranges coalesced.
+fn kept_ranges<R: Read + Seek>(
+    scanner: &mut MessageScanner<R>,
+    header: &Header,
+    options: &FilterOptions,
+) -> Result<(Vec<Range<u64>>, u32)> {
+    let progress = list_progress(header);
+    let mut buffer = Vec::new();
+    let mut ranges: Vec<Range<u64>> = Vec::new();
+    let mut kept_lists = 0;
+    for _ in 0..header.num_postings_lists {
+        let (start, term, df, remaining) = read_list_start(scanner, &mut buffer)?;
+        scanner.skip_bytes(remaining)?;
+        if options.keeps(&term, df) {
+            kept_lists += 1;
+            match ranges.last_mut() {
+                Some(last) if last.end == start => last.end = scanner.offset(),
+                _ => ranges.push(start..scanner.offset()),
+            }
+        }
+        progress.inc(1);
+    }
+    progress.finish();
+    Ok((ranges, kept_lists))
+}
+
+/// Returns the raw postings lists of `scanner` kept with `options`, skipping the others.
+fn kept_lists_of<'a, R: Read + Seek>(
+    scanner: &'a mut MessageScanner<R>,
+    header: &Header,
+    options: &'a FilterOptions,
+) -> impl Iterator<Item = Result<Vec<u8>>> + 'a {
+    let progress = list_progress(header);
+    let mut remaining_lists = header.num_postings_lists;
+    let mut next = move || -> Result<Option<Vec<u8>>> {
+        while remaining_lists > 0 {
+            remaining_lists -= 1;
+            progress.inc(1);
+            let mut buffer = Vec::new();
+            let (_, term, df, remaining) = read_list_start(scanner, &mut buffer)?;
+            if options.keeps(&term, df) {
+                scanner.read_bytes(remaining, &mut buffer)?;
+                return Ok(Some(buffer));
+            }
+            scanner.skip_bytes(remaining)?;
+        }
+        progress.finish();
+        Ok(None)
+    };
+    std::iter::from_fn(move || next().transpose())
+}
+
+/// Writes the selected document records, renumbered, and returns their number and total length.
+fn remap_documents<R: Read + Seek>(
+    scanner: &mut MessageScanner<R>,
+    header: &Header,
+    remap: &DocumentRemap,
+    out: &mut CodedOutputStream<'_>,
+) -> Result<(u32, i64)> {
+    eprintln!("Filtering documents");
+    let mut total_length = 0;
+    for docid in 0..header.num_documents {
+        let mut record: DocRecord = scanner.read_document()?;
+        if i64::from(record.get_docid()) != i64::from(docid) {
+            bail!("Document records must come in order");
+        }
+        if let Some(id) = remap.get(docid) {
+            record.set_docid(i32::try_from(id)?);
+            total_length += i64::from(record.get_doclength());
+            out.write_message_no_tag(&record)?;
+        }
+    }
+    Ok((remap.num_kept(), total_length))
+}
+
+fn write_header(path: &Path, header: &proto::Header) -> Result<File> {
+    let mut file =
+        File::create(path).with_context(|| format!("Unable to create {}", path.display()))?;
+    let mut bytes = Vec::new();
+    let mut out = CodedOutputStream::new(&mut bytes);
+    out.write_message_no_tag(header)?;
+    out.flush()?;
+    drop(out);
+    file.write_all(&bytes)?;
+    Ok(file)
+}
+
+/// Fails if `output` is the same file as `input`, which would be truncated before being read.
+pub(crate) fn check_distinct_output(input: &Path, output: &Path) -> Result<()> {
+    if let (Ok(input), Ok(output)) = (input.canonicalize(), output.canonicalize()) {
+        if input == output {
+            bail!("The output {} is also the input", output.display());
+        }
+    }
+    Ok(())
+}
+
+/// Rewritten postings lists, and possibly documents, of a CIFF file, written to a temporary
+/// file until the counts of the header are known, then copied behind the header.
+pub(crate) struct RewrittenBody {
+    path: PathBuf,
+    writer: BufWriter<File>,
+    _temp_files: TempFiles,
+}
+
+impl RewrittenBody {
+    pub(crate) fn create(path: PathBuf) -> Result<Self> {
+        let temp_files = TempFiles::default();
+        let path = temp_files.register(path);
+        let writer = BufWriter::new(
+            File::create(&path).with_context(|| format!("Unable to create {}", path.display()))?,
+        );
+        Ok(Self {
+            path,
+            writer,
+            _temp_files: temp_files,
+        })
+    }
+
+    /// Rewrites raw postings lists in parallel with `rewrite`, which returns `false` for lists
+    /// to drop, and appends the others in order. Returns the number of lists written.
+    pub(crate) fn write_lists<I, F>(&mut self, lists: I, threads: usize, rewrite: F) -> Result<u32>
+    where
+        I: IntoIterator<Item = Result<Vec<u8>>>,
+        F: Fn(&mut PostingsList) -> Result<bool> + Sync,
+    {
+        let writer = &mut self.writer;
+        let mut written = 0_u32;
+        let threads = threads.max(1);
+        parallel::map_ordered(
+            threads,
+            4 * threads,
+            lists,
+            |message| {
+                let mut list = PostingsList::parse_from_bytes(&message)?;
+                if !rewrite(&mut list)? {
+                    return Ok(None);
+                }
+                let mut bytes = Vec::new();
+                let mut out = CodedOutputStream::new(&mut bytes);
+                out.write_message_no_tag(&list)?;
+                out.flush()?;
+                drop(out);
+                Ok(Some(bytes))
+            },
+            |message| {
+                if let Some(message) = message {
+                    writer.write_all(&message)?;
+                    written += 1;
+                }
+                Ok(())
+            },
+        )?;
+        Ok(written)
+    }
+
+    /// Writes `header` to `output`, followed by the body, and returns the output file to
+    /// append the rest of the input to, if any.
+    pub(crate) fn finish(mut self, output: &Path, header: &proto::Header) -> Result<File> {
+        self.writer.flush()?;
+        let mut output_file = write_header(output, header)?;
+        let body = File::open(&self.path)?;
+        copy_range(&body, 0..body.metadata()?.len(), &mut output_file)?;
+        Ok(output_file)
+    }
+}
+
+/// Filters the postings lists, and possibly the documents, of a CIFF file into a new CIFF file.
+///
+/// Without a document range or deletions, kept lists and all document records are copied as
+/// raw bytes, and only the number of lists changes in the header. Otherwise, kept lists are
+/// rewritten in parallel by [`FilterOptions::threads`] threads, along with the selected
+/// documents, to a temporary file next to `output`, which is then copied behind the header.
+///
+/// # Errors
+///
+/// Returns an error when:
+/// - `output` is the same file as `input`,
+/// - an IO error occurs,
+/// - the input is not a valid CIFF file,
+/// - a renumbered document ID or a count overflows the types of the CIFF format.
+pub fn filter_ciff(input: &Path, output: &Path, options: &FilterOptions) -> Result<()> {
+    check_distinct_output(input, output)?;
+    let mut scanner = MessageScanner::open(input, &IoConfig::default())?;
+    let header = Header::from_protobuf(scanner.read_message()?)?;
+    println!("{}", header);
+    let mut filtered = header.protobuf_header.clone();
+    if let Some(description) = &options.description {
+        filtered.set_description(description.clone());
+    }
+    let input_file = File::open(input)?;
+    let Some(remap) = options.document_remap(header.num_documents) else {
+        let (ranges, kept_lists) = kept_ranges(&mut scanner, &header, options)?;
+        filtered.set_num_postings_lists(i32::try_from(kept_lists)?);
+        filtered.set_total_postings_lists(i32::try_from(kept_lists)?);
+        let mut output_file = write_header(output, &filtered)?;
+        eprintln!("Copying {} postings lists and all documents", kept_lists);
+        for range in ranges {
+            copy_range(&input_file, range, &mut output_file)?;
+        }
+        let input_length = input_file.metadata()?.len();
+        copy_range(
+            &input_file,
+            scanner.offset()..input_length,
+            &mut output_file,
+        )?;
+        return Ok(());
+    };
+
+    let mut body = RewrittenBody::create(PathBuf::from(format!("{}.body", output.display())))?;
+    let kept_lists = body.write_lists(
+        kept_lists_of(&mut scanner, &header, options),
+        options.threads,
+        |list| remap.remap_list(list),
+    )?;
+    let mut out = CodedOutputStream::new(&mut body.writer);
+    let (kept_documents, total_length) = remap_documents(&mut scanner, &header, &remap, &mut out)?;
+    out.flush()?;
+    drop(out);
+
+    let kept_lists = i32::try_from(kept_lists)?;
+    let kept_documents_i32 = i32::try_from(kept_documents)?;
+    filtered.set_num_postings_lists(kept_lists);
+    filtered.set_total_postings_lists(kept_lists);
+    filtered.set_num_docs(kept_documents_i32);
+    filtered.set_total_docs(kept_documents_i32);
+    filtered.set_total_terms_in_collection(total_length);
+    #[allow(clippy::cast_precision_loss)]
+    filtered.set_average_doclength(total_length as f64 / f64::from(kept_documents.max(1)));
+    eprintln!(
+        "Copying {} postings lists and {} documents",
+        kept_lists, kept_documents
+    );
+    body.finish(output, &filtered)?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::Posting;
+
+    fn list(term: &str, docids: &[i32]) -> PostingsList {
+        let mut list = PostingsList::default();
+        list.set_term(term.to_string());
+        list.set_df(docids.len() as i64);
+        list.set_cf(docids.len() as i64);
+        let mut previous = 0;
+        for &docid in docids {
+            let mut posting = Posting::default();
+            posting.set_docid(docid - previous);
+            posting.set_tf(1);
+            list.mut_postings().push(posting);
+            previous = docid;
+        }
+        list
+    }
+
+    #[test]
+    fn test_filter_header_counts_written_lists() -> Result<()> {
+        let input = Path::new("tests/test_data/toy-complete-20200309.ciff");
+        let temp = tempfile::TempDir::new()?;
+        let output = temp.path().join("filtered.ciff");
+        let options = FilterOptions {
+            min_df: Some(2),
+            ..FilterOptions::default()
+        };
+        filter_ciff(input, &output, &options)?;
+        let mut scanner = MessageScanner::open(&output, &IoConfig::default())?;
+        let header = Header::from_protobuf(scanner.read_message()?)?;
+        assert_eq!(header.num_postings_lists, 3);
+        assert_eq!(header.protobuf_header.get_total_postings_lists(), 3);
+        assert!(filter_ciff(&output, &output, &options).is_err());
+        assert!(filter_ciff(
+            &output,
+            &temp.path().join(".").join("filtered.ciff"),
+            &options
+        )
+        .is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_list_term_and_df() -> Result<()> {
+        let bytes = list("term", &[1, 5, 9]).write_to_bytes()?;
+        let expected = Some(("term".to_string(), 3));
+        assert_eq!(list_term_and_df(&bytes, true)?, expected);
+        assert_eq!(list_term_and_df(&bytes[..11], false)?, expected);
+        assert_eq!(list_term_and_df(&bytes[..10], false)?, None);
+        assert!(list_term_and_df(&bytes[..4], true).is_err());
+        let mut empty = PostingsList::default();
+        empty.set_term("empty".to_string());
+        assert_eq!(
+            list_term_and_df(&empty.write_to_bytes()?, true)?,
+            Some(("empty".to_string(), 0))
+        );
+        Ok(())
+    }
+}
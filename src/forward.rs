@@ -0,0 +1,191 @@
+//! Forward transposition of postings lists into partitions of documents, for tools that need
+//! the vectors of all documents while reading a term-major collection.
+//!
+//! Entries are kept in memory if the postings of the whole collection may fit in the memory
+//! budget; otherwise, they are written to one temporary file per range of documents, and read
+//! back partition by partition.
+
+use crate::collection::collection_path;
+use crate::inverter::TempFiles;
+use crate::{CollectionInput, Result};
+use anyhow::Context;
+use std::convert::{TryFrom, TryInto};
+use std::fs::File;
+use std::io::{BufReader, BufWriter, Read, Write};
+use std::ops::Range;
+use std::path::{Path, PathBuf};
+
+/// Weight of the term of a forward entry, if any, stored after the document and term IDs.
+pub(crate) trait Weight: Copy {
+    /// Number of bytes of the weight in partition files.
+    const SIZE: usize;
+    fn write_to<T: Write>(self, writer: &mut T) -> std::io::Result<()>;
+    fn from_le_bytes(bytes: &[u8]) -> Result<Self>;
+}
+
+impl Weight for f32 {
+    const SIZE: usize = 4;
+    fn write_to<T: Write>(self, writer: &mut T) -> std::io::Result<()> {
+        writer.write_all(&self.to_le_bytes())
+    }
+    fn from_le_bytes(bytes: &[u8]) -> Result<Self> {
+        Ok(f32::from_le_bytes(bytes.try_into()?))
+    }
+}
+
+impl Weight for u32 {
+    const SIZE: usize = 4;
+    fn write_to<T: Write>(self, writer: &mut T) -> std::io::Result<()> {
+        writer.write_all(&self.to_le_bytes())
+    }
+    fn from_le_bytes(bytes: &[u8]) -> Result<Self> {
+        Ok(u32::from_le_bytes(bytes.try_into()?))
+    }
+}
+
+/// No weight, for tools that only need the terms of documents.
+impl Weight for () {
+    const SIZE: usize = 0;
+    fn write_to<T: Write>(self, _: &mut T) -> std::io::Result<()> {
+        Ok(())
+    }
+    fn from_le_bytes(_: &[u8]) -> Result<Self> {
+        Ok(())
+    }
+}
+
+/// Forward entry of a document: its ID, a term ID, and the weight of the term.
+pub(crate) type Entry<W> = (u32, u32, W);
+
+/// Forward entries of documents, transposed to partitions by document range.
+pub(crate) struct ForwardPartitions<W: Weight> {
+    length: u32,
+    num_documents: u32,
+    memory: Vec<Entry<W>>,
+    files: Vec<BufWriter<File>>,
+    paths: Vec<PathBuf>,
+}
+
+impl<W: Weight> ForwardPartitions<W> {
+    /// Partitions for at most `max_entries` entries, in memory if they fit in the budget.
+    pub(crate) fn create(
+        num_documents: u32,
+        max_entries: u64,
+        budget: usize,
+        temp_files: &TempFiles,
+        prefix: &Path,
+    ) -> Result<Self> {
+        Self::with_max_length(
+            num_documents,
+            max_entries,
+            budget,
+            num_documents,
+            temp_files,
+            prefix,
+        )
+    }
+
+    /// Same as [`Self::create`], with partitions of at most `max_length` documents, for tools
+    /// holding state for each document of a partition.
+    pub(crate) fn with_max_length(
+        num_documents: u32,
+        max_entries: u64,
+        budget: usize,
+        max_length: u32,
+        temp_files: &TempFiles,
+        prefix: &Path,
+    ) -> Result<Self> {
+        let entry_size = std::mem::size_of::<Entry<W>>().max(1) as u64;
+        let budget = u64::try_from(budget).unwrap_or(u64::MAX).max(entry_size);
+        let num_partitions = u32::try_from((max_entries * entry_size).div_ceil(budget))
+            .unwrap_or(u32::MAX)
+            .max(num_documents.div_ceil(max_length.max(1)))
+            .clamp(1, num_documents.max(1));
+        let length = num_documents.div_ceil(num_partitions).max(1);
+        let mut files = Vec::new();
+        let mut paths = Vec::new();
+        if num_partitions > 1 {
+            eprintln!(
+                "Transposing postings into {} partitions of {} documents",
+                num_partitions, length
+            );
+            for index in 0..num_partitions {
+                let path = temp_files.register(collection_path(prefix, &format!("fwd{}", index)));
+                files
+                    .push(BufWriter::new(File::create(&path).with_context(|| {
+                        format!("Unable to create {}", path.display())
+                    })?));
+                paths.push(path);
+            }
+        }
+        Ok(Self {
+            length,
+            num_documents,
+            memory: Vec::new(),
+            files,
+            paths,
+        })
+    }
+
+    pub(crate) fn push(&mut self, (docid, term, weight): Entry<W>) -> Result<()> {
+        if self.files.is_empty() {
+            self.memory.push((docid, term, weight));
+            return Ok(());
+        }
+        let file = &mut self.files[(docid / self.length) as usize];
+        file.write_all(&docid.to_le_bytes())?;
+        file.write_all(&term.to_le_bytes())?;
+        weight.write_to(file)?;
+        Ok(())
+    }
+
+    pub(crate) fn num_documents(&self) -> u32 {
+        self.num_documents
+    }
+
+    /// Calls `process` with the document range and entries of each partition in turn.
+    pub(crate) fn for_each<F>(self, mut process: F) -> Result<()>
+    where
+        F: FnMut(Range<u32>, Vec<Entry<W>>) -> Result<()>,
+    {
+        if self.files.is_empty() {
+            return process(0..self.num_documents, self.memory);
+        }
+        for (index, (file, path)) in (0_u32..).zip(self.files.into_iter().zip(&self.paths)) {
+            file.into_inner()
+                .map_err(std::io::IntoInnerError::into_error)?;
+            let mut reader = BufReader::new(File::open(path)?);
+            let mut entries = Vec::new();
+            let mut bytes = vec![0_u8; 8 + W::SIZE];
+            loop {
+                match reader.read_exact(&mut bytes) {
+                    Ok(()) => {}
+                    Err(error) if error.kind() == std::io::ErrorKind::UnexpectedEof => break,
+                    Err(error) => return Err(error.into()),
+                }
+                entries.push((
+                    u32::from_le_bytes(bytes[0..4].try_into()?),
+                    u32::from_le_bytes(bytes[4..8].try_into()?),
+                    W::from_le_bytes(&bytes[8..])?,
+                ));
+            }
+            std::fs::remove_file(path)?;
+            let start = index * self.length;
+            process(start..self.num_documents.min(start + self.length), entries)?;
+        }
+        Ok(())
+    }
+}
+
+/// Upper bound of the number of postings of `input`: each CIFF posting takes at least two
+/// bytes, and each PISA one four bytes of the frequencies.
+pub(crate) fn max_postings(input: &CollectionInput) -> Result<u64> {
+    let (path, size) = match input {
+        CollectionInput::Ciff(path) => (path.clone(), 2),
+        CollectionInput::Pisa(basename) => (collection_path(basename, "freqs"), 4),
+    };
+    let length = std::fs::metadata(&path)
+        .with_context(|| format!("Unable to read {}", path.display()))?
+        .len();
+    Ok(length / size)
+}
@@ -0,0 +1,324 @@
+//! Hybrid representation of postings lists, where lists covering a large fraction of the
+//! collection are stored as bitmaps in a `.bitmaps` sidecar of the documents collection.
+//!
+//! The sidecar starts with two 4-byte values: the number of documents `N`, and the number of
+//! 8-byte words `W = ceil(N / 64)` of each bitmap. Then, a record per dense list follows, in
+//! increasing term order: the term ID, the document frequency, and `W` words, all little-endian.
+
+use crate::intersect::{intersect, intersection_size, Bitmap};
+use crate::io_backend::Output;
+use crate::postings::{map_file, DocumentLists};
+use crate::{BinarySequence, Result};
+use anyhow::{anyhow, bail};
+use memmap::Mmap;
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::io::Write;
+use std::path::{Path, PathBuf};
+
+const ELEMENT_SIZE: usize = std::mem::size_of::<u32>();
+const WORD_SIZE: usize = std::mem::size_of::<u64>();
+
+/// Options of bitmaps written by [`ciff_to_pisa_with_options`](crate::ciff_to_pisa_with_options).
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct BitmapOptions {
+    /// Lists covering at least this fraction of documents are written as bitmaps.
+    pub density: f64,
+    /// If set, dense lists are written empty in `.docs`, `.freqs`, and `.scores`, which saves
+    /// space but drops their frequencies and makes the collection readable only with
+    /// [`HybridCollection`]. Otherwise, the collection remains a valid PISA collection.
+    pub replace_lists: bool,
+}
+
+impl Default for BitmapOptions {
+    fn default() -> Self {
+        Self {
+            density: 1.0 / 8.0,
+            replace_lists: false,
+        }
+    }
+}
+
+/// Decides which lists are dense, and encodes their bitmaps.
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct BitmapEncoder {
+    universe: u32,
+    min_df: usize,
+    pub(crate) replace_lists: bool,
+}
+
+impl BitmapEncoder {
+    pub(crate) fn new(options: BitmapOptions, num_documents: u32) -> Result<Self> {
+        if !(options.density > 0.0 && options.density <= 1.0) {
+            bail!(
+                "Bitmap density must be in (0, 1], but is {}",
+                options.density
+            );
+        }
+        #[allow(clippy::cast_sign_loss)]
+        let min_df = (options.density * f64::from(num_documents)).ceil() as usize;
+        Ok(Self {
+            universe: num_documents,
+            min_df: min_df.max(1),
+            replace_lists: options.replace_lists,
+        })
+    }
+
+    /// Returns the record of a list, without its term ID, if it is dense.
+    pub(crate) fn encode(&self, documents: &[u32]) -> Result<Option<Vec<u8>>> {
+        if documents.len() < self.min_df {
+            return Ok(None);
+        }
+        if let Some(&document) = documents.iter().find(|&&d| d >= self.universe) {
+            bail!("Document ID out of bounds: {}", document);
+        }
+        let mut record = Vec::with_capacity(ELEMENT_SIZE + words(self.universe) * WORD_SIZE);
+        record.extend_from_slice(&(documents.len() as u32).to_le_bytes());
+        Bitmap::from_sorted(documents, self.universe).write_le(&mut record)?;
+        Ok(Some(record))
+    }
+}
+
+fn words(num_documents: u32) -> usize {
+    (num_documents as usize).div_ceil(64)
+}
+
+/// Writes the `.bitmaps` sidecar.
+pub(crate) struct BitmapWriter {
+    output: Output,
+}
+
+impl BitmapWriter {
+    /// Writes a new sidecar to an empty `output`.
+    pub(crate) fn create(mut output: Output, num_documents: u32) -> Result<Self> {
+        output.write_all(&num_documents.to_le_bytes())?;
+        output.write_all(&(words(num_documents) as u32).to_le_bytes())?;
+        Ok(Self { output })
+    }
+
+    /// Appends to a sidecar already written to `output`.
+    pub(crate) fn resume(output: Output) -> Self {
+        Self { output }
+    }
+
+    /// Writes a record encoded by [`BitmapEncoder::encode`]; terms must come in increasing order.
+    pub(crate) fn write(&mut self, term_id: u32, record: &[u8]) -> Result<()> {
+        self.output.write_all(&term_id.to_le_bytes())?;
+        self.output.write_all(record)?;
+        Ok(())
+    }
+
+    /// Number of bytes in the sidecar, including those not flushed yet.
+    pub(crate) fn len(&self) -> u64 {
+        self.output.len()
+    }
+
+    pub(crate) fn flush(&mut self) -> Result<()> {
+        self.output.flush()?;
+        Ok(())
+    }
+}
+
+fn read_u32(bytes: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(
+        bytes[offset..offset + ELEMENT_SIZE]
+            .try_into()
+            .expect("slice of 4 bytes"),
+    )
+}
+
+/// Postings list of a [`HybridCollection`], either a sequence of document IDs or a bitmap.
+pub struct HybridList<'a> {
+    representation: Representation<'a>,
+}
+
+enum Representation<'a> {
+    Sparse(BinarySequence<'a>),
+    Dense(Bitmap<'a>, usize),
+}
+
+impl<'a> HybridList<'a> {
+    /// Number of documents in the list.
+    #[must_use]
+    pub fn len(&self) -> usize {
+        match &self.representation {
+            Representation::Sparse(sequence) => sequence.len(),
+            Representation::Dense(_, length) => *length,
+        }
+    }
+
+    /// Checks if the list is empty.
+    #[must_use]
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Checks if the list is stored as a bitmap.
+    #[must_use]
+    pub fn is_bitmap(&self) -> bool {
+        matches!(self.representation, Representation::Dense(..))
+    }
+
+    /// Iterates over document IDs in increasing order.
+    #[must_use]
+    pub fn iter(&'a self) -> Box<dyn Iterator<Item = u32> + 'a> {
+        match &self.representation {
+            Representation::Sparse(sequence) => Box::new(sequence.iter()),
+            Representation::Dense(bitmap, _) => Box::new(bitmap.iter()),
+        }
+    }
+
+    /// Decodes all document IDs.
+    #[must_use]
+    pub fn to_vec(&self) -> Vec<u32> {
+        match &self.representation {
+            Representation::Sparse(sequence) => sequence.iter().collect(),
+            Representation::Dense(bitmap, _) => bitmap.iter().collect(),
+        }
+    }
+
+    /// Intersects two lists, using bitmap lookups or `AND` when either is a bitmap.
+    #[must_use]
+    pub fn intersect(&self, other: &HybridList<'_>) -> Vec<u32> {
+        match (&self.representation, &other.representation) {
+            (Representation::Dense(lhs, _), Representation::Dense(rhs, _)) => {
+                lhs.and(rhs).iter().collect()
+            }
+            (Representation::Dense(bitmap, _), Representation::Sparse(sequence))
+            | (Representation::Sparse(sequence), Representation::Dense(bitmap, _)) => sequence
+                .iter()
+                .filter(|&document| bitmap.contains(document))
+                .collect(),
+            (Representation::Sparse(_), Representation::Sparse(_)) => {
+                intersect(&self.to_vec(), &other.to_vec())
+            }
+        }
+    }
+
+    /// Size of the intersection of two lists.
+    #[must_use]
+    pub fn intersection_size(&self, other: &HybridList<'_>) -> usize {
+        match (&self.representation, &other.representation) {
+            (Representation::Dense(lhs, _), Representation::Dense(rhs, _)) => lhs.count_and(rhs),
+            (Representation::Dense(bitmap, _), Representation::Sparse(sequence))
+            | (Representation::Sparse(sequence), Representation::Dense(bitmap, _)) => sequence
+                .iter()
+                .filter(|&document| bitmap.contains(document))
+                .count(),
+            (Representation::Sparse(_), Representation::Sparse(_)) => {
+                intersection_size(&self.to_vec(), &other.to_vec())
+            }
+        }
+    }
+}
+
+impl<'a> IntoIterator for &'a HybridList<'a> {
+    type Item = u32;
+    type IntoIter = Box<dyn Iterator<Item = u32> + 'a>;
+
+    fn into_iter(self) -> Self::IntoIter {
+        self.iter()
+    }
+}
+
+/// Documents collection (`.docs`) read together with its `.bitmaps` sidecar, if any.
+///
+/// Lists present in the sidecar are returned as bitmaps, and others as sequences from `.docs`,
+/// so callers need not know which lists are dense.
+pub struct HybridCollection {
+    documents: DocumentLists,
+    bitmaps: Option<Mmap>,
+    /// Byte offset of the bitmap of each dense term.
+    bitmap_offsets: HashMap<u32, usize>,
+    words: usize,
+}
+
+impl HybridCollection {
+    /// Opens `{basename}.docs`, and `{basename}.bitmaps` if it exists.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error when a file cannot be read or is malformed.
+    pub fn open(basename: &Path) -> Result<Self> {
+        let path = |extension: &str| PathBuf::from(format!("{}.{}", basename.display(), extension));
+        let documents = DocumentLists::open(&path("docs"))?;
+        let bitmaps_path = path("bitmaps");
+        let mut bitmap_offsets = HashMap::new();
+        let mut words = 0;
+        let bitmaps = if bitmaps_path.exists() {
+            let bitmaps = map_file(&bitmaps_path)?;
+            if bitmaps.len() < 2 * ELEMENT_SIZE {
+                bail!("Bitmaps header is truncated");
+            }
+            if read_u32(&bitmaps, 0) != documents.num_documents() {
+                bail!("Bitmaps and documents have different numbers of documents");
+            }
+            words = read_u32(&bitmaps, ELEMENT_SIZE) as usize;
+            if words != self::words(documents.num_documents()) {
+                bail!(
+                    "Bitmaps have {} words for {} documents",
+                    words,
+                    documents.num_documents()
+                );
+            }
+            let record_size = 2 * ELEMENT_SIZE + words * WORD_SIZE;
+            let records = bitmaps.len() - 2 * ELEMENT_SIZE;
+            if records % record_size != 0 {
+                bail!("Bitmaps have a truncated record");
+            }
+            for offset in (2 * ELEMENT_SIZE..bitmaps.len()).step_by(record_size) {
+                let term_id = read_u32(&bitmaps, offset);
+                if term_id as usize >= documents.len() {
+                    return Err(anyhow!("Bitmap term ID out of bounds: {}", term_id));
+                }
+                bitmap_offsets.insert(term_id, offset + ELEMENT_SIZE);
+            }
+            Some(bitmaps)
+        } else {
+            None
+        };
+        Ok(Self {
+            documents,
+            bitmaps,
+            bitmap_offsets,
+            words,
+        })
+    }
+
+    /// Number of documents in the collection.
+    #[must_use]
+    pub fn num_documents(&self) -> u32 {
+        self.documents.num_documents()
+    }
+
+    /// Number of postings lists.
+    #[must_use]
+    pub fn num_lists(&self) -> usize {
+        self.documents.len()
+    }
+
+    /// Number of lists stored as bitmaps.
+    #[must_use]
+    pub fn num_bitmaps(&self) -> usize {
+        self.bitmap_offsets.len()
+    }
+
+    /// Postings list of `term_id`.
+    ///
+    /// # Panics
+    ///
+    /// Panics if `term_id` is not less than [`HybridCollection::num_lists`].
+    #[must_use]
+    pub fn list(&self, term_id: u32) -> HybridList<'_> {
+        let representation = match (&self.bitmaps, self.bitmap_offsets.get(&term_id)) {
+            (Some(bitmaps), Some(&offset)) => {
+                let length = read_u32(bitmaps, offset) as usize;
+                let start = offset + ELEMENT_SIZE;
+                let bitmap = Bitmap::from_le_bytes(&bitmaps[start..start + self.words * WORD_SIZE]);
+                Representation::Dense(bitmap, length)
+            }
+            _ => Representation::Sparse(self.documents.list(term_id)),
+        };
+        HybridList { representation }
+    }
+}
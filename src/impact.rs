@@ -0,0 +1,282 @@
+//! Impact-ordered (score-at-a-time) postings lists.
+//!
+//! Postings of each list are grouped into segments of equal impact, in decreasing order of
+//! impact, and document IDs are sorted within each segment, as expected by score-at-a-time
+//! engines such as JASS.
+
+use crate::{encode_u32_sequence, parallel, pb_style, read_raw_message, Header, Result};
+use crate::{BinaryCollection, BinarySequence, PostingsList};
+use anyhow::{anyhow, bail, Context};
+use indicatif::ProgressBar;
+use memmap::Mmap;
+use protobuf::{CodedInputStream, Message};
+use std::cmp::Reverse;
+use std::convert::TryFrom;
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::path::{Path, PathBuf};
+
+/// Source of postings with impacts.
+#[derive(Debug, Clone)]
+pub enum ImpactInput {
+    /// CIFF file, whose term frequencies are used as impacts; these may be quantized weights,
+    /// e.g., written by [`invert`](crate::invert) with quantization.
+    Ciff(PathBuf),
+    /// PISA binary collection.
+    Pisa {
+        /// Documents collection (`.docs`).
+        documents: PathBuf,
+        /// Collection of impacts aligned with documents, e.g., `.freqs` or `.scores`.
+        impacts: PathBuf,
+    },
+}
+
+/// Options of [`impact_order`].
+#[derive(Debug, Clone)]
+pub struct ImpactOrderOptions {
+    /// Number of threads segmenting postings lists.
+    pub threads: usize,
+}
+
+impl Default for ImpactOrderOptions {
+    fn default() -> Self {
+        Self {
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+        }
+    }
+}
+
+/// Impact-ordered postings list, encoded as binary sequences.
+#[derive(Debug, Default)]
+struct SegmentedList {
+    documents: Vec<u8>,
+    segments: Vec<u8>,
+    term: Vec<u8>,
+}
+
+/// Sorts postings by decreasing impact and increasing document ID, and encodes the documents
+/// along with `(impact, segment length)` pairs.
+fn segment_list<D, I>(documents: D, impacts: I) -> Result<SegmentedList>
+where
+    D: IntoIterator<Item = u32>,
+    I: IntoIterator<Item = u32>,
+{
+    let mut documents = documents.into_iter();
+    let mut impacts = impacts.into_iter();
+    let mut postings = Vec::new();
+    loop {
+        match (documents.next(), impacts.next()) {
+            (Some(document), Some(impact)) => postings.push((impact, document)),
+            (None, None) => break,
+            _ => bail!("Documents and impacts have different lengths"),
+        }
+    }
+    postings.sort_unstable_by_key(|&(impact, document)| (Reverse(impact), document));
+
+    let mut segments: Vec<u32> = Vec::new();
+    for group in postings.chunk_by(|lhs, rhs| lhs.0 == rhs.0) {
+        segments.push(group[0].0);
+        segments.push(group.len() as u32);
+    }
+    let mut list = SegmentedList::default();
+    encode_u32_sequence(
+        &mut list.documents,
+        postings.len() as u32,
+        postings.iter().map(|&(_, document)| document),
+    )?;
+    encode_u32_sequence(&mut list.segments, segments.len() as u32, &segments)?;
+    Ok(list)
+}
+
+fn segment_ciff_list(message: &[u8]) -> Result<SegmentedList> {
+    let posting_list = PostingsList::parse_from_bytes(message)?;
+    let postings = posting_list.get_postings();
+    let mut document = 0_u32;
+    let mut documents = Vec::with_capacity(postings.len());
+    let mut impacts = Vec::with_capacity(postings.len());
+    for posting in postings {
+        let gap = u32::try_from(posting.get_docid())
+            .map_err(|_| anyhow!("Negative document gap: {}", posting.get_docid()))?;
+        document = document
+            .checked_add(gap)
+            .ok_or_else(|| anyhow!("Document ID overflow"))?;
+        documents.push(document);
+        impacts.push(
+            u32::try_from(posting.get_tf())
+                .map_err(|_| anyhow!("Negative impact: {}", posting.get_tf()))?,
+        );
+    }
+    let mut list = segment_list(documents, impacts)?;
+    list.term = format!("{}\n", posting_list.get_term()).into_bytes();
+    Ok(list)
+}
+
+/// Writes segmented lists to `.docs`, `.segments`, and (for CIFF input) `.terms`.
+struct SegmentedWriter {
+    documents: BufWriter<File>,
+    segments: BufWriter<File>,
+    terms: Option<BufWriter<File>>,
+    progress: ProgressBar,
+}
+
+impl SegmentedWriter {
+    fn create(output: &Path, num_documents: u32, num_lists: u64, terms: bool) -> Result<Self> {
+        let create = |extension: &str| -> Result<BufWriter<File>> {
+            let path = format!("{}.{}", output.display(), extension);
+            Ok(BufWriter::new(
+                File::create(&path).with_context(|| format!("Unable to create {}", path))?,
+            ))
+        };
+        let mut documents = create("docs")?;
+        encode_u32_sequence(&mut documents, 1, [num_documents])?;
+        let progress = ProgressBar::new(num_lists);
+        progress.set_style(pb_style());
+        progress.set_draw_delta(num_lists / 100);
+        Ok(Self {
+            documents,
+            segments: create("segments")?,
+            terms: if terms { Some(create("terms")?) } else { None },
+            progress,
+        })
+    }
+
+    fn write(&mut self, list: &SegmentedList) -> Result<()> {
+        self.documents.write_all(&list.documents)?;
+        self.segments.write_all(&list.segments)?;
+        if let Some(terms) = self.terms.as_mut() {
+            terms.write_all(&list.term)?;
+        }
+        self.progress.inc(1);
+        Ok(())
+    }
+
+    fn finish(mut self) -> Result<()> {
+        self.progress.finish();
+        self.documents.flush()?;
+        self.segments.flush()?;
+        if let Some(terms) = self.terms.as_mut() {
+            terms.flush()?;
+        }
+        Ok(())
+    }
+}
+
+fn impact_order_ciff(input: &Path, output: &Path, threads: usize) -> Result<()> {
+    let mut ciff_reader =
+        File::open(input).with_context(|| format!("Unable to open {}", input.display()))?;
+    let mut input = CodedInputStream::new(&mut ciff_reader);
+    let header = Header::from_stream(&mut input)?;
+    println!("{}", header);
+
+    eprintln!("Segmenting postings");
+    let mut writer = SegmentedWriter::create(
+        output,
+        header.num_documents,
+        u64::from(header.num_postings_lists),
+        true,
+    )?;
+    let messages = (0..header.num_postings_lists).map(|_| read_raw_message(&mut input));
+    parallel::map_ordered(
+        threads,
+        4 * threads,
+        messages,
+        |message| segment_ciff_list(&message),
+        |list| writer.write(&list),
+    )?;
+    writer.finish()
+}
+
+fn impact_order_pisa(
+    documents: &Path,
+    impacts: &Path,
+    output: &Path,
+    threads: usize,
+) -> Result<()> {
+    let open = |path: &Path| -> Result<Mmap> {
+        let file =
+            File::open(path).with_context(|| format!("Unable to open {}", path.display()))?;
+        Ok(unsafe { Mmap::map(&file)? })
+    };
+    let documents_mmap = open(documents)?;
+    let impacts_mmap = open(impacts)?;
+    let mut documents = BinaryCollection::try_from(&documents_mmap[..])?;
+    let num_documents = crate::read_document_count(&mut documents)?;
+    let num_lists = BinaryCollection::try_from(&impacts_mmap[..])?.count() as u64;
+    let num_document_lists = BinaryCollection::try_from(&documents_mmap[..])?.count() as u64 - 1;
+    if num_document_lists != num_lists {
+        bail!(
+            "Documents have {} lists but impacts have {}",
+            num_document_lists,
+            num_lists
+        );
+    }
+
+    eprintln!("Segmenting postings");
+    let mut writer = SegmentedWriter::create(output, num_documents, num_lists, false)?;
+    let lists = documents
+        .zip(BinaryCollection::try_from(&impacts_mmap[..])?)
+        .map(|(documents, impacts)| Ok((documents?, impacts?)));
+    parallel::map_ordered(
+        threads,
+        4 * threads,
+        lists,
+        |(documents, impacts): (BinarySequence<'_>, BinarySequence<'_>)| {
+            segment_list(documents.iter(), impacts.iter())
+        },
+        |list| writer.write(&list),
+    )?;
+    writer.finish()
+}
+
+/// Writes an impact-ordered collection of postings lists.
+///
+/// The output consists of:
+/// - `.docs`: a binary collection in the same layout as PISA's, except that document IDs in each
+///   list are ordered by decreasing impact, and increasing ID within each impact;
+/// - `.segments`: for each list, a sequence of `(impact, length)` pairs, one per segment, in the
+///   same order as the documents;
+/// - `.terms`: the terms of the lists, for CIFF input only (PISA collections have theirs already).
+///
+/// Lists are segmented in parallel by [`ImpactOrderOptions::threads`] threads.
+///
+/// # Errors
+///
+/// Returns an error when an IO error occurs, the input is malformed, or the documents and impacts
+/// have different numbers of lists, or lists of different lengths.
+pub fn impact_order(
+    input: &ImpactInput,
+    output: &Path,
+    options: &ImpactOrderOptions,
+) -> Result<()> {
+    let threads = options.threads.max(1);
+    match input {
+        ImpactInput::Ciff(path) => impact_order_ciff(path, output, threads),
+        ImpactInput::Pisa { documents, impacts } => {
+            impact_order_pisa(documents, impacts, output, threads)
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn decode(bytes: &[u8]) -> Vec<u32> {
+        BinaryCollection::try_from(bytes)
+            .unwrap()
+            .next()
+            .unwrap()
+            .unwrap()
+            .iter()
+            .collect()
+    }
+
+    #[test]
+    fn test_segment_list() -> Result<()> {
+        let list = segment_list(vec![1, 4, 5, 7, 9], vec![2, 5, 2, 1, 5])?;
+        assert_eq!(decode(&list.documents), vec![4, 9, 1, 5, 7]);
+        assert_eq!(decode(&list.segments), vec![5, 2, 2, 2, 1, 1]);
+        assert!(segment_list(vec![1, 2], vec![1]).is_err());
+        Ok(())
+    }
+}
@@ -0,0 +1,329 @@
+//! Intersection of sorted lists of document IDs.
+//!
+//! Lists of similar lengths are intersected by skipping through the longer list in blocks of
+//! sixteen elements, galloping over whole blocks, and finding the position of each element of
+//! the shorter list within its block with four SSE2 comparisons on `x86_64`. When one list is
+//! much shorter than the other, each of its elements is searched for by galloping element-wise.
+//! Dense lists can instead be represented as bitmaps, see [`Bitmap`].
+
+use std::borrow::Cow;
+use std::convert::TryInto;
+
+/// Length ratio above which galloping is used instead of a block scan.
+const GALLOP_RATIO: usize = 32;
+
+/// Calls `f` with every element of both sorted, duplicate-free lists, in increasing order.
+pub(crate) fn intersect_with<F: FnMut(u32)>(lhs: &[u32], rhs: &[u32], f: F) {
+    let (short, long) = if lhs.len() <= rhs.len() {
+        (lhs, rhs)
+    } else {
+        (rhs, lhs)
+    };
+    if short.is_empty() {
+        return;
+    }
+    if long.len() / short.len() >= GALLOP_RATIO {
+        gallop(short, long, f);
+    } else {
+        block_scan(short, long, f);
+    }
+}
+
+/// Intersects two sorted, duplicate-free lists.
+pub(crate) fn intersect(lhs: &[u32], rhs: &[u32]) -> Vec<u32> {
+    let mut output = Vec::with_capacity(lhs.len().min(rhs.len()));
+    intersect_with(lhs, rhs, |element| output.push(element));
+    output
+}
+
+/// Size of the intersection of two sorted, duplicate-free lists.
+pub(crate) fn intersection_size(lhs: &[u32], rhs: &[u32]) -> usize {
+    let mut size = 0;
+    intersect_with(lhs, rhs, |_| size += 1);
+    size
+}
+
+/// Set of document IDs below a fixed universe size, one bit per document.
+///
+/// Intersecting a list of length `n` with a bitmap takes `n` lookups, and intersecting two
+/// bitmaps takes one `AND` and population count per 64 documents, so bitmaps pay off for lists
+/// covering a sizeable fraction of the collection.
+///
+/// Words are either owned or borrowed from a mapped file, see [`Bitmap::from_le_bytes`].
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub(crate) struct Bitmap<'a> {
+    words: Cow<'a, [u64]>,
+}
+
+impl<'a> Bitmap<'a> {
+    /// Constructs a bitmap of documents below `universe`; larger IDs are ignored.
+    pub(crate) fn from_sorted(list: &[u32], universe: u32) -> Self {
+        let mut words = vec![0_u64; (universe as usize).div_ceil(64)];
+        for &document in list.iter().take_while(|&&document| document < universe) {
+            words[document as usize / 64] |= 1 << (document % 64);
+        }
+        Self {
+            words: Cow::Owned(words),
+        }
+    }
+
+    /// Checks whether `document` is in the set.
+    pub(crate) fn contains(&self, document: u32) -> bool {
+        self.words
+            .get(document as usize / 64)
+            .is_some_and(|word| word & (1 << (document % 64)) != 0)
+    }
+
+    /// Reads a bitmap written by [`Bitmap::write_le`], borrowing its words from `bytes` when
+    /// they are aligned and the target is little-endian, and copying them otherwise.
+    pub(crate) fn from_le_bytes(bytes: &'a [u8]) -> Self {
+        #[cfg(target_endian = "little")]
+        {
+            // SAFETY: any 8 bytes are a valid `u64`, and `align_to` only returns aligned words.
+            let (prefix, words, suffix) = unsafe { bytes.align_to::<u64>() };
+            if prefix.is_empty() && suffix.is_empty() {
+                return Self {
+                    words: Cow::Borrowed(words),
+                };
+            }
+        }
+        let words = bytes
+            .chunks_exact(8)
+            .map(|chunk| u64::from_le_bytes(chunk.try_into().expect("chunk of 8 bytes")))
+            .collect();
+        Self {
+            words: Cow::Owned(words),
+        }
+    }
+
+    /// Writes the words of the bitmap in little-endian order.
+    pub(crate) fn write_le<W: std::io::Write>(&self, writer: &mut W) -> std::io::Result<()> {
+        for word in self.words.iter() {
+            writer.write_all(&word.to_le_bytes())?;
+        }
+        Ok(())
+    }
+
+    /// Iterates over documents in increasing order.
+    pub(crate) fn iter(&self) -> impl Iterator<Item = u32> + '_ {
+        self.words.iter().enumerate().flat_map(|(index, &word)| {
+            let base = index as u32 * 64;
+            let mut word = word;
+            std::iter::from_fn(move || {
+                if word == 0 {
+                    None
+                } else {
+                    let bit = word.trailing_zeros();
+                    word &= word - 1;
+                    Some(base + bit)
+                }
+            })
+        })
+    }
+
+    /// Intersection of two bitmaps.
+    pub(crate) fn and(&self, other: &Bitmap<'_>) -> Bitmap<'static> {
+        let words = self
+            .words
+            .iter()
+            .zip(other.words.iter())
+            .map(|(lhs, rhs)| lhs & rhs)
+            .collect();
+        Bitmap {
+            words: Cow::Owned(words),
+        }
+    }
+
+    /// Number of elements of `list` in the set.
+    pub(crate) fn count_in(&self, list: &[u32]) -> usize {
+        list.iter()
+            .filter(|&&document| self.contains(document))
+            .count()
+    }
+
+    /// Size of the intersection of two bitmaps.
+    pub(crate) fn count_and(&self, other: &Bitmap<'_>) -> usize {
+        self.words
+            .iter()
+            .zip(other.words.iter())
+            .map(|(lhs, rhs)| (lhs & rhs).count_ones() as usize)
+            .sum()
+    }
+}
+
+/// Returns the first position at or after `start` whose element is at least `target`.
+pub(crate) fn gallop_to(list: &[u32], start: usize, target: u32) -> usize {
+    if list.get(start).is_none_or(|&element| element >= target) {
+        return start;
+    }
+    let mut low = start;
+    let mut step = 1;
+    while low + step < list.len() && list[low + step] < target {
+        low += step;
+        step *= 2;
+    }
+    let high = (low + step).min(list.len());
+    low + 1 + list[low + 1..high].partition_point(|&element| element < target)
+}
+
+fn gallop<F: FnMut(u32)>(short: &[u32], long: &[u32], mut f: F) {
+    let mut position = 0;
+    for &element in short {
+        position = gallop_to(long, position, element);
+        match long.get(position) {
+            Some(&found) if found == element => f(element),
+            Some(_) => {}
+            None => return,
+        }
+    }
+}
+
+/// Number of elements of `long` compared at once by [`block_rank`].
+const BLOCK: usize = 16;
+
+/// Gallops over whole blocks of `long` whose last element is below each element of `short`,
+/// and finds the element within the first block that is not.
+fn block_scan<F: FnMut(u32)>(short: &[u32], long: &[u32], mut f: F) {
+    let below = |position: usize, length: usize, element: u32| {
+        position + length <= long.len() && long[position + length - 1] < element
+    };
+    let mut position = 0;
+    for &element in short {
+        let mut step = BLOCK;
+        while below(position, step, element) {
+            position += step;
+            step *= 2;
+        }
+        while step > BLOCK {
+            step /= 2;
+            if below(position, step, element) {
+                position += step;
+            }
+        }
+        if position + BLOCK <= long.len() {
+            position += block_rank(&long[position..position + BLOCK], element);
+        } else {
+            position += long[position..].partition_point(|&found| found < element);
+        }
+        match long.get(position) {
+            Some(&found) if found == element => f(element),
+            Some(_) => {}
+            None => return,
+        }
+    }
+}
+
+/// Number of elements of a sorted block of [`BLOCK`] elements that are below `element`.
+#[cfg(target_arch = "x86_64")]
+#[allow(clippy::cast_possible_wrap, clippy::cast_sign_loss)]
+fn block_rank(block: &[u32], element: u32) -> usize {
+    use std::arch::x86_64::{
+        _mm_castsi128_ps, _mm_cmplt_epi32, _mm_loadu_si128, _mm_movemask_ps, _mm_set1_epi32,
+        _mm_xor_si128,
+    };
+    debug_assert_eq!(block.len(), BLOCK);
+    // SAFETY: SSE2 is part of the `x86_64` baseline, and the block has 16 elements, so the
+    // four unaligned 16-byte loads stay within the slice.
+    unsafe {
+        // SSE2 only compares signed integers: flipping the sign bit preserves unsigned order.
+        let sign = _mm_set1_epi32(i32::MIN);
+        let target = _mm_xor_si128(_mm_set1_epi32(element as i32), sign);
+        let mut rank = 0;
+        for chunk in block.chunks_exact(4) {
+            let values = _mm_xor_si128(_mm_loadu_si128(chunk.as_ptr().cast()), sign);
+            let less = _mm_castsi128_ps(_mm_cmplt_epi32(values, target));
+            rank += (_mm_movemask_ps(less) as u32).count_ones();
+        }
+        rank as usize
+    }
+}
+
+#[cfg(not(target_arch = "x86_64"))]
+fn block_rank(block: &[u32], element: u32) -> usize {
+    block.partition_point(|&found| found < element)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::collections::BTreeSet;
+
+    /// Deterministic sorted list with roughly `density` of the IDs below `universe`.
+    fn random_list(seed: u64, universe: u32, density: u64) -> Vec<u32> {
+        let mut state = seed;
+        (0..universe)
+            .filter(|_| {
+                state = state
+                    .wrapping_mul(6_364_136_223_846_793_005)
+                    .wrapping_add(1_442_695_040_888_963_407);
+                (state >> 33) % 1000 < density
+            })
+            .collect()
+    }
+
+    #[test]
+    fn test_intersect_matches_naive() {
+        for &(lhs_density, rhs_density) in &[(500, 500), (10, 900), (1, 1000), (300, 0)] {
+            let lhs = random_list(1, 10_000, lhs_density);
+            let rhs = random_list(2, 10_000, rhs_density);
+            let expected: Vec<u32> = lhs
+                .iter()
+                .copied()
+                .collect::<BTreeSet<_>>()
+                .intersection(&rhs.iter().copied().collect())
+                .copied()
+                .collect();
+            assert_eq!(intersect(&lhs, &rhs), expected);
+            assert_eq!(intersect(&rhs, &lhs), expected);
+            assert_eq!(intersection_size(&lhs, &rhs), expected.len());
+            let lhs_bitmap = Bitmap::from_sorted(&lhs, 10_000);
+            let rhs_bitmap = Bitmap::from_sorted(&rhs, 10_000);
+            assert_eq!(lhs_bitmap.count_in(&rhs), expected.len());
+            assert_eq!(lhs_bitmap.count_and(&rhs_bitmap), expected.len());
+            assert_eq!(lhs_bitmap.iter().collect::<Vec<_>>(), lhs);
+            let intersection = lhs_bitmap.and(&rhs_bitmap);
+            assert_eq!(intersection.iter().collect::<Vec<_>>(), expected);
+            let mut bytes = Vec::new();
+            intersection.write_le(&mut bytes).unwrap();
+            assert_eq!(Bitmap::from_le_bytes(&bytes), intersection);
+        }
+    }
+
+    #[test]
+    fn test_bitmap_from_aligned_bytes() {
+        let words: Vec<u64> = vec![0b101_u64.to_le(), (1_u64 << 63).to_le()];
+        // SAFETY: any `u64` is a valid sequence of 8 bytes.
+        let (_, bytes, _) = unsafe { words.align_to::<u8>() };
+        let bitmap = Bitmap::from_le_bytes(bytes);
+        assert_eq!(bitmap.iter().collect::<Vec<_>>(), vec![0, 2, 127]);
+        assert_eq!(
+            matches!(bitmap.words, Cow::Borrowed(_)),
+            cfg!(target_endian = "little")
+        );
+    }
+
+    #[test]
+    fn test_block_rank() {
+        let block: Vec<u32> = (0..16).map(|index| index * 2 + u32::MAX / 2).collect();
+        for element in [
+            0,
+            u32::MAX / 2,
+            u32::MAX / 2 + 1,
+            u32::MAX / 2 + 30,
+            u32::MAX,
+        ] {
+            let expected = block.partition_point(|&found| found < element);
+            assert_eq!(block_rank(&block, element), expected, "{}", element);
+        }
+    }
+
+    #[test]
+    fn test_gallop_to() {
+        let list = vec![1, 3, 5, 7, 9, 11];
+        assert_eq!(gallop_to(&list, 0, 0), 0);
+        assert_eq!(gallop_to(&list, 0, 6), 3);
+        assert_eq!(gallop_to(&list, 2, 11), 5);
+        assert_eq!(gallop_to(&list, 0, 12), 6);
+        assert_eq!(gallop_to(&list, 6, 1), 6);
+    }
+}
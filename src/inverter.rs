@@ -0,0 +1,1076 @@
+//! Inverting forward (document-major) collections into an inverted index.
+//!
+//! Documents are parsed by a pool of worker threads, each accumulating postings in memory, term by
+//! term, until its share of the memory budget is exhausted. The accumulated postings are then
+//! sorted by term and spilled to a temporary run file. Once the entire input is consumed, all runs
+//! are merged with a k-way merge into either a CIFF file or a PISA binary collection.
+//!
+//! Floating-point weights of JSON inputs can be quantized; in that case, the range of weights is
+//! first computed in a separate parallel pass over the input.
+
+use crate::collection::collection_path;
+use crate::memory::MemoryBudget;
+use crate::quantization::WeightRange;
+use crate::{encode_u32_sequence, pb_style, proto, BinaryCollection, BinarySequence, Result};
+use crate::{DocRecord, Posting, PostingsList};
+use crate::{Quantization, Quantizer};
+use anyhow::{anyhow, bail, Context};
+use indicatif::ProgressBar;
+use memmap::Mmap;
+use protobuf::CodedOutputStream;
+use serde::Deserialize;
+use std::cmp::Reverse;
+use std::collections::{BTreeMap, BinaryHeap, HashMap};
+use std::convert::TryFrom;
+use std::fs::{self, File};
+use std::io::{self, BufRead, BufReader, BufWriter, Read, Write};
+use std::path::{Path, PathBuf};
+use std::str::FromStr;
+use std::sync::mpsc::{sync_channel, Receiver, SyncSender};
+use std::sync::Mutex;
+
+/// Forward index to invert.
+#[derive(Debug, Clone)]
+pub enum ForwardInput {
+    /// PISA forward index.
+    Pisa {
+        /// Binary collection (`.fwd`) starting with a single-element sequence containing the
+        /// number of documents, followed by one sequence of term IDs per document.
+        forward: PathBuf,
+        /// Term lexicon, one term per line, mapping term IDs to terms.
+        terms: PathBuf,
+        /// Document titles, one per line. If missing, document IDs are used as titles.
+        documents: Option<PathBuf>,
+    },
+    /// JSON lines in the format of Anserini's `JsonVectorCollection`, one document per line:
+    /// `{"id": "doc1", "vector": {"term": 3, ...}}`.
+    Jsonl(PathBuf),
+}
+
+/// Format of the inverted index produced by [`invert`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum InvertedFormat {
+    /// A single CIFF file.
+    Ciff,
+    /// PISA binary collection (`.docs`, `.freqs`, `.sizes`, `.terms`, `.documents`).
+    Pisa,
+}
+
+impl FromStr for InvertedFormat {
+    type Err = anyhow::Error;
+    fn from_str(s: &str) -> Result<Self> {
+        match s {
+            "ciff" => Ok(Self::Ciff),
+            "pisa" => Ok(Self::Pisa),
+            _ => Err(anyhow!(
+                "Unknown output format: {} (expected ciff or pisa)",
+                s
+            )),
+        }
+    }
+}
+
+/// Options of [`invert`].
+#[derive(Debug, Clone)]
+pub struct InvertOptions {
+    /// Output format.
+    pub format: InvertedFormat,
+    /// Number of worker threads parsing documents and building runs.
+    pub threads: usize,
+    /// Approximate total number of bytes of postings kept in memory before spilling to runs.
+    pub memory_budget: usize,
+    /// If set, the memory budget of runs is reduced as needed to keep memory use under this
+    /// many bytes, see [`cgroup_memory_limit`](crate::cgroup_memory_limit).
+    pub memory_limit: Option<u64>,
+    /// Number of documents sent to a worker at once.
+    pub batch_size: usize,
+    /// Directory for temporary run files. Defaults to the directory of the output.
+    pub temp_dir: Option<PathBuf>,
+    /// Description written to the CIFF header.
+    pub description: String,
+    /// Quantization of JSON weights. If `None`, weights are rounded to the nearest integer.
+    pub quantization: Option<Quantization>,
+}
+
+impl Default for InvertOptions {
+    fn default() -> Self {
+        Self {
+            format: InvertedFormat::Ciff,
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+            memory_budget: 1 << 30,
+            memory_limit: None,
+            batch_size: 10_000,
+            temp_dir: None,
+            description: String::new(),
+            quantization: None,
+        }
+    }
+}
+
+/// Estimated memory overhead of a single term in the in-memory run, on top of the term bytes.
+const TERM_OVERHEAD: usize = 64;
+
+/// Estimated memory of a single posting in the in-memory run.
+const POSTING_SIZE: usize = std::mem::size_of::<(u32, u32)>();
+
+#[derive(Deserialize)]
+struct JsonDocument {
+    id: String,
+    vector: HashMap<String, f64>,
+}
+
+/// A batch of raw documents to be parsed by a worker.
+enum Batch<'a> {
+    Forward(Vec<BinarySequence<'a>>),
+    Jsonl(Vec<String>),
+}
+
+struct Job<'a> {
+    index: usize,
+    first_docid: u32,
+    batch: Batch<'a>,
+}
+
+/// Document information collected by workers, needed to write document records.
+struct DocumentMeta {
+    title: Option<String>,
+    length: u32,
+}
+
+/// Removes all registered temporary files when dropped.
+#[derive(Default)]
+pub(crate) struct TempFiles(Mutex<Vec<PathBuf>>);
+
+impl TempFiles {
+    pub(crate) fn register(&self, path: PathBuf) -> PathBuf {
+        self.0.lock().unwrap().push(path.clone());
+        path
+    }
+}
+
+impl Drop for TempFiles {
+    fn drop(&mut self) {
+        for path in self.0.get_mut().unwrap().iter() {
+            let _ = fs::remove_file(path);
+        }
+    }
+}
+
+/// Prefix of the temporary files of a tool writing or reading `path`: its file name, in
+/// `temp_dir` if set, and in the directory of `path` otherwise.
+pub(crate) fn temp_prefix(temp_dir: Option<&Path>, path: &Path) -> Result<PathBuf> {
+    let name = path
+        .file_name()
+        .ok_or_else(|| anyhow!("Invalid path: {}", path.display()))?;
+    let dir = temp_dir.map_or_else(
+        || {
+            path.parent()
+                .filter(|parent| !parent.as_os_str().is_empty())
+                .map_or_else(|| PathBuf::from("."), Path::to_path_buf)
+        },
+        Path::to_path_buf,
+    );
+    Ok(dir.join(name))
+}
+
+/// Accumulates postings of a single worker and spills them to run files.
+struct RunBuilder<'a> {
+    postings: HashMap<String, Vec<(u32, u32)>>,
+    bytes: usize,
+    budget: usize,
+    prefix: String,
+    temp_files: &'a TempFiles,
+    runs: Vec<PathBuf>,
+    num_postings: u64,
+}
+
+impl<'a> RunBuilder<'a> {
+    fn new(prefix: String, budget: usize, temp_files: &'a TempFiles) -> Self {
+        Self {
+            postings: HashMap::new(),
+            bytes: 0,
+            budget,
+            prefix,
+            temp_files,
+            runs: Vec::new(),
+            num_postings: 0,
+        }
+    }
+
+    fn push(&mut self, term: &str, docid: u32, frequency: u32) -> Result<()> {
+        if let Some(postings) = self.postings.get_mut(term) {
+            postings.push((docid, frequency));
+        } else {
+            self.postings
+                .insert(term.to_string(), vec![(docid, frequency)]);
+            self.bytes += term.len() + TERM_OVERHEAD;
+        }
+        self.bytes += POSTING_SIZE;
+        self.num_postings += 1;
+        if self.bytes >= self.budget {
+            self.spill()?;
+        }
+        Ok(())
+    }
+
+    /// Writes all accumulated postings, sorted by term, to a new run file.
+    fn spill(&mut self) -> Result<()> {
+        if self.postings.is_empty() {
+            return Ok(());
+        }
+        let path = self.temp_files.register(PathBuf::from(format!(
+            "{}.{}",
+            self.prefix,
+            self.runs.len()
+        )));
+        let mut writer = BufWriter::new(
+            File::create(&path)
+                .with_context(|| format!("Unable to create run file {}", path.display()))?,
+        );
+        let mut terms: Vec<_> = self.postings.drain().collect();
+        terms.sort_unstable_by(|(lhs, _), (rhs, _)| lhs.cmp(rhs));
+        for (term, postings) in terms {
+            writer.write_all(&u32::try_from(term.len())?.to_le_bytes())?;
+            writer.write_all(term.as_bytes())?;
+            writer.write_all(&u32::try_from(postings.len())?.to_le_bytes())?;
+            for (docid, frequency) in postings {
+                writer.write_all(&docid.to_le_bytes())?;
+                writer.write_all(&frequency.to_le_bytes())?;
+            }
+        }
+        writer.flush()?;
+        self.runs.push(path);
+        self.bytes = 0;
+        Ok(())
+    }
+}
+
+/// Sequential reader of a single run file.
+struct RunReader {
+    reader: BufReader<File>,
+}
+
+fn read_u32<R: Read>(reader: &mut R) -> io::Result<u32> {
+    let mut bytes = [0_u8; 4];
+    reader.read_exact(&mut bytes)?;
+    Ok(u32::from_le_bytes(bytes))
+}
+
+impl RunReader {
+    fn open(path: &Path) -> Result<Self> {
+        let file =
+            File::open(path).with_context(|| format!("Unable to open run {}", path.display()))?;
+        Ok(Self {
+            reader: BufReader::new(file),
+        })
+    }
+
+    /// Reads the next term, or returns `None` if the run is exhausted.
+    /// Must be followed by [`RunReader::read_postings`].
+    fn next_term(&mut self) -> Result<Option<String>> {
+        if self.reader.fill_buf()?.is_empty() {
+            return Ok(None);
+        }
+        let length = read_u32(&mut self.reader)? as usize;
+        let mut term = vec![0_u8; length];
+        self.reader.read_exact(&mut term)?;
+        Ok(Some(String::from_utf8(term)?))
+    }
+
+    /// Appends postings of the current term to `postings`.
+    fn read_postings(&mut self, postings: &mut Vec<(u32, u32)>) -> Result<()> {
+        let length = read_u32(&mut self.reader)?;
+        postings.reserve(length as usize);
+        for _ in 0..length {
+            let docid = read_u32(&mut self.reader)?;
+            let frequency = read_u32(&mut self.reader)?;
+            postings.push((docid, frequency));
+        }
+        Ok(())
+    }
+}
+
+/// Merges all runs, calling `emit` for each term, in lexicographical order, together with its
+/// postings sorted by document ID.
+fn merge_runs<F>(runs: &[PathBuf], num_postings: u64, mut emit: F) -> Result<()>
+where
+    F: FnMut(&str, &[(u32, u32)]) -> Result<()>,
+{
+    let mut readers = runs
+        .iter()
+        .map(|path| RunReader::open(path))
+        .collect::<Result<Vec<_>>>()?;
+    let mut heap = BinaryHeap::with_capacity(readers.len());
+    for (idx, reader) in readers.iter_mut().enumerate() {
+        if let Some(term) = reader.next_term()? {
+            heap.push(Reverse((term, idx)));
+        }
+    }
+
+    eprintln!("Merging {} runs", runs.len());
+    let progress = ProgressBar::new(num_postings);
+    progress.set_style(pb_style());
+    progress.set_draw_delta(num_postings / 100);
+    let mut postings = Vec::new();
+    while let Some(Reverse((term, idx))) = heap.pop() {
+        postings.clear();
+        let mut sources = vec![idx];
+        while heap.peek().is_some_and(|Reverse((next, _))| *next == term) {
+            if let Some(Reverse((_, idx))) = heap.pop() {
+                sources.push(idx);
+            }
+        }
+        for &idx in &sources {
+            readers[idx].read_postings(&mut postings)?;
+            if let Some(next) = readers[idx].next_term()? {
+                heap.push(Reverse((next, idx)));
+            }
+        }
+        if sources.len() > 1 {
+            // Each run's postings are sorted but runs of different workers interleave.
+            postings.sort_unstable_by_key(|&(docid, _)| docid);
+        }
+        emit(&term, &postings)?;
+        progress.inc(postings.len() as u64);
+    }
+    progress.finish();
+    Ok(())
+}
+
+/// Converts a JSON weight to a term frequency.
+///
+/// Without a quantizer, weights are expected to be non-negative integers, as in Anserini's impact
+/// collections, and are rounded otherwise. With a quantizer, non-positive weights are treated as
+/// missing and return 0.
+#[allow(clippy::cast_sign_loss)]
+fn weight_to_frequency(term: &str, weight: f64, quantizer: Option<&Quantizer>) -> Result<u32> {
+    if !weight.is_finite() {
+        bail!("Invalid weight of term {}: {}", term, weight);
+    }
+    match quantizer {
+        Some(_) if weight <= 0.0 => Ok(0),
+        Some(quantizer) => Ok(quantizer.quantize(weight)),
+        None if weight < 0.0 || weight.round() > f64::from(u32::MAX) => {
+            bail!("Invalid weight of term {}: {}", term, weight)
+        }
+        None => Ok(weight.round() as u32),
+    }
+}
+
+/// Parses a batch and pushes its postings to `builder`. Returns metadata of parsed documents.
+fn parse_batch(
+    job: Job<'_>,
+    lexicon: &[String],
+    quantizer: Option<&Quantizer>,
+    builder: &mut RunBuilder<'_>,
+) -> Result<Vec<DocumentMeta>> {
+    let mut meta = Vec::new();
+    match job.batch {
+        Batch::Forward(sequences) => {
+            let mut term_ids = Vec::new();
+            for (docid, sequence) in (job.first_docid..).zip(sequences) {
+                term_ids.clear();
+                term_ids.extend(sequence.iter());
+                term_ids.sort_unstable();
+                let mut start = 0;
+                while start < term_ids.len() {
+                    let term_id = term_ids[start];
+                    let end = start + term_ids[start..].partition_point(|&id| id == term_id);
+                    let term = lexicon.get(term_id as usize).ok_or_else(|| {
+                        anyhow!(
+                            "Term ID {} out of lexicon bounds in document {}",
+                            term_id,
+                            docid
+                        )
+                    })?;
+                    builder.push(term, docid, u32::try_from(end - start)?)?;
+                    start = end;
+                }
+                meta.push(DocumentMeta {
+                    title: None,
+                    length: u32::try_from(term_ids.len())?,
+                });
+            }
+        }
+        Batch::Jsonl(lines) => {
+            for (docid, line) in (job.first_docid..).zip(lines) {
+                let document: JsonDocument = serde_json::from_str(&line)
+                    .with_context(|| format!("Invalid JSON document {}", docid))?;
+                let mut length = 0_u32;
+                for (term, &weight) in &document.vector {
+                    let frequency = weight_to_frequency(term, weight, quantizer)?;
+                    if frequency > 0 {
+                        builder.push(term, docid, frequency)?;
+                        length = length.saturating_add(frequency);
+                    }
+                }
+                meta.push(DocumentMeta {
+                    title: Some(document.id),
+                    length,
+                });
+            }
+        }
+    }
+    Ok(meta)
+}
+
+fn next_job<T>(jobs: &Mutex<Receiver<T>>) -> Option<T> {
+    jobs.lock().unwrap().recv().ok()
+}
+
+/// Worker loop: parses batches until the job queue is closed.
+/// On failure, the worker keeps draining the queue so that the reader never blocks.
+fn run_worker(
+    jobs: &Mutex<Receiver<Job<'_>>>,
+    meta: &SyncSender<(usize, Vec<DocumentMeta>)>,
+    lexicon: &[String],
+    quantizer: Option<&Quantizer>,
+    mut builder: RunBuilder<'_>,
+) -> Result<(Vec<PathBuf>, u64)> {
+    let mut result = Ok(());
+    while let Some(job) = next_job(jobs) {
+        if result.is_err() {
+            continue;
+        }
+        let index = job.index;
+        result = parse_batch(job, lexicon, quantizer, &mut builder).and_then(|documents| {
+            meta.send((index, documents))
+                .map_err(|_| anyhow!("Document metadata collector terminated"))
+        });
+    }
+    result?;
+    builder.spill()?;
+    Ok((builder.runs, builder.num_postings))
+}
+
+/// Receives document metadata out of order, and writes titles in order. Returns lengths.
+fn collect_documents<I>(
+    meta: &Receiver<(usize, Vec<DocumentMeta>)>,
+    titles: &mut BufWriter<File>,
+    mut input_titles: Option<I>,
+) -> Result<Vec<u32>>
+where
+    I: Iterator<Item = io::Result<String>>,
+{
+    let mut lengths = Vec::new();
+    let mut pending = BTreeMap::new();
+    let mut next_index = 0;
+    for (index, documents) in meta {
+        pending.insert(index, documents);
+        while let Some(documents) = pending.remove(&next_index) {
+            next_index += 1;
+            for document in documents {
+                let title = match (document.title, input_titles.as_mut()) {
+                    (Some(title), _) => title,
+                    (None, Some(titles)) => titles
+                        .next()
+                        .ok_or_else(|| anyhow!("Too few document titles"))??,
+                    (None, None) => lengths.len().to_string(),
+                };
+                writeln!(titles, "{}", title)?;
+                lengths.push(document.length);
+            }
+        }
+    }
+    titles.flush()?;
+    Ok(lengths)
+}
+
+/// Reads non-empty lines of `file` in batches of `batch_size` and passes them to `send`.
+fn send_lines<F>(file: &File, batch_size: usize, mut send: F) -> Result<()>
+where
+    F: FnMut(Vec<String>) -> Result<()>,
+{
+    let progress = ProgressBar::new(file.metadata()?.len());
+    progress.set_style(pb_style());
+    progress.set_draw_delta(1 << 20);
+    let mut batch = Vec::with_capacity(batch_size);
+    for line in BufReader::new(file).lines() {
+        let line = line?;
+        progress.inc(line.len() as u64 + 1);
+        if line.trim().is_empty() {
+            continue;
+        }
+        batch.push(line);
+        if batch.len() == batch_size {
+            send(std::mem::replace(
+                &mut batch,
+                Vec::with_capacity(batch_size),
+            ))?;
+        }
+    }
+    if !batch.is_empty() {
+        send(batch)?;
+    }
+    progress.finish();
+    Ok(())
+}
+
+/// Computes the range of positive weights of JSON lines in `path`, parsing lines in parallel.
+fn jsonl_weight_range(path: &Path, threads: usize, batch_size: usize) -> Result<WeightRange> {
+    let file = File::open(path).with_context(|| format!("Unable to open {}", path.display()))?;
+    eprintln!("Computing weight range");
+    let (sender, receiver) = sync_channel::<Vec<String>>(2 * threads);
+    let receiver = Mutex::new(receiver);
+    std::thread::scope(|scope| {
+        let workers: Vec<_> = (0..threads)
+            .map(|_| {
+                let receiver = &receiver;
+                scope.spawn(move || {
+                    let mut range = WeightRange::default();
+                    let mut result = Ok(());
+                    while let Some(lines) = next_job(receiver) {
+                        if result.is_ok() {
+                            result = lines.iter().try_for_each(|line| -> Result<()> {
+                                let document: JsonDocument = serde_json::from_str(line)?;
+                                document.vector.values().for_each(|&w| range.add(w));
+                                Ok(())
+                            });
+                        }
+                    }
+                    result.map(|()| range)
+                })
+            })
+            .collect();
+        let sent = send_lines(&file, batch_size, |batch| {
+            sender
+                .send(batch)
+                .map_err(|_| anyhow!("All workers terminated"))
+        });
+        drop(sender);
+        let range = workers
+            .into_iter()
+            .try_fold(WeightRange::default(), |acc, worker| {
+                worker
+                    .join()
+                    .expect("Worker thread panicked")
+                    .map(|range| acc.merge(range))
+            });
+        sent?;
+        range
+    })
+}
+
+/// Reads the input in batches and sends them to workers.
+fn send_batches<'a>(
+    input: &'a ForwardSource,
+    batch_size: usize,
+    jobs: &SyncSender<Job<'a>>,
+) -> Result<()> {
+    let closed = || anyhow!("All workers terminated");
+    let mut index = 0;
+    let mut first_docid = 0_u32;
+    match input {
+        ForwardSource::Pisa(mmap) => {
+            let mut collection = BinaryCollection::try_from(&mmap[..])?;
+            let num_documents = crate::read_document_count(&mut collection)?;
+            let progress = ProgressBar::new(u64::from(num_documents));
+            progress.set_style(pb_style());
+            progress.set_draw_delta(u64::from(num_documents) / 100);
+            let mut batch = Vec::with_capacity(batch_size);
+            for sequence in collection {
+                batch.push(sequence?);
+                if batch.len() == batch_size {
+                    let len = u32::try_from(batch.len())?;
+                    let batch = std::mem::replace(&mut batch, Vec::with_capacity(batch_size));
+                    jobs.send(Job {
+                        index,
+                        first_docid,
+                        batch: Batch::Forward(batch),
+                    })
+                    .map_err(|_| closed())?;
+                    index += 1;
+                    first_docid += len;
+                    progress.inc(u64::from(len));
+                }
+            }
+            let len = u32::try_from(batch.len())?;
+            if !batch.is_empty() {
+                jobs.send(Job {
+                    index,
+                    first_docid,
+                    batch: Batch::Forward(batch),
+                })
+                .map_err(|_| closed())?;
+            }
+            progress.inc(u64::from(len));
+            progress.finish();
+            if first_docid + len != num_documents {
+                bail!(
+                    "Forward index has {} documents but declares {}",
+                    first_docid + len,
+                    num_documents
+                );
+            }
+        }
+        ForwardSource::Jsonl(file) => {
+            send_lines(file, batch_size, |batch| {
+                let len = u32::try_from(batch.len())?;
+                jobs.send(Job {
+                    index,
+                    first_docid,
+                    batch: Batch::Jsonl(batch),
+                })
+                .map_err(|_| closed())?;
+                index += 1;
+                first_docid = first_docid
+                    .checked_add(len)
+                    .ok_or_else(|| anyhow!("Too many documents"))?;
+                Ok(())
+            })?;
+        }
+    }
+    Ok(())
+}
+
+/// Opened forward input.
+enum ForwardSource {
+    Pisa(Mmap),
+    Jsonl(File),
+}
+
+/// Result of the run generation phase.
+struct Runs {
+    paths: Vec<PathBuf>,
+    lengths: Vec<u32>,
+    num_postings: u64,
+}
+
+/// Memory budget of runs: at most half of the memory available under the limit, if any, as
+/// vectors of postings may have up to twice the capacity they use.
+fn runs_budget(options: &InvertOptions) -> usize {
+    let Some(limit) = options.memory_limit else {
+        return options.memory_budget;
+    };
+    let available = usize::try_from(MemoryBudget::new(limit).available() / 2).unwrap_or(usize::MAX);
+    if available < options.memory_budget {
+        eprintln!(
+            "Memory limit of {} MiB: reducing the memory budget of runs to {} MiB",
+            limit >> 20,
+            available >> 20
+        );
+    }
+    options.memory_budget.min(available)
+}
+
+fn generate_runs(
+    input: &ForwardInput,
+    options: &InvertOptions,
+    quantizer: Option<&Quantizer>,
+    titles_path: &Path,
+    run_prefix: &str,
+    temp_files: &TempFiles,
+) -> Result<Runs> {
+    let (source, lexicon, input_titles) = match input {
+        ForwardInput::Pisa {
+            forward,
+            terms,
+            documents,
+        } => {
+            let file = File::open(forward)
+                .with_context(|| format!("Unable to open {}", forward.display()))?;
+            let lexicon = BufReader::new(
+                File::open(terms).with_context(|| format!("Unable to open {}", terms.display()))?,
+            )
+            .lines()
+            .collect::<io::Result<Vec<_>>>()?;
+            let titles = match documents {
+                Some(path) => Some(
+                    BufReader::new(
+                        File::open(path)
+                            .with_context(|| format!("Unable to open {}", path.display()))?,
+                    )
+                    .lines(),
+                ),
+                None => None,
+            };
+            (
+                ForwardSource::Pisa(unsafe { Mmap::map(&file)? }),
+                lexicon,
+                titles,
+            )
+        }
+        ForwardInput::Jsonl(path) => (
+            ForwardSource::Jsonl(
+                File::open(path).with_context(|| format!("Unable to open {}", path.display()))?,
+            ),
+            Vec::new(),
+            None,
+        ),
+    };
+    let threads = options.threads.max(1);
+    let worker_budget = (runs_budget(options) / threads).max(1);
+    let mut titles = BufWriter::new(File::create(titles_path)?);
+
+    eprintln!("Inverting documents");
+    let (job_sender, job_receiver) = sync_channel(2 * threads);
+    let job_receiver = Mutex::new(job_receiver);
+    let (meta_sender, meta_receiver) = sync_channel(2 * threads);
+    std::thread::scope(|scope| {
+        let workers: Vec<_> = (0..threads)
+            .map(|worker| {
+                let meta_sender = meta_sender.clone();
+                let builder = RunBuilder::new(
+                    format!("{}.{}", run_prefix, worker),
+                    worker_budget,
+                    temp_files,
+                );
+                let job_receiver = &job_receiver;
+                let lexicon = &lexicon;
+                scope.spawn(move || {
+                    run_worker(job_receiver, &meta_sender, lexicon, quantizer, builder)
+                })
+            })
+            .collect();
+        drop(meta_sender);
+        let collector = scope.spawn(move || {
+            let mut input_titles = input_titles;
+            let lengths = collect_documents(&meta_receiver, &mut titles, input_titles.as_mut());
+            // Drain remaining metadata in case of an error, so that workers never block.
+            for _ in &meta_receiver {}
+            lengths
+        });
+        let sent = send_batches(&source, options.batch_size.max(1), &job_sender);
+        drop(job_sender);
+        let mut paths = Vec::new();
+        let mut num_postings = 0;
+        let mut worker_error = None;
+        for worker in workers {
+            match worker.join().expect("Worker thread panicked") {
+                Ok((runs, postings)) => {
+                    paths.extend(runs);
+                    num_postings += postings;
+                }
+                Err(err) => worker_error = Some(err),
+            }
+        }
+        let lengths = collector.join().expect("Collector thread panicked");
+        sent?;
+        if let Some(err) = worker_error {
+            return Err(err);
+        }
+        Ok(Runs {
+            paths,
+            lengths: lengths?,
+            num_postings,
+        })
+    })
+}
+
+fn write_pisa_postings(output: &Path, runs: &Runs) -> Result<()> {
+    let mut documents = BufWriter::new(File::create(format!("{}.docs", output.display()))?);
+    let mut frequencies = BufWriter::new(File::create(format!("{}.freqs", output.display()))?);
+    let mut terms = BufWriter::new(File::create(format!("{}.terms", output.display()))?);
+    let num_documents = u32::try_from(runs.lengths.len())?;
+    encode_u32_sequence(&mut documents, 1, [num_documents].iter())?;
+    merge_runs(&runs.paths, runs.num_postings, |term, postings| {
+        let length = u32::try_from(postings.len())?;
+        encode_u32_sequence(&mut documents, length, postings.iter().map(|&(d, _)| d))?;
+        encode_u32_sequence(&mut frequencies, length, postings.iter().map(|&(_, f)| f))?;
+        writeln!(terms, "{}", term)?;
+        Ok(())
+    })?;
+    documents.flush()?;
+    frequencies.flush()?;
+    terms.flush()?;
+
+    let mut sizes = BufWriter::new(File::create(format!("{}.sizes", output.display()))?);
+    encode_u32_sequence(&mut sizes, num_documents, &runs.lengths)?;
+    sizes.flush()?;
+    Ok(())
+}
+
+fn write_ciff(
+    output: &Path,
+    runs: &Runs,
+    titles_path: &Path,
+    postings_path: &Path,
+    description: &str,
+) -> Result<()> {
+    let num_documents = i32::try_from(runs.lengths.len())?;
+    let mut num_postings_lists = 0_i32;
+    {
+        let mut writer = BufWriter::new(File::create(postings_path)?);
+        let mut out = CodedOutputStream::new(&mut writer);
+        merge_runs(&runs.paths, runs.num_postings, |term, postings| {
+            let mut posting_list = PostingsList::default();
+            posting_list.set_term(term.to_string());
+            let mut last_doc = 0;
+            let mut cf = 0;
+            for &(docid, frequency) in postings {
+                let mut posting = Posting::default();
+                posting.set_docid(i32::try_from(docid - last_doc)?);
+                posting.set_tf(i32::try_from(frequency)?);
+                posting_list.postings.push(posting);
+                cf += i64::from(frequency);
+                last_doc = docid;
+            }
+            posting_list.set_df(postings.len() as i64);
+            posting_list.set_cf(cf);
+            out.write_message_no_tag(&posting_list)?;
+            num_postings_lists += 1;
+            Ok(())
+        })?;
+        out.flush()?;
+    }
+
+    let doclen_sum: i64 = runs.lengths.iter().copied().map(i64::from).sum();
+    let mut header = proto::Header::default();
+    header.set_version(1);
+    header.set_description(description.into());
+    header.set_num_postings_lists(num_postings_lists);
+    header.set_total_postings_lists(num_postings_lists);
+    header.set_total_terms_in_collection(doclen_sum);
+    header.set_num_docs(num_documents);
+    header.set_total_docs(num_documents);
+    #[allow(clippy::cast_precision_loss)]
+    header.set_average_doclength(doclen_sum as f64 / f64::from(num_documents.max(1)));
+
+    eprintln!("Writing CIFF file");
+    let mut writer = BufWriter::new(File::create(output)?);
+    {
+        let mut out = CodedOutputStream::new(&mut writer);
+        out.write_message_no_tag(&header)?;
+        out.flush()?;
+    }
+    io::copy(&mut File::open(postings_path)?, &mut writer)?;
+    let mut out = CodedOutputStream::new(&mut writer);
+    let titles = BufReader::new(File::open(titles_path)?);
+    for ((docid, &length), title) in runs.lengths.iter().enumerate().zip(titles.lines()) {
+        let mut document = DocRecord::default();
+        document.set_docid(docid as i32);
+        document.set_collection_docid(title?);
+        document.set_doclength(i32::try_from(length)?);
+        out.write_message_no_tag(&document)?;
+    }
+    out.flush()?;
+    Ok(())
+}
+
+/// Inverts a forward index `input` into an inverted index written to `output`. Depending on
+/// [`InvertOptions::format`], `output` is either a path to a CIFF file or a basename of a PISA
+/// binary collection.
+///
+/// Term frequencies are computed by counting term occurrences in PISA forward indexes, or are
+/// taken from the (rounded) vector weights in JSON lines. If [`InvertOptions::quantization`] is
+/// set, JSON weights are quantized instead, and the quantization parameters are appended to the
+/// CIFF header description, or written to a `.quantization` file next to a PISA collection.
+/// Document lengths are sums of term frequencies. Terms are written in lexicographical order.
+///
+/// # Errors
+///
+/// Returns an error when:
+/// - an IO error occurs,
+/// - the input is malformed, e.g., a term ID is out of lexicon bounds or a weight is negative,
+/// - any count overflows the integer types of the output format.
+pub fn invert(input: &ForwardInput, output: &Path, options: &InvertOptions) -> Result<()> {
+    let prefix = temp_prefix(options.temp_dir.as_deref(), output)?;
+    let temp_files = TempFiles::default();
+    let run_prefix = collection_path(&prefix, "run").display().to_string();
+    let titles_path = match options.format {
+        InvertedFormat::Pisa => PathBuf::from(format!("{}.documents", output.display())),
+        InvertedFormat::Ciff => temp_files.register(collection_path(&prefix, "titles")),
+    };
+    let quantizer = match (options.quantization, input) {
+        (None, _) => None,
+        (Some(quantization), ForwardInput::Jsonl(path)) => {
+            let range =
+                jsonl_weight_range(path, options.threads.max(1), options.batch_size.max(1))?;
+            let quantizer = Quantizer::new(quantization, range.min, range.max)
+                .context("Unable to quantize weights")?;
+            eprintln!("Weights in [{}, {}]", range.min, range.max);
+            Some(quantizer)
+        }
+        (Some(_), ForwardInput::Pisa { .. }) => {
+            bail!("Quantization is only supported for weighted (JSON) inputs")
+        }
+    };
+    let runs = generate_runs(
+        input,
+        options,
+        quantizer.as_ref(),
+        &titles_path,
+        &run_prefix,
+        &temp_files,
+    )?;
+    eprintln!(
+        "Inverted {} documents into {} runs",
+        runs.lengths.len(),
+        runs.paths.len()
+    );
+    match options.format {
+        InvertedFormat::Pisa => {
+            if let Some(quantizer) = &quantizer {
+                fs::write(
+                    format!("{}.quantization", output.display()),
+                    format!("{}\n", quantizer),
+                )?;
+            }
+            write_pisa_postings(output, &runs)
+        }
+        InvertedFormat::Ciff => {
+            let postings_path = temp_files.register(collection_path(&prefix, "postings"));
+            let description = match (&quantizer, options.description.as_str()) {
+                (Some(quantizer), "") => quantizer.to_string(),
+                (Some(quantizer), description) => format!("{}; {}", description, quantizer),
+                (None, description) => description.to_string(),
+            };
+            write_ciff(output, &runs, &titles_path, &postings_path, &description)
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use tempfile::TempDir;
+
+    fn read_collection(path: &Path) -> Vec<Vec<u32>> {
+        let bytes = fs::read(path).unwrap();
+        BinaryCollection::try_from(&bytes[..])
+            .unwrap()
+            .map(|sequence| sequence.unwrap().iter().collect())
+            .collect()
+    }
+
+    #[test]
+    fn test_invert_jsonl_with_spilling() -> Result<()> {
+        let temp = TempDir::new()?;
+        let input = temp.path().join("docs.jsonl");
+        fs::write(
+            &input,
+            r#"{"id": "D0", "vector": {"b": 2, "a": 1}}
+{"id": "D1", "vector": {"c": 1}}
+
+{"id": "D2", "vector": {"a": 3, "c": 0, "b": 1}}
+"#,
+        )?;
+        let output = temp.path().join("coll");
+        let options = InvertOptions {
+            format: InvertedFormat::Pisa,
+            threads: 2,
+            memory_budget: 1,
+            batch_size: 1,
+            ..InvertOptions::default()
+        };
+        invert(&ForwardInput::Jsonl(input), &output, &options)?;
+        assert_eq!(
+            read_collection(&temp.path().join("coll.docs")),
+            vec![vec![3], vec![0, 2], vec![0, 2], vec![1]]
+        );
+        assert_eq!(
+            read_collection(&temp.path().join("coll.freqs")),
+            vec![vec![1, 3], vec![2, 1], vec![1]]
+        );
+        assert_eq!(
+            read_collection(&temp.path().join("coll.sizes")),
+            vec![vec![3, 1, 4]]
+        );
+        assert_eq!(
+            fs::read_to_string(temp.path().join("coll.terms"))?,
+            "a\nb\nc\n"
+        );
+        assert_eq!(
+            fs::read_to_string(temp.path().join("coll.documents"))?,
+            "D0\nD1\nD2\n"
+        );
+        let leftovers = fs::read_dir(temp.path())?.count();
+        assert_eq!(leftovers, 6);
+        Ok(())
+    }
+
+    #[test]
+    fn test_invert_forward_to_ciff() -> Result<()> {
+        let temp = TempDir::new()?;
+        let forward = temp.path().join("fwd");
+        let mut bytes = Vec::new();
+        encode_u32_sequence(&mut bytes, 1, [3])?;
+        encode_u32_sequence(&mut bytes, 3, [1, 0, 1])?;
+        encode_u32_sequence(&mut bytes, 0, Vec::<u32>::new())?;
+        encode_u32_sequence(&mut bytes, 2, [2, 1])?;
+        fs::write(&forward, bytes)?;
+        let terms = temp.path().join("terms");
+        fs::write(&terms, "a\nb\nc\n")?;
+        let input = ForwardInput::Pisa {
+            forward,
+            terms,
+            documents: None,
+        };
+        let ciff = temp.path().join("ciff");
+        let options = InvertOptions {
+            threads: 3,
+            batch_size: 1,
+            ..InvertOptions::default()
+        };
+        invert(&input, &ciff, &options)?;
+        let output = temp.path().join("coll");
+        crate::ciff_to_pisa(&ciff, &output)?;
+        assert_eq!(
+            read_collection(&temp.path().join("coll.docs")),
+            vec![vec![3], vec![0], vec![0, 2], vec![2]]
+        );
+        assert_eq!(
+            read_collection(&temp.path().join("coll.freqs")),
+            vec![vec![1], vec![2, 1], vec![1]]
+        );
+        assert_eq!(
+            read_collection(&temp.path().join("coll.sizes")),
+            vec![vec![3, 0, 2]]
+        );
+        assert_eq!(
+            fs::read_to_string(temp.path().join("coll.documents"))?,
+            "0\n1\n2\n"
+        );
+        Ok(())
+    }
+
+    #[test]
+    fn test_invert_quantized_jsonl() -> Result<()> {
+        let temp = TempDir::new()?;
+        let input = temp.path().join("docs.jsonl");
+        fs::write(
+            &input,
+            r#"{"id": "D0", "vector": {"a": 0.5, "b": 2.0}}
+{"id": "D1", "vector": {"a": 1.0, "b": -1.0}}
+"#,
+        )?;
+        let output = temp.path().join("coll");
+        let options = InvertOptions {
+            format: InvertedFormat::Pisa,
+            quantization: Some(Quantization {
+                scale: crate::QuantizationScale::Linear,
+                bits: 4,
+            }),
+            ..InvertOptions::default()
+        };
+        invert(&ForwardInput::Jsonl(input), &output, &options)?;
+        assert_eq!(
+            read_collection(&temp.path().join("coll.freqs")),
+            vec![vec![4, 8], vec![15]]
+        );
+        assert_eq!(
+            fs::read_to_string(temp.path().join("coll.quantization"))?,
+            "quantization: scale=linear bits=4 min=0.5 max=2\n"
+        );
+        Ok(())
+    }
+
+    #[test]
+    fn test_invert_rejects_out_of_bounds_term() -> Result<()> {
+        let temp = TempDir::new()?;
+        let forward = temp.path().join("fwd");
+        let mut bytes = Vec::new();
+        encode_u32_sequence(&mut bytes, 1, [1])?;
+        encode_u32_sequence(&mut bytes, 2, [0, 5])?;
+        fs::write(&forward, bytes)?;
+        let terms = temp.path().join("terms");
+        fs::write(&terms, "a\nb\n")?;
+        let input = ForwardInput::Pisa {
+            forward,
+            terms,
+            documents: None,
+        };
+        assert!(invert(&input, &temp.path().join("coll"), &InvertOptions::default()).is_err());
+        Ok(())
+    }
+}
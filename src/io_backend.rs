@@ -0,0 +1,368 @@
+//! Selection of the I/O implementation used by converters.
+
+use crate::cache::DropBehindFile;
+use crate::checksum::{Checksummer, Manifest, ManifestBuilder};
+use crate::throttle::{Throttle, ThrottleOptions, Throttled};
+use crate::Result;
+use anyhow::{anyhow, bail, Context};
+use std::fs::{File, OpenOptions};
+use std::io::{self, BufRead, BufReader, BufWriter, Read, Seek, SeekFrom, Write};
+use std::ops::Range;
+use std::path::{Path, PathBuf};
+use std::str::FromStr;
+use std::sync::Arc;
+
+/// I/O implementation for reading inputs and writing outputs.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum IoBackend {
+    /// Buffered blocking reads and writes.
+    Blocking,
+    /// Linux `io_uring`, with several large reads and writes in flight per file.
+    /// Falls back to [`IoBackend::Blocking`] when `io_uring` is unavailable.
+    Uring,
+}
+
+impl Default for IoBackend {
+    fn default() -> Self {
+        Self::Blocking
+    }
+}
+
+impl FromStr for IoBackend {
+    type Err = anyhow::Error;
+    fn from_str(s: &str) -> Result<Self> {
+        match s {
+            "blocking" => Ok(Self::Blocking),
+            "uring" => Ok(Self::Uring),
+            _ => Err(anyhow!(
+                "Unknown I/O backend: {} (expected blocking or uring)",
+                s
+            )),
+        }
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn warn_fallback(error: &std::io::Error) {
+    static WARNING: std::sync::Once = std::sync::Once::new();
+    WARNING.call_once(|| {
+        eprintln!(
+            "io_uring unavailable ({}), falling back to blocking I/O",
+            error
+        );
+    });
+}
+
+/// Largest range copied by a single `copy_file_range` call.
+#[cfg(target_os = "linux")]
+const COPY_CHUNK: usize = 64 << 20;
+
+/// Buffer memory per file of the `io_uring` backend, and the most given to any file under a
+/// memory limit.
+pub(crate) const MAX_BUFFER_MEMORY: usize = 8 << 20;
+/// Buffer size of the blocking backend when memory is not limited.
+const DEFAULT_BUFFER_SIZE: usize = 8 << 10;
+
+/// How files of a conversion are read and written.
+#[derive(Debug, Clone, Default)]
+pub(crate) struct IoConfig {
+    pub(crate) backend: IoBackend,
+    /// Drop files from the page cache behind the current position.
+    pub(crate) drop_behind: bool,
+    pub(crate) throttle: Option<Arc<Throttle>>,
+    /// Buffer memory per file, if limited.
+    pub(crate) buffer_memory: Option<usize>,
+    /// Collects checksums of outputs, if set.
+    pub(crate) manifest: Option<Arc<ManifestBuilder>>,
+}
+
+impl IoConfig {
+    /// Configuration with bandwidth limits `throttle`, which also checksums outputs into the
+    /// manifest of `output` if `manifest` is set.
+    pub(crate) fn new(
+        backend: IoBackend,
+        drop_behind: bool,
+        throttle: &ThrottleOptions,
+        output: &Path,
+        manifest: bool,
+    ) -> Result<Self> {
+        Ok(Self {
+            backend,
+            drop_behind,
+            throttle: Throttle::new(throttle)?,
+            buffer_memory: None,
+            manifest: if manifest {
+                Some(Arc::new(ManifestBuilder::new(Manifest::path(output))))
+            } else {
+                None
+            },
+        })
+    }
+
+    /// Writes the manifest, if any, once all outputs have been dropped.
+    pub(crate) fn save_manifest(&self) -> Result<()> {
+        match &self.manifest {
+            Some(manifest) => manifest.save(),
+            None => Ok(()),
+        }
+    }
+
+    /// Same configuration with blocking I/O, for small files and seekable inputs.
+    pub(crate) fn blocking(&self) -> Self {
+        Self {
+            backend: IoBackend::Blocking,
+            ..self.clone()
+        }
+    }
+
+    /// Number and size of the buffers of each file read or written with `io_uring`.
+    #[cfg(target_os = "linux")]
+    fn uring_buffers(&self) -> (usize, usize) {
+        use crate::uring::{BUFFERS, BUFFER_SIZE};
+        match self.buffer_memory {
+            Some(memory) => (
+                BUFFERS,
+                (memory / BUFFERS / 4096 * 4096).clamp(4096, BUFFER_SIZE),
+            ),
+            None => (BUFFERS, BUFFER_SIZE),
+        }
+    }
+
+    fn buffer_size(&self) -> usize {
+        self.buffer_memory.unwrap_or(DEFAULT_BUFFER_SIZE)
+    }
+}
+
+/// Input file read through blocking I/O.
+pub(crate) type InputFile = Throttled<DropBehindFile>;
+
+/// Opens an input file for blocking, possibly seeking, reads.
+pub(crate) fn open_file(path: &Path, config: &IoConfig) -> Result<InputFile> {
+    let file = File::open(path).with_context(|| format!("Unable to open {}", path.display()))?;
+    Ok(Throttled::new(
+        DropBehindFile::new(file, config.drop_behind),
+        config.throttle.clone(),
+    ))
+}
+
+/// Opens an input file for sequential reading from `offset`.
+pub(crate) fn open_input_at(
+    path: &Path,
+    offset: u64,
+    config: &IoConfig,
+) -> Result<Box<dyn BufRead + Send>> {
+    #[cfg(target_os = "linux")]
+    {
+        if config.backend == IoBackend::Uring {
+            let file =
+                File::open(path).with_context(|| format!("Unable to open {}", path.display()))?;
+            let (buffers, buffer_size) = config.uring_buffers();
+            match crate::uring::UringReader::new(
+                file,
+                offset,
+                buffers,
+                buffer_size,
+                config.drop_behind,
+                config.throttle.clone(),
+            ) {
+                Ok(reader) => return Ok(Box::new(reader)),
+                Err(error) => warn_fallback(&error),
+            }
+        }
+    }
+    let mut file = open_file(path, config)?;
+    file.seek(SeekFrom::Start(offset))?;
+    Ok(Box::new(BufReader::with_capacity(
+        config.buffer_size(),
+        file,
+    )))
+}
+
+/// Output file written sequentially, which keeps track of its length, and of its checksums if
+/// they go to a manifest.
+pub(crate) struct Output {
+    writer: Box<dyn Write + Send>,
+    length: u64,
+    checksums: Option<OutputChecksums>,
+}
+
+/// Checksums of an output, added to the manifest when the output is dropped.
+struct OutputChecksums {
+    checksummer: Checksummer,
+    path: PathBuf,
+    manifest: Arc<ManifestBuilder>,
+}
+
+impl Output {
+    /// Number of bytes in the file, including those not flushed yet.
+    pub(crate) fn len(&self) -> u64 {
+        self.length
+    }
+}
+
+impl Write for Output {
+    fn write(&mut self, data: &[u8]) -> std::io::Result<usize> {
+        let length = self.writer.write(data)?;
+        self.length += length as u64;
+        if let Some(checksums) = self.checksums.as_mut() {
+            checksums.checksummer.update(&data[..length]);
+        }
+        Ok(length)
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        self.writer.flush()
+    }
+}
+
+impl Drop for Output {
+    fn drop(&mut self) {
+        if let Some(checksums) = self.checksums.take() {
+            let checksum = checksums.checksummer.finish();
+            checksums.manifest.add(&checksums.path, checksum);
+        }
+    }
+}
+
+/// Creates an output file for sequential writing.
+pub(crate) fn create_output(path: &Path, config: &IoConfig) -> Result<Output> {
+    open_output(path, None, config)
+}
+
+/// Opens an existing output file truncated to `length`, and appends to it.
+pub(crate) fn resume_output(path: &Path, length: u64, config: &IoConfig) -> Result<Output> {
+    open_output(path, Some(length), config)
+}
+
+fn open_output(path: &Path, resume_length: Option<u64>, config: &IoConfig) -> Result<Output> {
+    let open = || -> Result<File> {
+        match resume_length {
+            None => {
+                File::create(path).with_context(|| format!("Unable to create {}", path.display()))
+            }
+            Some(length) => {
+                let file = OpenOptions::new()
+                    .write(true)
+                    .open(path)
+                    .with_context(|| format!("Unable to open {}", path.display()))?;
+                if file.metadata()?.len() < length {
+                    bail!("{} is shorter than expected", path.display());
+                }
+                file.set_len(length)?;
+                Ok(file)
+            }
+        }
+    };
+    let length = resume_length.unwrap_or(0);
+    let checksums = |file: File| -> Result<(File, Option<OutputChecksums>)> {
+        let Some(manifest) = &config.manifest else {
+            return Ok((file, None));
+        };
+        let checksummer = match resume_length {
+            Some(length) => Checksummer::of_prefix(path, length)?,
+            None => Checksummer::default(),
+        };
+        let checksums = OutputChecksums {
+            checksummer,
+            path: path.to_path_buf(),
+            manifest: Arc::clone(manifest),
+        };
+        Ok((file, Some(checksums)))
+    };
+    #[cfg(target_os = "linux")]
+    {
+        if config.backend == IoBackend::Uring {
+            let (buffers, buffer_size) = config.uring_buffers();
+            let (file, checksums) = checksums(open()?)?;
+            match crate::uring::UringWriter::new(
+                file,
+                length,
+                buffers,
+                buffer_size,
+                config.drop_behind,
+                config.throttle.clone(),
+            ) {
+                Ok(writer) => {
+                    return Ok(Output {
+                        writer: Box::new(writer),
+                        length,
+                        checksums,
+                    })
+                }
+                Err(error) => warn_fallback(&error),
+            }
+        }
+    }
+    let (file, checksums) = checksums(open()?)?;
+    let mut file = Throttled::new(
+        DropBehindFile::new(file, config.drop_behind),
+        config.throttle.clone(),
+    );
+    file.seek(SeekFrom::Start(length))?;
+    Ok(Output {
+        writer: Box::new(BufWriter::with_capacity(config.buffer_size(), file)),
+        length,
+        checksums,
+    })
+}
+
+/// Copies as much of `range` of `input` as possible to the current position of `output` with
+/// `copy_file_range`, and returns the offset reached, short of the end if the kernel or the file
+/// systems do not support it.
+#[cfg(target_os = "linux")]
+fn copy_in_kernel(input: &File, range: Range<u64>, output: &File) -> Result<u64> {
+    use std::convert::TryFrom;
+    use std::os::unix::io::AsRawFd;
+    let mut offset = range.start;
+    while offset < range.end {
+        let length = usize::try_from(range.end - offset)
+            .unwrap_or(usize::MAX)
+            .min(COPY_CHUNK);
+        let mut input_offset = libc::loff_t::try_from(offset)?;
+        // SAFETY: the input offset outlives the call, and the output offset is the file's.
+        let copied = unsafe {
+            libc::copy_file_range(
+                input.as_raw_fd(),
+                std::ptr::addr_of_mut!(input_offset),
+                output.as_raw_fd(),
+                std::ptr::null_mut(),
+                length,
+                0,
+            )
+        };
+        match u64::try_from(copied) {
+            Ok(0) => bail!("Unexpected end of input at byte {}", offset),
+            Ok(copied) => offset += copied,
+            Err(_) => {
+                let error = io::Error::last_os_error();
+                match error.raw_os_error() {
+                    // Unsupported by the kernel or the file systems.
+                    Some(libc::EXDEV | libc::ENOSYS | libc::EOPNOTSUPP | libc::EINVAL) => break,
+                    _ => return Err(error.into()),
+                }
+            }
+        }
+    }
+    Ok(offset)
+}
+
+#[cfg(not(target_os = "linux"))]
+#[allow(clippy::unnecessary_wraps)]
+fn copy_in_kernel(_input: &File, range: Range<u64>, _output: &File) -> Result<u64> {
+    Ok(range.start)
+}
+
+/// Copies `range` of `input` to the current position of `output`, within the kernel with
+/// `copy_file_range` where supported, and through a buffer otherwise.
+pub(crate) fn copy_range(input: &File, range: Range<u64>, output: &mut File) -> Result<()> {
+    let offset = copy_in_kernel(input, range.clone(), output)?;
+    if offset < range.end {
+        let mut input = input;
+        input.seek(SeekFrom::Start(offset))?;
+        let copied = io::copy(&mut input.take(range.end - offset), output)?;
+        if copied < range.end - offset {
+            bail!("Unexpected end of input at byte {}", offset + copied);
+        }
+    }
+    Ok(())
+}
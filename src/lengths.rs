@@ -0,0 +1,177 @@
+//! Document lengths recomputed from postings while converting, for exporters that write zero
+//! lengths or count them differently than the sum of term frequencies that BM25 expects.
+//!
+//! Threads decoding postings lists add the frequency of each posting to a shared array of
+//! atomic counters, one per document, so that lengths are known once the last list is decoded,
+//! without another pass over the input.
+
+use crate::{PostingsList, Result};
+use anyhow::{anyhow, bail};
+use std::convert::TryFrom;
+use std::str::FromStr;
+use std::sync::atomic::{AtomicBool, AtomicU32, Ordering};
+
+/// Number of mismatching documents reported when verifying lengths.
+const MAX_REPORTED: usize = 5;
+
+/// Source of the document lengths written to `.sizes`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum DocumentLengths {
+    /// Lengths of the document records.
+    Records,
+    /// Sums of the term frequencies of the postings of each document.
+    Recompute,
+    /// Lengths of the document records, checked against the sums of term frequencies.
+    Verify,
+}
+
+impl Default for DocumentLengths {
+    fn default() -> Self {
+        Self::Records
+    }
+}
+
+impl DocumentLengths {
+    /// Checks if recomputed lengths replace those of the records.
+    pub(crate) fn replaces_records(self) -> bool {
+        self == Self::Recompute
+    }
+}
+
+impl FromStr for DocumentLengths {
+    type Err = anyhow::Error;
+    fn from_str(s: &str) -> Result<Self> {
+        match s {
+            "records" => Ok(Self::Records),
+            "recompute" => Ok(Self::Recompute),
+            "verify" => Ok(Self::Verify),
+            _ => Err(anyhow!(
+                "Unknown document lengths: {} (expected records, recompute, or verify)",
+                s
+            )),
+        }
+    }
+}
+
+/// Sums of term frequencies per document, added to concurrently by threads decoding lists.
+pub(crate) struct LengthCounter {
+    sums: Vec<AtomicU32>,
+    overflow: AtomicBool,
+}
+
+impl LengthCounter {
+    pub(crate) fn new(num_documents: u32) -> Self {
+        Self {
+            sums: (0..num_documents).map(|_| AtomicU32::new(0)).collect(),
+            overflow: AtomicBool::new(false),
+        }
+    }
+
+    /// Adds the frequencies of the postings of `list`, whose document IDs are gaps.
+    pub(crate) fn add(&self, list: &PostingsList) -> Result<()> {
+        let mut docid = 0_u32;
+        for posting in list.get_postings() {
+            docid = u32::try_from(posting.get_docid())
+                .ok()
+                .and_then(|gap| docid.checked_add(gap))
+                .filter(|&docid| (docid as usize) < self.sums.len())
+                .ok_or_else(|| anyhow!("Document ID out of bounds in {}", list.get_term()))?;
+            let tf = u32::try_from(posting.get_tf())
+                .map_err(|_| anyhow!("Negative frequency in {}", list.get_term()))?;
+            // Counters are only read once all lists are added.
+            let previous = self.sums[docid as usize].fetch_add(tf, Ordering::Relaxed);
+            if previous.checked_add(tf).is_none() {
+                self.overflow.store(true, Ordering::Relaxed);
+            }
+        }
+        Ok(())
+    }
+
+    /// Returns the lengths of all documents, once all lists are added.
+    pub(crate) fn finish(self) -> Result<Vec<u32>> {
+        if self.overflow.into_inner() {
+            bail!("Document length exceeds {}", u32::MAX);
+        }
+        Ok(self.sums.into_iter().map(AtomicU32::into_inner).collect())
+    }
+}
+
+/// Checks that the lengths of the document records match the recomputed ones.
+pub(crate) fn verify_lengths(records: &[u32], recomputed: &[u32]) -> Result<()> {
+    let mismatches: Vec<usize> = records
+        .iter()
+        .zip(recomputed)
+        .enumerate()
+        .filter(|(_, (record, recomputed))| record != recomputed)
+        .map(|(docid, _)| docid)
+        .collect();
+    if mismatches.is_empty() {
+        eprintln!("Document lengths match the sums of term frequencies");
+        return Ok(());
+    }
+    let examples: Vec<String> = mismatches
+        .iter()
+        .take(MAX_REPORTED)
+        .map(|&docid| {
+            format!(
+                "document {}: {} in record, {} in postings",
+                docid, records[docid], recomputed[docid]
+            )
+        })
+        .collect();
+    bail!(
+        "{} document lengths differ from the sums of term frequencies ({})",
+        mismatches.len(),
+        examples.join(", ")
+    )
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::Posting;
+    use protobuf::RepeatedField;
+
+    fn list(postings: &[(i32, i32)]) -> PostingsList {
+        let mut list = PostingsList::default();
+        list.set_postings(RepeatedField::from_vec(
+            postings
+                .iter()
+                .map(|&(gap, tf)| {
+                    let mut posting = Posting::default();
+                    posting.set_docid(gap);
+                    posting.set_tf(tf);
+                    posting
+                })
+                .collect(),
+        ));
+        list
+    }
+
+    #[test]
+    fn test_length_counter() -> Result<()> {
+        let counter = LengthCounter::new(4);
+        counter.add(&list(&[(0, 2), (2, 1)]))?;
+        counter.add(&list(&[(2, 3), (1, 1)]))?;
+        assert!(counter.add(&list(&[(4, 1)])).is_err());
+        assert_eq!(counter.finish()?, vec![2, 0, 4, 1]);
+
+        let counter = LengthCounter::new(1);
+        counter.add(&list(&[(0, i32::MAX)]))?;
+        counter.add(&list(&[(0, i32::MAX)]))?;
+        counter.add(&list(&[(0, 2)]))?;
+        assert!(counter.finish().is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_verify_lengths() {
+        assert!(verify_lengths(&[1, 2, 3], &[1, 2, 3]).is_ok());
+        let error = verify_lengths(&[0, 2, 0], &[1, 2, 3]).unwrap_err();
+        assert_eq!(
+            error.to_string(),
+            "2 document lengths differ from the sums of term frequencies \
+             (document 0: 0 in record, 1 in postings, document 2: 0 in record, 3 in postings)"
+        );
+    }
+}
@@ -26,18 +26,85 @@ use indicatif::ProgressIterator;
 use indicatif::{ProgressBar, ProgressStyle};
 use memmap::Mmap;
 use num_traits::ToPrimitive;
-use protobuf::{CodedInputStream, CodedOutputStream};
+use protobuf::{CodedInputStream, CodedOutputStream, Message};
 use std::borrow::Borrow;
+use std::collections::BTreeMap;
 use std::convert::TryFrom;
 use std::fmt;
 use std::fs::File;
-use std::io::{self, BufRead, BufReader, BufWriter, Write};
+use std::io::{self, BufRead, BufReader, Write};
 use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant};
 
 mod proto;
 pub use proto::{DocRecord, Posting, PostingsList};
+mod append;
+pub use append::{append_ciff, AppendOptions};
 mod binary_collection;
 pub use binary_collection::{BinaryCollection, BinarySequence, InvalidFormat};
+mod cache;
+use cache::MappedDropBehind;
+mod checkpoint;
+use checkpoint::{Checkpoint, Fingerprint};
+mod checksum;
+pub use checksum::{crc32c, crc32c_combine, verify_manifest, FileChecksum, Manifest};
+mod collection;
+pub use collection::CollectionInput;
+mod cooccurrence;
+pub use cooccurrence::{cooccurrence, CooccurrenceOptions, TermSelection};
+mod dedup;
+pub use dedup::{find_duplicates, DedupOptions};
+mod deletion;
+use deletion::DocumentRemap;
+pub use deletion::{read_docid_list, Deletions};
+mod filter;
+pub use filter::{filter_ciff, FilterOptions};
+mod forward;
+mod hybrid;
+use hybrid::{BitmapEncoder, BitmapWriter};
+pub use hybrid::{BitmapOptions, HybridCollection, HybridList};
+mod impact;
+pub use impact::{impact_order, ImpactInput, ImpactOrderOptions};
+mod intersect;
+mod io_backend;
+pub use io_backend::IoBackend;
+use io_backend::{IoConfig, Output};
+mod inverter;
+pub use inverter::{invert, ForwardInput, InvertOptions, InvertedFormat};
+mod lengths;
+pub use lengths::DocumentLengths;
+use lengths::{verify_lengths, LengthCounter};
+mod lookup;
+pub use lookup::{CacheStats, CiffReader, CiffReaderOptions, DecodedPostings};
+mod memory;
+use memory::MemoryBudget;
+pub use memory::{cgroup_memory_limit, peak_rss};
+mod pairs;
+pub use pairs::{build_pair_index, PairIndexOptions};
+mod parallel;
+mod postings;
+mod prune;
+pub use prune::{prune_documents, PruneOptions};
+mod quantization;
+pub use quantization::{Quantization, QuantizationScale, Quantizer};
+mod query;
+pub use query::{
+    run_queries, LatencyStats, QueryAlgorithm, QueryIndex, QueryOptions, ScoredDocument,
+};
+mod sample;
+pub use sample::{sample_collection, DocumentSample, SampleOptions};
+mod scan;
+mod scoring;
+pub use scoring::Bm25;
+mod shard;
+pub use shard::{shard_collection, ShardOptions};
+mod throttle;
+pub use throttle::ThrottleOptions;
+use throttle::{Direction, Throttle};
+mod tier;
+pub use tier::{split_tiers, TierOptions, TierSplit};
+#[cfg(target_os = "linux")]
+mod uring;
 
 type Result<T> = anyhow::Result<T>;
 
@@ -62,7 +129,11 @@ impl Header {
     ///
     /// Returns an error if the protobuf header contains negative counts.
     fn from_stream(input: &mut CodedInputStream<'_>) -> Result<Self> {
-        let header = input.read_message::<proto::Header>()?;
+        Self::from_protobuf(input.read_message::<proto::Header>()?)
+    }
+
+    /// Converts the protobuf header, failing if it contains negative counts.
+    fn from_protobuf(header: proto::Header) -> Result<Self> {
         let num_documents = u32::try_from(header.get_num_docs())
             .context("Number of documents must be non-negative.")?;
         let num_postings_lists = u32::try_from(header.get_num_postings_lists())
@@ -166,6 +237,580 @@ where
     Ok(())
 }
 
+/// Parameters of quantized scores precomputed by [`ciff_to_pisa_with_options`].
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct ScoreQuantization {
+    /// Scoring function.
+    pub bm25: Bm25,
+    /// Number of bits of quantized scores.
+    pub bits: u8,
+}
+
+/// Options of [`ciff_to_pisa_with_options`].
+#[derive(Debug, Clone)]
+#[allow(clippy::struct_excessive_bools)]
+pub struct CiffToPisaOptions {
+    /// Number of threads decoding postings lists.
+    pub threads: usize,
+    /// If set, quantized scores are written to `.scores`, in the same layout as `.freqs`.
+    pub scores: Option<ScoreQuantization>,
+    /// If set, only `.sizes` and `.documents` are written, and postings are skipped.
+    pub documents_only: bool,
+    /// If set, dense lists are also written as bitmaps to `.bitmaps`,
+    /// see [`HybridCollection`].
+    pub bitmaps: Option<BitmapOptions>,
+    /// I/O used for reading the CIFF input and writing postings.
+    pub io: IoBackend,
+    /// If set, the input and outputs are dropped from the page cache once processed, and outputs
+    /// are written back as they go, so that the conversion does not evict other cached data.
+    pub drop_behind: bool,
+    /// Limits on read and write bandwidth.
+    pub throttle: ThrottleOptions,
+    /// If set, progress is saved to `{output}.checkpoint` at this interval while processing
+    /// postings lists.
+    pub checkpoint_interval: Option<Duration>,
+    /// If set, the conversion resumes from `{output}.checkpoint`, if it exists: outputs are
+    /// truncated to their checkpointed lengths, and the input is read from the checkpointed
+    /// offset.
+    pub resume: bool,
+    /// If set, threads, queues, and I/O buffers are sized to keep memory use under this many
+    /// bytes, see [`cgroup_memory_limit`].
+    pub memory_limit: Option<u64>,
+    /// If set, CRC32C checksums of all outputs are computed while writing them, and saved to
+    /// `{output}.manifest`, see [`verify_manifest`].
+    pub manifest: bool,
+    /// If set, these documents are removed, and the remaining ones are renumbered densely in
+    /// their original order.
+    pub deletions: Option<Deletions>,
+    /// Source of the lengths written to `.sizes`: the document records, or the sums of term
+    /// frequencies of the postings of each document, computed while streaming postings.
+    pub document_lengths: DocumentLengths,
+}
+
+impl Default for CiffToPisaOptions {
+    fn default() -> Self {
+        Self {
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+            scores: None,
+            documents_only: false,
+            bitmaps: None,
+            io: IoBackend::default(),
+            drop_behind: false,
+            throttle: ThrottleOptions::default(),
+            checkpoint_interval: None,
+            resume: false,
+            memory_limit: None,
+            manifest: false,
+            deletions: None,
+            document_lengths: DocumentLengths::default(),
+        }
+    }
+}
+
+impl CiffToPisaOptions {
+    fn io_config(&self, output: &Path) -> Result<IoConfig> {
+        IoConfig::new(
+            self.io,
+            self.drop_behind,
+            &self.throttle,
+            output,
+            self.manifest,
+        )
+    }
+}
+
+/// Computes quantized scores of postings given document lengths known in advance.
+struct ListScorer<'a> {
+    bm25: Bm25,
+    lengths: &'a [u32],
+    avg_doclen: f32,
+    quantizer: Quantizer,
+}
+
+impl<'a> ListScorer<'a> {
+    /// Quantizes scores linearly up to the upper bound of all BM25 scores in the collection,
+    /// so that postings can be scored in a single pass.
+    fn new(lengths: &'a [u32], scores: ScoreQuantization) -> Result<Self> {
+        let num_documents = lengths.len() as u64;
+        #[allow(clippy::cast_precision_loss)]
+        let avg_doclen = lengths.iter().copied().map(u64::from).sum::<u64>() as f32
+            / num_documents.max(1) as f32;
+        // Without documents, there is nothing to score, but the bound must stay positive.
+        let max_score = scores
+            .bm25
+            .max_score(scores.bm25.idf(1, num_documents.max(1)));
+        let quantization = Quantization {
+            scale: QuantizationScale::Linear,
+            bits: scores.bits,
+        };
+        Ok(Self {
+            bm25: scores.bm25,
+            lengths,
+            avg_doclen,
+            quantizer: Quantizer::new(quantization, 0.0, f64::from(max_score))?,
+        })
+    }
+
+    /// Writes the scoring and quantization parameters to `{output}.scores.quantization`.
+    fn write_parameters(&self, output: &Path, io: &IoConfig) -> Result<()> {
+        let path = PathBuf::from(format!("{}.scores.quantization", output.display()));
+        let mut parameters = io_backend::create_output(&path, &io.blocking())?;
+        writeln!(parameters, "{}; {}", self.bm25, self.quantizer)?;
+        parameters.flush()?;
+        Ok(())
+    }
+
+    fn write_scores<W: Write>(&self, posting_list: &PostingsList, writer: &mut W) -> Result<()> {
+        let postings = posting_list.get_postings();
+        let idf = self
+            .bm25
+            .idf(postings.len() as u64, self.lengths.len() as u64);
+        let length = u32::try_from(postings.len())?;
+        writer.write_all(&length.to_le_bytes())?;
+        let mut docid = 0_u32;
+        for posting in postings {
+            docid += u32::try_from(posting.get_docid()).context("Negative ID")?;
+            let doclen = *self
+                .lengths
+                .get(docid as usize)
+                .ok_or_else(|| anyhow!("Document ID out of bounds: {}", docid))?;
+            let tf = u32::try_from(posting.get_tf()).context("Negative frequency")?;
+            #[allow(clippy::cast_precision_loss)]
+            let score = self.bm25.score(idf, tf, doclen as f32, self.avg_doclen);
+            let score = self.quantizer.quantize(f64::from(score));
+            writer.write_all(&score.to_le_bytes())?;
+        }
+        Ok(())
+    }
+}
+
+/// Postings list encoded in the PISA binary collection format.
+#[derive(Default)]
+struct EncodedList {
+    documents: Vec<u8>,
+    frequencies: Vec<u8>,
+    scores: Vec<u8>,
+    term: Vec<u8>,
+    bitmap: Option<Vec<u8>>,
+}
+
+/// Encodes a raw postings list, or returns `None` if all its documents are deleted.
+fn encode_posting_list(
+    message: &[u8],
+    scorer: Option<&ListScorer<'_>>,
+    bitmaps: Option<&BitmapEncoder>,
+    remap: Option<&DocumentRemap>,
+    counter: Option<&LengthCounter>,
+) -> Result<Option<EncodedList>> {
+    let mut posting_list = PostingsList::parse_from_bytes(message)?;
+    if let Some(remap) = remap {
+        if !remap.remap_list(&mut posting_list)? {
+            return Ok(None);
+        }
+    }
+    if let Some(counter) = counter {
+        counter.add(&posting_list)?;
+    }
+    let mut encoded = EncodedList::default();
+    write_posting_list(
+        &posting_list,
+        &mut encoded.documents,
+        &mut encoded.frequencies,
+        &mut encoded.term,
+    )?;
+    if let Some(scorer) = scorer {
+        scorer.write_scores(&posting_list, &mut encoded.scores)?;
+    }
+    if let Some(bitmaps) = bitmaps {
+        let documents: Vec<u32> = BinarySequence::try_from(&encoded.documents[4..])
+            .map_err(|()| anyhow!("Invalid encoded list"))?
+            .iter()
+            .collect();
+        encoded.bitmap = bitmaps.encode(&documents)?;
+        if encoded.bitmap.is_some() && bitmaps.replace_lists {
+            encoded.documents = 0_u32.to_le_bytes().to_vec();
+            encoded.frequencies = 0_u32.to_le_bytes().to_vec();
+            if !encoded.scores.is_empty() {
+                encoded.scores = 0_u32.to_le_bytes().to_vec();
+            }
+        }
+    }
+    Ok(Some(encoded))
+}
+
+/// Reads the bytes of a single length-delimited message without decoding it.
+fn read_raw_message(input: &mut CodedInputStream<'_>) -> Result<Vec<u8>> {
+    let length = input.read_raw_varint32()?;
+    Ok(input.read_raw_bytes(length)?)
+}
+
+/// Validates a document record that is expected to have ID `docid`, and returns its length.
+fn document_length(doc_record: &DocRecord, docid: u32) -> Result<u32> {
+    let record_docid: u32 = doc_record
+        .get_docid()
+        .to_u32()
+        .ok_or_else(|| anyhow!("Cannot cast docid to u32: {}", doc_record.get_docid()))?;
+    let length: u32 = doc_record.get_doclength().to_u32().ok_or_else(|| {
+        anyhow!(
+            "Cannot cast doc length to u32: {}",
+            doc_record.get_doclength()
+        )
+    })?;
+    if record_docid != docid {
+        anyhow::bail!("Document sizes must come in order");
+    }
+    Ok(length)
+}
+
+/// Writes `.sizes` and `.documents` from `num_documents` records returned by `next_record`,
+/// skipping deleted documents, and returns the lengths of their records. Lengths written to
+/// `.sizes` are the `recomputed` ones instead, if set.
+fn write_documents<F>(
+    num_documents: u32,
+    mut next_record: F,
+    remap: Option<&DocumentRemap>,
+    recomputed: Option<&[u32]>,
+    output: &Path,
+    io: &IoConfig,
+) -> Result<Vec<u32>>
+where
+    F: FnMut() -> Result<DocRecord>,
+{
+    eprintln!("Processing document lengths");
+    let output_path =
+        |extension: &str| PathBuf::from(format!("{}.{}", output.display(), extension));
+    let mut sizes = io_backend::create_output(&output_path("sizes"), &io.blocking())?;
+    let mut trecids = io_backend::create_output(&output_path("documents"), &io.blocking())?;
+
+    let progress = ProgressBar::new(u64::from(num_documents));
+    progress.set_style(pb_style());
+    progress.set_draw_delta(u64::from(num_documents) / 100);
+    let num_kept = remap.map_or(num_documents, DocumentRemap::num_kept);
+    sizes.write_all(&num_kept.to_le_bytes())?;
+
+    let mut lengths = Vec::with_capacity(num_kept as usize);
+    for docs_seen in 0..num_documents {
+        let doc_record = next_record()?;
+        let length = document_length(&doc_record, docs_seen)?;
+        let trecid = doc_record.get_collection_docid();
+        if remap.is_some_and(|remap| remap.get(docs_seen).is_none()) {
+            progress.inc(1);
+            continue;
+        }
+
+        let size = recomputed.map_or(length, |recomputed| recomputed[lengths.len()]);
+        sizes.write_all(&size.to_le_bytes())?;
+        writeln!(trecids, "{}", trecid)?;
+        lengths.push(length);
+        progress.inc(1);
+    }
+    progress.finish();
+
+    sizes.flush()?;
+    trecids.flush()?;
+    Ok(lengths)
+}
+
+/// Returns the number of threads and the queue depth for processing postings lists within the
+/// memory limit, if any, which also limits the I/O buffers of `io`.
+fn postings_parallelism(
+    header: &Header,
+    options: &CiffToPisaOptions,
+    io: &mut IoConfig,
+) -> Result<(usize, usize)> {
+    let threads = options.threads.max(1);
+    let Some(limit) = options.memory_limit else {
+        return Ok((threads, 4 * threads));
+    };
+    let mut budget = MemoryBudget::new(limit);
+    let documents = u64::from(header.num_documents);
+    if options.scores.is_some() {
+        budget.reserve(4 * documents, "document lengths")?;
+    }
+    if options.deletions.is_some() {
+        budget.reserve(4 * documents, "the table of remaining documents")?;
+    }
+    if options.document_lengths != DocumentLengths::Records {
+        budget.reserve(4 * documents, "recomputed document lengths")?;
+    }
+    let files = 4 + usize::from(options.scores.is_some()) + usize::from(options.bitmaps.is_some());
+    io.buffer_memory = Some(budget.buffers(files, io_backend::MAX_BUFFER_MEMORY));
+    // The longest list has a posting for every document. Its raw message takes at most 16 bytes
+    // per posting, as does its encoding: 4 bytes per document ID, frequency, and score, and a
+    // bitmap. Decoding takes a `Posting` and a document ID for bitmaps per posting.
+    let item_bytes = 16 * documents;
+    let working_bytes = documents * (std::mem::size_of::<Posting>() as u64 + 4);
+    let (threads, queue_depth) = budget.parallelism(threads, item_bytes, working_bytes);
+    eprintln!(
+        "Memory limit of {} MiB: {} threads, queue depth {}",
+        limit >> 20,
+        threads,
+        queue_depth
+    );
+    Ok((threads, queue_depth))
+}
+
+/// Reads the header of a CIFF file, and returns it with the offset of the first postings list.
+fn read_header_at_start(input: &Path, io: &IoConfig) -> Result<(Header, u64)> {
+    let mut scanner = scan::MessageScanner::open(input, &io.blocking())?;
+    let header = Header::from_protobuf(scanner.read_message()?)?;
+    Ok((header, scanner.offset()))
+}
+
+/// Loads the checkpoint at `path`, if any and the conversion resumes, and checks that it belongs
+/// to the same conversion.
+fn load_checkpoint(
+    path: &Path,
+    fingerprint: &Fingerprint,
+    num_documents: u32,
+    options: &CiffToPisaOptions,
+) -> Result<Option<Checkpoint>> {
+    if !options.resume {
+        return Ok(None);
+    }
+    let checkpoint = Checkpoint::load(path)?;
+    match &checkpoint {
+        Some(checkpoint) => {
+            let extensions = PostingsOutputs::extensions(options);
+            checkpoint.validate(fingerprint, num_documents, &extensions)?;
+            eprintln!(
+                "Resuming from postings list {} at byte {}",
+                checkpoint.lists, checkpoint.input_offset
+            );
+        }
+        None => eprintln!("No checkpoint found, starting from the beginning"),
+    }
+    Ok(checkpoint)
+}
+
+/// Reads document lengths from `.sizes` written by a previous run.
+fn read_sizes(output: &Path, num_documents: u32, io: &IoConfig) -> Result<Vec<u32>> {
+    let path = |extension: &str| PathBuf::from(format!("{}.{}", output.display(), extension));
+    if let Some(manifest) = &io.manifest {
+        manifest.add_existing(&path("sizes"))?;
+        manifest.add_existing(&path("documents"))?;
+    }
+    let bytes = postings::map_file(&path("sizes"))?;
+    let lengths: Vec<u32> = sizes(&bytes)?.iter().collect();
+    if lengths.len() != num_documents as usize {
+        anyhow::bail!("Document sizes do not match the number of documents");
+    }
+    Ok(lengths)
+}
+
+/// Outputs written while streaming postings lists.
+struct PostingsOutputs {
+    documents: Output,
+    frequencies: Output,
+    terms: Output,
+    scores: Option<Output>,
+    bitmaps: Option<BitmapWriter>,
+}
+
+impl PostingsOutputs {
+    /// Extensions of outputs written with `options`.
+    fn extensions(options: &CiffToPisaOptions) -> Vec<&'static str> {
+        let mut extensions = vec!["docs", "freqs", "terms"];
+        if options.scores.is_some() {
+            extensions.push("scores");
+        }
+        if options.bitmaps.is_some() {
+            extensions.push("bitmaps");
+        }
+        extensions
+    }
+
+    /// Creates outputs, or reopens them at the lengths recorded by `checkpoint`.
+    fn open(
+        output: &Path,
+        num_documents: u32,
+        options: &CiffToPisaOptions,
+        checkpoint: Option<&Checkpoint>,
+        io: &IoConfig,
+    ) -> Result<Self> {
+        let path = |extension: &str| PathBuf::from(format!("{}.{}", output.display(), extension));
+        let open = |extension: &str| match checkpoint {
+            Some(checkpoint) => io_backend::resume_output(
+                &path(extension),
+                checkpoint.output_length(extension)?,
+                io,
+            ),
+            None => io_backend::create_output(&path(extension), io),
+        };
+        let mut documents = open("docs")?;
+        if checkpoint.is_none() {
+            encode_u32_sequence(&mut documents, 1, [num_documents].iter())?;
+        }
+        let scores = match options.scores {
+            Some(_) => Some(open("scores")?),
+            None => None,
+        };
+        let bitmaps = match (options.bitmaps, checkpoint) {
+            (None, _) => None,
+            (Some(_), Some(_)) => Some(BitmapWriter::resume(open("bitmaps")?)),
+            (Some(_), None) => Some(BitmapWriter::create(open("bitmaps")?, num_documents)?),
+        };
+        Ok(Self {
+            documents,
+            frequencies: open("freqs")?,
+            terms: open("terms")?,
+            scores,
+            bitmaps,
+        })
+    }
+
+    fn write(&mut self, term_id: u32, encoded: &EncodedList) -> Result<()> {
+        if let (Some(bitmaps), Some(record)) = (self.bitmaps.as_mut(), &encoded.bitmap) {
+            bitmaps.write(term_id, record)?;
+        }
+        self.documents.write_all(&encoded.documents)?;
+        self.frequencies.write_all(&encoded.frequencies)?;
+        self.terms.write_all(&encoded.term)?;
+        if let Some(scores) = self.scores.as_mut() {
+            scores.write_all(&encoded.scores)?;
+        }
+        Ok(())
+    }
+
+    fn flush(&mut self) -> Result<()> {
+        self.documents.flush()?;
+        self.frequencies.flush()?;
+        self.terms.flush()?;
+        if let Some(scores) = self.scores.as_mut() {
+            scores.flush()?;
+        }
+        if let Some(bitmaps) = self.bitmaps.as_mut() {
+            bitmaps.flush()?;
+        }
+        Ok(())
+    }
+
+    /// Lengths of outputs by extension.
+    fn lengths(&self) -> BTreeMap<String, u64> {
+        let mut lengths = BTreeMap::new();
+        lengths.insert("docs".to_string(), self.documents.len());
+        lengths.insert("freqs".to_string(), self.frequencies.len());
+        lengths.insert("terms".to_string(), self.terms.len());
+        if let Some(scores) = &self.scores {
+            lengths.insert("scores".to_string(), scores.len());
+        }
+        if let Some(bitmaps) = &self.bitmaps {
+            lengths.insert("bitmaps".to_string(), bitmaps.len());
+        }
+        lengths
+    }
+
+    /// Flushes all outputs, and saves a checkpoint of their lengths to `path`.
+    fn save_checkpoint(&mut self, path: &Path, checkpoint: &mut Checkpoint) -> Result<()> {
+        self.flush()?;
+        checkpoint.outputs = self.lengths();
+        checkpoint.save(path)
+    }
+
+    /// Flushes and closes all outputs once all postings lists are written, saving a last
+    /// checkpoint to `checkpoint_path` if set.
+    fn finish(
+        mut self,
+        checkpoint_path: Option<&PathBuf>,
+        checkpoint: &mut Checkpoint,
+    ) -> Result<()> {
+        match checkpoint_path {
+            // Document records are written from scratch if the conversion resumes from here.
+            Some(path) => self.save_checkpoint(path, checkpoint),
+            None => self.flush(),
+        }
+    }
+}
+
+/// Writes `.sizes` and `.documents` before any postings, by skipping over postings lists:
+/// only the length of each list is read, and its body is skipped with a seek.
+fn write_documents_first(
+    input: &Path,
+    output: &Path,
+    remap: Option<&DocumentRemap>,
+    io: &IoConfig,
+) -> Result<Vec<u32>> {
+    let mut scanner = scan::MessageScanner::open(input, io)?;
+    eprintln!("Skipping postings");
+    let header = scanner.skip_to_documents()?;
+    write_documents(
+        header.num_documents,
+        || scanner.read_document(),
+        remap,
+        None,
+        output,
+        io,
+    )
+}
+
+/// Builds the table of remaining documents if documents are deleted. Document lengths are read
+/// first, by skipping over postings, if empty documents are deleted too.
+fn document_remap(
+    input: &Path,
+    header: &Header,
+    options: &CiffToPisaOptions,
+    io: &IoConfig,
+) -> Result<Option<DocumentRemap>> {
+    let Some(deletions) = &options.deletions else {
+        return Ok(None);
+    };
+    let lengths = if deletions.drop_empty {
+        let mut scanner = scan::MessageScanner::open(input, &io.blocking())?;
+        eprintln!("Skipping postings to find empty documents");
+        scanner.skip_to_documents()?;
+        let lengths = (0..header.num_documents)
+            .map(|docid| document_length(&scanner.read_document()?, docid))
+            .collect::<Result<Vec<_>>>()?;
+        Some(lengths)
+    } else {
+        None
+    };
+    let remap = DocumentRemap::new(deletions, header.num_documents, lengths.as_deref())?;
+    eprintln!(
+        "Keeping {} of {} documents",
+        remap.num_kept(),
+        header.num_documents
+    );
+    Ok(Some(remap))
+}
+
+/// Creates the scorer of postings if scores are written, given document lengths known in
+/// advance, and writes its parameters.
+fn list_scorer<'a>(
+    lengths: Option<&'a [u32]>,
+    options: &CiffToPisaOptions,
+    output: &Path,
+    io: &IoConfig,
+) -> Result<Option<ListScorer<'a>>> {
+    let (Some(quantization), Some(lengths)) = (options.scores, lengths) else {
+        return Ok(None);
+    };
+    let scorer = ListScorer::new(lengths, quantization)?;
+    scorer.write_parameters(output, io)?;
+    Ok(Some(scorer))
+}
+
+/// Creates the counter of document lengths recomputed from postings, unless lengths are those of
+/// the records.
+fn length_counter(
+    num_documents: u32,
+    options: &CiffToPisaOptions,
+) -> Result<Option<LengthCounter>> {
+    if options.document_lengths == DocumentLengths::Records {
+        return Ok(None);
+    }
+    if options.documents_only {
+        anyhow::bail!("Document lengths cannot be recomputed without postings");
+    }
+    if options.resume {
+        anyhow::bail!("Document lengths cannot be recomputed when resuming a conversion");
+    }
+    if options.scores.is_some() && options.document_lengths == DocumentLengths::Recompute {
+        anyhow::bail!("Scores need document lengths before postings, which can only be verified");
+    }
+    Ok(Some(LengthCounter::new(num_documents)))
+}
+
 /// Converts a CIFF index stored in `path` to a PISA "binary collection" (uncompressed inverted
 /// index) with a basename `output`.
 ///
@@ -177,71 +822,136 @@ where
 /// - data format is valid but any ID, frequency, or a count is negative,
 /// - document records is out of order.
 pub fn ciff_to_pisa(input: &Path, output: &Path) -> Result<()> {
-    let mut ciff_reader =
-        File::open(input).with_context(|| format!("Unable to open {}", input.display()))?;
-    let mut input = CodedInputStream::new(&mut ciff_reader);
-    let mut documents = BufWriter::new(File::create(format!("{}.docs", output.display()))?);
-    let mut frequencies = BufWriter::new(File::create(format!("{}.freqs", output.display()))?);
-    let mut terms = BufWriter::new(File::create(format!("{}.terms", output.display()))?);
-
-    let header = Header::from_stream(&mut input)?;
+    ciff_to_pisa_with_options(input, output, &CiffToPisaOptions::default())
+}
+
+/// Converts a CIFF index stored in `path` to a PISA "binary collection" (uncompressed inverted
+/// index) with a basename `output`, as [`ciff_to_pisa`] does, with additional `options`.
+///
+/// Postings lists are decoded in parallel by [`CiffToPisaOptions::threads`] threads.
+///
+/// If [`CiffToPisaOptions::scores`] or [`CiffToPisaOptions::documents_only`] is set,
+/// document records are processed first, by skipping over the postings lists at I/O speed.
+/// With scores, quantized scores are then computed while streaming the postings, and written to
+/// `.scores`. Scores are quantized linearly up to the upper bound of all scores in the collection; the
+/// parameters are written to `.scores.quantization`.
+///
+/// Unless [`CiffToPisaOptions::document_lengths`] is [`DocumentLengths::Records`], the term
+/// frequencies of each document are summed while streaming the postings, to replace or verify
+/// the lengths of the records written after them.
+///
+/// # Errors
+///
+/// Returns an error in the same cases as [`ciff_to_pisa`], and when:
+/// - any document ID exceeds the number of documents while computing scores,
+/// - lengths are recomputed with scores, without postings, or when resuming,
+/// - verified lengths differ from the sums of term frequencies, once all outputs are written.
+pub fn ciff_to_pisa_with_options(
+    input: &Path,
+    output: &Path,
+    options: &CiffToPisaOptions,
+) -> Result<()> {
+    let mut io = options.io_config(output)?;
+    let (header, header_end) = read_header_at_start(input, &io)?;
+    let remap = document_remap(input, &header, options, &io)?;
+    let num_documents = remap
+        .as_ref()
+        .map_or(header.num_documents, DocumentRemap::num_kept);
+    let counter = length_counter(num_documents, options)?;
+    if options.documents_only {
+        write_documents_first(input, output, remap.as_ref(), &io)?;
+        return io.save_manifest();
+    }
+    let fingerprint = Fingerprint::new(input, options)?;
     println!("{}", header);
+    let (threads, queue_depth) = postings_parallelism(&header, options, &mut io)?;
+    let checkpoint_path = Checkpoint::path(output);
+    let resumed = load_checkpoint(&checkpoint_path, &fingerprint, num_documents, options)?;
+
+    let lengths = match (options.scores, &resumed) {
+        (None, _) => None,
+        // Document lengths were written before the checkpoint.
+        (Some(_), Some(_)) => Some(read_sizes(output, num_documents, &io)?),
+        (Some(_), None) => Some(write_documents_first(input, output, remap.as_ref(), &io)?),
+    };
+    let list_scorer = list_scorer(lengths.as_deref(), options, output, &io)?;
+    let mut outputs = PostingsOutputs::open(output, num_documents, options, resumed.as_ref(), &io)?;
+    let bitmap_encoder = options
+        .bitmaps
+        .map(|bitmap_options| BitmapEncoder::new(bitmap_options, num_documents))
+        .transpose()?;
 
     eprintln!("Processing postings");
-    encode_u32_sequence(&mut documents, 1, [header.num_documents].iter())?;
-    let progress = ProgressBar::new(u64::try_from(header.num_postings_lists)?);
+    let mut position =
+        resumed.unwrap_or_else(|| Checkpoint::start(fingerprint, header_end, num_documents));
+    let (start, first_list) = (position.input_offset, position.lists);
+    let mut ciff_reader = io_backend::open_input_at(input, start, &io)?;
+    let mut input = CodedInputStream::from_buffered_reader(&mut ciff_reader);
+    let progress = ProgressBar::new(u64::from(header.num_postings_lists));
     progress.set_style(pb_style());
     progress.set_draw_delta(10);
-    for _ in 0..header.num_postings_lists {
-        write_posting_list(
-            &input.read_message::<PostingsList>()?,
-            &mut documents,
-            &mut frequencies,
-            &mut terms,
-        )?;
-        progress.inc(1);
-    }
+    progress.set_position(u64::from(first_list));
+    // Each message comes with the input offset following it, where a checkpoint may resume.
+    let messages = (first_list..header.num_postings_lists).map(|_| {
+        let message = read_raw_message(&mut input)?;
+        Ok((message, start + input.pos()))
+    });
+    let mut last_checkpoint = Instant::now();
+    parallel::map_ordered(
+        threads,
+        queue_depth,
+        messages,
+        |(message, end)| {
+            let encoded = encode_posting_list(
+                &message,
+                list_scorer.as_ref(),
+                bitmap_encoder.as_ref(),
+                remap.as_ref(),
+                counter.as_ref(),
+            )?;
+            Ok((encoded, end))
+        },
+        |(encoded, end)| {
+            if let Some(encoded) = encoded {
+                outputs.write(position.terms, &encoded)?;
+                position.terms += 1;
+            }
+            position.lists += 1;
+            position.input_offset = end;
+            progress.inc(1);
+            if options
+                .checkpoint_interval
+                .is_some_and(|interval| last_checkpoint.elapsed() >= interval)
+            {
+                outputs.save_checkpoint(&checkpoint_path, &mut position)?;
+                last_checkpoint = Instant::now();
+            }
+            Ok(())
+        },
+    )?;
     progress.finish();
+    let checkpoint = options.checkpoint_interval.map(|_| &checkpoint_path);
+    outputs.finish(checkpoint, &mut position)?;
 
-    documents.flush()?;
-    frequencies.flush()?;
-    terms.flush()?;
-
-    eprintln!("Processing document lengths");
-    let mut sizes = BufWriter::new(File::create(format!("{}.sizes", output.display()))?);
-    let mut trecids = BufWriter::new(File::create(format!("{}.documents", output.display()))?);
-
-    let progress = ProgressBar::new(u64::from(header.num_documents));
-    progress.set_style(pb_style());
-    progress.set_draw_delta(u64::from(header.num_documents) / 100);
-    sizes.write_all(&header.num_documents.to_le_bytes())?;
-
-    for docs_seen in 0..header.num_documents {
-        let doc_record = input.read_message::<DocRecord>()?;
-
-        let docid: u32 = doc_record
-            .get_docid()
-            .to_u32()
-            .ok_or_else(|| anyhow!("Cannot cast docid to u32: {}", doc_record.get_docid()))?;
-
-        let trecid = doc_record.get_collection_docid();
-        let length: u32 = doc_record.get_doclength().to_u32().ok_or_else(|| {
-            anyhow!(
-                "Cannot cast doc length to u32: {}",
-                doc_record.get_doclength()
-            )
-        })?;
-
-        if docid != docs_seen {
-            anyhow::bail!("Document sizes must come in order");
-        }
-
-        sizes.write_all(&length.to_le_bytes())?;
-        writeln!(trecids, "{}", trecid)?;
-        progress.inc(1);
+    let recomputed = counter.map(LengthCounter::finish).transpose()?;
+    let lengths = match lengths {
+        Some(lengths) => lengths,
+        None => write_documents(
+            header.num_documents,
+            || Ok(input.read_message::<DocRecord>()?),
+            remap.as_ref(),
+            recomputed
+                .as_deref()
+                .filter(|_| options.document_lengths.replaces_records()),
+            output,
+            &io,
+        )?,
+    };
+    io.save_manifest()?;
+    Checkpoint::remove(&checkpoint_path)?;
+    if let (DocumentLengths::Verify, Some(recomputed)) = (options.document_lengths, &recomputed) {
+        verify_lengths(&lengths, recomputed)?;
     }
-    progress.finish();
-
     Ok(())
 }
 
@@ -256,8 +966,16 @@ fn read_document_count(
         .ok_or_else(invalid)
 }
 
-fn header(documents_bytes: &[u8], sizes_bytes: &[u8], description: &str) -> Result<proto::Header> {
+fn header(
+    documents_bytes: &[u8],
+    sizes_bytes: &[u8],
+    description: &str,
+    mut drop_behind: Option<MappedDropBehind<'_>>,
+    throttle: Option<&Throttle>,
+    remap: Option<&DocumentRemap>,
+) -> Result<proto::Header> {
     let mut num_postings_lists = 0;
+    let kept = |docid: u32| remap.is_none_or(|remap| remap.get(docid).is_some());
 
     eprintln!("Collecting posting lists statistics");
     let progress = ProgressBar::new(documents_bytes.len() as u64);
@@ -266,20 +984,33 @@ fn header(documents_bytes: &[u8], sizes_bytes: &[u8], description: &str) -> Resu
     let mut collection = BinaryCollection::try_from(documents_bytes)?;
     let num_documents = read_document_count(&mut collection)?;
     for sequence in collection {
-        num_postings_lists += 1;
         let sequence = sequence?;
+        // Lists of deleted documents only are dropped.
+        if remap.is_none() || sequence.iter().any(kept) {
+            num_postings_lists += 1;
+        }
         progress.inc((sequence.bytes().len() + 4) as u64);
+        if let Some(throttle) = throttle {
+            throttle.acquire(Direction::Read, sequence.bytes().len() + 4);
+        }
+        if let Some(drop_behind) = drop_behind.as_mut() {
+            drop_behind.read_to(end_offset(documents_bytes, &sequence))?;
+        }
     }
     progress.finish();
+    drop(drop_behind);
 
     eprintln!("Computing average document length");
     let progress = ProgressBar::new(u64::from(num_documents));
     progress.set_style(pb_style());
     let doclen_sum: i64 = sizes(sizes_bytes)?
         .iter()
-        .map(i64::from)
+        .zip(0..)
+        .filter(|&(_, docid)| kept(docid))
+        .map(|(length, _)| i64::from(length))
         .progress_with(progress)
         .sum();
+    let num_documents = remap.map_or(num_documents, DocumentRemap::num_kept);
 
     let mut header = proto::Header::default();
     header.set_version(1);
@@ -290,7 +1021,7 @@ fn header(documents_bytes: &[u8], sizes_bytes: &[u8], description: &str) -> Resu
     header.set_num_docs(num_documents as i32);
     header.set_total_docs(num_documents as i32);
     #[allow(clippy::cast_precision_loss)]
-    header.set_average_doclength(doclen_sum as f64 / f64::from(num_documents));
+    header.set_average_doclength(doclen_sum as f64 / f64::from(num_documents.max(1)));
     Ok(header)
 }
 
@@ -300,9 +1031,17 @@ fn sizes(memory: &[u8]) -> std::result::Result<BinarySequence<'_>, InvalidFormat
         .ok_or_else(|| InvalidFormat::new("sizes collection is empty"))?
 }
 
-fn write_sizes(sizes_mmap: &Mmap, titles_file: &File, out: &mut CodedOutputStream) -> Result<()> {
+fn write_sizes(
+    sizes_mmap: &Mmap,
+    titles_file: &File,
+    out: &mut CodedOutputStream,
+    remap: Option<&DocumentRemap>,
+) -> Result<()> {
     let titles = BufReader::new(titles_file);
-    for ((docid, size), title) in sizes(sizes_mmap)?.iter().enumerate().zip(titles.lines()) {
+    for ((size, docid), title) in sizes(sizes_mmap)?.iter().zip(0..).zip(titles.lines()) {
+        let Some(docid) = remap.map_or(Some(docid), |remap| remap.get(docid)) else {
+            continue;
+        };
         let mut document = DocRecord::default();
         document.set_docid(docid as i32);
         document.set_collection_docid(title?);
@@ -312,11 +1051,25 @@ fn write_sizes(sizes_mmap: &Mmap, titles_file: &File, out: &mut CodedOutputStrea
     Ok(())
 }
 
+/// Inputs of [`write_postings`] to drop from the page cache while they are processed.
+struct PostingsDropBehind<'a> {
+    documents: MappedDropBehind<'a>,
+    frequencies: MappedDropBehind<'a>,
+}
+
+/// Offset of the end of `sequence` within `memory`.
+fn end_offset(memory: &[u8], sequence: &BinarySequence<'_>) -> usize {
+    sequence.bytes().as_ptr() as usize + sequence.bytes().len() - memory.as_ptr() as usize
+}
+
 fn write_postings(
     documents_mmap: &Mmap,
     frequencies_mmap: &Mmap,
     terms_file: &File,
     out: &mut CodedOutputStream,
+    mut drop_behind: Option<PostingsDropBehind<'_>>,
+    throttle: Option<&Throttle>,
+    remap: Option<&DocumentRemap>,
 ) -> Result<()> {
     let mut documents = BinaryCollection::try_from(&documents_mmap[..])?;
     let num_documents = u64::from(read_document_count(&mut documents)?);
@@ -332,12 +1085,16 @@ fn write_postings(
         .zip(terms.lines())
         .progress_with(progress)
     {
+        let (term_documents, term_frequencies) = (term_documents?, term_frequencies?);
         let mut posting_list = PostingsList::default();
         posting_list.set_term(term?);
         let mut count = 0;
         let mut sum = 0;
         let mut last_doc = 0;
-        for (docid, frequency) in term_documents?.iter().zip(term_frequencies?.iter()) {
+        for (docid, frequency) in term_documents.iter().zip(term_frequencies.iter()) {
+            let Some(docid) = remap.map_or(Some(docid), |remap| remap.get(docid)) else {
+                continue;
+            };
             let mut posting = Posting::default();
             posting.set_docid(docid as i32 - last_doc);
             posting.set_tf(frequency as i32);
@@ -348,7 +1105,21 @@ fn write_postings(
         }
         posting_list.set_df(count);
         posting_list.set_cf(sum);
-        out.write_message_no_tag(&posting_list)?;
+        if count > 0 || remap.is_none() {
+            out.write_message_no_tag(&posting_list)?;
+        }
+        if let Some(throttle) = throttle {
+            let length = term_documents.bytes().len() + term_frequencies.bytes().len();
+            throttle.acquire(Direction::Read, length + 8);
+        }
+        if let Some(drop_behind) = drop_behind.as_mut() {
+            drop_behind
+                .documents
+                .read_to(end_offset(documents_mmap, &term_documents))?;
+            drop_behind
+                .frequencies
+                .read_to(end_offset(frequencies_mmap, &term_frequencies))?;
+        }
     }
     Ok(())
 }
@@ -368,48 +1139,123 @@ pub fn pisa_to_ciff(
     output: &Path,
     description: &str,
 ) -> Result<()> {
-    pisa_to_ciff_from_paths(
-        &PathBuf::from(format!("{}.docs", collection_input.display())),
-        &PathBuf::from(format!("{}.freqs", collection_input.display())),
-        &PathBuf::from(format!("{}.sizes", collection_input.display())),
+    pisa_to_ciff_with_options(
+        collection_input,
         terms_input,
         titles_input,
         output,
         description,
+        &PisaToCiffOptions::default(),
     )
 }
 
-fn pisa_to_ciff_from_paths(
-    documents_path: &Path,
-    frequencies_path: &Path,
-    sizes_path: &Path,
-    terms_path: &Path,
-    titles_path: &Path,
+/// Options of [`pisa_to_ciff_with_options`].
+#[derive(Debug, Clone, Default)]
+pub struct PisaToCiffOptions {
+    /// If set, inputs are dropped from the page cache once processed, and the output is written
+    /// back as it goes, so that the conversion does not evict other cached data.
+    pub drop_behind: bool,
+    /// Limits on read and write bandwidth. Reads of memory-mapped inputs are accounted for
+    /// as they are processed.
+    pub throttle: ThrottleOptions,
+    /// If set, CRC32C checksums of the output are computed while writing it, and saved to
+    /// `{output}.manifest`, see [`verify_manifest`].
+    pub manifest: bool,
+    /// If set, these documents are removed, and the remaining ones are renumbered densely in
+    /// their original order.
+    pub deletions: Option<Deletions>,
+}
+
+/// Converts a PISA "binary collection" to a CIFF index, as [`pisa_to_ciff`] does, with
+/// additional `options`.
+///
+/// # Errors
+///
+/// Returns an error in the same cases as [`pisa_to_ciff`].
+pub fn pisa_to_ciff_with_options(
+    collection_input: &Path,
+    terms_input: &Path,
+    titles_input: &Path,
     output: &Path,
     description: &str,
+    options: &PisaToCiffOptions,
 ) -> Result<()> {
-    let documents_file = File::open(documents_path)?;
-    let frequencies_file = File::open(frequencies_path)?;
-    let sizes_file = File::open(sizes_path)?;
-    let terms_file = File::open(terms_path)?;
-    let titles_file = File::open(titles_path)?;
+    let input_path = |extension: &str| format!("{}.{}", collection_input.display(), extension);
+    let documents_file = File::open(input_path("docs"))?;
+    let frequencies_file = File::open(input_path("freqs"))?;
+    let sizes_file = File::open(input_path("sizes"))?;
+    let terms_file = File::open(terms_input)?;
+    let titles_file = File::open(titles_input)?;
 
     let documents_mmap = unsafe { Mmap::map(&documents_file)? };
     let frequencies_mmap = unsafe { Mmap::map(&frequencies_file)? };
     let sizes_mmap = unsafe { Mmap::map(&sizes_file)? };
+    let remap = match &options.deletions {
+        Some(deletions) => {
+            let lengths: Vec<u32> = sizes(&sizes_mmap)?.iter().collect();
+            let num_documents = u32::try_from(lengths.len())?;
+            Some(DocumentRemap::new(
+                deletions,
+                num_documents,
+                Some(&lengths),
+            )?)
+        }
+        None => None,
+    };
 
-    let mut writer = BufWriter::new(File::create(output)?);
+    let io = IoConfig::new(
+        IoBackend::Blocking,
+        options.drop_behind,
+        &options.throttle,
+        output,
+        options.manifest,
+    )?;
+    let mut writer = io_backend::create_output(output, &io)?;
     let mut out = CodedOutputStream::new(&mut writer);
 
-    let header = header(&documents_mmap[..], &sizes_mmap[..], description)?;
+    let sizes_drop_behind = if options.drop_behind {
+        Some(MappedDropBehind::new(&sizes_mmap, &sizes_file))
+    } else {
+        None
+    };
+    let header = header(
+        &documents_mmap[..],
+        &sizes_mmap[..],
+        description,
+        if options.drop_behind {
+            Some(MappedDropBehind::new(&documents_mmap, &documents_file))
+        } else {
+            None
+        },
+        io.throttle.as_deref(),
+        remap.as_ref(),
+    )?;
     out.write_message_no_tag(&header)?;
 
-    write_postings(&documents_mmap, &frequencies_mmap, &terms_file, &mut out)?;
-    write_sizes(&sizes_mmap, &titles_file, &mut out)?;
+    let drop_behind = if options.drop_behind {
+        Some(PostingsDropBehind {
+            documents: MappedDropBehind::new(&documents_mmap, &documents_file),
+            frequencies: MappedDropBehind::new(&frequencies_mmap, &frequencies_file),
+        })
+    } else {
+        None
+    };
+    write_postings(
+        &documents_mmap,
+        &frequencies_mmap,
+        &terms_file,
+        &mut out,
+        drop_behind,
+        io.throttle.as_deref(),
+        remap.as_ref(),
+    )?;
+    write_sizes(&sizes_mmap, &titles_file, &mut out, remap.as_ref())?;
+    drop(sizes_drop_behind);
 
     out.flush()?;
-
-    Ok(())
+    drop(out);
+    drop(writer);
+    io.save_manifest()
 }
 
 #[cfg(test)]
@@ -493,4 +1339,31 @@ mod test {
         assert!(Header::from_stream(&mut input).is_err());
         Ok(())
     }
+
+    #[test]
+    fn test_delete_all_documents() -> Result<()> {
+        let input = Path::new("tests/test_data/toy-complete-20200309.ciff");
+        let temp = tempfile::TempDir::new()?;
+        let collection = temp.path().join("coll");
+        ciff_to_pisa(input, &collection)?;
+        let output = temp.path().join("empty.ciff");
+        let options = PisaToCiffOptions {
+            deletions: Some(Deletions::from_docids(0..3)),
+            ..PisaToCiffOptions::default()
+        };
+        pisa_to_ciff_with_options(
+            &collection,
+            &temp.path().join("coll.terms"),
+            &temp.path().join("coll.documents"),
+            &output,
+            "",
+            &options,
+        )?;
+        let mut scanner = scan::MessageScanner::open(&output, &IoConfig::default())?;
+        let header = Header::from_protobuf(scanner.read_message()?)?;
+        assert_eq!(header.num_documents, 0);
+        assert_eq!(header.protobuf_header.get_num_postings_lists(), 0);
+        assert!(header.protobuf_header.get_average_doclength().abs() < f64::EPSILON);
+        Ok(())
+    }
 }
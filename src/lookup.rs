@@ -0,0 +1,502 @@
+//! Random access to the postings lists of CIFF files, for services and tools that fetch a few
+//! lists repeatedly rather than converting the whole file.
+//!
+//! Opening a file scans it once, reading only the start of each list, to index the byte range
+//! of each term. A list is then fetched with a single positioned read and decoded to document
+//! IDs and frequencies, which are kept in a concurrent cache bounded in bytes. The cache is
+//! split into shards by term, each behind its own lock and evicting its least recently used
+//! lists, so that threads looking up different terms rarely contend. Each shard keeps to its
+//! share of the capacity, except that a list larger than the share may be cached alone, as long
+//! as all shards together stay within the capacity.
+
+use crate::filter::read_list_start;
+use crate::io_backend::IoConfig;
+use crate::scan::MessageScanner;
+use crate::{pb_style, Header, PostingsList, Result};
+use anyhow::{anyhow, bail, Context};
+use indicatif::ProgressBar;
+use protobuf::CodedInputStream;
+use std::collections::{BTreeMap, HashMap};
+use std::convert::TryFrom;
+use std::fmt;
+use std::fs::File;
+use std::ops::Range;
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+
+/// Bytes accounted for each cached list in addition to its postings.
+const ENTRY_OVERHEAD: usize = 64;
+
+/// Options of [`CiffReader::open`].
+#[derive(Debug, Clone)]
+pub struct CiffReaderOptions {
+    /// Maximum number of bytes of decoded lists kept in the cache.
+    pub cache_bytes: usize,
+    /// Number of independently locked shards of the cache.
+    pub cache_shards: usize,
+}
+
+impl Default for CiffReaderOptions {
+    fn default() -> Self {
+        Self {
+            cache_bytes: 256 << 20,
+            cache_shards: 16,
+        }
+    }
+}
+
+/// Decoded postings list.
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct DecodedPostings {
+    /// Document IDs, in increasing order.
+    pub docids: Vec<u32>,
+    /// Term frequencies, aligned with the document IDs.
+    pub tfs: Vec<u32>,
+}
+
+impl DecodedPostings {
+    fn decode(list: &PostingsList) -> Result<Self> {
+        let mut docid = 0_u32;
+        let mut docids = Vec::with_capacity(list.get_postings().len());
+        let mut tfs = Vec::with_capacity(list.get_postings().len());
+        for posting in list.get_postings() {
+            docid = u32::try_from(posting.get_docid())
+                .ok()
+                .and_then(|gap| docid.checked_add(gap))
+                .ok_or_else(|| anyhow!("Invalid document ID in {}", list.get_term()))?;
+            docids.push(docid);
+            tfs.push(
+                u32::try_from(posting.get_tf())
+                    .with_context(|| format!("Negative frequency in {}", list.get_term()))?,
+            );
+        }
+        Ok(Self { docids, tfs })
+    }
+
+    /// Bytes accounted for the list in the cache.
+    fn size(&self) -> usize {
+        ENTRY_OVERHEAD + 4 * (self.docids.len() + self.tfs.len())
+    }
+}
+
+/// Counters of the cache of a [`CiffReader`].
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct CacheStats {
+    /// Lookups served from the cache.
+    pub hits: u64,
+    /// Lookups that read the list from the file.
+    pub misses: u64,
+    /// Lists evicted to make room for others.
+    pub evictions: u64,
+    /// Lists currently cached.
+    pub lists: u64,
+    /// Bytes currently cached.
+    pub bytes: u64,
+}
+
+impl CacheStats {
+    /// Fraction of lookups served from the cache, or 0 before any lookup.
+    #[must_use]
+    #[allow(clippy::cast_precision_loss)]
+    pub fn hit_rate(&self) -> f64 {
+        let lookups = self.hits + self.misses;
+        if lookups == 0 {
+            0.0
+        } else {
+            self.hits as f64 / lookups as f64
+        }
+    }
+}
+
+impl fmt::Display for CacheStats {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "{} hits, {} misses ({:.1}% hit rate), {} evictions, {} lists in {} bytes cached",
+            self.hits,
+            self.misses,
+            100.0 * self.hit_rate(),
+            self.evictions,
+            self.lists,
+            self.bytes
+        )
+    }
+}
+
+/// Bytes cached by all shards, bounded by the capacity of the cache.
+struct Budget {
+    capacity: usize,
+    used: AtomicUsize,
+}
+
+impl Budget {
+    fn new(capacity: usize) -> Self {
+        Self {
+            capacity,
+            used: AtomicUsize::new(0),
+        }
+    }
+
+    /// Reserves `bytes` if they fit in the capacity.
+    fn reserve(&self, bytes: usize) -> bool {
+        self.used
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |used| {
+                Some(used + bytes).filter(|&used| used <= self.capacity)
+            })
+            .is_ok()
+    }
+
+    fn release(&self, bytes: usize) {
+        self.used.fetch_sub(bytes, Ordering::AcqRel);
+    }
+}
+
+/// Lists of a shard of the cache, by term ID, with their last use.
+#[derive(Default)]
+struct Shard {
+    lists: HashMap<u32, (Arc<DecodedPostings>, u64)>,
+    /// Term IDs by last use, least recent first.
+    recency: BTreeMap<u64, u32>,
+    clock: u64,
+    bytes: usize,
+}
+
+impl Shard {
+    fn get(&mut self, term_id: u32) -> Option<Arc<DecodedPostings>> {
+        self.clock += 1;
+        let (list, last_use) = self.lists.get_mut(&term_id)?;
+        self.recency.remove(last_use);
+        *last_use = self.clock;
+        self.recency.insert(self.clock, term_id);
+        Some(Arc::clone(list))
+    }
+
+    /// Inserts a list, evicting others to fit in the `share` of the shard, unless the list is
+    /// alone, and in the `budget` of all shards. Returns the number of lists evicted; the list
+    /// is not inserted if the shard runs out of lists to evict before it fits.
+    fn insert(
+        &mut self,
+        term_id: u32,
+        list: Arc<DecodedPostings>,
+        share: usize,
+        budget: &Budget,
+    ) -> u64 {
+        let size = list.size();
+        if size > budget.capacity || self.lists.contains_key(&term_id) {
+            return 0;
+        }
+        let mut evictions = 0;
+        while !((self.bytes + size <= share || self.lists.is_empty()) && budget.reserve(size)) {
+            let Some((_, evicted)) = self.recency.pop_first() else {
+                return evictions;
+            };
+            if let Some((evicted, _)) = self.lists.remove(&evicted) {
+                self.bytes -= evicted.size();
+                budget.release(evicted.size());
+                evictions += 1;
+            }
+        }
+        self.clock += 1;
+        self.bytes += size;
+        self.recency.insert(self.clock, term_id);
+        self.lists.insert(term_id, (list, self.clock));
+        evictions
+    }
+}
+
+/// Concurrent cache of decoded lists, bounded in bytes, split into shards by term ID.
+struct ListCache {
+    shards: Vec<Mutex<Shard>>,
+    shard_capacity: usize,
+    budget: Budget,
+    hits: AtomicU64,
+    misses: AtomicU64,
+    evictions: AtomicU64,
+}
+
+impl ListCache {
+    fn new(options: &CiffReaderOptions) -> Self {
+        let num_shards = options.cache_shards.max(1);
+        Self {
+            shards: (0..num_shards).map(|_| Mutex::default()).collect(),
+            shard_capacity: options.cache_bytes / num_shards,
+            budget: Budget::new(options.cache_bytes),
+            hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+            evictions: AtomicU64::new(0),
+        }
+    }
+
+    fn shard(&self, term_id: u32) -> &Mutex<Shard> {
+        &self.shards[term_id as usize % self.shards.len()]
+    }
+
+    /// Returns the cached list of `term_id`, or loads and caches it. The shard is not locked
+    /// while loading, so that other lists of the shard are served meanwhile.
+    fn get_or_load<F>(&self, term_id: u32, load: F) -> Result<Arc<DecodedPostings>>
+    where
+        F: FnOnce() -> Result<DecodedPostings>,
+    {
+        let shard = self.shard(term_id);
+        if let Some(list) = shard.lock().expect("poisoned cache").get(term_id) {
+            self.hits.fetch_add(1, Ordering::Relaxed);
+            return Ok(list);
+        }
+        self.misses.fetch_add(1, Ordering::Relaxed);
+        let list = Arc::new(load()?);
+        let evictions = shard.lock().expect("poisoned cache").insert(
+            term_id,
+            Arc::clone(&list),
+            self.shard_capacity,
+            &self.budget,
+        );
+        self.evictions.fetch_add(evictions, Ordering::Relaxed);
+        Ok(list)
+    }
+
+    fn stats(&self) -> CacheStats {
+        let mut stats = CacheStats {
+            hits: self.hits.load(Ordering::Relaxed),
+            misses: self.misses.load(Ordering::Relaxed),
+            evictions: self.evictions.load(Ordering::Relaxed),
+            ..CacheStats::default()
+        };
+        for shard in &self.shards {
+            let shard = shard.lock().expect("poisoned cache");
+            stats.lists += shard.lists.len() as u64;
+            stats.bytes += shard.bytes as u64;
+        }
+        stats
+    }
+}
+
+/// Reads `buffer.len()` bytes at `offset` without moving the file position, so that threads
+/// share the file.
+#[cfg(unix)]
+fn read_at(file: &File, buffer: &mut [u8], offset: u64) -> std::io::Result<()> {
+    std::os::unix::fs::FileExt::read_exact_at(file, buffer, offset)
+}
+
+#[cfg(windows)]
+fn read_at(file: &File, mut buffer: &mut [u8], mut offset: u64) -> std::io::Result<()> {
+    use std::os::windows::fs::FileExt;
+    while !buffer.is_empty() {
+        match file.seek_read(buffer, offset)? {
+            0 => return Err(std::io::ErrorKind::UnexpectedEof.into()),
+            read => {
+                buffer = &mut buffer[read..];
+                offset += read as u64;
+            }
+        }
+    }
+    Ok(())
+}
+
+/// CIFF file opened for fetching postings lists by term, from any number of threads.
+pub struct CiffReader {
+    file: File,
+    header: Header,
+    term_ids: HashMap<String, u32>,
+    /// Byte range of each list, including its length.
+    ranges: Vec<Range<u64>>,
+    cache: ListCache,
+}
+
+impl CiffReader {
+    /// Opens a CIFF file, and indexes the byte range of each postings list. Only the start of
+    /// each list is read; the rest is skipped with a seek.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error when an IO error occurs, the header or a list is malformed, or two
+    /// lists have the same term.
+    pub fn open(path: &Path, options: &CiffReaderOptions) -> Result<Self> {
+        let mut scanner = MessageScanner::open(path, &IoConfig::default())?;
+        let header = Header::from_protobuf(scanner.read_message()?)?;
+        eprintln!("Indexing postings lists");
+        let progress = ProgressBar::new(u64::from(header.num_postings_lists));
+        progress.set_style(pb_style());
+        progress.set_draw_delta(u64::from(header.num_postings_lists) / 100);
+        let mut buffer = Vec::new();
+        let mut term_ids = HashMap::with_capacity(header.num_postings_lists as usize);
+        let mut ranges = Vec::with_capacity(header.num_postings_lists as usize);
+        for term_id in 0..header.num_postings_lists {
+            let (start, term, _, remaining) = read_list_start(&mut scanner, &mut buffer)?;
+            scanner.skip_bytes(remaining)?;
+            ranges.push(start..scanner.offset());
+            if let Some(first) = term_ids.insert(term, term_id) {
+                bail!("Lists {} and {} have the same term", first, term_id);
+            }
+            progress.inc(1);
+        }
+        progress.finish();
+        Ok(Self {
+            file: File::open(path).with_context(|| format!("Unable to open {}", path.display()))?,
+            header,
+            term_ids,
+            ranges,
+            cache: ListCache::new(options),
+        })
+    }
+
+    /// Number of documents in the collection.
+    #[must_use]
+    pub fn num_documents(&self) -> u32 {
+        self.header.num_documents
+    }
+
+    /// Number of postings lists.
+    #[must_use]
+    pub fn num_lists(&self) -> u32 {
+        self.header.num_postings_lists
+    }
+
+    /// ID of `term`, which is the position of its list in the file.
+    #[must_use]
+    pub fn term_id(&self, term: &str) -> Option<u32> {
+        self.term_ids.get(term).copied()
+    }
+
+    /// Postings list of `term`, or `None` if the term has no list.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error when an IO error occurs, or the list is malformed.
+    pub fn list(&self, term: &str) -> Result<Option<Arc<DecodedPostings>>> {
+        self.term_id(term)
+            .map(|term_id| self.list_by_id(term_id))
+            .transpose()
+    }
+
+    /// Postings list of `term_id`, served from the cache or read with a single positioned read.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error when `term_id` is out of bounds, an IO error occurs, or the list is
+    /// malformed.
+    pub fn list_by_id(&self, term_id: u32) -> Result<Arc<DecodedPostings>> {
+        let range = self
+            .ranges
+            .get(term_id as usize)
+            .ok_or_else(|| anyhow!("Term ID out of bounds: {}", term_id))?;
+        self.cache.get_or_load(term_id, || {
+            let mut bytes = vec![0; usize::try_from(range.end - range.start)?];
+            read_at(&self.file, &mut bytes, range.start)?;
+            let list = CodedInputStream::from_bytes(&bytes).read_message::<PostingsList>()?;
+            DecodedPostings::decode(&list)
+        })
+    }
+
+    /// Counters of the cache.
+    #[must_use]
+    pub fn cache_stats(&self) -> CacheStats {
+        self.cache.stats()
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn list(length: usize) -> Arc<DecodedPostings> {
+        Arc::new(DecodedPostings {
+            docids: vec![0; length],
+            tfs: vec![1; length],
+        })
+    }
+
+    #[test]
+    fn test_shard_eviction() {
+        // Each list of 8 postings takes 128 bytes.
+        let budget = Budget::new(300);
+        let mut shard = Shard::default();
+        assert_eq!(shard.insert(0, list(8), 300, &budget), 0);
+        assert_eq!(shard.insert(1, list(8), 300, &budget), 0);
+        assert!(shard.get(0).is_some());
+        assert_eq!(shard.insert(2, list(8), 300, &budget), 1);
+        assert!(shard.get(1).is_none());
+        assert!(shard.get(0).is_some());
+        assert!(shard.get(2).is_some());
+        assert_eq!(shard.bytes, 256);
+        assert_eq!(budget.used.load(Ordering::Relaxed), 256);
+        // Lists larger than the whole cache are not cached.
+        assert_eq!(shard.insert(3, list(100), 300, &budget), 0);
+        assert!(shard.get(3).is_none());
+        assert_eq!(shard.lists.len(), shard.recency.len());
+    }
+
+    #[test]
+    fn test_shard_over_its_share() {
+        // A list of 100 postings takes 864 bytes, more than the share of its shard.
+        let budget = Budget::new(1024);
+        let mut shard = Shard::default();
+        let mut other = Shard::default();
+        assert_eq!(shard.insert(0, list(8), 300, &budget), 0);
+        assert_eq!(shard.insert(1, list(100), 300, &budget), 1);
+        assert!(shard.get(1).is_some());
+        assert_eq!(budget.used.load(Ordering::Relaxed), 864);
+        // Other shards still fit in the rest of the budget, but not beyond it.
+        assert_eq!(other.insert(2, list(8), 300, &budget), 0);
+        assert_eq!(other.insert(3, list(8), 300, &budget), 1);
+        assert_eq!(budget.used.load(Ordering::Relaxed), 992);
+        assert_eq!(other.insert(4, list(100), 300, &budget), 1);
+        assert!(other.get(4).is_none());
+        assert_eq!(budget.used.load(Ordering::Relaxed), 864);
+    }
+
+    #[test]
+    fn test_cache_stats() -> Result<()> {
+        let cache = ListCache::new(&CiffReaderOptions {
+            cache_bytes: 1024,
+            cache_shards: 2,
+        });
+        for term_id in &[0, 1, 0, 2, 0] {
+            cache.get_or_load(*term_id, || Ok((*list(8)).clone()))?;
+        }
+        assert!(cache
+            .get_or_load(5, || Err(anyhow!("Unreadable list")))
+            .is_err());
+        let stats = cache.stats();
+        assert_eq!((stats.hits, stats.misses, stats.evictions), (2, 4, 0));
+        assert_eq!((stats.lists, stats.bytes), (3, 384));
+        assert!((stats.hit_rate() - 1.0 / 3.0).abs() < 1e-9);
+
+        // Lists larger than the share of a shard are cached within the capacity.
+        let cache = ListCache::new(&CiffReaderOptions {
+            cache_bytes: 1024,
+            cache_shards: 16,
+        });
+        for term_id in &[0, 1, 0, 1] {
+            cache.get_or_load(*term_id, || Ok((*list(8)).clone()))?;
+        }
+        let stats = cache.stats();
+        assert_eq!((stats.hits, stats.misses), (2, 2));
+        assert_eq!((stats.lists, stats.bytes), (2, 256));
+        Ok(())
+    }
+
+    #[test]
+    fn test_duplicate_terms() -> Result<()> {
+        let temp = tempfile::TempDir::new()?;
+        let path = temp.path().join("duplicates.ciff");
+        let mut bytes = Vec::new();
+        {
+            let mut out = protobuf::CodedOutputStream::vec(&mut bytes);
+            let mut header = crate::proto::Header::default();
+            header.set_num_postings_lists(2);
+            out.write_message_no_tag(&header)?;
+            let mut list = PostingsList::default();
+            list.set_term("a".into());
+            out.write_message_no_tag(&list)?;
+            out.write_message_no_tag(&list)?;
+            out.flush()?;
+        }
+        std::fs::write(&path, bytes)?;
+        let error = CiffReader::open(&path, &CiffReaderOptions::default())
+            .err()
+            .expect("duplicate terms are rejected");
+        assert!(error.to_string().contains("same term"));
+        Ok(())
+    }
+}
@@ -0,0 +1,217 @@
+//! Memory budgets, so that conversions running under a hard memory limit, such as the cgroup
+//! limit of a container, stay under it instead of being killed, while still using the memory they
+//! are given.
+//!
+//! Converters size their parallelism, queues, I/O buffers, and in-memory runs from the budget,
+//! using upper bounds of the memory held by each item in flight.
+
+use crate::Result;
+use anyhow::bail;
+use std::convert::TryFrom;
+use std::fs;
+use std::path::{Path, PathBuf};
+
+/// Memory kept out of the budget for code, stacks, and small allocations.
+const RESERVE: u64 = 32 << 20;
+/// Values of cgroup v1 limits at or above this mean no limit.
+const UNLIMITED: u64 = 1 << 60;
+/// Smallest I/O buffer per file.
+const MIN_BUFFER: u64 = 64 << 10;
+
+/// Parses the contents of a cgroup `memory.max` (v2) or `memory.limit_in_bytes` (v1) file.
+fn parse_limit(contents: &str) -> Option<u64> {
+    let limit: u64 = contents.trim().parse().ok()?;
+    if limit < UNLIMITED {
+        Some(limit)
+    } else {
+        None
+    }
+}
+
+/// Files that may hold memory limits of the process, given the contents of `/proc/self/cgroup`:
+/// those of its cgroup and of all ancestors, in both the v2 and the v1 hierarchies.
+fn limit_files(cgroups: &str) -> Vec<PathBuf> {
+    let mut files = Vec::new();
+    for line in cgroups.lines() {
+        let mut fields = line.splitn(3, ':');
+        let (Some(_), Some(controllers), Some(path)) =
+            (fields.next(), fields.next(), fields.next())
+        else {
+            continue;
+        };
+        let (root, file) = if controllers.is_empty() {
+            (Path::new("/sys/fs/cgroup"), "memory.max")
+        } else if controllers
+            .split(',')
+            .any(|controller| controller == "memory")
+        {
+            (Path::new("/sys/fs/cgroup/memory"), "memory.limit_in_bytes")
+        } else {
+            continue;
+        };
+        let mut path = Path::new(path.trim_start_matches('/'));
+        loop {
+            files.push(root.join(path).join(file));
+            match path.parent() {
+                Some(parent) => path = parent,
+                None => break,
+            }
+        }
+    }
+    files
+}
+
+/// Memory limit of the cgroup of the process, including limits of its ancestors, if any.
+///
+/// Returns `None` if no limit is set, or if cgroups are not available, as on platforms other
+/// than Linux.
+#[must_use]
+pub fn cgroup_memory_limit() -> Option<u64> {
+    let cgroups = fs::read_to_string("/proc/self/cgroup").ok()?;
+    limit_files(&cgroups)
+        .iter()
+        .filter_map(|file| parse_limit(&fs::read_to_string(file).ok()?))
+        .min()
+}
+
+/// Peak resident set size of the process in bytes, if known.
+///
+/// Only available on Linux, where it is read from `/proc/self/status`.
+#[must_use]
+pub fn peak_rss() -> Option<u64> {
+    let status = fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|line| line.starts_with("VmHWM:"))?;
+    let kilobytes: u64 = line
+        .trim_start_matches("VmHWM:")
+        .trim()
+        .trim_end_matches("kB")
+        .trim()
+        .parse()
+        .ok()?;
+    Some(kilobytes << 10)
+}
+
+/// Memory available to a conversion under a limit, handed out to its buffers and queues.
+#[derive(Debug, Clone)]
+pub(crate) struct MemoryBudget {
+    limit: u64,
+    available: u64,
+}
+
+impl MemoryBudget {
+    /// Budget under `limit` bytes, keeping an eighth of it for allocator fragmentation.
+    pub(crate) fn new(limit: u64) -> Self {
+        Self {
+            limit,
+            available: limit.saturating_sub(RESERVE) / 8 * 7,
+        }
+    }
+
+    /// Bytes not yet handed out.
+    pub(crate) fn available(&self) -> u64 {
+        self.available
+    }
+
+    /// Sets aside `bytes` held for the whole conversion, such as document lengths.
+    pub(crate) fn reserve(&mut self, bytes: u64, what: &str) -> Result<()> {
+        if bytes > self.available {
+            bail!(
+                "Memory limit of {} MiB is too low to hold {} ({} MiB)",
+                self.limit >> 20,
+                what,
+                bytes >> 20
+            );
+        }
+        self.available -= bytes;
+        Ok(())
+    }
+
+    /// Sets aside I/O buffers for `files` files, at most an eighth of the budget, and returns
+    /// the buffer size per file, at most `max_size`.
+    pub(crate) fn buffers(&mut self, files: usize, max_size: usize) -> usize {
+        let files = u64::try_from(files.max(1)).unwrap_or(u64::MAX);
+        let per_file = (self.available / 8 / files)
+            .max(MIN_BUFFER)
+            .min(u64::try_from(max_size).unwrap_or(u64::MAX));
+        self.available = self.available.saturating_sub(per_file * files);
+        usize::try_from(per_file).unwrap_or(max_size)
+    }
+
+    /// Number of threads, at most `threads`, and queue depth, at most `4 * threads`, for
+    /// [`map_ordered`](crate::parallel::map_ordered) over items holding at most `item_bytes`,
+    /// which need `working_bytes` more while mapped.
+    ///
+    /// Each thread holds an item, its result, and its working memory, while each slot of the
+    /// queues holds an item or a result. Items that do not fit even on a single thread are
+    /// reported, as the bounds are worst cases.
+    pub(crate) fn parallelism(
+        &self,
+        threads: usize,
+        item_bytes: u64,
+        working_bytes: u64,
+    ) -> (usize, usize) {
+        let item_bytes = item_bytes.max(1);
+        let per_thread = 2 * item_bytes + working_bytes;
+        let per_slot = 2 * item_bytes;
+        let fitting = |threads: u64| self.available / threads.max(1) >= per_thread + per_slot;
+        let mut selected = threads.max(1);
+        while selected > 1 && !fitting(selected as u64) {
+            selected -= 1;
+        }
+        let remaining = self.available.saturating_sub(per_thread * selected as u64);
+        let queue_depth = usize::try_from(remaining / per_slot)
+            .unwrap_or(usize::MAX)
+            .clamp(1, 4 * selected);
+        if !fitting(1) {
+            eprintln!(
+                "WARNING: the largest items may exceed the memory limit of {} MiB",
+                self.limit >> 20
+            );
+        }
+        (selected, queue_depth)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_parse_limit() {
+        assert_eq!(parse_limit("1073741824\n"), Some(1 << 30));
+        assert_eq!(parse_limit("max\n"), None);
+        assert_eq!(parse_limit("9223372036854771712\n"), None);
+    }
+
+    #[test]
+    fn test_limit_files() {
+        let files = limit_files("12:cpu,cpuacct:/a\n11:memory:/docker/abc\n0::/job\n");
+        let expected: Vec<PathBuf> = vec![
+            "/sys/fs/cgroup/memory/docker/abc/memory.limit_in_bytes".into(),
+            "/sys/fs/cgroup/memory/docker/memory.limit_in_bytes".into(),
+            "/sys/fs/cgroup/memory/memory.limit_in_bytes".into(),
+            "/sys/fs/cgroup/job/memory.max".into(),
+            "/sys/fs/cgroup/memory.max".into(),
+        ];
+        assert_eq!(files, expected);
+        assert_eq!(
+            limit_files("0::/\n"),
+            vec![PathBuf::from("/sys/fs/cgroup/memory.max")]
+        );
+    }
+
+    #[test]
+    fn test_budget() {
+        let mut budget = MemoryBudget::new(RESERVE + (800 << 20));
+        assert_eq!(budget.available(), 700 << 20);
+        assert!(budget.reserve(1 << 40, "everything").is_err());
+        budget.reserve(100 << 20, "lengths").unwrap();
+        assert_eq!(budget.buffers(4, 1 << 20), 1 << 20);
+        assert_eq!(budget.available(), 596 << 20);
+        // Small items use all threads and the full queue depth.
+        assert_eq!(budget.parallelism(8, 1 << 20, 1 << 20), (8, 32));
+        // Large items limit both.
+        assert_eq!(budget.parallelism(8, 100 << 20, 100 << 20), (1, 1));
+        assert_eq!(budget.parallelism(8, 10 << 20, 10 << 20), (8, 17));
+    }
+}
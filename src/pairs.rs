@@ -0,0 +1,148 @@
+//! Precomputed intersections of postings lists of frequent query term pairs.
+
+use crate::intersect::intersect;
+use crate::postings::{read_lines, DocumentLists};
+use crate::query::parse_query;
+use crate::{encode_u32_sequence, parallel, pb_style, Result};
+use indicatif::ProgressBar;
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::{BufRead, BufWriter, Write};
+use std::path::{Path, PathBuf};
+
+/// Options of [`build_pair_index`].
+#[derive(Debug, Clone)]
+pub struct PairIndexOptions {
+    /// Number of most frequent pairs to precompute.
+    pub pairs: usize,
+    /// Number of threads intersecting lists.
+    pub threads: usize,
+}
+
+impl Default for PairIndexOptions {
+    fn default() -> Self {
+        Self {
+            pairs: 10_000,
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+        }
+    }
+}
+
+/// Counts how many queries contain each pair of distinct terms, as `(lower ID, higher ID)`.
+fn count_pairs<R: BufRead>(
+    queries: R,
+    lexicon: &HashMap<String, u32>,
+) -> Result<HashMap<(u32, u32), u64>> {
+    let mut counts = HashMap::new();
+    for (line_number, line) in queries.lines().enumerate() {
+        let (_, terms) = parse_query(&line?, line_number);
+        let mut term_ids: Vec<u32> = terms
+            .iter()
+            .filter_map(|term| lexicon.get(term).copied())
+            .collect();
+        term_ids.sort_unstable();
+        term_ids.dedup();
+        for (position, &first) in term_ids.iter().enumerate() {
+            for &second in &term_ids[position + 1..] {
+                *counts.entry((first, second)).or_insert(0) += 1;
+            }
+        }
+    }
+    Ok(counts)
+}
+
+/// Returns the `n` most frequent pairs with their counts, most frequent first,
+/// breaking ties by term IDs.
+fn top_pairs(counts: HashMap<(u32, u32), u64>, n: usize) -> Vec<((u32, u32), u64)> {
+    let mut pairs: Vec<_> = counts.into_iter().collect();
+    pairs.sort_unstable_by(|lhs, rhs| rhs.1.cmp(&lhs.1).then(lhs.0.cmp(&rhs.0)));
+    pairs.truncate(n);
+    pairs
+}
+
+/// Finds the most frequent term pairs in a query log and writes intersections of their
+/// postings lists.
+///
+/// Queries are read from `queries`, one per line, in the same format as
+/// [`run_queries`](crate::run_queries); terms missing from `{collection}.terms` are ignored.
+/// Lists are read from `{collection}.docs` and intersected in parallel. The output consists of:
+/// - `{output}.docs`: a binary collection of intersections, starting with the number of
+///   documents, like PISA's `.docs`;
+/// - `{output}.pairs`: the pair lexicon, with one line per intersection containing both terms
+///   and the number of queries containing the pair, separated by tabs.
+///
+/// # Errors
+///
+/// Returns an error when an IO error occurs or the collection is malformed, including when
+/// `{collection}.terms` does not have a term per list.
+pub fn build_pair_index(
+    collection: &Path,
+    queries: &Path,
+    output: &Path,
+    options: &PairIndexOptions,
+) -> Result<()> {
+    let path = |basename: &Path, extension: &str| {
+        PathBuf::from(format!("{}.{}", basename.display(), extension))
+    };
+    let documents = DocumentLists::open(&path(collection, "docs"))?;
+    let terms = read_lines(&path(collection, "terms"))?;
+    documents.check_terms(&terms)?;
+    let lexicon: HashMap<String, u32> = terms.iter().cloned().zip(0..).collect();
+
+    eprintln!("Counting query term pairs");
+    let queries = std::io::BufReader::new(File::open(queries)?);
+    let pairs = top_pairs(count_pairs(queries, &lexicon)?, options.pairs);
+
+    eprintln!("Intersecting {} pairs", pairs.len());
+    let mut lists = BufWriter::new(File::create(path(output, "docs"))?);
+    let mut lexicon = BufWriter::new(File::create(path(output, "pairs"))?);
+    encode_u32_sequence(&mut lists, 1, [documents.num_documents()])?;
+    let progress = ProgressBar::new(pairs.len() as u64);
+    progress.set_style(pb_style());
+    progress.set_draw_delta(pairs.len() as u64 / 100);
+    let threads = options.threads.max(1);
+    parallel::map_ordered(
+        threads,
+        4 * threads,
+        pairs.iter().map(Ok),
+        |&((first, second), count)| {
+            let intersection = intersect(&documents.decode(first), &documents.decode(second));
+            let mut encoded = Vec::with_capacity((intersection.len() + 1) * 4);
+            encode_u32_sequence(&mut encoded, intersection.len() as u32, &intersection)?;
+            Ok((first, second, count, encoded))
+        },
+        |(first, second, count, encoded)| {
+            lists.write_all(&encoded)?;
+            writeln!(
+                lexicon,
+                "{}\t{}\t{}",
+                terms[first as usize], terms[second as usize], count
+            )?;
+            progress.inc(1);
+            Ok(())
+        },
+    )?;
+    progress.finish();
+    lists.flush()?;
+    lexicon.flush()?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_count_pairs() -> Result<()> {
+        let lexicon: HashMap<String, u32> = vec![("a", 0), ("b", 1), ("c", 2)]
+            .into_iter()
+            .map(|(term, id)| (term.to_string(), id))
+            .collect();
+        let queries = "1:a b\n2:b a a\n3:c b a\n4:c x\n";
+        let counts = count_pairs(queries.as_bytes(), &lexicon)?;
+        assert_eq!(counts.len(), 3);
+        let top = top_pairs(counts, 2);
+        assert_eq!(top, vec![((0, 1), 3), ((0, 2), 1)]);
+        Ok(())
+    }
+}
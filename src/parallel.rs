@@ -0,0 +1,140 @@
+//! Order-preserving parallel processing of a stream of items.
+
+use crate::Result;
+use anyhow::anyhow;
+use std::collections::BTreeMap;
+use std::sync::mpsc::{sync_channel, Receiver};
+use std::sync::Mutex;
+
+fn next_item<T>(receiver: &Mutex<Receiver<T>>) -> Option<T> {
+    receiver.lock().unwrap().recv().ok()
+}
+
+/// Maps items of `input` with `map` on `threads` worker threads, and passes the results to `sink`
+/// in the original order.
+///
+/// Items are read from `input` on the calling thread, so it need not be `Send`, while `sink` runs
+/// on a dedicated thread. At most `queue_depth` items wait for a worker, and at most
+/// `queue_depth` results wait for the sink, which bounds the memory used by items in flight.
+///
+/// The first error returned by `input`, `map`, or `sink` stops the processing and is returned.
+pub(crate) fn map_ordered<T, U, I, F, S>(
+    threads: usize,
+    queue_depth: usize,
+    input: I,
+    map: F,
+    mut sink: S,
+) -> Result<()>
+where
+    T: Send,
+    U: Send,
+    I: IntoIterator<Item = Result<T>>,
+    F: Fn(T) -> Result<U> + Sync,
+    S: FnMut(U) -> Result<()> + Send,
+{
+    let threads = threads.max(1);
+    let queue_depth = queue_depth.max(1);
+    let (item_sender, item_receiver) = sync_channel::<(usize, T)>(queue_depth);
+    let item_receiver = Mutex::new(item_receiver);
+    let (result_sender, result_receiver) = sync_channel::<(usize, Result<U>)>(queue_depth);
+    std::thread::scope(|scope| {
+        for _ in 0..threads {
+            let result_sender = result_sender.clone();
+            let item_receiver = &item_receiver;
+            let map = &map;
+            scope.spawn(move || {
+                let mut closed = false;
+                while let Some((index, item)) = next_item(item_receiver) {
+                    // Once the sink is gone, keep draining items so that the input never blocks.
+                    if !closed {
+                        closed = result_sender.send((index, map(item))).is_err();
+                    }
+                }
+            });
+        }
+        drop(result_sender);
+        let sink = scope.spawn(move || -> Result<()> {
+            let mut pending = BTreeMap::new();
+            let mut next_index = 0;
+            for (index, result) in &result_receiver {
+                pending.insert(index, result);
+                while let Some(result) = pending.remove(&next_index) {
+                    next_index += 1;
+                    // On error, dropping the receiver stops the workers, and in turn the input.
+                    result.and_then(&mut sink)?;
+                }
+            }
+            Ok(())
+        });
+        let mut input_result = Ok(());
+        for (index, item) in input.into_iter().enumerate() {
+            match item {
+                Ok(item) => {
+                    if item_sender.send((index, item)).is_err() {
+                        break;
+                    }
+                }
+                Err(err) => {
+                    input_result = Err(err);
+                    break;
+                }
+            }
+            if sink.is_finished() {
+                break;
+            }
+        }
+        drop(item_sender);
+        sink.join().map_err(|_| anyhow!("Sink thread panicked"))??;
+        input_result
+    })
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_map_ordered_preserves_order() -> Result<()> {
+        let mut output = Vec::new();
+        map_ordered(
+            4,
+            2,
+            (0..1000_u32).map(Ok),
+            |n| Ok(n * 2),
+            |n| {
+                output.push(n);
+                Ok(())
+            },
+        )?;
+        assert_eq!(output, (0..1000).map(|n| n * 2).collect::<Vec<_>>());
+        Ok(())
+    }
+
+    #[test]
+    fn test_map_ordered_propagates_errors() {
+        let map_error = map_ordered(
+            3,
+            1,
+            (0..1000_u32).map(Ok),
+            |n| if n == 500 { Err(anyhow!("map")) } else { Ok(n) },
+            |_| Ok(()),
+        );
+        assert_eq!(map_error.unwrap_err().to_string(), "map");
+        let sink_error = map_ordered(3, 1, (0..1000_u32).map(Ok), Ok, |n| {
+            if n == 10 {
+                Err(anyhow!("sink"))
+            } else {
+                Ok(())
+            }
+        });
+        assert_eq!(sink_error.unwrap_err().to_string(), "sink");
+        let input_error = map_ordered(
+            3,
+            1,
+            (0..1000_u32).map(|n| if n == 7 { Err(anyhow!("input")) } else { Ok(n) }),
+            Ok,
+            |_| Ok(()),
+        );
+        assert_eq!(input_error.unwrap_err().to_string(), "input");
+    }
+}
@@ -12,7 +12,7 @@
 #![warn(clippy::all, clippy::pedantic)]
 #![allow(clippy::module_name_repetitions, clippy::default_trait_access)]
 
-use ciff::pisa_to_ciff;
+use ciff::{pisa_to_ciff_with_options, Deletions, PisaToCiffOptions, ThrottleOptions};
 use std::path::PathBuf;
 use structopt::StructOpt;
 
@@ -32,16 +32,75 @@ struct Args {
     output: PathBuf,
     #[structopt(long, help = "Index description")]
     description: Option<String>,
+    #[structopt(
+        long,
+        help = "Drop inputs and output from the page cache once processed"
+    )]
+    drop_behind: bool,
+    #[structopt(long, help = "Maximum read bandwidth in MB/s")]
+    max_read_mbps: Option<f64>,
+    #[structopt(long, help = "Maximum write bandwidth in MB/s")]
+    max_write_mbps: Option<f64>,
+    #[structopt(
+        long,
+        help = "File with lines `read <MB/s>` or `write <MB/s>` adjusting limits while running"
+    )]
+    throttle_control: Option<PathBuf>,
+    #[structopt(
+        long,
+        help = "Write CRC32C checksums of the output to <output>.manifest"
+    )]
+    manifest: bool,
+    #[structopt(
+        long,
+        help = "Delete the documents with the IDs in this file, one per line"
+    )]
+    delete_docids: Option<PathBuf>,
+    #[structopt(
+        long,
+        conflicts_with = "delete-docids",
+        help = "Delete the documents set in this bitmap (bit i % 8 of byte i / 8)"
+    )]
+    delete_bitmap: Option<PathBuf>,
+    #[structopt(long, help = "Delete documents of length 0")]
+    drop_empty_documents: bool,
 }
 
 fn main() {
     let args = Args::from_args();
-    if let Err(error) = pisa_to_ciff(
+    let deletions = match (&args.delete_docids, &args.delete_bitmap) {
+        (Some(path), _) => Some(Deletions::read_docids(path)),
+        (None, Some(path)) => Some(Deletions::read_bitmap(path)),
+        (None, None) if args.drop_empty_documents => Some(Ok(Deletions::default())),
+        (None, None) => None,
+    };
+    let deletions = match deletions.transpose() {
+        Ok(deletions) => deletions.map(|deletions| Deletions {
+            drop_empty: args.drop_empty_documents,
+            ..deletions
+        }),
+        Err(error) => {
+            eprintln!("ERROR: {:#}", error);
+            std::process::exit(1);
+        }
+    };
+    let options = PisaToCiffOptions {
+        drop_behind: args.drop_behind,
+        throttle: ThrottleOptions {
+            max_read_mbps: args.max_read_mbps,
+            max_write_mbps: args.max_write_mbps,
+            control_file: args.throttle_control.clone(),
+        },
+        manifest: args.manifest,
+        deletions,
+    };
+    if let Err(error) = pisa_to_ciff_with_options(
         &args.collection,
         &args.terms,
         &args.documents,
         &args.output,
         &args.description.unwrap_or_else(String::new),
+        &options,
     ) {
         eprintln!("ERROR: {}", error);
         std::process::exit(1);
@@ -0,0 +1,109 @@
+//! Random access to postings lists of PISA binary collections.
+
+use crate::{read_document_count, BinaryCollection, BinarySequence, InvalidFormat, Result};
+use anyhow::Context;
+use memmap::Mmap;
+use std::collections::HashMap;
+use std::convert::TryFrom;
+use std::fs::File;
+use std::io::{BufRead, BufReader};
+use std::ops::Range;
+use std::path::Path;
+
+/// Memory-maps a file.
+pub(crate) fn map_file(path: &Path) -> Result<Mmap> {
+    let file = File::open(path).with_context(|| format!("Unable to open {}", path.display()))?;
+    Ok(unsafe { Mmap::map(&file)? })
+}
+
+/// Reads all lines of a text file.
+pub(crate) fn read_lines(path: &Path) -> Result<Vec<String>> {
+    let file = File::open(path).with_context(|| format!("Unable to open {}", path.display()))?;
+    Ok(BufReader::new(file)
+        .lines()
+        .collect::<std::io::Result<_>>()?)
+}
+
+/// Reads a `.terms` file into a map from terms to their IDs (line numbers), checking that it
+/// has a term per list of `documents`.
+pub(crate) fn read_lexicon(path: &Path, documents: &DocumentLists) -> Result<HashMap<String, u32>> {
+    let terms = read_lines(path)?;
+    documents.check_terms(&terms)?;
+    Ok(terms.into_iter().zip(0..).collect())
+}
+
+/// Memory-mapped documents collection (`.docs`) with postings lists indexed by term ID.
+pub(crate) struct DocumentLists {
+    mmap: Mmap,
+    num_documents: u32,
+    /// Byte offset of the length of each list.
+    offsets: Vec<usize>,
+}
+
+impl DocumentLists {
+    /// Maps a documents collection and records where each list starts.
+    pub(crate) fn open(path: &Path) -> Result<Self> {
+        let mmap = map_file(path)?;
+        let mut collection = BinaryCollection::try_from(&mmap[..])?;
+        let num_documents = read_document_count(&mut collection)?;
+        let element_size = std::mem::size_of::<u32>();
+        let mut offsets = Vec::new();
+        let mut offset = 2 * element_size;
+        for sequence in collection {
+            offsets.push(offset);
+            offset += (sequence?.len() + 1) * element_size;
+        }
+        Ok(Self {
+            mmap,
+            num_documents,
+            offsets,
+        })
+    }
+
+    /// Number of documents in the collection.
+    pub(crate) fn num_documents(&self) -> u32 {
+        self.num_documents
+    }
+
+    /// Number of postings lists.
+    pub(crate) fn len(&self) -> usize {
+        self.offsets.len()
+    }
+
+    /// Checks that there is a term per list.
+    pub(crate) fn check_terms(&self, terms: &[String]) -> Result<()> {
+        if terms.len() != self.len() {
+            return Err(InvalidFormat::new(format!(
+                "{} terms for {} postings lists",
+                terms.len(),
+                self.len()
+            ))
+            .into());
+        }
+        Ok(())
+    }
+
+    /// Byte range of the elements of list `term_id`, excluding its length.
+    pub(crate) fn byte_range(&self, term_id: u32) -> Range<usize> {
+        let element_size = std::mem::size_of::<u32>();
+        let offset = self.offsets[term_id as usize];
+        let length = u32::from_le_bytes([
+            self.mmap[offset],
+            self.mmap[offset + 1],
+            self.mmap[offset + 2],
+            self.mmap[offset + 3],
+        ]) as usize;
+        offset + element_size..offset + (length + 1) * element_size
+    }
+
+    /// Postings list of `term_id`.
+    pub(crate) fn list(&self, term_id: u32) -> BinarySequence<'_> {
+        BinarySequence::try_from(&self.mmap[self.byte_range(term_id)])
+            .expect("length is a multiple of 4")
+    }
+
+    /// Decodes the postings list of `term_id`.
+    pub(crate) fn decode(&self, term_id: u32) -> Vec<u32> {
+        self.list(term_id).iter().collect()
+    }
+}
@@ -0,0 +1,345 @@
+//! Document-centric static pruning of CIFF files, keeping the top-weighted terms of each
+//! document.
+//!
+//! The postings of a document are spread over all lists of a term-major file, so its weights
+//! are only known once the whole file has been read. A first pass transposes postings into
+//! forward partitions by document range, small enough for the entries and the top weights of
+//! all documents of a partition to fit in the memory budget, and selects the weight of each
+//! document's `k`-th top posting from each partition in turn. A second pass then streams the
+//! lists again, keeping only postings with a weight of at least their document's threshold.
+
+use crate::collection::collection_path;
+use crate::filter::{check_distinct_output, RewrittenBody};
+use crate::forward::{max_postings, ForwardPartitions};
+use crate::inverter::{temp_prefix, TempFiles};
+use crate::io_backend::{copy_range, IoConfig};
+use crate::scan::MessageScanner;
+use crate::{parallel, pb_style, CollectionInput, Header, PostingsList, Result};
+use anyhow::{anyhow, bail, Context};
+use indicatif::ProgressBar;
+use protobuf::{Message, RepeatedField};
+use std::convert::TryFrom;
+use std::fs::File;
+use std::io::Read;
+use std::ops::Range;
+use std::path::{Path, PathBuf};
+
+/// Options of [`prune_documents`].
+#[derive(Debug, Clone)]
+pub struct PruneOptions {
+    /// Number of threads decoding and pruning postings lists.
+    pub threads: usize,
+    /// Approximate number of bytes of forward entries and top weights kept in memory at once,
+    /// half for each; documents are transposed to partitions on disk if those of the whole
+    /// collection do not fit.
+    pub memory_budget: usize,
+    /// Directory for temporary files. Defaults to the directory of the output.
+    pub temp_dir: Option<PathBuf>,
+    /// If set, replaces the description of the header.
+    pub description: Option<String>,
+}
+
+impl Default for PruneOptions {
+    fn default() -> Self {
+        Self {
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+            memory_budget: 1 << 30,
+            temp_dir: None,
+            description: None,
+        }
+    }
+}
+
+/// Top `k` weights of each document of a range, in one min-heap per document.
+struct TopWeights {
+    documents: Range<u32>,
+    k: usize,
+    heaps: Vec<u32>,
+    lengths: Vec<u32>,
+}
+
+impl TopWeights {
+    fn new(documents: Range<u32>, k: usize) -> Self {
+        let num_documents = documents.len();
+        Self {
+            documents,
+            k,
+            heaps: vec![0; num_documents * k],
+            lengths: vec![0; num_documents],
+        }
+    }
+
+    /// Bytes held per document.
+    fn document_bytes(k: usize) -> usize {
+        (k + 1) * std::mem::size_of::<u32>()
+    }
+
+    fn push(&mut self, docid: u32, weight: u32) {
+        let index = (docid - self.documents.start) as usize;
+        let heap = &mut self.heaps[index * self.k..(index + 1) * self.k];
+        let length = &mut self.lengths[index];
+        if (*length as usize) < heap.len() {
+            let mut child = *length as usize;
+            heap[child] = weight;
+            *length += 1;
+            while child > 0 && heap[(child - 1) / 2] > heap[child] {
+                heap.swap(child, (child - 1) / 2);
+                child = (child - 1) / 2;
+            }
+        } else if weight > heap[0] {
+            heap[0] = weight;
+            let mut parent = 0;
+            loop {
+                let left = 2 * parent + 1;
+                let right = left + 1;
+                let smallest = if right < heap.len() && heap[right] < heap[left] {
+                    right
+                } else {
+                    left
+                };
+                if smallest >= heap.len() || heap[parent] <= heap[smallest] {
+                    break;
+                }
+                heap.swap(parent, smallest);
+                parent = smallest;
+            }
+        }
+    }
+
+    /// Weight of the `k`-th top posting of each document, or 0 for documents with fewer
+    /// postings.
+    fn thresholds(&self) -> impl Iterator<Item = u32> + '_ {
+        self.lengths
+            .iter()
+            .zip(self.heaps.chunks_exact(self.k))
+            .map(move |(&length, heap)| {
+                if length as usize == self.k {
+                    heap[0]
+                } else {
+                    0
+                }
+            })
+    }
+}
+
+/// Raw postings lists of `scanner`, with a progress bar.
+fn raw_lists<'a, R: Read + std::io::Seek>(
+    scanner: &'a mut MessageScanner<R>,
+    header: &Header,
+    message: &str,
+) -> impl Iterator<Item = Result<Vec<u8>>> + 'a {
+    eprintln!("{}", message);
+    let num_lists = header.num_postings_lists;
+    let progress = ProgressBar::new(u64::from(num_lists));
+    progress.set_style(pb_style());
+    progress.set_draw_delta(u64::from(num_lists) / 100);
+    (0..num_lists).map(move |list| {
+        let mut buffer = Vec::new();
+        scanner.read_message_bytes(&mut buffer)?;
+        progress.inc(1);
+        if list + 1 == num_lists {
+            progress.finish();
+        }
+        Ok(buffer)
+    })
+}
+
+/// Decodes the postings of a list into document IDs and weights.
+fn list_weights(message: &[u8], num_documents: u32) -> Result<Vec<(u32, u32)>> {
+    let list = PostingsList::parse_from_bytes(message)?;
+    let mut docid = 0_u32;
+    list.get_postings()
+        .iter()
+        .map(|posting| {
+            docid = u32::try_from(posting.get_docid())
+                .ok()
+                .and_then(|gap| docid.checked_add(gap))
+                .filter(|&docid| docid < num_documents)
+                .ok_or_else(|| anyhow!("Invalid document ID in {}", list.get_term()))?;
+            let weight = u32::try_from(posting.get_tf())
+                .with_context(|| format!("Negative weight in {}", list.get_term()))?;
+            Ok((docid, weight))
+        })
+        .collect()
+}
+
+/// Computes the weight of the `k`-th top posting of each document of `input`, transposing
+/// postings to forward partitions with temporary files at `prefix` if the entries or top
+/// weights do not fit in the memory budget.
+fn document_thresholds(
+    input: &Path,
+    k: usize,
+    prefix: &Path,
+    options: &PruneOptions,
+) -> Result<Vec<u32>> {
+    let mut scanner = MessageScanner::open(input, &IoConfig::default())?;
+    let header = Header::from_protobuf(scanner.read_message()?)?;
+    let num_documents = header.num_documents;
+    let budget = options.memory_budget / 2;
+    let temp_files = TempFiles::default();
+    let mut forward = ForwardPartitions::<u32>::with_max_length(
+        num_documents,
+        max_postings(&CollectionInput::Ciff(input.to_path_buf()))?,
+        budget,
+        u32::try_from(budget / TopWeights::document_bytes(k)).unwrap_or(u32::MAX),
+        &temp_files,
+        prefix,
+    )?;
+    let threads = options.threads.max(1);
+    let mut term_id = 0_u32;
+    parallel::map_ordered(
+        threads,
+        4 * threads,
+        raw_lists(&mut scanner, &header, "Selecting top weights of documents"),
+        |message| list_weights(&message, num_documents),
+        |postings| {
+            for (docid, weight) in postings {
+                forward.push((docid, term_id, weight))?;
+            }
+            term_id += 1;
+            Ok(())
+        },
+    )?;
+
+    let mut thresholds = Vec::with_capacity(num_documents as usize);
+    forward.for_each(|documents, entries| {
+        let mut top = TopWeights::new(documents, k);
+        for (docid, _, weight) in entries {
+            top.push(docid, weight);
+        }
+        thresholds.extend(top.thresholds());
+        Ok(())
+    })?;
+    Ok(thresholds)
+}
+
+/// Removes postings with weights below the threshold of their document from `list`, and
+/// updates its frequencies. Returns `false` if no posting is left.
+#[allow(clippy::cast_sign_loss, clippy::cast_possible_wrap)]
+fn prune_list(list: &mut PostingsList, thresholds: &[u32]) -> bool {
+    let mut docid = 0_u32;
+    let mut previous = 0_u32;
+    let mut cf = 0;
+    let mut postings = Vec::with_capacity(list.get_postings().len());
+    for mut posting in list.take_postings().into_vec() {
+        // IDs and weights were validated by the first pass.
+        docid += posting.get_docid() as u32;
+        if posting.get_tf() as u32 >= thresholds[docid as usize] {
+            posting.set_docid((docid - previous) as i32);
+            cf += i64::from(posting.get_tf());
+            previous = docid;
+            postings.push(posting);
+        }
+    }
+    list.set_df(postings.len() as i64);
+    list.set_cf(cf);
+    let kept = !postings.is_empty();
+    list.set_postings(RepeatedField::from_vec(postings));
+    kept
+}
+
+/// Prunes a CIFF file into a new one, keeping the `k` postings with the largest weights, or
+/// term frequencies, of each document.
+///
+/// Postings tied with the `k`-th top weight of their document are all kept, so a document may
+/// keep more than `k` postings. Lists left empty are dropped, and the document and collection
+/// frequencies of the others are recomputed; document records are copied unchanged. Lists are
+/// decoded and pruned in parallel by [`PruneOptions::threads`] threads, in two passes over the
+/// input.
+///
+/// # Errors
+///
+/// Returns an error when:
+/// - `k` is 0,
+/// - `output` is the same file as `input`,
+/// - an IO error occurs,
+/// - the input is not a valid CIFF file, or has a negative weight or an out-of-bounds document.
+pub fn prune_documents(
+    input: &Path,
+    output: &Path,
+    k: usize,
+    options: &PruneOptions,
+) -> Result<()> {
+    if k == 0 {
+        bail!("At least one term per document must be kept");
+    }
+    check_distinct_output(input, output)?;
+    let prefix = temp_prefix(options.temp_dir.as_deref(), output)?;
+    let thresholds = document_thresholds(input, k, &prefix, options)?;
+
+    let mut scanner = MessageScanner::open(input, &IoConfig::default())?;
+    let header = Header::from_protobuf(scanner.read_message()?)?;
+    println!("{}", header);
+    let mut body = RewrittenBody::create(collection_path(&prefix, "body"))?;
+    let kept_lists = body.write_lists(
+        raw_lists(&mut scanner, &header, "Pruning postings lists"),
+        options.threads,
+        |list| Ok(prune_list(list, &thresholds)),
+    )?;
+
+    let mut pruned = header.protobuf_header.clone();
+    let kept_lists = i32::try_from(kept_lists)?;
+    pruned.set_num_postings_lists(kept_lists);
+    pruned.set_total_postings_lists(kept_lists);
+    if let Some(description) = &options.description {
+        pruned.set_description(description.clone());
+    }
+    eprintln!("Copying {} postings lists and all documents", kept_lists);
+    let mut output_file = body.finish(output, &pruned)?;
+    let input_file = File::open(input)?;
+    let input_length = input_file.metadata()?.len();
+    copy_range(
+        &input_file,
+        scanner.offset()..input_length,
+        &mut output_file,
+    )?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::Posting;
+
+    #[test]
+    fn test_top_weights() {
+        let mut top = TopWeights::new(10..13, 3);
+        for &(docid, weight) in &[
+            (10, 5),
+            (11, 1),
+            (10, 2),
+            (10, 9),
+            (10, 7),
+            (10, 1),
+            (12, 4),
+        ] {
+            top.push(docid, weight);
+        }
+        for &weight in &[3, 8, 6, 2] {
+            top.push(12, weight);
+        }
+        let thresholds: Vec<_> = top.thresholds().collect();
+        assert_eq!(thresholds, vec![5, 0, 4]);
+    }
+
+    #[test]
+    fn test_prune_list() {
+        let mut list = PostingsList::default();
+        for &(gap, tf) in &[(0, 2), (1, 3), (3, 1)] {
+            let mut posting = Posting::default();
+            posting.set_docid(gap);
+            posting.set_tf(tf);
+            list.mut_postings().push(posting);
+        }
+        let mut pruned = list.clone();
+        assert!(prune_list(&mut pruned, &[0, 4, 0, 0, 1]));
+        let postings: Vec<_> = pruned
+            .get_postings()
+            .iter()
+            .map(|posting| (posting.get_docid(), posting.get_tf()))
+            .collect();
+        assert_eq!(postings, vec![(0, 2), (4, 1)]);
+        assert_eq!((pruned.get_df(), pruned.get_cf()), (2, 3));
+        assert!(!prune_list(&mut list, &[3, 4, 0, 0, 2]));
+    }
+}
@@ -0,0 +1,236 @@
+//! Quantization of floating-point term weights (impacts) into integers that fit into CIFF term
+//! frequencies and can be used directly as PISA quantized scores.
+
+use crate::Result;
+use anyhow::{anyhow, bail};
+use std::fmt;
+use std::str::FromStr;
+
+/// Scale on which weights are quantized.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum QuantizationScale {
+    /// Weights are scaled proportionally to the maximum weight, which preserves ratios between
+    /// weights (and therefore between their sums) up to rounding.
+    Linear,
+    /// Logarithms of weights are mapped linearly between the minimum and maximum weights, which
+    /// gives more resolution to low weights.
+    Log,
+}
+
+impl FromStr for QuantizationScale {
+    type Err = anyhow::Error;
+    fn from_str(s: &str) -> Result<Self> {
+        match s {
+            "linear" => Ok(Self::Linear),
+            "log" => Ok(Self::Log),
+            _ => Err(anyhow!(
+                "Unknown quantization scale: {} (expected linear or log)",
+                s
+            )),
+        }
+    }
+}
+
+impl fmt::Display for QuantizationScale {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Self::Linear => write!(f, "linear"),
+            Self::Log => write!(f, "log"),
+        }
+    }
+}
+
+/// Requested quantization, before the range of weights is known.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Quantization {
+    /// Quantization scale.
+    pub scale: QuantizationScale,
+    /// Number of bits of quantized values; must be between 1 and 31.
+    pub bits: u8,
+}
+
+/// Maps positive weights from the range `[min, max]` to integers in `[1, 2^bits - 1]`.
+///
+/// # Examples
+///
+/// ```
+/// # use ciff::{Quantization, QuantizationScale, Quantizer};
+/// # fn main() -> anyhow::Result<()> {
+/// let quantization = Quantization { scale: QuantizationScale::Linear, bits: 8 };
+/// let quantizer = Quantizer::new(quantization, 0.5, 10.0)?;
+/// assert_eq!(quantizer.quantize(10.0), 255);
+/// assert_eq!(quantizer.quantize(5.0), 128);
+/// assert_eq!(quantizer.quantize(0.001), 1);
+/// # Ok(())
+/// # }
+/// ```
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct Quantizer {
+    quantization: Quantization,
+    min: f64,
+    max: f64,
+    range: f64,
+}
+
+impl Quantizer {
+    /// Constructs a quantizer for positive weights between `min` and `max`.
+    /// On the linear scale, `min` is only informative and may be 0.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the number of bits is not between 1 and 31, or if the weight range
+    /// is not a valid range of positive numbers.
+    pub fn new(quantization: Quantization, min: f64, max: f64) -> Result<Self> {
+        if quantization.bits == 0 || quantization.bits > 31 {
+            bail!(
+                "Number of quantization bits must be between 1 and 31, but is {}",
+                quantization.bits
+            );
+        }
+        let min_bound_valid = match quantization.scale {
+            QuantizationScale::Linear => min >= 0.0,
+            QuantizationScale::Log => min > 0.0,
+        };
+        if !(min_bound_valid && max.is_finite() && max > 0.0 && min <= max) {
+            bail!("Invalid weight range for quantization: [{}, {}]", min, max);
+        }
+        Ok(Self {
+            quantization,
+            min,
+            max,
+            range: f64::from((1_u32 << quantization.bits) - 1),
+        })
+    }
+
+    /// Quantizes a positive weight. Weights outside of `[min, max]` are clamped.
+    #[must_use]
+    #[allow(clippy::cast_sign_loss)]
+    pub fn quantize(&self, weight: f64) -> u32 {
+        let normalized = match self.quantization.scale {
+            QuantizationScale::Linear => weight / self.max,
+            QuantizationScale::Log if self.max > self.min => {
+                let weight = weight.max(self.min);
+                (weight / self.min).ln() / (self.max / self.min).ln()
+            }
+            QuantizationScale::Log => 1.0,
+        };
+        let quantized = if self.quantization.scale == QuantizationScale::Log {
+            1.0 + (normalized * (self.range - 1.0)).round()
+        } else {
+            (normalized * self.range).round()
+        };
+        quantized.max(1.0).min(self.range) as u32
+    }
+
+    /// Minimum weight of the quantized range.
+    #[must_use]
+    pub fn min(&self) -> f64 {
+        self.min
+    }
+
+    /// Maximum weight of the quantized range.
+    #[must_use]
+    pub fn max(&self) -> f64 {
+        self.max
+    }
+}
+
+impl fmt::Display for Quantizer {
+    /// Formats parameters as a single line of `key=value` pairs, as recorded in CIFF headers and
+    /// `.quantization` files.
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "quantization: scale={} bits={} min={} max={}",
+            self.quantization.scale, self.quantization.bits, self.min, self.max
+        )
+    }
+}
+
+/// Running minimum and maximum of positive weights.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub(crate) struct WeightRange {
+    pub(crate) min: f64,
+    pub(crate) max: f64,
+}
+
+impl Default for WeightRange {
+    fn default() -> Self {
+        Self {
+            min: f64::INFINITY,
+            max: f64::NEG_INFINITY,
+        }
+    }
+}
+
+impl WeightRange {
+    pub(crate) fn add(&mut self, weight: f64) {
+        if weight > 0.0 {
+            self.min = self.min.min(weight);
+            self.max = self.max.max(weight);
+        }
+    }
+
+    pub(crate) fn merge(self, other: Self) -> Self {
+        Self {
+            min: self.min.min(other.min),
+            max: self.max.max(other.max),
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_invalid_quantizers() {
+        let linear = |bits| Quantization {
+            scale: QuantizationScale::Linear,
+            bits,
+        };
+        assert!(Quantizer::new(linear(0), 1.0, 2.0).is_err());
+        assert!(Quantizer::new(linear(32), 1.0, 2.0).is_err());
+        assert!(Quantizer::new(linear(8), 0.0, 2.0).is_ok());
+        assert!(Quantizer::new(linear(8), -1.0, 2.0).is_err());
+        assert!(Quantizer::new(linear(8), 0.0, 0.0).is_err());
+        let log = Quantization {
+            scale: QuantizationScale::Log,
+            bits: 8,
+        };
+        assert!(Quantizer::new(log, 0.0, 2.0).is_err());
+        assert!(Quantizer::new(linear(8), 3.0, 2.0).is_err());
+        assert!(Quantizer::new(linear(8), 1.0, f64::INFINITY).is_err());
+        assert!(Quantizer::new(linear(8), 2.0, 2.0).is_ok());
+    }
+
+    #[test]
+    fn test_log_quantization() -> Result<()> {
+        let quantization = Quantization {
+            scale: QuantizationScale::Log,
+            bits: 4,
+        };
+        let quantizer = Quantizer::new(quantization, 0.1, 1000.0)?;
+        assert_eq!(quantizer.quantize(0.1), 1);
+        assert_eq!(quantizer.quantize(0.01), 1);
+        assert_eq!(quantizer.quantize(1000.0), 15);
+        assert_eq!(quantizer.quantize(10.0), 8);
+        let single = Quantizer::new(quantization, 2.0, 2.0)?;
+        assert_eq!(single.quantize(2.0), 15);
+        Ok(())
+    }
+
+    #[test]
+    fn test_format_parameters() -> Result<()> {
+        let quantization = Quantization {
+            scale: QuantizationScale::Linear,
+            bits: 8,
+        };
+        let quantizer = Quantizer::new(quantization, 0.25, 3.5)?;
+        assert_eq!(
+            quantizer.to_string(),
+            "quantization: scale=linear bits=8 min=0.25 max=3.5"
+        );
+        Ok(())
+    }
+}
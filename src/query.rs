@@ -0,0 +1,602 @@
+//! Reference top-k query processing over PISA binary collections.
+//!
+//! This is meant for sanity-checking converted collections and getting a throughput baseline,
+//! not as a replacement for a compressed PISA index.
+
+use crate::postings::{map_file, read_lexicon, read_lines, DocumentLists};
+use crate::{parallel, sizes, BinaryCollection, BinarySequence, Bm25, Result};
+use anyhow::anyhow;
+use memmap::Mmap;
+use std::cmp::{Ordering, Reverse};
+use std::collections::{BinaryHeap, HashMap};
+use std::convert::TryFrom;
+use std::fmt;
+use std::io::{BufRead, Write};
+use std::path::{Path, PathBuf};
+use std::str::FromStr;
+use std::time::{Duration, Instant};
+
+/// Document ID returned by exhausted cursors.
+const END: u32 = u32::MAX;
+
+/// Query processing algorithm.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum QueryAlgorithm {
+    /// Scores every document in the union of the postings lists.
+    Exhaustive,
+    /// Skips documents that cannot enter the top-k based on score upper bounds of the lists.
+    MaxScore,
+}
+
+impl FromStr for QueryAlgorithm {
+    type Err = anyhow::Error;
+    fn from_str(s: &str) -> Result<Self> {
+        match s {
+            "exhaustive" => Ok(Self::Exhaustive),
+            "maxscore" => Ok(Self::MaxScore),
+            _ => Err(anyhow!(
+                "Unknown query algorithm: {} (expected exhaustive or maxscore)",
+                s
+            )),
+        }
+    }
+}
+
+/// Document with its score.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct ScoredDocument {
+    /// Document ID.
+    pub docid: u32,
+    /// Sum of BM25 scores of query terms.
+    pub score: f32,
+}
+
+/// Top-k entry ordered from worst to best: by score, then by decreasing document ID,
+/// so that ties are broken in favor of lower IDs.
+#[derive(Debug, Clone, Copy)]
+struct Entry(ScoredDocument);
+
+impl Ord for Entry {
+    fn cmp(&self, other: &Self) -> Ordering {
+        self.0
+            .score
+            .total_cmp(&other.0.score)
+            .then_with(|| other.0.docid.cmp(&self.0.docid))
+    }
+}
+
+impl PartialOrd for Entry {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl PartialEq for Entry {
+    fn eq(&self, other: &Self) -> bool {
+        self.cmp(other) == Ordering::Equal
+    }
+}
+
+impl Eq for Entry {}
+
+/// Min-heap of the `k` best documents seen so far.
+struct TopK {
+    k: usize,
+    heap: BinaryHeap<Reverse<Entry>>,
+}
+
+impl TopK {
+    fn new(k: usize) -> Self {
+        Self {
+            k,
+            heap: BinaryHeap::with_capacity(k + 1),
+        }
+    }
+
+    /// Score a document must exceed to enter the top-k.
+    fn threshold(&self) -> f32 {
+        if self.heap.len() < self.k {
+            f32::NEG_INFINITY
+        } else {
+            self.heap
+                .peek()
+                .map_or(f32::INFINITY, |entry| (entry.0).0.score)
+        }
+    }
+
+    /// Inserts a document if it belongs to the top-k, and returns whether it was inserted.
+    fn insert(&mut self, docid: u32, score: f32) -> bool {
+        if self.k == 0 || score <= self.threshold() {
+            return false;
+        }
+        self.heap
+            .push(Reverse(Entry(ScoredDocument { docid, score })));
+        if self.heap.len() > self.k {
+            self.heap.pop();
+        }
+        true
+    }
+
+    /// Returns documents sorted from best to worst.
+    fn into_sorted_vec(self) -> Vec<ScoredDocument> {
+        self.heap
+            .into_sorted_vec()
+            .into_iter()
+            .map(|entry| (entry.0).0)
+            .collect()
+    }
+}
+
+/// Cursor over a postings list.
+struct Cursor<'a> {
+    documents: BinarySequence<'a>,
+    frequencies: BinarySequence<'a>,
+    position: usize,
+    idf: f32,
+    max_score: f32,
+}
+
+impl Cursor<'_> {
+    fn docid(&self) -> u32 {
+        self.documents.get(self.position).unwrap_or(END)
+    }
+
+    fn frequency(&self) -> u32 {
+        self.frequencies.get(self.position).unwrap_or(0)
+    }
+
+    fn next(&mut self) {
+        self.position += 1;
+    }
+
+    /// Moves to the first posting with document ID at least `target`, galloping forward.
+    fn next_geq(&mut self, target: u32) {
+        let length = self.documents.len();
+        let below = |position: usize| self.documents.get(position).is_some_and(|d| d < target);
+        if !below(self.position) {
+            return;
+        }
+        let mut low = self.position;
+        let mut step = 1;
+        while low + step < length && below(low + step) {
+            low += step;
+            step *= 2;
+        }
+        let mut high = (low + step).min(length);
+        low += 1;
+        while low < high {
+            let middle = low + (high - low) / 2;
+            if below(middle) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        self.position = low;
+    }
+}
+
+/// In-memory view of a PISA binary collection (`.docs`, `.freqs`, `.sizes`, `.terms`, and
+/// optionally `.documents`) that evaluates disjunctive BM25 top-k queries.
+pub struct QueryIndex {
+    documents: DocumentLists,
+    frequencies: Mmap,
+    lengths: Vec<u32>,
+    avg_doclen: f32,
+    terms: HashMap<String, u32>,
+    titles: Option<Vec<String>>,
+    bm25: Bm25,
+}
+
+impl QueryIndex {
+    /// Opens the collection with the given basename, scoring documents with `bm25`.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error when any file is missing or malformed, when the documents and
+    /// frequencies collections are not aligned, or when `.terms` does not have a term per list.
+    pub fn open(basename: &Path, bm25: Bm25) -> Result<Self> {
+        let path = |extension: &str| PathBuf::from(format!("{}.{}", basename.display(), extension));
+        let documents = DocumentLists::open(&path("docs"))?;
+        let frequencies = map_file(&path("freqs"))?;
+        let lengths: Vec<u32> = sizes(&map_file(&path("sizes"))?)?.iter().collect();
+        if documents.num_documents() as usize != lengths.len() {
+            return Err(anyhow!(
+                "Document count {} does not match number of sizes {}",
+                documents.num_documents(),
+                lengths.len()
+            ));
+        }
+        let mut frequency_lists = BinaryCollection::try_from(&frequencies[..])?;
+        for term_id in 0..documents.len() as u32 {
+            let frequency_length = frequency_lists
+                .next()
+                .ok_or_else(|| anyhow!("Missing frequencies of list {}", term_id))??
+                .len();
+            if frequency_length != documents.list(term_id).len() {
+                return Err(anyhow!(
+                    "Documents and frequencies of list {} differ",
+                    term_id
+                ));
+            }
+        }
+
+        let terms = read_lexicon(&path("terms"), &documents)?;
+        let titles_path = path("documents");
+        let titles = if titles_path.exists() {
+            Some(read_lines(&titles_path)?)
+        } else {
+            None
+        };
+
+        let total_length: u64 = lengths.iter().copied().map(u64::from).sum();
+        #[allow(clippy::cast_precision_loss)]
+        let avg_doclen = total_length as f32 / lengths.len().max(1) as f32;
+        Ok(Self {
+            documents,
+            frequencies,
+            lengths,
+            avg_doclen,
+            terms,
+            titles,
+            bm25,
+        })
+    }
+
+    /// Number of documents in the collection.
+    #[must_use]
+    pub fn num_documents(&self) -> usize {
+        self.lengths.len()
+    }
+
+    /// Title of a document, if `.documents` is present.
+    #[must_use]
+    pub fn title(&self, docid: u32) -> Option<&str> {
+        self.titles
+            .as_ref()
+            .and_then(|titles| titles.get(docid as usize))
+            .map(String::as_str)
+    }
+
+    fn cursor(&self, term_id: u32) -> Cursor<'_> {
+        let documents = self.documents.list(term_id);
+        // Frequencies have no leading sequence with the document count.
+        let range = self.documents.byte_range(term_id);
+        let shift = 2 * std::mem::size_of::<u32>();
+        let frequencies =
+            BinarySequence::try_from(&self.frequencies[range.start - shift..range.end - shift])
+                .expect("length is a multiple of 4");
+        let idf = self
+            .bm25
+            .idf(documents.len() as u64, self.num_documents() as u64);
+        Cursor {
+            documents,
+            frequencies,
+            position: 0,
+            idf,
+            max_score: self.bm25.max_score(idf),
+        }
+    }
+
+    fn score(&self, cursor: &Cursor<'_>) -> f32 {
+        #[allow(clippy::cast_precision_loss)]
+        let length = self.lengths[cursor.docid() as usize] as f32;
+        self.bm25
+            .score(cursor.idf, cursor.frequency(), length, self.avg_doclen)
+    }
+
+    /// Returns the `k` documents with the highest sum of BM25 scores of `terms`, best first.
+    /// Terms missing from the collection are ignored, and repeated terms are counted once.
+    #[must_use]
+    pub fn search<S: AsRef<str>>(
+        &self,
+        terms: &[S],
+        k: usize,
+        algorithm: QueryAlgorithm,
+    ) -> Vec<ScoredDocument> {
+        let mut term_ids: Vec<u32> = terms
+            .iter()
+            .filter_map(|term| self.terms.get(term.as_ref()).copied())
+            .collect();
+        term_ids.sort_unstable();
+        term_ids.dedup();
+        let mut cursors: Vec<_> = term_ids.into_iter().map(|id| self.cursor(id)).collect();
+        let mut top_k = TopK::new(k);
+        match algorithm {
+            QueryAlgorithm::Exhaustive => self.exhaustive(&mut cursors, &mut top_k),
+            QueryAlgorithm::MaxScore => self.max_score(&mut cursors, &mut top_k),
+        }
+        top_k.into_sorted_vec()
+    }
+
+    fn exhaustive(&self, cursors: &mut [Cursor<'_>], top_k: &mut TopK) {
+        loop {
+            let docid = cursors.iter().map(Cursor::docid).min().unwrap_or(END);
+            if docid == END {
+                break;
+            }
+            let mut score = 0.0;
+            for cursor in cursors.iter_mut().filter(|cursor| cursor.docid() == docid) {
+                score += self.score(cursor);
+                cursor.next();
+            }
+            top_k.insert(docid, score);
+        }
+    }
+
+    /// `MaxScore`: lists are sorted by increasing score upper bound, and the longest prefix of
+    /// lists whose upper bounds sum to at most the top-k threshold is non-essential. Only
+    /// documents from essential lists are candidates, and non-essential lists are probed only
+    /// while the candidate can still exceed the threshold.
+    fn max_score(&self, cursors: &mut [Cursor<'_>], top_k: &mut TopK) {
+        cursors.sort_by(|lhs, rhs| lhs.max_score.total_cmp(&rhs.max_score));
+        let upper_bounds: Vec<f32> = cursors
+            .iter()
+            .scan(0.0, |sum, cursor| {
+                *sum += cursor.max_score;
+                Some(*sum)
+            })
+            .collect();
+        let mut first_essential = 0;
+        while first_essential < cursors.len() {
+            let (non_essential, essential) = cursors.split_at_mut(first_essential);
+            let docid = essential.iter().map(Cursor::docid).min().unwrap_or(END);
+            if docid == END {
+                break;
+            }
+            let mut score = 0.0;
+            for cursor in essential
+                .iter_mut()
+                .filter(|cursor| cursor.docid() == docid)
+            {
+                score += self.score(cursor);
+                cursor.next();
+            }
+            let threshold = top_k.threshold();
+            let mut candidate = true;
+            for (cursor, upper_bound) in non_essential.iter_mut().zip(&upper_bounds).rev() {
+                if score + upper_bound <= threshold {
+                    candidate = false;
+                    break;
+                }
+                cursor.next_geq(docid);
+                if cursor.docid() == docid {
+                    score += self.score(cursor);
+                }
+            }
+            if candidate && top_k.insert(docid, score) {
+                let threshold = top_k.threshold();
+                while first_essential < cursors.len() && upper_bounds[first_essential] <= threshold
+                {
+                    first_essential += 1;
+                }
+            }
+        }
+    }
+}
+
+/// Options of [`run_queries`].
+#[derive(Debug, Clone)]
+pub struct QueryOptions {
+    /// Number of results per query.
+    pub k: usize,
+    /// Query processing algorithm.
+    pub algorithm: QueryAlgorithm,
+    /// Number of threads processing queries.
+    pub threads: usize,
+}
+
+impl Default for QueryOptions {
+    fn default() -> Self {
+        Self {
+            k: 10,
+            algorithm: QueryAlgorithm::MaxScore,
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+        }
+    }
+}
+
+/// Query latency statistics.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct LatencyStats {
+    /// Number of queries.
+    pub queries: usize,
+    /// Wall-clock time of the whole batch.
+    pub elapsed: Duration,
+    /// Mean latency.
+    pub mean: Duration,
+    /// Median latency.
+    pub p50: Duration,
+    /// 90th percentile latency.
+    pub p90: Duration,
+    /// 99th percentile latency.
+    pub p99: Duration,
+    /// Maximum latency.
+    pub max: Duration,
+}
+
+impl LatencyStats {
+    /// Computes statistics of latencies, using nearest-rank percentiles.
+    #[must_use]
+    pub fn new(mut latencies: Vec<Duration>, elapsed: Duration) -> Self {
+        latencies.sort_unstable();
+        let percentile = |p: usize| {
+            if latencies.is_empty() {
+                Duration::default()
+            } else {
+                let rank = (p * latencies.len()).div_ceil(100);
+                latencies[rank.max(1) - 1]
+            }
+        };
+        let total: Duration = latencies.iter().sum();
+        Self {
+            queries: latencies.len(),
+            elapsed,
+            mean: total / u32::try_from(latencies.len().max(1)).unwrap_or(u32::MAX),
+            p50: percentile(50),
+            p90: percentile(90),
+            p99: percentile(99),
+            max: latencies.last().copied().unwrap_or_default(),
+        }
+    }
+}
+
+impl fmt::Display for LatencyStats {
+    #[allow(clippy::cast_precision_loss)]
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let throughput = self.queries as f64 / self.elapsed.as_secs_f64().max(f64::EPSILON);
+        write!(
+            f,
+            "queries: {} throughput: {:.1} q/s latency (us): mean={} p50={} p90={} p99={} max={}",
+            self.queries,
+            throughput,
+            self.mean.as_micros(),
+            self.p50.as_micros(),
+            self.p90.as_micros(),
+            self.p99.as_micros(),
+            self.max.as_micros()
+        )
+    }
+}
+
+/// Parses a query line in PISA's format: `id:terms`, or only terms, in which case the ID is the
+/// line number, starting from 0. Terms are separated by whitespace and must match the lexicon.
+pub(crate) fn parse_query(line: &str, line_number: usize) -> (String, Vec<String>) {
+    let (id, text) = match line.split_once(':') {
+        Some((id, text)) => (id.to_string(), text),
+        None => (line_number.to_string(), line),
+    };
+    (id, text.split_whitespace().map(str::to_string).collect())
+}
+
+/// Runs queries read line by line from `queries` on `options.threads` threads, writes results
+/// to `output` in TREC run format, and returns latency statistics.
+///
+/// Results are written in the order of queries. Documents are identified by their titles if the
+/// index has them, and by their IDs otherwise.
+///
+/// # Errors
+///
+/// Returns an error when reading queries or writing results fails.
+pub fn run_queries<R, W>(
+    index: &QueryIndex,
+    queries: R,
+    output: &mut W,
+    options: &QueryOptions,
+) -> Result<LatencyStats>
+where
+    R: BufRead,
+    W: Write + Send,
+{
+    let threads = options.threads.max(1);
+    let mut latencies = Vec::new();
+    let start = Instant::now();
+    let queries = queries
+        .lines()
+        .enumerate()
+        .map(|(line_number, line)| Ok(parse_query(&line?, line_number)));
+    parallel::map_ordered(
+        threads,
+        4 * threads,
+        queries,
+        |(id, terms)| {
+            let start = Instant::now();
+            let results = index.search(&terms, options.k, options.algorithm);
+            Ok((id, results, start.elapsed()))
+        },
+        |(id, results, latency)| {
+            for (rank, result) in results.iter().enumerate() {
+                let docid = result.docid.to_string();
+                let name = index.title(result.docid).unwrap_or(&docid);
+                writeln!(
+                    output,
+                    "{} Q0 {} {} {} ciff",
+                    id,
+                    name,
+                    rank + 1,
+                    result.score
+                )?;
+            }
+            latencies.push(latency);
+            Ok(())
+        },
+    )?;
+    output.flush()?;
+    Ok(LatencyStats::new(latencies, start.elapsed()))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn sequence(bytes: &mut Vec<u8>, values: &[u32]) {
+        bytes.clear();
+        for value in values {
+            bytes.extend_from_slice(&value.to_le_bytes());
+        }
+    }
+
+    #[test]
+    fn test_top_k() {
+        let mut top_k = TopK::new(2);
+        assert!(top_k.insert(5, 1.0));
+        assert!(top_k.threshold().is_infinite());
+        assert!(top_k.insert(3, 2.0));
+        assert!((top_k.threshold() - 1.0).abs() < f32::EPSILON);
+        assert!(!top_k.insert(7, 1.0));
+        assert!(top_k.insert(1, 3.0));
+        let docids: Vec<_> = top_k.into_sorted_vec().iter().map(|d| d.docid).collect();
+        assert_eq!(docids, vec![1, 3]);
+    }
+
+    #[test]
+    fn test_next_geq() {
+        let mut documents = Vec::new();
+        sequence(&mut documents, &(0..100).map(|n| n * 3).collect::<Vec<_>>());
+        let frequencies = vec![0_u8; documents.len()];
+        let mut cursor = Cursor {
+            documents: BinarySequence::try_from(&documents[..]).unwrap(),
+            frequencies: BinarySequence::try_from(&frequencies[..]).unwrap(),
+            position: 0,
+            idf: 1.0,
+            max_score: 1.0,
+        };
+        cursor.next_geq(0);
+        assert_eq!(cursor.docid(), 0);
+        cursor.next_geq(4);
+        assert_eq!(cursor.docid(), 6);
+        cursor.next_geq(200);
+        assert_eq!(cursor.docid(), 201);
+        cursor.next_geq(201);
+        assert_eq!(cursor.docid(), 201);
+        cursor.next_geq(297);
+        assert_eq!(cursor.docid(), 297);
+        cursor.next_geq(298);
+        assert_eq!(cursor.docid(), END);
+    }
+
+    #[test]
+    fn test_parse_query() {
+        assert_eq!(
+            parse_query("301:foo  bar", 0),
+            (
+                "301".to_string(),
+                vec!["foo".to_string(), "bar".to_string()]
+            )
+        );
+        assert_eq!(
+            parse_query("foo", 4),
+            ("4".to_string(), vec!["foo".to_string()])
+        );
+    }
+
+    #[test]
+    fn test_latency_percentiles() {
+        let latencies = (1..=100).map(Duration::from_millis).collect();
+        let stats = LatencyStats::new(latencies, Duration::from_secs(1));
+        assert_eq!(stats.p50, Duration::from_millis(50));
+        assert_eq!(stats.p99, Duration::from_millis(99));
+        assert_eq!(stats.max, Duration::from_millis(100));
+        assert_eq!(stats.queries, 100);
+    }
+}
@@ -0,0 +1,228 @@
+//! Document samples and subsets of collections, for fast experiments.
+//!
+//! A sample is turned into [`Deletions`] of the documents outside of it, so that selected
+//! documents are renumbered densely, lists left empty are dropped, and header statistics are
+//! recomputed, as when deleting documents while converting. Sampling hashes document IDs with a
+//! seed: the same seed selects the same documents, and samples of growing fractions are nested.
+
+use crate::collection::{collection_path, CollectionReader, PisaWriter};
+use crate::deletion::DocumentRemap;
+use crate::postings::map_file;
+use crate::{ciff_to_pisa_with_options, filter_ciff, parallel, pisa_to_ciff_with_options};
+use crate::{read_header_at_start, sizes, CiffToPisaOptions, CollectionInput, Deletions};
+use crate::{FilterOptions, InvertedFormat, PisaToCiffOptions, Result};
+use std::convert::TryFrom;
+use std::path::Path;
+
+/// Documents selected from a collection.
+#[derive(Debug, Clone, PartialEq)]
+pub enum DocumentSample {
+    /// Each document is selected with probability `fraction`, by a hash of its ID and `seed`.
+    Fraction {
+        /// Expected fraction of selected documents, between 0 and 1.
+        fraction: f64,
+        /// Seed of the hash function.
+        seed: u64,
+    },
+    /// Documents with these IDs.
+    Docids(Vec<u32>),
+}
+
+/// Mixes a value, such as a document ID, with a seed, with the finalizer of `SplitMix64`.
+pub(crate) fn hash(value: u32, seed: u64) -> u64 {
+    let mut hash = seed.wrapping_add(u64::from(value).wrapping_mul(0x9E37_79B9_7F4A_7C15));
+    hash = (hash ^ (hash >> 30)).wrapping_mul(0xBF58_476D_1CE4_E5B9);
+    hash = (hash ^ (hash >> 27)).wrapping_mul(0x94D0_49BB_1331_11EB);
+    hash ^ (hash >> 31)
+}
+
+impl DocumentSample {
+    /// Deletions of the documents of a collection of `num_documents` outside of the sample.
+    #[must_use]
+    pub fn deletions(&self, num_documents: u32) -> Deletions {
+        match self {
+            Self::Fraction { fraction, seed } => {
+                // Saturates to `u64::MAX` for fractions of 1 or more.
+                #[allow(clippy::cast_possible_truncation, clippy::cast_sign_loss)]
+                let threshold = (fraction * 2_f64.powi(64)) as u64;
+                Deletions::from_docids(
+                    (0..num_documents).filter(|&docid| hash(docid, *seed) >= threshold),
+                )
+            }
+            Self::Docids(docids) => {
+                let selected = Deletions::from_docids(docids.iter().copied());
+                Deletions::from_docids(
+                    (0..num_documents).filter(|&docid| !selected.is_deleted(docid)),
+                )
+            }
+        }
+    }
+}
+
+/// Options of [`sample_collection`].
+#[derive(Debug, Clone)]
+pub struct SampleOptions {
+    /// Output format.
+    pub format: InvertedFormat,
+    /// Number of threads processing postings lists.
+    pub threads: usize,
+    /// Description of the CIFF header [default: that of the input, if any].
+    pub description: Option<String>,
+}
+
+impl Default for SampleOptions {
+    fn default() -> Self {
+        Self {
+            format: InvertedFormat::Ciff,
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+            description: None,
+        }
+    }
+}
+
+/// Writes the selected documents of a PISA binary collection to another, processing lists in
+/// parallel.
+fn sample_pisa(
+    input: &CollectionInput,
+    output: &Path,
+    remap: &DocumentRemap,
+    threads: usize,
+) -> Result<()> {
+    let mut reader = CollectionReader::open(input)?;
+    let num_documents = reader.num_documents();
+    let mut writer = PisaWriter::create(output, remap.num_kept())?;
+    parallel::map_ordered(
+        threads,
+        4 * threads,
+        reader.lists("Sampling postings lists")?,
+        |list| {
+            let list = list.decode(num_documents)?;
+            let postings: Vec<(u32, u32)> = list
+                .postings
+                .iter()
+                .filter_map(|&(docid, frequency)| Some((remap.get(docid)?, frequency)))
+                .collect();
+            if postings.is_empty() {
+                return Ok(None);
+            }
+            PisaWriter::encode(&list.term, &postings).map(Some)
+        },
+        |list| {
+            if let Some(list) = list {
+                writer.write_list(&list)?;
+            }
+            Ok(())
+        },
+    )?;
+    eprintln!("Sampling documents");
+    for (docid, document) in (0..).zip(reader.documents()?) {
+        let document = document?;
+        if remap.get(docid).is_some() {
+            writer.write_document(&document)?;
+        }
+    }
+    writer.finish()
+}
+
+/// Writes the documents of `input` selected by `sample` to a smaller collection at `output`,
+/// in the format of [`SampleOptions::format`].
+///
+/// Selected documents are renumbered densely in their original order, lists without any
+/// selected document are dropped, and the header statistics of CIFF outputs describe the
+/// sample. Lists are processed in parallel by [`SampleOptions::threads`] threads, except when
+/// converting a PISA collection to CIFF, which is sequential.
+///
+/// # Errors
+///
+/// Returns an error when an IO error occurs, or the input is malformed.
+pub fn sample_collection(
+    input: &CollectionInput,
+    output: &Path,
+    sample: &DocumentSample,
+    options: &SampleOptions,
+) -> Result<()> {
+    let threads = options.threads.max(1);
+    match input {
+        CollectionInput::Ciff(path) => {
+            let (header, _) = read_header_at_start(path, &Default::default())?;
+            let deletions = sample.deletions(header.num_documents);
+            match options.format {
+                InvertedFormat::Ciff => {
+                    let filter = FilterOptions {
+                        deletions: Some(deletions),
+                        description: options.description.clone(),
+                        threads,
+                        ..FilterOptions::default()
+                    };
+                    filter_ciff(path, output, &filter)
+                }
+                InvertedFormat::Pisa => {
+                    let convert = CiffToPisaOptions {
+                        deletions: Some(deletions),
+                        threads,
+                        ..CiffToPisaOptions::default()
+                    };
+                    ciff_to_pisa_with_options(path, output, &convert)
+                }
+            }
+        }
+        CollectionInput::Pisa(basename) => {
+            let path = |extension: &str| collection_path(basename, extension);
+            let num_documents = u32::try_from(sizes(&map_file(&path("sizes"))?)?.len())?;
+            let deletions = sample.deletions(num_documents);
+            match options.format {
+                InvertedFormat::Ciff => {
+                    let convert = PisaToCiffOptions {
+                        deletions: Some(deletions),
+                        ..PisaToCiffOptions::default()
+                    };
+                    pisa_to_ciff_with_options(
+                        basename,
+                        &path("terms"),
+                        &path("documents"),
+                        output,
+                        options.description.as_deref().unwrap_or(""),
+                        &convert,
+                    )
+                }
+                InvertedFormat::Pisa => {
+                    let remap = DocumentRemap::new(&deletions, num_documents, None)?;
+                    sample_pisa(input, output, &remap, threads)
+                }
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_fraction() {
+        let kept = |fraction: f64, seed: u64| -> Vec<u32> {
+            let deletions = DocumentSample::Fraction { fraction, seed }.deletions(10_000);
+            (0..10_000)
+                .filter(|&docid| !deletions.is_deleted(docid))
+                .collect()
+        };
+        let small = kept(0.01, 7);
+        let large = kept(0.1, 7);
+        assert!((50..150).contains(&small.len()), "{}", small.len());
+        assert!((900..1100).contains(&large.len()), "{}", large.len());
+        assert!(small.iter().all(|docid| large.contains(docid)));
+        assert_eq!(small, kept(0.01, 7));
+        assert_ne!(small, kept(0.01, 8));
+        assert_eq!(kept(1.0, 7).len(), 10_000);
+        assert!(kept(0.0, 7).is_empty());
+    }
+
+    #[test]
+    fn test_docids() {
+        let deletions = DocumentSample::Docids(vec![1, 3, 20]).deletions(5);
+        let kept: Vec<u32> = (0..5)
+            .filter(|&docid| !deletions.is_deleted(docid))
+            .collect();
+        assert_eq!(kept, vec![1, 3]);
+    }
+}
@@ -0,0 +1,214 @@
+//! Scanning CIFF files message by message without decoding them.
+//!
+//! Every CIFF message is preceded by its length encoded as a varint, so any message can be
+//! skipped by reading only its length and seeking past its body.
+
+use crate::io_backend::{open_file, InputFile, IoConfig};
+use crate::{DocRecord, Header, Result};
+use anyhow::{anyhow, bail, Context};
+use protobuf::Message;
+use std::convert::TryFrom;
+use std::io::{BufRead, BufReader, Read, Seek};
+use std::path::Path;
+
+/// Size of the read buffer. Messages shorter than that are skipped within the buffer, while
+/// longer ones are skipped with a seek.
+const BUFFER_SIZE: usize = 1 << 16;
+
+/// Reads length-delimited messages from a seekable input.
+pub(crate) struct MessageScanner<R> {
+    reader: BufReader<R>,
+    offset: u64,
+    /// Length of the input, past which messages cannot be skipped.
+    length: u64,
+}
+
+impl MessageScanner<InputFile> {
+    /// Opens a CIFF file for scanning.
+    pub(crate) fn open(path: &Path, config: &IoConfig) -> Result<Self> {
+        let file = open_file(path, config)?;
+        Ok(Self::new(file, std::fs::metadata(path)?.len()))
+    }
+}
+
+impl<R: Read + Seek> MessageScanner<R> {
+    /// Scans `reader`, with `length` bytes left from its current position.
+    pub(crate) fn new(reader: R, length: u64) -> Self {
+        Self {
+            reader: BufReader::with_capacity(BUFFER_SIZE, reader),
+            offset: 0,
+            length,
+        }
+    }
+
+    /// Number of bytes consumed from the input.
+    pub(crate) fn offset(&self) -> u64 {
+        self.offset
+    }
+
+    /// Reads a message length, or returns `None` if the input is exhausted.
+    pub(crate) fn next_length(&mut self) -> Result<Option<u32>> {
+        if self.reader.fill_buf()?.is_empty() {
+            return Ok(None);
+        }
+        let mut value = 0_u64;
+        for shift in (0..64).step_by(7) {
+            let Some(&byte) = self.reader.fill_buf()?.first() else {
+                bail!("Unexpected end of input at byte {}", self.offset);
+            };
+            self.reader.consume(1);
+            self.offset += 1;
+            value |= u64::from(byte & 0x7F) << shift;
+            if byte & 0x80 == 0 {
+                return Ok(Some(u32::try_from(value).map_err(|_| {
+                    anyhow!("Message length too large at byte {}", self.offset)
+                })?));
+            }
+        }
+        Err(anyhow!("Malformed varint at byte {}", self.offset))
+    }
+
+    /// Skips `length` bytes, failing if fewer are left, since seeking past the end of a file
+    /// succeeds.
+    pub(crate) fn skip_bytes(&mut self, length: u32) -> Result<()> {
+        if self.offset + u64::from(length) > self.length {
+            bail!("Unexpected end of input at byte {}", self.length);
+        }
+        self.reader.seek_relative(i64::from(length))?;
+        self.offset += u64::from(length);
+        Ok(())
+    }
+
+    /// Reads `length` bytes, and appends them to `buffer`.
+    pub(crate) fn read_bytes(&mut self, length: u32, buffer: &mut Vec<u8>) -> Result<()> {
+        let start = buffer.len();
+        buffer.resize(start + length as usize, 0);
+        self.reader.read_exact(&mut buffer[start..])?;
+        self.offset += u64::from(length);
+        Ok(())
+    }
+
+    fn expect_length(&mut self) -> Result<u32> {
+        self.next_length()?
+            .ok_or_else(|| anyhow!("Unexpected end of input at byte {}", self.offset))
+    }
+
+    /// Reads the length of the next message and skips its body. Returns the message length.
+    pub(crate) fn skip_message(&mut self) -> Result<u32> {
+        let length = self.expect_length()?;
+        self.skip_bytes(length)?;
+        Ok(length)
+    }
+
+    /// Reads the raw bytes of the next message, excluding its length.
+    pub(crate) fn read_message_bytes(&mut self, buffer: &mut Vec<u8>) -> Result<()> {
+        let length = self.expect_length()?;
+        buffer.clear();
+        self.read_bytes(length, buffer)
+    }
+
+    /// Reads the length of the next message, and at most `prefix` bytes of its body into
+    /// `buffer`. Returns the message length; the rest of the body must be read with
+    /// [`Self::read_bytes`] or skipped with [`Self::skip_bytes`].
+    pub(crate) fn read_message_start(&mut self, prefix: u32, buffer: &mut Vec<u8>) -> Result<u32> {
+        let length = self.expect_length()?;
+        buffer.clear();
+        self.read_bytes(length.min(prefix), buffer)?;
+        Ok(length)
+    }
+
+    /// Reads and decodes the next message.
+    pub(crate) fn read_message<M: Message>(&mut self) -> Result<M> {
+        let mut buffer = Vec::new();
+        self.read_message_bytes(&mut buffer)?;
+        Ok(M::parse_from_bytes(&buffer)?)
+    }
+
+    /// Reads the header and skips all postings lists, leaving the scanner at the first document
+    /// record.
+    pub(crate) fn skip_to_documents(&mut self) -> Result<Header> {
+        let header = Header::from_protobuf(self.read_message()?)?;
+        for _ in 0..header.num_postings_lists {
+            self.skip_message()?;
+        }
+        Ok(header)
+    }
+
+    /// Reads the next document record.
+    pub(crate) fn read_document(&mut self) -> Result<DocRecord> {
+        let offset = self.offset;
+        self.read_message()
+            .with_context(|| format!("Invalid document record at byte {}", offset))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::proto;
+    use crate::PostingsList;
+    use protobuf::CodedOutputStream;
+    use std::io::Cursor;
+
+    #[test]
+    fn test_skip_to_documents() -> Result<()> {
+        let mut buffer = Vec::new();
+        {
+            let mut out = CodedOutputStream::vec(&mut buffer);
+            let mut header = proto::Header::default();
+            header.set_num_postings_lists(2);
+            header.set_num_docs(1);
+            out.write_message_no_tag(&header)?;
+            let mut postings_list = PostingsList::default();
+            postings_list.set_term("a".repeat(300));
+            out.write_message_no_tag(&postings_list)?;
+            postings_list.set_term("b".into());
+            out.write_message_no_tag(&postings_list)?;
+            let mut document = DocRecord::default();
+            document.set_collection_docid("D0".into());
+            document.set_doclength(7);
+            out.write_message_no_tag(&document)?;
+            out.flush()?;
+        }
+        let mut scanner = MessageScanner::new(Cursor::new(&buffer), buffer.len() as u64);
+        let header = scanner.skip_to_documents()?;
+        assert_eq!(header.num_postings_lists, 2);
+        let document = scanner.read_document()?;
+        assert_eq!(document.get_collection_docid(), "D0");
+        assert_eq!(document.get_doclength(), 7);
+        assert_eq!(scanner.offset, buffer.len() as u64);
+        assert!(scanner.next_length()?.is_none());
+
+        Ok(())
+    }
+
+    #[test]
+    fn test_truncated_last_list() -> Result<()> {
+        let mut buffer = Vec::new();
+        {
+            let mut out = CodedOutputStream::vec(&mut buffer);
+            let mut header = proto::Header::default();
+            header.set_num_postings_lists(1);
+            out.write_message_no_tag(&header)?;
+            let mut postings_list = PostingsList::default();
+            postings_list.set_term("a".repeat(300));
+            out.write_message_no_tag(&postings_list)?;
+            out.flush()?;
+        }
+        buffer.truncate(buffer.len() - 1);
+        let mut scanner = MessageScanner::new(Cursor::new(&buffer), buffer.len() as u64);
+        assert!(scanner.skip_to_documents().is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_truncated_input() {
+        let mut scanner = MessageScanner::new(Cursor::new(vec![0x80_u8]), 1);
+        assert!(scanner.next_length().is_err());
+        let mut scanner = MessageScanner::new(Cursor::new(vec![5_u8, 0, 0]), 3);
+        let mut buffer = Vec::new();
+        assert!(scanner.read_message_bytes(&mut buffer).is_err());
+        let mut scanner = MessageScanner::new(Cursor::new(vec![5_u8, 0, 0]), 3);
+        assert!(scanner.skip_message().is_err());
+    }
+}
@@ -0,0 +1,61 @@
+//! Document scoring functions.
+
+use std::fmt;
+
+/// Okapi BM25 scoring function, as implemented in PISA.
+///
+/// # Examples
+///
+/// ```
+/// # use ciff::Bm25;
+/// let bm25 = Bm25::default();
+/// let idf = bm25.idf(1, 1000);
+/// assert!(bm25.score(idf, 3, 10.0, 10.0) > bm25.score(idf, 1, 10.0, 10.0));
+/// assert!(bm25.score(idf, 3, 10.0, 10.0) < bm25.max_score(idf));
+/// ```
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct Bm25 {
+    /// Term frequency saturation parameter.
+    pub k1: f32,
+    /// Document length normalization parameter.
+    pub b: f32,
+}
+
+impl Default for Bm25 {
+    fn default() -> Self {
+        Self { k1: 0.9, b: 0.4 }
+    }
+}
+
+impl Bm25 {
+    /// Inverse document frequency of a term occurring in `df` out of `num_documents` documents.
+    #[must_use]
+    #[allow(clippy::cast_precision_loss)]
+    pub fn idf(&self, df: u64, num_documents: u64) -> f32 {
+        let df = df as f32;
+        let num_documents = num_documents as f32;
+        (1.0 + (num_documents - df + 0.5) / (df + 0.5)).ln()
+    }
+
+    /// Score of a term with inverse document frequency `idf`, occurring `tf` times in a document
+    /// of length `doclen`, in a collection with average document length `avg_doclen`.
+    #[must_use]
+    #[allow(clippy::cast_precision_loss)]
+    pub fn score(&self, idf: f32, tf: u32, doclen: f32, avg_doclen: f32) -> f32 {
+        let tf = tf as f32;
+        let norm = self.k1 * (1.0 - self.b + self.b * doclen / avg_doclen);
+        idf * tf * (self.k1 + 1.0) / (tf + norm)
+    }
+
+    /// Upper bound of scores of a term with inverse document frequency `idf`.
+    #[must_use]
+    pub fn max_score(&self, idf: f32) -> f32 {
+        idf * (self.k1 + 1.0)
+    }
+}
+
+impl fmt::Display for Bm25 {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "bm25: k1={} b={}", self.k1, self.b)
+    }
+}
@@ -0,0 +1,492 @@
+//! Topical shards for selective search: documents are clustered by content, so that a query
+//! only needs to be sent to the few shards most likely to hold its results.
+//!
+//! A first pass over the postings lists transposes them into forward partitions of
+//! `(docid, term, weight)` entries by document range, while collecting the vectors of a hashed
+//! sample of documents. Spherical k-means over the sample yields sparse centroids, truncated to
+//! their top terms, to which all documents are then assigned in parallel, partition by
+//! partition. A second pass writes each shard as a PISA binary collection, with documents
+//! renumbered densely, along with shard summaries for resource selection.
+
+use crate::collection::{collection_path, CollectionReader, PisaWriter};
+use crate::deletion::DocumentRemap;
+use crate::forward::{max_postings, ForwardPartitions};
+use crate::inverter::{temp_prefix, TempFiles};
+use crate::{parallel, CollectionInput, DocumentSample, Result};
+use anyhow::{anyhow, bail, Context};
+use std::collections::HashMap;
+use std::convert::TryFrom;
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::ops::Range;
+use std::path::{Path, PathBuf};
+
+/// Sparse vector of term IDs and weights.
+type Vector = Vec<(u32, f32)>;
+
+/// Number of documents assigned at once by a thread.
+const BATCH_SIZE: usize = 1024;
+
+/// Options of [`shard_collection`].
+#[derive(Debug, Clone)]
+pub struct ShardOptions {
+    /// Approximate number of documents sampled to compute centroids.
+    pub sample_size: u32,
+    /// Maximum number of k-means iterations.
+    pub iterations: u32,
+    /// Number of top terms kept in each centroid.
+    pub centroid_terms: usize,
+    /// Seed of the sample.
+    pub seed: u64,
+    /// Number of threads decoding lists and assigning documents.
+    pub threads: usize,
+    /// Approximate number of bytes of forward entries kept in memory at once; entries are
+    /// transposed to partitions on disk if those of the whole collection may not fit.
+    pub memory_budget: usize,
+    /// Directory for temporary files. Defaults to the directory of the output.
+    pub temp_dir: Option<PathBuf>,
+}
+
+impl Default for ShardOptions {
+    fn default() -> Self {
+        Self {
+            sample_size: 10_000,
+            iterations: 10,
+            centroid_terms: 1000,
+            seed: 0,
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+            memory_budget: 1 << 30,
+            temp_dir: None,
+        }
+    }
+}
+
+/// Weight of a term in a document, from its frequency and document frequency.
+#[allow(clippy::cast_precision_loss)]
+fn term_weight(frequency: u32, df: usize, num_documents: u32) -> f32 {
+    if frequency == 0 {
+        return 0.0;
+    }
+    (1.0 + (frequency as f32).ln()) * (1.0 + num_documents as f32 / df as f32).ln()
+}
+
+/// Scales a vector to unit length.
+fn normalize(vector: &mut Vector) {
+    let norm = vector
+        .iter()
+        .map(|&(_, weight)| weight * weight)
+        .sum::<f32>()
+        .sqrt();
+    if norm > 0.0 {
+        for (_, weight) in vector.iter_mut() {
+            *weight /= norm;
+        }
+    }
+}
+
+/// Centroid of `members`, truncated to its `max_terms` top terms and scaled to unit length.
+fn centroid<'a, I: IntoIterator<Item = &'a Vector>>(members: I, max_terms: usize) -> Vector {
+    let mut sums: HashMap<u32, f32> = HashMap::new();
+    for member in members {
+        for &(term, weight) in member {
+            *sums.entry(term).or_default() += weight;
+        }
+    }
+    let mut centroid: Vector = sums.into_iter().collect();
+    centroid.sort_unstable_by(|lhs, rhs| rhs.1.total_cmp(&lhs.1).then(lhs.0.cmp(&rhs.0)));
+    centroid.truncate(max_terms);
+    normalize(&mut centroid);
+    centroid
+}
+
+/// Centroids indexed by term, to score documents against all of them at once.
+struct Centroids {
+    index: HashMap<u32, Vec<(u32, f32)>>,
+    num_centroids: usize,
+}
+
+impl Centroids {
+    fn new(centroids: &[Vector]) -> Self {
+        let mut index: HashMap<u32, Vec<(u32, f32)>> = HashMap::new();
+        for (shard, centroid) in (0..).zip(centroids) {
+            for &(term, weight) in centroid {
+                index.entry(term).or_default().push((shard, weight));
+            }
+        }
+        Self {
+            index,
+            num_centroids: centroids.len(),
+        }
+    }
+
+    /// Centroid most similar to `vector`, or `fallback` if it shares no term with any.
+    fn assign(&self, vector: &[(u32, f32)], fallback: u32) -> u32 {
+        let mut scores = vec![0_f32; self.num_centroids];
+        for (term, weight) in vector {
+            for &(shard, centroid_weight) in self.index.get(term).into_iter().flatten() {
+                scores[shard as usize] += weight * centroid_weight;
+            }
+        }
+        (0..)
+            .zip(scores)
+            .filter(|&(_, score)| score > 0.0)
+            .fold(
+                None,
+                |best: Option<(u32, f32)>, (shard, score)| match best {
+                    Some((_, best_score)) if best_score >= score => best,
+                    _ => Some((shard, score)),
+                },
+            )
+            .map_or(fallback, |(shard, _)| shard)
+    }
+}
+
+/// Clusters the vectors of `sample`, scaled to unit length, into at most `k` centroids.
+fn kmeans(sample: &[Vector], k: u32, options: &ShardOptions) -> Result<Vec<Vector>> {
+    let k = (k as usize).min(sample.len());
+    let mut centroids: Vec<Vector> = (0..k)
+        .map(|index| centroid([&sample[index * sample.len() / k]], options.centroid_terms))
+        .collect();
+    let mut assignments: Vec<u32> = Vec::new();
+    for iteration in 0..options.iterations {
+        let index = Centroids::new(&centroids);
+        let mut next = Vec::with_capacity(sample.len());
+        let threads = options.threads.max(1);
+        parallel::map_ordered(
+            threads,
+            4 * threads,
+            (0..).zip(sample.chunks(BATCH_SIZE)).map(Ok),
+            |(batch, vectors): (usize, &[Vector])| {
+                Ok((batch * BATCH_SIZE..)
+                    .zip(vectors)
+                    .map(|(position, vector)| index.assign(vector, (position % k) as u32))
+                    .collect::<Vec<_>>())
+            },
+            |batch| {
+                next.extend(batch);
+                Ok(())
+            },
+        )?;
+        if next == assignments {
+            eprintln!("K-means converged after {} iterations", iteration + 1);
+            break;
+        }
+        assignments = next;
+        let mut members: Vec<Vec<&Vector>> = vec![Vec::new(); k];
+        for (vector, &shard) in sample.iter().zip(&assignments) {
+            members[shard as usize].push(vector);
+        }
+        for (centroid_vector, members) in centroids.iter_mut().zip(members) {
+            if !members.is_empty() {
+                *centroid_vector = centroid(members, options.centroid_terms);
+            }
+        }
+    }
+    Ok(centroids)
+}
+
+/// Forward transposition of a collection, with the vectors of its sample and its lexicon.
+struct Transposed {
+    forward: ForwardPartitions<f32>,
+    sample: Vec<Vector>,
+    terms: Vec<String>,
+}
+
+/// Reads all lists of `input`, transposing them, and collecting the vectors of a sample.
+fn transpose(
+    input: &CollectionInput,
+    options: &ShardOptions,
+    temp_files: &TempFiles,
+    prefix: &Path,
+) -> Result<Transposed> {
+    let mut reader = CollectionReader::open(input)?;
+    let num_documents = reader.num_documents();
+    let sample = DocumentSample::Fraction {
+        fraction: f64::from(options.sample_size) / f64::from(num_documents.max(1)),
+        seed: options.seed,
+    }
+    .deletions(num_documents);
+    let sampled = DocumentRemap::from_kept(num_documents, |docid| !sample.is_deleted(docid));
+    let mut transposed = Transposed {
+        forward: ForwardPartitions::create(
+            num_documents,
+            max_postings(input)?,
+            options.memory_budget,
+            temp_files,
+            prefix,
+        )?,
+        sample: vec![Vec::new(); sampled.num_kept() as usize],
+        terms: Vec::new(),
+    };
+    let threads = options.threads.max(1);
+    parallel::map_ordered(
+        threads,
+        4 * threads,
+        reader.lists("Transposing postings lists")?,
+        |list| {
+            let list = list.decode(num_documents)?;
+            let df = list.postings.len();
+            let weights: Vec<(u32, f32)> = list
+                .postings
+                .iter()
+                .map(|&(docid, frequency)| (docid, term_weight(frequency, df, num_documents)))
+                .filter(|&(_, weight)| weight > 0.0)
+                .collect();
+            Ok((list.term, weights))
+        },
+        |(term, weights)| {
+            let term_id = u32::try_from(transposed.terms.len())?;
+            transposed.terms.push(term);
+            for (docid, weight) in weights {
+                if let Some(index) = sampled.get(docid) {
+                    transposed.sample[index as usize].push((term_id, weight));
+                }
+                transposed.forward.push((docid, term_id, weight))?;
+            }
+            Ok(())
+        },
+    )?;
+    for vector in &mut transposed.sample {
+        normalize(vector);
+    }
+    Ok(transposed)
+}
+
+/// Assigns each document of `forward` to the shard of its most similar centroid, or to
+/// `docid % num_shards` if it shares no term with any.
+fn assign_documents(
+    forward: ForwardPartitions<f32>,
+    centroids: &Centroids,
+    num_shards: u32,
+    threads: usize,
+) -> Result<Vec<u32>> {
+    eprintln!("Assigning documents to shards");
+    let mut shards: Vec<u32> = (0..forward.num_documents())
+        .map(|docid| docid % num_shards)
+        .collect();
+    forward.for_each(|_, mut entries| {
+        entries.sort_unstable_by_key(|&(docid, _, _)| docid);
+        let mut documents: Vec<Range<usize>> = Vec::new();
+        for (position, &(docid, _, _)) in entries.iter().enumerate() {
+            match documents.last_mut() {
+                Some(last) if entries[last.start].0 == docid => last.end = position + 1,
+                _ => documents.push(position..position + 1),
+            }
+        }
+        let entries = &entries;
+        parallel::map_ordered(
+            threads,
+            4 * threads,
+            documents.chunks(BATCH_SIZE).map(Ok),
+            |batch| {
+                Ok(batch
+                    .iter()
+                    .map(|range| {
+                        let docid = entries[range.start].0;
+                        let vector: Vector = entries[range.clone()]
+                            .iter()
+                            .map(|&(_, term, weight)| (term, weight))
+                            .collect();
+                        (docid, centroids.assign(&vector, docid % num_shards))
+                    })
+                    .collect::<Vec<_>>())
+            },
+            |batch| {
+                for (docid, shard) in batch {
+                    shards[docid as usize] = shard;
+                }
+                Ok(())
+            },
+        )
+    })?;
+    Ok(shards)
+}
+
+/// Writes each shard as a binary collection, with the term statistics of all shards and the
+/// document map.
+fn write_shards(
+    input: &CollectionInput,
+    output: &Path,
+    shards: &[u32],
+    num_shards: u32,
+    threads: usize,
+) -> Result<()> {
+    let mut sizes = vec![0_u32; num_shards as usize];
+    let ids: Vec<u32> = shards
+        .iter()
+        .map(|&shard| {
+            sizes[shard as usize] += 1;
+            sizes[shard as usize] - 1
+        })
+        .collect();
+    let mut writers = (0..num_shards)
+        .zip(&sizes)
+        .map(|(shard, &size)| {
+            PisaWriter::create(&collection_path(output, &shard.to_string()), size)
+        })
+        .collect::<Result<Vec<_>>>()?;
+    let create = |extension: &str| -> Result<BufWriter<File>> {
+        let path = collection_path(output, extension);
+        Ok(BufWriter::new(File::create(&path).with_context(|| {
+            format!("Unable to create {}", path.display())
+        })?))
+    };
+    let mut summary = create("summary")?;
+    let mut reader = CollectionReader::open(input)?;
+    let num_documents = reader.num_documents();
+    if num_documents as usize != shards.len() {
+        bail!("The collection changed while sharding");
+    }
+    parallel::map_ordered(
+        threads,
+        4 * threads,
+        reader.lists("Writing shards")?,
+        |list| {
+            let list = list.decode(num_documents)?;
+            let mut postings: Vec<Vec<(u32, u32)>> = vec![Vec::new(); num_shards as usize];
+            for &(docid, frequency) in &list.postings {
+                postings[shards[docid as usize] as usize].push((ids[docid as usize], frequency));
+            }
+            (0_u32..)
+                .zip(postings)
+                .filter(|(_, postings)| !postings.is_empty())
+                .map(|(shard, postings)| {
+                    let cf: u64 = postings.iter().map(|&(_, tf)| u64::from(tf)).sum();
+                    let encoded = PisaWriter::encode(&list.term, &postings)?;
+                    let line = format!("{}\t{}\t{}\t{}\n", list.term, shard, postings.len(), cf);
+                    Ok((shard, encoded, line))
+                })
+                .collect::<Result<Vec<_>>>()
+        },
+        |lists| {
+            for (shard, encoded, line) in lists {
+                writers[shard as usize].write_list(&encoded)?;
+                summary.write_all(line.as_bytes())?;
+            }
+            Ok(())
+        },
+    )?;
+    summary.flush()?;
+
+    eprintln!("Writing documents");
+    let mut docmap = create("docmap")?;
+    for (docid, document) in reader.documents()?.enumerate() {
+        let shard = *shards
+            .get(docid)
+            .ok_or_else(|| anyhow!("Too many documents"))?;
+        writers[shard as usize].write_document(&document?)?;
+        writeln!(docmap, "{}\t{}", shard, ids[docid])?;
+    }
+    docmap.flush()?;
+    for writer in writers {
+        writer.finish()?;
+    }
+    Ok(())
+}
+
+/// Clusters the documents of `input` into `num_shards` topical shards, for selective search.
+///
+/// Writes:
+/// - each shard `i` as a binary collection at `<output>.<i>`, with its documents in their
+///   original order, renumbered densely;
+/// - `<output>.docmap`, with the shard and new ID of each document, one per line;
+/// - `<output>.summary`, with the term, shard, document frequency, and collection frequency of
+///   each list of each shard, one per line in the order of the input lexicon;
+/// - `<output>.centroids`, with the shard, term, and weight of each term of each centroid.
+///
+/// Documents sharing no term with any centroid are assigned by their ID, round robin.
+///
+/// # Errors
+///
+/// Returns an error when:
+/// - `num_shards` is 0,
+/// - an IO error occurs,
+/// - the input is malformed.
+pub fn shard_collection(
+    input: &CollectionInput,
+    output: &Path,
+    num_shards: u32,
+    options: &ShardOptions,
+) -> Result<()> {
+    if num_shards == 0 {
+        bail!("At least one shard is required");
+    }
+    let temp_files = TempFiles::default();
+    let prefix = temp_prefix(options.temp_dir.as_deref(), output)?;
+    let transposed = transpose(input, options, &temp_files, &prefix)?;
+
+    eprintln!(
+        "Clustering a sample of {} documents",
+        transposed.sample.len()
+    );
+    let centroids = kmeans(&transposed.sample, num_shards, options)?;
+    let path = collection_path(output, "centroids");
+    let mut writer = BufWriter::new(
+        File::create(&path).with_context(|| format!("Unable to create {}", path.display()))?,
+    );
+    for (shard, centroid) in centroids.iter().enumerate() {
+        for &(term, weight) in centroid {
+            writeln!(
+                writer,
+                "{}\t{}\t{}",
+                shard, transposed.terms[term as usize], weight
+            )?;
+        }
+    }
+    writer.flush()?;
+    drop(transposed.terms);
+
+    let threads = options.threads.max(1);
+    let centroids = Centroids::new(&centroids);
+    let shards = assign_documents(transposed.forward, &centroids, num_shards, threads)?;
+    write_shards(input, output, &shards, num_shards, threads)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_kmeans() -> Result<()> {
+        // Two topics, over terms 0-2 and 3-5.
+        let mut sample: Vec<Vector> = (0..20_u32)
+            .map(|index| {
+                let base = if index % 2 == 0 { 0 } else { 3 };
+                vec![
+                    (base, 1.0),
+                    (base + 1 + index % 3 / 2, 0.5),
+                    (base + 2, 0.25),
+                ]
+            })
+            .collect();
+        for vector in &mut sample {
+            normalize(vector);
+        }
+        let options = ShardOptions {
+            threads: 2,
+            ..ShardOptions::default()
+        };
+        let centroids = kmeans(&sample, 2, &options)?;
+        let index = Centroids::new(&centroids);
+        let assignments: Vec<u32> = sample
+            .iter()
+            .map(|vector| index.assign(vector, 7))
+            .collect();
+        assert_ne!(assignments[0], assignments[1]);
+        for (position, &shard) in assignments.iter().enumerate() {
+            assert_eq!(shard, assignments[position % 2]);
+        }
+        assert_eq!(index.assign(&[(10, 1.0)], 7), 7);
+        Ok(())
+    }
+
+    #[test]
+    fn test_centroid() {
+        let members = vec![vec![(0, 3.0), (1, 1.0)], vec![(0, 1.0), (2, 2.0)]];
+        let centroid = centroid(&members, 2);
+        let terms: Vec<_> = centroid.iter().map(|&(term, _)| term).collect();
+        assert_eq!(terms, vec![0, 2]);
+        let norm: f32 = centroid.iter().map(|&(_, weight)| weight * weight).sum();
+        assert!((norm - 1.0).abs() < 1e-6);
+    }
+}
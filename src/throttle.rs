@@ -0,0 +1,299 @@
+//! Bandwidth limits on reads and writes, so that conversions can run next to latency-sensitive
+//! workloads without saturating the disks.
+//!
+//! Each direction is limited by a token bucket refilled at the maximum rate. Transfers take
+//! tokens before (writes) or after (reads) they happen, possibly running into debt, and then
+//! sleep until the debt is paid off, so that accounting costs one lock per buffer.
+//!
+//! Rates can be changed while a conversion runs by editing a control file, which is checked for
+//! modifications at most once per second. Each line sets a rate in MB/s (10^6 bytes per second)
+//! or removes it, e.g.:
+//!
+//! ```text
+//! read 200
+//! write unlimited
+//! ```
+
+use crate::Result;
+use anyhow::{anyhow, bail, Context};
+use std::fs;
+use std::io::{self, Read, Seek, SeekFrom, Write};
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant, SystemTime};
+
+/// Bursts allowed after idle periods, in seconds of transfer at the maximum rate.
+const BURST_SECONDS: f64 = 0.05;
+/// Minimum interval between checks of the control file.
+const POLL_INTERVAL: Duration = Duration::from_secs(1);
+
+/// Options of bandwidth limits.
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct ThrottleOptions {
+    /// Maximum read bandwidth in MB/s.
+    pub max_read_mbps: Option<f64>,
+    /// Maximum write bandwidth in MB/s.
+    pub max_write_mbps: Option<f64>,
+    /// File whose lines `read <MB/s>` and `write <MB/s>` override the limits while running;
+    /// `unlimited` removes a limit. The file need not exist.
+    pub control_file: Option<PathBuf>,
+}
+
+/// Direction of a transfer.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum Direction {
+    Read,
+    Write,
+}
+
+#[derive(Debug)]
+struct Bucket {
+    /// Bytes per second, or `None` if unlimited.
+    rate: Option<f64>,
+    /// Available bytes; negative when in debt.
+    tokens: f64,
+    updated: Instant,
+}
+
+impl Bucket {
+    fn new(rate_mbps: Option<f64>) -> Self {
+        Self {
+            rate: rate_mbps.map(bytes_per_second),
+            tokens: 0.0,
+            updated: Instant::now(),
+        }
+    }
+
+    /// Takes `bytes` tokens, and returns how long to wait for the debt to be paid off.
+    #[allow(clippy::cast_precision_loss)]
+    fn take(&mut self, bytes: usize, now: Instant) -> Option<Duration> {
+        let rate = self.rate?;
+        let elapsed = now.saturating_duration_since(self.updated).as_secs_f64();
+        self.tokens = (self.tokens + elapsed * rate).min(rate * BURST_SECONDS) - bytes as f64;
+        self.updated = now;
+        if self.tokens < 0.0 {
+            Some(Duration::from_secs_f64(-self.tokens / rate))
+        } else {
+            None
+        }
+    }
+
+    fn set_rate(&mut self, rate_mbps: Option<f64>) {
+        self.rate = rate_mbps.map(bytes_per_second);
+        // Debt accumulated at the previous rate is forgiven.
+        self.tokens = self.tokens.max(0.0);
+    }
+}
+
+fn bytes_per_second(mbps: f64) -> f64 {
+    mbps * 1e6
+}
+
+fn parse_rate(value: &str) -> Result<Option<f64>> {
+    if value == "unlimited" {
+        return Ok(None);
+    }
+    let rate: f64 = value
+        .parse()
+        .map_err(|_| anyhow!("Invalid rate: {}", value))?;
+    if rate.is_finite() && rate > 0.0 {
+        Ok(Some(rate))
+    } else {
+        Err(anyhow!("Rate must be positive, but is {}", value))
+    }
+}
+
+/// Parses a control file, and returns the read and write limits it sets.
+#[allow(clippy::type_complexity)]
+fn parse_control(contents: &str) -> Result<(Option<Option<f64>>, Option<Option<f64>>)> {
+    let mut read = None;
+    let mut write = None;
+    for (line_number, line) in contents.lines().enumerate() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+        let mut fields = line.split_whitespace();
+        let (Some(direction), Some(value), None) = (fields.next(), fields.next(), fields.next())
+        else {
+            bail!("Line {}: expected `read|write <MB/s>`", line_number + 1);
+        };
+        let rate = parse_rate(value).with_context(|| format!("Line {}", line_number + 1))?;
+        match direction {
+            "read" => read = Some(rate),
+            "write" => write = Some(rate),
+            _ => bail!("Line {}: unknown direction {}", line_number + 1, direction),
+        }
+    }
+    Ok((read, write))
+}
+
+#[derive(Debug)]
+struct State {
+    read: Bucket,
+    write: Bucket,
+    polled: Instant,
+    control_modified: Option<SystemTime>,
+}
+
+/// Read and write bandwidth limits shared by all files of a conversion.
+#[derive(Debug)]
+pub(crate) struct Throttle {
+    state: Mutex<State>,
+    control_file: Option<PathBuf>,
+}
+
+impl Throttle {
+    /// Returns `None` if `options` set no limit and no control file, so that unthrottled
+    /// conversions pay nothing.
+    pub(crate) fn new(options: &ThrottleOptions) -> Result<Option<Arc<Self>>> {
+        for rate in options.max_read_mbps.iter().chain(&options.max_write_mbps) {
+            if !(rate.is_finite() && *rate > 0.0) {
+                bail!("Bandwidth limit must be positive, but is {}", rate);
+            }
+        }
+        if options.max_read_mbps.is_none()
+            && options.max_write_mbps.is_none()
+            && options.control_file.is_none()
+        {
+            return Ok(None);
+        }
+        let throttle = Self {
+            state: Mutex::new(State {
+                read: Bucket::new(options.max_read_mbps),
+                write: Bucket::new(options.max_write_mbps),
+                polled: Instant::now(),
+                control_modified: None,
+            }),
+            control_file: options.control_file.clone(),
+        };
+        if let Some(path) = &throttle.control_file {
+            let mut state = throttle.state.lock().expect("throttle lock");
+            Self::poll(path, &mut state);
+        }
+        Ok(Some(Arc::new(throttle)))
+    }
+
+    /// Reloads limits from the control file if it was modified. Errors are reported and leave
+    /// the limits unchanged, so that a bad edit does not abort a long conversion.
+    fn poll(path: &Path, state: &mut State) {
+        let Ok(modified) = fs::metadata(path).and_then(|metadata| metadata.modified()) else {
+            return;
+        };
+        if state.control_modified == Some(modified) {
+            return;
+        }
+        state.control_modified = Some(modified);
+        let result = fs::read_to_string(path)
+            .map_err(anyhow::Error::from)
+            .and_then(|contents| parse_control(&contents));
+        match result {
+            Ok((read, write)) => {
+                if let Some(rate) = read {
+                    state.read.set_rate(rate);
+                }
+                if let Some(rate) = write {
+                    state.write.set_rate(rate);
+                }
+            }
+            Err(error) => eprintln!("Ignoring {}: {:#}", path.display(), error),
+        }
+    }
+
+    /// Accounts for a transfer of `bytes`, sleeping if it exceeds the limit.
+    pub(crate) fn acquire(&self, direction: Direction, bytes: usize) {
+        let wait = {
+            let mut state = self.state.lock().expect("throttle lock");
+            let now = Instant::now();
+            if let Some(path) = &self.control_file {
+                if now.saturating_duration_since(state.polled) >= POLL_INTERVAL {
+                    state.polled = now;
+                    Self::poll(path, &mut state);
+                }
+            }
+            match direction {
+                Direction::Read => state.read.take(bytes, now),
+                Direction::Write => state.write.take(bytes, now),
+            }
+        };
+        if let Some(wait) = wait {
+            std::thread::sleep(wait);
+        }
+    }
+}
+
+/// Reader or writer whose transfers are limited by a [`Throttle`], if any.
+pub(crate) struct Throttled<T> {
+    inner: T,
+    throttle: Option<Arc<Throttle>>,
+}
+
+impl<T> Throttled<T> {
+    pub(crate) fn new(inner: T, throttle: Option<Arc<Throttle>>) -> Self {
+        Self { inner, throttle }
+    }
+}
+
+impl<T: Read> Read for Throttled<T> {
+    fn read(&mut self, buffer: &mut [u8]) -> io::Result<usize> {
+        let length = self.inner.read(buffer)?;
+        if let Some(throttle) = &self.throttle {
+            throttle.acquire(Direction::Read, length);
+        }
+        Ok(length)
+    }
+}
+
+impl<T: Seek> Seek for Throttled<T> {
+    fn seek(&mut self, position: SeekFrom) -> io::Result<u64> {
+        self.inner.seek(position)
+    }
+}
+
+impl<T: Write> Write for Throttled<T> {
+    fn write(&mut self, data: &[u8]) -> io::Result<usize> {
+        if let Some(throttle) = &self.throttle {
+            throttle.acquire(Direction::Write, data.len());
+        }
+        self.inner.write(data)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.inner.flush()
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_bucket() {
+        let start = Instant::now();
+        let mut bucket = Bucket::new(Some(1.0));
+        assert_eq!(
+            bucket.take(500_000, start),
+            Some(Duration::from_millis(500))
+        );
+        // Half a second later, the debt is paid off.
+        assert_eq!(bucket.take(0, start + Duration::from_millis(500)), None);
+        // Idle time accumulates at most a short burst.
+        let later = start + Duration::from_secs(10);
+        assert_eq!(bucket.take(50_000, later), None);
+        assert!(bucket.take(1, later).is_some());
+        bucket.set_rate(None);
+        assert_eq!(bucket.take(1 << 30, later), None);
+    }
+
+    #[test]
+    fn test_parse_control() {
+        assert_eq!(parse_control("").unwrap(), (None, None));
+        assert_eq!(
+            parse_control("# limits\nread 20\n\nwrite unlimited\n").unwrap(),
+            (Some(Some(20.0)), Some(None))
+        );
+        assert!(parse_control("read").is_err());
+        assert!(parse_control("read -1").is_err());
+        assert!(parse_control("erase 10").is_err());
+    }
+}
@@ -0,0 +1,187 @@
+//! Two-tier indexes: a small hot tier of top-quality documents or high-impact postings, served
+//! first, and a cold tier with the full collection.
+//!
+//! Both tiers are written as PISA binary collections in a single pass over the input, each with
+//! its own lexicon of the terms it has postings for, and its own document sizes and titles. A
+//! document map lists, for each document of the hot tier, its ID in the cold tier, which is that
+//! of the input.
+
+use crate::collection::{collection_path, CollectionReader, PisaWriter};
+use crate::deletion::DocumentRemap;
+use crate::{parallel, CollectionInput, Result};
+use anyhow::{bail, Context};
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::path::{Path, PathBuf};
+
+/// How postings are split between the tiers.
+#[derive(Debug, Clone, PartialEq)]
+pub enum TierSplit {
+    /// The hot tier holds the `count` documents with the highest static ranks, renumbered
+    /// densely in their original order; ties are broken by lower document IDs.
+    StaticRank {
+        /// Static rank of each document.
+        ranks: Vec<f64>,
+        /// Number of documents in the hot tier.
+        count: u32,
+    },
+    /// The hot tier holds the postings with at least this weight, or term frequency.
+    MinWeight(u32),
+    /// The hot tier holds the lists with at most this document frequency.
+    MaxDf(u32),
+}
+
+/// Options of [`split_tiers`].
+#[derive(Debug, Clone)]
+pub struct TierOptions {
+    /// Number of threads decoding and splitting postings lists.
+    pub threads: usize,
+}
+
+impl Default for TierOptions {
+    fn default() -> Self {
+        Self {
+            threads: std::thread::available_parallelism().map_or(1, usize::from),
+        }
+    }
+}
+
+/// Table of the documents of the hot tier, for splits by static rank.
+fn hot_documents(ranks: &[f64], count: u32, num_documents: u32) -> Result<DocumentRemap> {
+    if ranks.len() != num_documents as usize {
+        bail!(
+            "Expected {} static ranks but got {}",
+            num_documents,
+            ranks.len()
+        );
+    }
+    let mut order: Vec<u32> = (0..num_documents).collect();
+    let count = count.min(num_documents) as usize;
+    if count > 0 && count < order.len() {
+        order.select_nth_unstable_by(count - 1, |&lhs, &rhs| {
+            ranks[rhs as usize]
+                .total_cmp(&ranks[lhs as usize])
+                .then(lhs.cmp(&rhs))
+        });
+    }
+    let mut hot = vec![false; num_documents as usize];
+    for &docid in &order[..count] {
+        hot[docid as usize] = true;
+    }
+    Ok(DocumentRemap::from_kept(num_documents, |docid| {
+        hot[docid as usize]
+    }))
+}
+
+/// Writes the hot tier of `input` to `<output>.hot`, the cold tier to `<output>.cold`, and the
+/// document map to `<output>.docmap`.
+///
+/// Lists of the hot tier left without postings are dropped. When splitting postings, the hot
+/// tier keeps all documents, with their lengths in the input, so that scores of both tiers are
+/// comparable. Lists are processed in parallel by [`TierOptions::threads`] threads.
+///
+/// # Errors
+///
+/// Returns an error when:
+/// - an IO error occurs,
+/// - the input is malformed,
+/// - the number of static ranks differs from the number of documents.
+pub fn split_tiers(
+    input: &CollectionInput,
+    output: &Path,
+    split: &TierSplit,
+    options: &TierOptions,
+) -> Result<()> {
+    let mut reader = CollectionReader::open(input)?;
+    let num_documents = reader.num_documents();
+    let hot_documents = match split {
+        TierSplit::StaticRank { ranks, count } => {
+            Some(hot_documents(ranks, *count, num_documents)?)
+        }
+        _ => None,
+    };
+    let tier = |name: &str| PathBuf::from(format!("{}.{}", output.display(), name));
+    let mut hot = PisaWriter::create(
+        &tier("hot"),
+        hot_documents
+            .as_ref()
+            .map_or(num_documents, DocumentRemap::num_kept),
+    )?;
+    let mut cold = PisaWriter::create(&tier("cold"), num_documents)?;
+    let threads = options.threads.max(1);
+    parallel::map_ordered(
+        threads,
+        4 * threads,
+        reader.lists("Splitting postings lists")?,
+        |list| {
+            let list = list.decode(num_documents)?;
+            let hot_postings: Vec<(u32, u32)> = match (split, &hot_documents) {
+                (_, Some(remap)) => list
+                    .postings
+                    .iter()
+                    .filter_map(|&(docid, weight)| Some((remap.get(docid)?, weight)))
+                    .collect(),
+                (TierSplit::MinWeight(min_weight), None) => list
+                    .postings
+                    .iter()
+                    .filter(|&&(_, weight)| weight >= *min_weight)
+                    .copied()
+                    .collect(),
+                (TierSplit::MaxDf(max_df), None) if list.postings.len() <= *max_df as usize => {
+                    list.postings.clone()
+                }
+                _ => Vec::new(),
+            };
+            let hot_list = if hot_postings.is_empty() {
+                None
+            } else {
+                Some(PisaWriter::encode(&list.term, &hot_postings)?)
+            };
+            Ok((hot_list, PisaWriter::encode(&list.term, &list.postings)?))
+        },
+        |(hot_list, cold_list)| {
+            if let Some(hot_list) = hot_list {
+                hot.write_list(&hot_list)?;
+            }
+            cold.write_list(&cold_list)
+        },
+    )?;
+
+    eprintln!("Splitting documents");
+    let docmap_path = collection_path(output, "docmap");
+    let mut docmap = BufWriter::new(
+        File::create(&docmap_path)
+            .with_context(|| format!("Unable to create {}", docmap_path.display()))?,
+    );
+    for (docid, document) in (0_u32..).zip(reader.documents()?) {
+        let document = document?;
+        let is_hot = hot_documents
+            .as_ref()
+            .is_none_or(|remap| remap.get(docid).is_some());
+        if is_hot {
+            hot.write_document(&document)?;
+            writeln!(docmap, "{}", docid)?;
+        }
+        cold.write_document(&document)?;
+    }
+    docmap.flush()?;
+    hot.finish()?;
+    cold.finish()
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_hot_documents() -> Result<()> {
+        let ranks = [0.5, 2.0, 1.0, 2.0, 0.1];
+        let remap = hot_documents(&ranks, 3, 5)?;
+        let ids: Vec<_> = (0..5).map(|docid| remap.get(docid)).collect();
+        assert_eq!(ids, vec![None, Some(0), Some(1), Some(2), None]);
+        assert_eq!(hot_documents(&ranks, 10, 5)?.num_kept(), 5);
+        assert_eq!(hot_documents(&ranks, 0, 5)?.num_kept(), 0);
+        assert!(hot_documents(&ranks, 1, 4).is_err());
+        Ok(())
+    }
+}
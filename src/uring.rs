@@ -0,0 +1,699 @@
+//! Minimal `io_uring` interface (Linux 5.1 or later) for sequential reads and writes of regular
+//! files, with several large registered buffers in flight at once.
+
+use crate::cache::{DropBehind, WINDOW};
+use crate::throttle::{Direction, Throttle};
+use std::collections::VecDeque;
+use std::convert::TryFrom;
+use std::fs::File;
+use std::io::{self, BufRead, Read, Write};
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::Arc;
+
+const IORING_OFF_SQ_RING: libc::off_t = 0;
+const IORING_OFF_CQ_RING: libc::off_t = 0x800_0000;
+const IORING_OFF_SQES: libc::off_t = 0x1000_0000;
+const IORING_ENTER_GETEVENTS: u32 = 1;
+const IORING_REGISTER_BUFFERS: u32 = 0;
+const IORING_OP_READ_FIXED: u8 = 4;
+const IORING_OP_WRITE_FIXED: u8 = 5;
+
+/// Number of buffers in flight per file.
+pub(crate) const BUFFERS: usize = 8;
+/// Size of each buffer.
+pub(crate) const BUFFER_SIZE: usize = 1 << 20;
+
+#[repr(C)]
+#[derive(Debug, Default)]
+struct SqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    flags: u32,
+    dropped: u32,
+    array: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Debug, Default)]
+struct CqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    overflow: u32,
+    cqes: u32,
+    flags: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Debug, Default)]
+struct Params {
+    sq_entries: u32,
+    cq_entries: u32,
+    flags: u32,
+    sq_thread_cpu: u32,
+    sq_thread_idle: u32,
+    features: u32,
+    wq_fd: u32,
+    resv: [u32; 3],
+    sq_off: SqringOffsets,
+    cq_off: CqringOffsets,
+}
+
+/// Submission queue entry.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+struct Sqe {
+    opcode: u8,
+    flags: u8,
+    ioprio: u16,
+    fd: i32,
+    off: u64,
+    addr: u64,
+    len: u32,
+    rw_flags: u32,
+    user_data: u64,
+    buf_index: u16,
+    personality: u16,
+    splice_fd_in: i32,
+    addr3: u64,
+    pad: u64,
+}
+
+/// Completion queue entry.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct Cqe {
+    user_data: u64,
+    res: i32,
+    flags: u32,
+}
+
+/// Shared memory region of a ring.
+struct Mapping {
+    pointer: *mut libc::c_void,
+    length: usize,
+}
+
+impl Mapping {
+    fn new(fd: RawFd, length: usize, offset: libc::off_t) -> io::Result<Self> {
+        // SAFETY: a fresh shared mapping of the ring file descriptor, unmapped on drop.
+        let pointer = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                length,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_POPULATE,
+                fd,
+                offset,
+            )
+        };
+        if pointer == libc::MAP_FAILED {
+            Err(io::Error::last_os_error())
+        } else {
+            Ok(Self { pointer, length })
+        }
+    }
+
+    /// Pointer to an object at `offset` bytes from the start of the mapping.
+    fn at<T>(&self, offset: u32) -> *mut T {
+        debug_assert!((offset as usize) < self.length);
+        // SAFETY: offsets come from the kernel and lie within the mapping.
+        unsafe { self.pointer.cast::<u8>().add(offset as usize).cast() }
+    }
+}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        // SAFETY: the region was mapped in `Mapping::new` and is not used after drop.
+        unsafe {
+            libc::munmap(self.pointer, self.length);
+        }
+    }
+}
+
+/// An `io_uring` instance, used from a single thread at a time.
+struct Ring {
+    sq_head: *const AtomicU32,
+    sq_tail: *const AtomicU32,
+    sq_mask: u32,
+    sq_entries: u32,
+    sq_array: *mut u32,
+    sqes: *mut Sqe,
+    cq_head: *const AtomicU32,
+    cq_tail: *const AtomicU32,
+    cq_mask: u32,
+    cqes: *const Cqe,
+    /// Operations queued or submitted, whose completions have not been returned yet.
+    in_flight: usize,
+    /// Operations queued but not submitted to the kernel yet.
+    pending: u32,
+    // Mappings must be dropped before the file descriptor is closed.
+    _mappings: [Mapping; 3],
+    fd: OwnedFd,
+}
+
+// SAFETY: the ring is only accessed through `&mut self`, and the kernel side is thread-agnostic.
+unsafe impl Send for Ring {}
+
+fn check(result: libc::c_long) -> io::Result<u32> {
+    u32::try_from(result).map_err(|_| io::Error::last_os_error())
+}
+
+impl Ring {
+    fn new(entries: u32) -> io::Result<Self> {
+        let mut params = Params::default();
+        // SAFETY: `params` is a valid `io_uring_params` structure.
+        let fd = check(unsafe {
+            libc::syscall(
+                libc::SYS_io_uring_setup,
+                entries,
+                std::ptr::addr_of_mut!(params),
+            )
+        })?;
+        // SAFETY: the kernel returned a new file descriptor that we own.
+        let fd = unsafe { OwnedFd::from_raw_fd(fd as RawFd) };
+        let raw_fd = fd.as_raw_fd();
+        let sq_length =
+            params.sq_off.array as usize + params.sq_entries as usize * std::mem::size_of::<u32>();
+        let cq_length =
+            params.cq_off.cqes as usize + params.cq_entries as usize * std::mem::size_of::<Cqe>();
+        let sqes_length = params.sq_entries as usize * std::mem::size_of::<Sqe>();
+        let sq = Mapping::new(raw_fd, sq_length, IORING_OFF_SQ_RING)?;
+        let cq = Mapping::new(raw_fd, cq_length, IORING_OFF_CQ_RING)?;
+        let sqes = Mapping::new(raw_fd, sqes_length, IORING_OFF_SQES)?;
+        // SAFETY: the ring masks are written by the kernel before setup returns.
+        let (sq_mask, cq_mask) = unsafe {
+            (
+                *sq.at::<u32>(params.sq_off.ring_mask),
+                *cq.at::<u32>(params.cq_off.ring_mask),
+            )
+        };
+        Ok(Self {
+            sq_head: sq.at(params.sq_off.head),
+            sq_tail: sq.at(params.sq_off.tail),
+            sq_mask,
+            sq_entries: params.sq_entries,
+            sq_array: sq.at(params.sq_off.array),
+            sqes: sqes.at(0),
+            cq_head: cq.at(params.cq_off.head),
+            cq_tail: cq.at(params.cq_off.tail),
+            cq_mask,
+            cqes: cq.at(params.cq_off.cqes),
+            in_flight: 0,
+            pending: 0,
+            _mappings: [sq, cq, sqes],
+            fd,
+        })
+    }
+
+    fn enter(&self, to_submit: u32, min_complete: u32, flags: u32) -> io::Result<u32> {
+        loop {
+            // SAFETY: no signal mask is passed.
+            let result = check(unsafe {
+                libc::syscall(
+                    libc::SYS_io_uring_enter,
+                    self.fd.as_raw_fd(),
+                    to_submit,
+                    min_complete,
+                    flags,
+                    std::ptr::null::<libc::sigset_t>(),
+                    0,
+                )
+            });
+            match result {
+                Err(error) if error.kind() == io::ErrorKind::Interrupted => {}
+                result => return result,
+            }
+        }
+    }
+
+    /// Registers buffers, so that they are mapped once instead of on every operation.
+    ///
+    /// # Safety
+    ///
+    /// The buffers must stay allocated and must not move until the ring is dropped.
+    unsafe fn register_buffers(&self, buffers: &mut [Vec<u8>]) -> io::Result<()> {
+        let iovecs: Vec<libc::iovec> = buffers
+            .iter_mut()
+            .map(|buffer| libc::iovec {
+                iov_base: buffer.as_mut_ptr().cast(),
+                iov_len: buffer.capacity(),
+            })
+            .collect();
+        check(libc::syscall(
+            libc::SYS_io_uring_register,
+            self.fd.as_raw_fd(),
+            IORING_REGISTER_BUFFERS,
+            iovecs.as_ptr(),
+            iovecs.len() as u32,
+        ))
+        .map(|_| ())
+    }
+
+    /// Queues an operation. Queued operations are submitted together, once half of the
+    /// submission queue is pending, or by [`Ring::submit`] or [`Ring::wait`].
+    ///
+    /// # Safety
+    ///
+    /// Memory referenced by the entry must remain valid until its completion is returned by
+    /// [`Ring::wait`].
+    unsafe fn push(&mut self, sqe: Sqe) -> io::Result<()> {
+        let tail = (*self.sq_tail).load(Ordering::Relaxed);
+        if tail.wrapping_sub((*self.sq_head).load(Ordering::Acquire)) >= self.sq_entries {
+            self.submit()?;
+            if tail.wrapping_sub((*self.sq_head).load(Ordering::Acquire)) >= self.sq_entries {
+                return Err(io::Error::other("io_uring submission queue is full"));
+            }
+        }
+        let index = tail & self.sq_mask;
+        *self.sqes.add(index as usize) = sqe;
+        *self.sq_array.add(index as usize) = index;
+        (*self.sq_tail).store(tail.wrapping_add(1), Ordering::Release);
+        self.in_flight += 1;
+        self.pending += 1;
+        if self.pending >= (self.sq_entries / 2).max(1) {
+            self.submit()?;
+        }
+        Ok(())
+    }
+
+    /// Submits all queued operations with as few system calls as possible.
+    fn submit(&mut self) -> io::Result<()> {
+        while self.pending > 0 {
+            match self.enter(self.pending, 0, 0)? {
+                0 => return Err(io::Error::other("io_uring submitted no operations")),
+                submitted => self.pending -= submitted.min(self.pending),
+            }
+        }
+        Ok(())
+    }
+
+    /// Submits queued operations, then waits for the next completion, and returns its user
+    /// data and result.
+    fn wait(&mut self) -> io::Result<(u64, i32)> {
+        if self.in_flight == 0 {
+            return Err(io::Error::other("No io_uring operations in flight"));
+        }
+        loop {
+            // SAFETY: head and tail point into the completion ring mapping.
+            let (head, tail) = unsafe {
+                (
+                    (*self.cq_head).load(Ordering::Relaxed),
+                    (*self.cq_tail).load(Ordering::Acquire),
+                )
+            };
+            if head != tail {
+                // SAFETY: entries between head and tail were written by the kernel.
+                let cqe = unsafe { *self.cqes.add((head & self.cq_mask) as usize) };
+                unsafe { (*self.cq_head).store(head.wrapping_add(1), Ordering::Release) };
+                self.in_flight -= 1;
+                return Ok((cqe.user_data, cqe.res));
+            }
+            let submitted = self.enter(self.pending, 1, IORING_ENTER_GETEVENTS)?;
+            self.pending -= submitted.min(self.pending);
+        }
+    }
+
+    /// Waits for all operations in flight, so that their buffers can be released.
+    /// Returns `false` if the ring failed, in which case buffers must be leaked.
+    fn drain(&mut self) -> bool {
+        while self.in_flight > 0 {
+            if self.wait().is_err() {
+                return false;
+            }
+        }
+        true
+    }
+}
+
+fn allocate_buffers(count: usize, size: usize) -> Vec<Vec<u8>> {
+    (0..count).map(|_| Vec::with_capacity(size)).collect()
+}
+
+fn completion_error(result: i32) -> io::Result<usize> {
+    usize::try_from(result).map_err(|_| io::Error::from_raw_os_error(-result))
+}
+
+/// Read in flight or completed, in file order.
+struct ReadSlot {
+    buffer: usize,
+    offset: u64,
+    length: usize,
+    done: bool,
+}
+
+/// Sequential reader keeping several large reads in flight.
+pub(crate) struct UringReader {
+    ring: Ring,
+    file: File,
+    file_length: u64,
+    buffers: Vec<Vec<u8>>,
+    slots: VecDeque<ReadSlot>,
+    next_offset: u64,
+    position: usize,
+    drop_behind: Option<DropBehind>,
+    throttle: Option<Arc<Throttle>>,
+}
+
+impl UringReader {
+    /// Starts reading `file` from `offset`, dropping consumed buffers from the page cache if
+    /// `drop_behind` is set, and limiting the read bandwidth by `throttle`.
+    pub(crate) fn new(
+        file: File,
+        offset: u64,
+        buffers: usize,
+        buffer_size: usize,
+        drop_behind: bool,
+        throttle: Option<Arc<Throttle>>,
+    ) -> io::Result<Self> {
+        let ring = Ring::new(buffers as u32)?;
+        let mut buffers: Vec<Vec<u8>> = allocate_buffers(buffers, buffer_size)
+            .into_iter()
+            .map(|mut buffer| {
+                buffer.resize(buffer_size, 0);
+                buffer
+            })
+            .collect();
+        // SAFETY: buffers are never resized, and are dropped only after the ring is drained.
+        unsafe { ring.register_buffers(&mut buffers)? };
+        let mut reader = Self {
+            ring,
+            file_length: file.metadata()?.len(),
+            drop_behind: if drop_behind {
+                Some(DropBehind::new(&file))
+            } else {
+                None
+            },
+            file,
+            buffers,
+            slots: VecDeque::new(),
+            next_offset: offset,
+            position: 0,
+            throttle,
+        };
+        for buffer in 0..reader.buffers.len() {
+            reader.submit(buffer)?;
+        }
+        reader.ring.submit()?;
+        Ok(reader)
+    }
+
+    fn submit(&mut self, buffer: usize) -> io::Result<()> {
+        if self.next_offset >= self.file_length {
+            return Ok(());
+        }
+        let remaining = self.file_length - self.next_offset;
+        let length = self.buffers[buffer].len().min(remaining as usize);
+        if let Some(throttle) = &self.throttle {
+            throttle.acquire(Direction::Read, length);
+        }
+        let sqe = Sqe {
+            opcode: IORING_OP_READ_FIXED,
+            fd: self.file.as_raw_fd(),
+            off: self.next_offset,
+            addr: self.buffers[buffer].as_mut_ptr() as u64,
+            len: length as u32,
+            user_data: buffer as u64,
+            buf_index: buffer as u16,
+            ..Sqe::default()
+        };
+        // SAFETY: the buffer is registered and not accessed until its read completes.
+        unsafe { self.ring.push(sqe)? };
+        self.slots.push_back(ReadSlot {
+            buffer,
+            offset: self.next_offset,
+            length,
+            done: false,
+        });
+        self.next_offset += length as u64;
+        Ok(())
+    }
+
+    fn complete_one(&mut self) -> io::Result<()> {
+        let (buffer, result) = self.ring.wait()?;
+        let slot = self
+            .slots
+            .iter_mut()
+            .find(|slot| slot.buffer as u64 == buffer)
+            .expect("completion of a submitted read");
+        // A failed read leaves its slot pending, so that the error is not followed by stale data.
+        let read = completion_error(result)?;
+        if read < slot.length {
+            // Short reads are rare for regular files; finish them synchronously.
+            let offset = slot.offset + read as u64;
+            self.file
+                .read_exact_at(&mut self.buffers[slot.buffer][read..slot.length], offset)?;
+        }
+        slot.done = true;
+        Ok(())
+    }
+}
+
+impl BufRead for UringReader {
+    fn fill_buf(&mut self) -> io::Result<&[u8]> {
+        loop {
+            let (buffer, offset, length, done) = match self.slots.front() {
+                Some(slot) => (slot.buffer, slot.offset, slot.length, slot.done),
+                None => return Ok(&[]),
+            };
+            if !done {
+                self.complete_one()?;
+            } else if self.position < length {
+                return Ok(&self.buffers[buffer][self.position..length]);
+            } else {
+                self.slots.pop_front();
+                self.position = 0;
+                if let Some(drop_behind) = self.drop_behind.as_mut() {
+                    drop_behind.read_to(offset + length as u64)?;
+                }
+                self.submit(buffer)?;
+            }
+        }
+    }
+
+    fn consume(&mut self, amount: usize) {
+        self.position += amount;
+    }
+}
+
+impl Read for UringReader {
+    fn read(&mut self, output: &mut [u8]) -> io::Result<usize> {
+        let available = self.fill_buf()?;
+        let length = available.len().min(output.len());
+        output[..length].copy_from_slice(&available[..length]);
+        self.consume(length);
+        Ok(length)
+    }
+}
+
+impl Drop for UringReader {
+    fn drop(&mut self) {
+        if !self.ring.drain() {
+            std::mem::take(&mut self.buffers)
+                .into_iter()
+                .for_each(std::mem::forget);
+        }
+        if let Some(drop_behind) = self.drop_behind.as_mut() {
+            let _ = drop_behind.finish_read();
+        }
+    }
+}
+
+/// Sequential writer submitting full buffers asynchronously.
+pub(crate) struct UringWriter {
+    ring: Ring,
+    file: File,
+    buffers: Vec<Vec<u8>>,
+    /// File offset and length of the write in flight for each buffer.
+    writes: Vec<(u64, usize)>,
+    free: Vec<usize>,
+    current: Option<usize>,
+    offset: u64,
+    drop_behind: Option<DropBehind>,
+    throttle: Option<Arc<Throttle>>,
+}
+
+impl UringWriter {
+    /// Writes `file` from `offset`, dropping written ranges from the page cache if
+    /// `drop_behind` is set, and limiting the write bandwidth by `throttle`.
+    pub(crate) fn new(
+        file: File,
+        offset: u64,
+        buffers: usize,
+        buffer_size: usize,
+        drop_behind: bool,
+        throttle: Option<Arc<Throttle>>,
+    ) -> io::Result<Self> {
+        // Writes submitted before the last `WINDOW` bytes must have completed when they are
+        // dropped, see `UringWriter::submit`.
+        debug_assert!((buffers * buffer_size) as u64 <= WINDOW);
+        let ring = Ring::new(buffers as u32)?;
+        let mut buffers = allocate_buffers(buffers, buffer_size);
+        // SAFETY: buffers never grow beyond their capacity, so they never move, and they are
+        // dropped only after the ring is drained.
+        unsafe { ring.register_buffers(&mut buffers)? };
+        Ok(Self {
+            ring,
+            writes: vec![(0, 0); buffers.len()],
+            free: (0..buffers.len()).rev().collect(),
+            buffers,
+            current: None,
+            offset,
+            drop_behind: if drop_behind {
+                Some(DropBehind::new(&file))
+            } else {
+                None
+            },
+            file,
+            throttle,
+        })
+    }
+
+    fn submit(&mut self, buffer: usize) -> io::Result<()> {
+        let length = self.buffers[buffer].len();
+        if let Some(throttle) = &self.throttle {
+            throttle.acquire(Direction::Write, length);
+        }
+        let sqe = Sqe {
+            opcode: IORING_OP_WRITE_FIXED,
+            fd: self.file.as_raw_fd(),
+            off: self.offset,
+            addr: self.buffers[buffer].as_ptr() as u64,
+            len: length as u32,
+            user_data: buffer as u64,
+            buf_index: buffer as u16,
+            ..Sqe::default()
+        };
+        // SAFETY: the buffer is registered and not modified until its write completes.
+        unsafe { self.ring.push(sqe)? };
+        self.writes[buffer] = (self.offset, length);
+        self.offset += length as u64;
+        if let Some(drop_behind) = self.drop_behind.as_mut() {
+            // At most one buffer per ring entry is in flight, so only writes within the last
+            // `WINDOW` bytes may be incomplete, and these are not dropped yet.
+            drop_behind.written_to(self.offset)?;
+        }
+        Ok(())
+    }
+
+    fn complete_one(&mut self) -> io::Result<()> {
+        let (buffer, result) = self.ring.wait()?;
+        let buffer = buffer as usize;
+        let written = completion_error(result)?;
+        let (offset, length) = self.writes[buffer];
+        if written < length {
+            self.file.write_all_at(
+                &self.buffers[buffer][written..length],
+                offset + written as u64,
+            )?;
+        }
+        self.buffers[buffer].clear();
+        self.free.push(buffer);
+        Ok(())
+    }
+}
+
+impl Write for UringWriter {
+    fn write(&mut self, data: &[u8]) -> io::Result<usize> {
+        let buffer = if let Some(buffer) = self.current {
+            buffer
+        } else {
+            while self.free.is_empty() {
+                self.complete_one()?;
+            }
+            let buffer = self.free.pop().expect("free buffer");
+            self.current = Some(buffer);
+            buffer
+        };
+        let target = &mut self.buffers[buffer];
+        let length = data.len().min(target.capacity() - target.len());
+        target.extend_from_slice(&data[..length]);
+        if target.len() == target.capacity() {
+            self.current = None;
+            self.submit(buffer)?;
+        }
+        Ok(length)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        if let Some(buffer) = self.current.take() {
+            if self.buffers[buffer].is_empty() {
+                self.free.push(buffer);
+            } else {
+                self.submit(buffer)?;
+            }
+        }
+        while self.ring.in_flight > 0 {
+            self.complete_one()?;
+        }
+        match self.drop_behind.as_mut() {
+            Some(drop_behind) => drop_behind.finish_write(),
+            None => Ok(()),
+        }
+    }
+}
+
+impl Drop for UringWriter {
+    fn drop(&mut self) {
+        let _ = self.flush();
+        if !self.ring.drain() {
+            std::mem::take(&mut self.buffers)
+                .into_iter()
+                .for_each(std::mem::forget);
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use tempfile::TempDir;
+
+    fn data(length: usize) -> Vec<u8> {
+        (0..length).map(|n| (n * 31 % 251) as u8).collect()
+    }
+
+    #[test]
+    fn test_read_and_write() -> io::Result<()> {
+        let temp = TempDir::new()?;
+        let path = temp.path().join("data");
+        let expected = data(50_000);
+        // io_uring may be disabled, e.g., in containers.
+        let mut writer = match UringWriter::new(File::create(&path)?, 0, 3, 4096, true, None) {
+            Ok(writer) => writer,
+            Err(error) => {
+                eprintln!(
+                    "Skipping test_read_and_write: io_uring is unavailable: {}",
+                    error
+                );
+                return Ok(());
+            }
+        };
+        for chunk in expected.chunks(1000) {
+            writer.write_all(chunk)?;
+        }
+        writer.flush()?;
+        drop(writer);
+        assert_eq!(std::fs::read(&path)?, expected);
+
+        let mut reader = UringReader::new(File::open(&path)?, 0, 3, 4096, true, None)?;
+        let mut actual = Vec::new();
+        reader.read_to_end(&mut actual)?;
+        assert_eq!(actual, expected);
+
+        let mut reader = UringReader::new(File::open(&path)?, 10_000, 3, 4096, false, None)?;
+        let mut actual = Vec::new();
+        reader.read_to_end(&mut actual)?;
+        assert_eq!(actual, &expected[10_000..]);
+        Ok(())
+    }
+}
@@ -1,6 +1,20 @@
-use ciff::{ciff_to_pisa, pisa_to_ciff};
+use ciff::{append_ciff, AppendOptions, Deletions, DocumentLengths};
+use ciff::{build_pair_index, ciff_to_pisa, ciff_to_pisa_with_options, impact_order};
+use ciff::{cooccurrence, pisa_to_ciff, CooccurrenceOptions, PairIndexOptions, TermSelection};
+use ciff::{crc32c, filter_ciff, verify_manifest, FilterOptions, ThrottleOptions};
+use ciff::{encode_u32_sequence, find_duplicates, shard_collection, DedupOptions, ShardOptions};
+use ciff::{
+    pisa_to_ciff_with_options, BitmapOptions, HybridCollection, IoBackend, PisaToCiffOptions,
+};
+use ciff::{prune_documents, split_tiers, PruneOptions, TierOptions, TierSplit};
+use ciff::{run_queries, QueryAlgorithm, QueryIndex, QueryOptions, ScoreQuantization};
+use ciff::{sample_collection, CollectionInput, DocumentSample, InvertedFormat, SampleOptions};
+use ciff::{BinaryCollection, Bm25, CiffToPisaOptions, ImpactInput, ImpactOrderOptions};
+use ciff::{CiffReader, CiffReaderOptions};
+use std::convert::TryFrom;
 use std::fs::read;
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
+use std::time::Duration;
 use tempfile::TempDir;
 
 /// Tests the toy index that can be downloaded from: https://github.com/osirrc/ciff/issues/12
@@ -109,3 +123,1167 @@ fn test_to_and_from_ciff() -> anyhow::Result<()> {
 
     Ok(())
 }
+
+fn read_collection(path: &std::path::Path) -> anyhow::Result<Vec<Vec<u32>>> {
+    let bytes = read(path)?;
+    let collection = BinaryCollection::try_from(&bytes[..])?;
+    Ok(collection
+        .map(|sequence| sequence.map(|s| s.iter().collect()))
+        .collect::<Result<_, _>>()?)
+}
+
+/// `(term, docid, tf)` postings of the binary collection `basename` in `dir`.
+fn read_postings(dir: &Path, basename: &str) -> anyhow::Result<Vec<(String, u32, u32)>> {
+    let path = |extension: &str| dir.join(format!("{}.{}", basename, extension));
+    let documents = read_collection(&path("docs"))?;
+    let frequencies = read_collection(&path("freqs"))?;
+    let terms = std::fs::read_to_string(path("terms"))?;
+    let mut postings = Vec::new();
+    for ((docids, tfs), term) in documents[1..].iter().zip(&frequencies).zip(terms.lines()) {
+        for (&docid, &tf) in docids.iter().zip(tfs) {
+            postings.push((term.to_string(), docid, tf));
+        }
+    }
+    Ok(postings)
+}
+
+/// Asserts that the binary collections `lhs` and `rhs` in `dir` are identical.
+fn assert_same_collection(dir: &Path, lhs: &str, rhs: &str) -> anyhow::Result<()> {
+    for extension in &["docs", "freqs", "terms", "sizes", "documents"] {
+        assert_eq!(
+            read(dir.join(format!("{}.{}", lhs, extension)))?,
+            read(dir.join(format!("{}.{}", rhs, extension)))?,
+            "{}",
+            extension
+        );
+    }
+    Ok(())
+}
+
+/// Writes the binary collection `range` in `dir`, of the last two documents of `input`.
+fn write_range_collection(input: &Path, dir: &Path) -> anyhow::Result<()> {
+    let options = FilterOptions {
+        documents: Some(1..3),
+        ..FilterOptions::default()
+    };
+    filter_ciff(input, &dir.join("range.ciff"), &options)?;
+    ciff_to_pisa(&dir.join("range.ciff"), &dir.join("range"))
+}
+
+#[test]
+fn test_toy_index_with_scores() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let output_path = temp.path().join("coll");
+    let options = CiffToPisaOptions {
+        threads: 3,
+        scores: Some(ScoreQuantization {
+            bm25: Bm25::default(),
+            bits: 8,
+        }),
+        ..CiffToPisaOptions::default()
+    };
+    ciff_to_pisa_with_options(&input_path, &output_path, &options)?;
+    let frequencies = read_collection(&temp.path().join("coll.freqs"))?;
+    let scores = read_collection(&temp.path().join("coll.scores"))?;
+    assert_eq!(frequencies.len(), scores.len());
+    for (term_frequencies, term_scores) in frequencies.iter().zip(&scores) {
+        assert_eq!(term_frequencies.len(), term_scores.len());
+        assert!(term_scores.iter().all(|&score| score >= 1 && score <= 255));
+    }
+    // "text" occurs once in documents 0 and 1 (lengths 6 and 4), and 3 times in document 2.
+    let text = &scores[7];
+    assert!(text[0] < text[1]);
+    assert!(text[1] < text[2]);
+    assert!(
+        std::fs::read_to_string(temp.path().join("coll.scores.quantization"))?
+            .starts_with("bm25: k1=0.9 b=0.4; quantization: scale=linear bits=8 min=0 max=")
+    );
+
+    // A collection without documents has no scores to write.
+    let no_documents = FilterOptions {
+        documents: Some(0..0),
+        ..FilterOptions::default()
+    };
+    let empty_path = temp.path().join("empty.ciff");
+    filter_ciff(&input_path, &empty_path, &no_documents)?;
+    ciff_to_pisa_with_options(&empty_path, &temp.path().join("empty"), &options)?;
+    assert!(read_collection(&temp.path().join("empty.scores"))?.is_empty());
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_documents_only() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let output_path = temp.path().join("coll");
+    let options = CiffToPisaOptions {
+        documents_only: true,
+        ..CiffToPisaOptions::default()
+    };
+    ciff_to_pisa_with_options(&input_path, &output_path, &options)?;
+    assert_eq!(
+        std::fs::read_to_string(temp.path().join("coll.documents"))?,
+        "WSJ_1\nTREC_DOC_1\nDOC222\n"
+    );
+    assert_eq!(
+        std::fs::read(temp.path().join("coll.sizes"))?,
+        vec![3, 0, 0, 0, 6, 0, 0, 0, 4, 0, 0, 0, 6, 0, 0, 0]
+    );
+    assert!(!temp.path().join("coll.docs").exists());
+    assert!(!temp.path().join("coll.terms").exists());
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_impact_order() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let ciff_output = temp.path().join("ciff");
+    impact_order(
+        &ImpactInput::Ciff(input_path.clone()),
+        &ciff_output,
+        &ImpactOrderOptions { threads: 2 },
+    )?;
+    let documents = read_collection(&temp.path().join("ciff.docs"))?;
+    let segments = read_collection(&temp.path().join("ciff.segments"))?;
+    assert_eq!(documents[0], vec![3]);
+    // "text" occurs once in documents 0 and 1, and 3 times in document 2.
+    assert_eq!(documents[8], vec![2, 0, 1]);
+    assert_eq!(segments[7], vec![3, 1, 1, 2]);
+
+    let pisa_output = temp.path().join("pisa");
+    ciff_to_pisa(&input_path, &pisa_output)?;
+    assert_eq!(
+        std::fs::read_to_string(temp.path().join("ciff.terms"))?,
+        std::fs::read_to_string(temp.path().join("pisa.terms"))?
+    );
+    let input = ImpactInput::Pisa {
+        documents: temp.path().join("pisa.docs"),
+        impacts: temp.path().join("pisa.freqs"),
+    };
+    let impact_output = temp.path().join("pisa-impact");
+    impact_order(&input, &impact_output, &ImpactOrderOptions { threads: 2 })?;
+    assert_eq!(
+        read_collection(&temp.path().join("pisa-impact.docs"))?,
+        documents
+    );
+    assert_eq!(
+        read_collection(&temp.path().join("pisa-impact.segments"))?,
+        segments
+    );
+    assert!(!temp.path().join("pisa-impact.terms").exists());
+
+    // Impacts missing the last list are rejected.
+    let freqs = std::fs::read(temp.path().join("pisa.freqs"))?;
+    let truncated = temp.path().join("truncated.freqs");
+    std::fs::write(&truncated, &freqs[..freqs.len() - 8])?;
+    let input = ImpactInput::Pisa {
+        documents: temp.path().join("pisa.docs"),
+        impacts: truncated,
+    };
+    assert!(impact_order(&input, &impact_output, &ImpactOrderOptions { threads: 2 }).is_err());
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_queries() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let output_path = temp.path().join("coll");
+    ciff_to_pisa(&input_path, &output_path)?;
+    let index = QueryIndex::open(&output_path, Bm25::default())?;
+    assert_eq!(index.num_documents(), 3);
+    for terms in &[
+        vec!["text"],
+        vec!["text", "head", "veri"],
+        vec!["simpl", "missing"],
+    ] {
+        let exhaustive = index.search(terms, 2, QueryAlgorithm::Exhaustive);
+        let max_score = index.search(terms, 2, QueryAlgorithm::MaxScore);
+        assert_eq!(exhaustive, max_score);
+    }
+    // "text" occurs 3 times in DOC222.
+    let results = index.search(&["text"], 10, QueryAlgorithm::MaxScore);
+    assert_eq!(index.title(results[0].docid), Some("DOC222"));
+    assert_eq!(results.len(), 3);
+
+    let queries = "q1:text head\nveri\n";
+    let mut output = Vec::new();
+    let options = QueryOptions {
+        k: 1,
+        threads: 2,
+        ..QueryOptions::default()
+    };
+    let stats = run_queries(&index, queries.as_bytes(), &mut output, &options)?;
+    assert_eq!(stats.queries, 2);
+    let run = String::from_utf8(output)?;
+    let lines: Vec<_> = run.lines().collect();
+    assert_eq!(lines.len(), 2);
+    assert!(lines[0].starts_with("q1 Q0 "));
+    assert!(lines[1].starts_with("1 Q0 "));
+
+    // A lexicon with more terms than lists is rejected.
+    let terms_path = temp.path().join("coll.terms");
+    let mut terms = std::fs::read_to_string(&terms_path)?;
+    terms.push_str("extra\n");
+    std::fs::write(&terms_path, terms)?;
+    assert!(QueryIndex::open(&output_path, Bm25::default()).is_err());
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_pairs() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let output_path = temp.path().join("coll");
+    ciff_to_pisa(&input_path, &output_path)?;
+    let queries_path = temp.path().join("queries");
+    std::fs::write(
+        &queries_path,
+        "1:text head\n2:head text\n3:text veri\n4:missing\n",
+    )?;
+    let pairs_path = temp.path().join("pairs");
+    let options = PairIndexOptions {
+        pairs: 1,
+        threads: 2,
+    };
+    build_pair_index(&output_path, &queries_path, &pairs_path, &options)?;
+    assert_eq!(
+        std::fs::read_to_string(temp.path().join("pairs.pairs"))?,
+        "head\ttext\t2\n"
+    );
+    assert_eq!(
+        read_collection(&temp.path().join("pairs.docs"))?,
+        vec![vec![3], vec![0, 1, 2]]
+    );
+
+    // A lexicon without a term per list is rejected.
+    let terms_path = temp.path().join("coll.terms");
+    let terms = std::fs::read_to_string(&terms_path)?;
+    std::fs::write(&terms_path, format!("{}extra\n", terms))?;
+    assert!(build_pair_index(&output_path, &queries_path, &pairs_path, &options).is_err());
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_cooccurrence() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let output_path = temp.path().join("coll");
+    ciff_to_pisa(&input_path, &output_path)?;
+    let terms_path = temp.path().join("selected");
+    std::fs::write(&terms_path, "text\nhead\nveri\nmissing\n")?;
+    for &bitmap_density in &[0.0, 1.0, 2.0] {
+        let cooccurrence_path = temp.path().join("cooccurrence");
+        let options = CooccurrenceOptions {
+            threads: 2,
+            min_count: 1,
+            bitmap_density,
+        };
+        let selection = TermSelection::Terms(terms_path.clone());
+        cooccurrence(&output_path, &selection, &cooccurrence_path, &options)?;
+        let lines: Vec<Vec<String>> = std::fs::read_to_string(&cooccurrence_path)?
+            .lines()
+            .map(|line| line.split('\t').map(str::to_string).collect())
+            .collect();
+        // "head" and "text" occur in all documents, and "veri" only in document 1.
+        assert_eq!(lines.len(), 3);
+        assert_eq!(&lines[0][..3], &["head", "text", "3"]);
+        assert_eq!(&lines[1][..3], &["head", "veri", "1"]);
+        assert_eq!(&lines[2][..3], &["text", "veri", "1"]);
+        assert!(lines[0][3].parse::<f64>()?.abs() < 1e-9);
+    }
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_bitmaps() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let plain_path = temp.path().join("plain");
+    ciff_to_pisa(&input_path, &plain_path)?;
+    let expected = read_collection(&temp.path().join("plain.docs"))?;
+    for &replace_lists in &[false, true] {
+        let output_path = temp.path().join(format!("hybrid-{}", replace_lists));
+        let options = CiffToPisaOptions {
+            bitmaps: Some(BitmapOptions {
+                density: 0.9,
+                replace_lists,
+            }),
+            ..CiffToPisaOptions::default()
+        };
+        ciff_to_pisa_with_options(&input_path, &output_path, &options)?;
+        let collection = HybridCollection::open(&output_path)?;
+        assert_eq!(collection.num_lists(), 9);
+        // "head" (t5) and "text" (t7) occur in all 3 documents.
+        assert_eq!(collection.num_bitmaps(), 2);
+        for term_id in 0..9 {
+            let list = collection.list(term_id);
+            assert_eq!(list.is_bitmap(), term_id == 5 || term_id == 7);
+            assert_eq!(list.to_vec(), expected[term_id as usize + 1]);
+            assert_eq!(list.iter().count(), list.len());
+        }
+        let head = collection.list(5);
+        assert_eq!(head.intersect(&collection.list(7)), vec![0, 1, 2]);
+        assert_eq!(head.intersect(&collection.list(6)), vec![1, 2]);
+        assert_eq!(collection.list(6).intersection_size(&collection.list(8)), 1);
+        let docs = read_collection(&temp.path().join(format!("hybrid-{}.docs", replace_lists)))?;
+        assert_eq!(docs[6].is_empty(), replace_lists);
+        let freqs = read_collection(&temp.path().join(format!("hybrid-{}.freqs", replace_lists)))?;
+        assert_eq!(freqs[5].is_empty(), replace_lists);
+        assert!(docs[1..]
+            .iter()
+            .zip(&freqs)
+            .all(|(d, f)| d.len() == f.len()));
+    }
+
+    // A header with too few words per bitmap for the documents is rejected.
+    let output_path = temp.path().join("hybrid-false");
+    let bitmaps_path = temp.path().join("hybrid-false.bitmaps");
+    let mut bitmaps = std::fs::read(&bitmaps_path)?;
+    bitmaps[4..8].copy_from_slice(&0_u32.to_le_bytes());
+    std::fs::write(&bitmaps_path, bitmaps)?;
+    assert!(HybridCollection::open(&output_path).is_err());
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_uring() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let blocking_path = temp.path().join("blocking");
+    let uring_path = temp.path().join("uring");
+    let scores = Some(ScoreQuantization {
+        bm25: Bm25::default(),
+        bits: 8,
+    });
+    ciff_to_pisa_with_options(
+        &input_path,
+        &blocking_path,
+        &CiffToPisaOptions {
+            scores,
+            ..CiffToPisaOptions::default()
+        },
+    )?;
+    ciff_to_pisa_with_options(
+        &input_path,
+        &uring_path,
+        &CiffToPisaOptions {
+            scores,
+            io: IoBackend::Uring,
+            ..CiffToPisaOptions::default()
+        },
+    )?;
+    for extension in &["docs", "freqs", "scores", "terms", "sizes", "documents"] {
+        assert_eq!(
+            read(temp.path().join(format!("uring.{}", extension)))?,
+            read(temp.path().join(format!("blocking.{}", extension)))?,
+            "{}",
+            extension
+        );
+    }
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_drop_behind() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+    ciff_to_pisa(&input_path, &path("coll"))?;
+    for &io in &[IoBackend::Blocking, IoBackend::Uring] {
+        let options = CiffToPisaOptions {
+            io,
+            drop_behind: true,
+            ..CiffToPisaOptions::default()
+        };
+        ciff_to_pisa_with_options(&input_path, &path("dropped"), &options)?;
+        for extension in &["docs", "freqs", "terms", "sizes", "documents"] {
+            assert_eq!(
+                read(path(&format!("dropped.{}", extension)))?,
+                read(path(&format!("coll.{}", extension)))?
+            );
+        }
+    }
+    let description = "toy";
+    let export = |output: &str, drop_behind: bool| {
+        pisa_to_ciff_with_options(
+            &path("coll"),
+            &path("coll.terms"),
+            &path("coll.documents"),
+            &path(output),
+            description,
+            &PisaToCiffOptions {
+                drop_behind,
+                ..PisaToCiffOptions::default()
+            },
+        )
+    };
+    export("kept.ciff", false)?;
+    export("dropped.ciff", true)?;
+    assert_eq!(read(path("dropped.ciff"))?, read(path("kept.ciff"))?);
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_throttled() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+    std::fs::write(path("control"), "read 1000\nwrite unlimited\n")?;
+    let throttle = ThrottleOptions {
+        max_read_mbps: Some(1.0),
+        max_write_mbps: Some(1.0),
+        control_file: Some(path("control")),
+    };
+    ciff_to_pisa(&input_path, &path("coll"))?;
+    for &io in &[IoBackend::Blocking, IoBackend::Uring] {
+        let options = CiffToPisaOptions {
+            io,
+            throttle: throttle.clone(),
+            ..CiffToPisaOptions::default()
+        };
+        ciff_to_pisa_with_options(&input_path, &path("throttled"), &options)?;
+        for extension in &["docs", "freqs", "terms", "sizes", "documents"] {
+            assert_eq!(
+                read(path(&format!("throttled.{}", extension)))?,
+                read(path(&format!("coll.{}", extension)))?
+            );
+        }
+    }
+    pisa_to_ciff(
+        &path("coll"),
+        &path("coll.terms"),
+        &path("coll.documents"),
+        &path("coll.ciff"),
+        "toy",
+    )?;
+    pisa_to_ciff_with_options(
+        &path("coll"),
+        &path("coll.terms"),
+        &path("coll.documents"),
+        &path("throttled.ciff"),
+        "toy",
+        &PisaToCiffOptions {
+            throttle,
+            ..PisaToCiffOptions::default()
+        },
+    )?;
+    assert_eq!(read(path("throttled.ciff"))?, read(path("coll.ciff"))?);
+
+    let invalid = CiffToPisaOptions {
+        throttle: ThrottleOptions {
+            max_read_mbps: Some(0.0),
+            ..ThrottleOptions::default()
+        },
+        ..CiffToPisaOptions::default()
+    };
+    assert!(ciff_to_pisa_with_options(&input_path, &path("invalid"), &invalid).is_err());
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_resume() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+    ciff_to_pisa(&input_path, &path("coll"))?;
+
+    // Checkpoints are removed once the conversion succeeds.
+    let options = CiffToPisaOptions {
+        checkpoint_interval: Some(Duration::from_secs(0)),
+        manifest: true,
+        ..CiffToPisaOptions::default()
+    };
+    ciff_to_pisa_with_options(&input_path, &path("resumed"), &options)?;
+    assert!(!path("resumed.checkpoint").exists());
+
+    // A conversion failing after the postings leaves its last checkpoint behind.
+    std::fs::remove_file(path("resumed.manifest"))?;
+    std::fs::create_dir(path("resumed.manifest"))?;
+    assert!(ciff_to_pisa_with_options(&input_path, &path("resumed"), &options).is_err());
+    std::fs::remove_dir(path("resumed.manifest"))?;
+    let checkpoint: serde_json::Value =
+        serde_json::from_str(&std::fs::read_to_string(path("resumed.checkpoint"))?)?;
+
+    // Resume from a checkpoint taken right after the header, with stale data to truncate.
+    let header_end = 1 + u64::from(read(&input_path)?[0]);
+    std::fs::write(
+        path("resumed.checkpoint"),
+        format!(
+            r#"{{"fingerprint":{},"input_offset":{},"lists":0,"terms":0,"documents":3,
+                "outputs":{{"docs":8,"freqs":0,"terms":0}}}}"#,
+            checkpoint["fingerprint"], header_end
+        ),
+    )?;
+    let options = CiffToPisaOptions {
+        resume: true,
+        ..options
+    };
+    ciff_to_pisa_with_options(&input_path, &path("resumed"), &options)?;
+    assert!(!path("resumed.checkpoint").exists());
+    verify_manifest(&path("resumed.manifest"), 1)?;
+    for extension in &["docs", "freqs", "terms", "sizes", "documents"] {
+        assert_eq!(
+            read(path(&format!("resumed.{}", extension)))?,
+            read(path(&format!("coll.{}", extension)))?
+        );
+    }
+
+    // A checkpoint of a different input, or of different options, is rejected.
+    std::fs::write(
+        path("resumed.checkpoint"),
+        r#"{"input_offset":0,"lists":0,"documents":3,"outputs":{}}"#,
+    )?;
+    assert!(ciff_to_pisa_with_options(&input_path, &path("resumed"), &options).is_err());
+    std::fs::write(
+        path("resumed.checkpoint"),
+        serde_json::to_string(&checkpoint)?,
+    )?;
+    let drop_empty = CiffToPisaOptions {
+        deletions: Some(Deletions {
+            drop_empty: true,
+            ..Deletions::default()
+        }),
+        ..options
+    };
+    let error = ciff_to_pisa_with_options(&input_path, &path("resumed"), &drop_empty).unwrap_err();
+    assert!(error.to_string().contains("different options"));
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_memory_limit() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+    ciff_to_pisa(&input_path, &path("coll"))?;
+    for &io in &[IoBackend::Blocking, IoBackend::Uring] {
+        let options = CiffToPisaOptions {
+            io,
+            memory_limit: Some(48 << 20),
+            ..CiffToPisaOptions::default()
+        };
+        ciff_to_pisa_with_options(&input_path, &path("limited"), &options)?;
+        for extension in &["docs", "freqs", "terms", "sizes", "documents"] {
+            assert_eq!(
+                read(path(&format!("limited.{}", extension)))?,
+                read(path(&format!("coll.{}", extension)))?
+            );
+        }
+    }
+    let too_low = CiffToPisaOptions {
+        memory_limit: Some(1 << 20),
+        scores: Some(ScoreQuantization {
+            bm25: Bm25::default(),
+            bits: 8,
+        }),
+        ..CiffToPisaOptions::default()
+    };
+    assert!(ciff_to_pisa_with_options(&input_path, &path("limited"), &too_low).is_err());
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_manifest() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+    for &io in &[IoBackend::Blocking, IoBackend::Uring] {
+        let options = CiffToPisaOptions {
+            io,
+            scores: Some(ScoreQuantization {
+                bm25: Bm25::default(),
+                bits: 8,
+            }),
+            bitmaps: Some(BitmapOptions {
+                density: 0.5,
+                replace_lists: false,
+            }),
+            manifest: true,
+            ..CiffToPisaOptions::default()
+        };
+        ciff_to_pisa_with_options(&input_path, &path("coll"), &options)?;
+        let manifest = verify_manifest(&path("coll.manifest"), 2)?;
+        let names: Vec<&str> = manifest.files.keys().map(String::as_str).collect();
+        assert_eq!(
+            names,
+            vec![
+                "coll.bitmaps",
+                "coll.docs",
+                "coll.documents",
+                "coll.freqs",
+                "coll.scores",
+                "coll.scores.quantization",
+                "coll.sizes",
+                "coll.terms"
+            ]
+        );
+        for (name, checksum) in &manifest.files {
+            assert_eq!(checksum.crc32c, crc32c(0, &read(path(name))?));
+        }
+    }
+
+    pisa_to_ciff_with_options(
+        &path("coll"),
+        &path("coll.terms"),
+        &path("coll.documents"),
+        &path("coll.ciff"),
+        "toy",
+        &PisaToCiffOptions {
+            manifest: true,
+            ..PisaToCiffOptions::default()
+        },
+    )?;
+    let manifest = verify_manifest(&path("coll.ciff.manifest"), 2)?;
+    assert_eq!(manifest.files.len(), 1);
+    let mut corrupted = read(path("coll.ciff"))?;
+    corrupted[10] ^= 0xFF;
+    std::fs::write(path("coll.ciff"), corrupted)?;
+    assert!(verify_manifest(&path("coll.ciff.manifest"), 2).is_err());
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_filter() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+    let terms = |name: &str| -> anyhow::Result<Vec<String>> {
+        Ok(std::fs::read_to_string(path(name))?
+            .lines()
+            .map(String::from)
+            .collect())
+    };
+
+    filter_ciff(&input_path, &path("all.ciff"), &FilterOptions::default())?;
+    assert_eq!(read(path("all.ciff"))?, read(&input_path)?);
+
+    let options = FilterOptions {
+        terms: Some(
+            vec!["head".to_string(), "simpl".to_string(), "veri".to_string()]
+                .into_iter()
+                .collect(),
+        ),
+        min_df: Some(2),
+        ..FilterOptions::default()
+    };
+    filter_ciff(&input_path, &path("terms.ciff"), &options)?;
+    ciff_to_pisa(&path("terms.ciff"), &path("terms"))?;
+    assert_eq!(terms("terms.terms")?, vec!["head", "simpl"]);
+    assert_eq!(
+        read_collection(&path("terms.docs"))?,
+        vec![vec![3], vec![0, 1, 2], vec![1, 2]]
+    );
+    assert_eq!(
+        terms("terms.documents")?,
+        vec!["WSJ_1", "TREC_DOC_1", "DOC222"]
+    );
+
+    let options = FilterOptions {
+        documents: Some(1..3),
+        ..FilterOptions::default()
+    };
+    filter_ciff(&input_path, &path("range.ciff"), &options)?;
+    assert!(!path("range.ciff.body").exists());
+    ciff_to_pisa(&path("range.ciff"), &path("range"))?;
+    assert_eq!(
+        terms("range.terms")?,
+        vec!["enough", "head", "simpl", "text", "veri"]
+    );
+    assert_eq!(
+        read_collection(&path("range.docs"))?,
+        vec![
+            vec![2],
+            vec![1],
+            vec![0, 1],
+            vec![0, 1],
+            vec![0, 1],
+            vec![0]
+        ]
+    );
+    assert_eq!(terms("range.documents")?, vec!["TREC_DOC_1", "DOC222"]);
+    assert_eq!(read_collection(&path("range.sizes"))?, vec![vec![4, 6]]);
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_append() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+    ciff_to_pisa(&input_path, &path("coll"))?;
+
+    // The first document, followed by a delta with the other two.
+    let split = |name: &str, documents| {
+        let options = FilterOptions {
+            documents: Some(documents),
+            ..FilterOptions::default()
+        };
+        filter_ciff(&input_path, &path(name), &options)
+    };
+    split("base.ciff", 0..1)?;
+    split("delta.ciff", 1..3)?;
+    ciff_to_pisa(&path("base.ciff"), &path("base"))?;
+    append_ciff(
+        &path("base"),
+        &path("delta.ciff"),
+        &path("appended"),
+        &AppendOptions::default(),
+    )?;
+    for extension in &["docs", "freqs", "terms", "sizes", "documents"] {
+        assert_eq!(
+            read(path(&format!("appended.{}", extension)))?,
+            read(path(&format!("coll.{}", extension)))?,
+            "{}",
+            extension
+        );
+    }
+    assert!(append_ciff(
+        &path("base"),
+        &path("delta.ciff"),
+        &path("base"),
+        &AppendOptions::default()
+    )
+    .is_err());
+    assert!(append_ciff(
+        &path("base"),
+        &path("delta.ciff"),
+        &temp.path().join(".").join("base"),
+        &AppendOptions::default()
+    )
+    .is_err());
+
+    // Collections with an extra frequency list or missing sizes are rejected.
+    let copy_base = |name: &str| -> anyhow::Result<()> {
+        for extension in &["docs", "freqs", "terms", "sizes", "documents"] {
+            std::fs::copy(
+                path(&format!("base.{}", extension)),
+                path(&format!("{}.{}", name, extension)),
+            )?;
+        }
+        Ok(())
+    };
+    copy_base("extra")?;
+    let mut freqs = read(path("extra.freqs"))?;
+    freqs.extend_from_slice(&[1, 0, 0, 0, 1, 0, 0, 0]);
+    std::fs::write(path("extra.freqs"), freqs)?;
+    copy_base("short")?;
+    let sizes = read(path("short.sizes"))?;
+    std::fs::write(path("short.sizes"), &sizes[..sizes.len() - 4])?;
+    for name in &["extra", "short"] {
+        assert!(append_ciff(
+            &path(name),
+            &path("delta.ciff"),
+            &path("rejected"),
+            &AppendOptions::default()
+        )
+        .is_err());
+    }
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_deletions() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+
+    // Deleting the first document is the same as keeping the range of the others.
+    write_range_collection(&input_path, temp.path())?;
+
+    let deletions = Deletions::from_docids(vec![0]);
+    let options = CiffToPisaOptions {
+        deletions: Some(deletions.clone()),
+        ..CiffToPisaOptions::default()
+    };
+    ciff_to_pisa_with_options(&input_path, &path("deleted"), &options)?;
+    assert_same_collection(temp.path(), "deleted", "range")?;
+
+    ciff_to_pisa(&input_path, &path("coll"))?;
+    let options = PisaToCiffOptions {
+        deletions: Some(deletions),
+        ..PisaToCiffOptions::default()
+    };
+    pisa_to_ciff_with_options(
+        &path("coll"),
+        &path("coll.terms"),
+        &path("coll.documents"),
+        &path("deleted.ciff"),
+        "",
+        &options,
+    )?;
+    ciff_to_pisa(&path("deleted.ciff"), &path("roundtrip"))?;
+    assert_same_collection(temp.path(), "roundtrip", "range")?;
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_sample() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+
+    write_range_collection(&input_path, temp.path())?;
+    ciff_to_pisa(&input_path, &path("coll"))?;
+
+    // Sampling the last two documents from either format, to either format, is the same as
+    // keeping their range.
+    let sample = DocumentSample::Docids(vec![1, 2]);
+    let inputs = [
+        CollectionInput::Ciff(input_path.clone()),
+        CollectionInput::Pisa(path("coll")),
+    ];
+    for (index, input) in inputs.iter().enumerate() {
+        let to_pisa = format!("pisa{}", index);
+        let options = SampleOptions {
+            format: InvertedFormat::Pisa,
+            threads: 2,
+            ..SampleOptions::default()
+        };
+        sample_collection(input, &path(&to_pisa), &sample, &options)?;
+        assert_same_collection(temp.path(), &to_pisa, "range")?;
+
+        let to_ciff = format!("ciff{}", index);
+        let options = SampleOptions {
+            format: InvertedFormat::Ciff,
+            threads: 2,
+            ..SampleOptions::default()
+        };
+        sample_collection(
+            input,
+            &path(&format!("{}.ciff", to_ciff)),
+            &sample,
+            &options,
+        )?;
+        ciff_to_pisa(&path(&format!("{}.ciff", to_ciff)), &path(&to_ciff))?;
+        assert_same_collection(temp.path(), &to_ciff, "range")?;
+    }
+
+    // Samples of the same seed are reproducible.
+    let sample = DocumentSample::Fraction {
+        fraction: 0.5,
+        seed: 42,
+    };
+    for name in &["first.ciff", "second.ciff"] {
+        sample_collection(&inputs[0], &path(name), &sample, &SampleOptions::default())?;
+    }
+    assert_eq!(read(path("first.ciff"))?, read(path("second.ciff"))?);
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_prune() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+    let options = PruneOptions {
+        threads: 2,
+        ..PruneOptions::default()
+    };
+    ciff_to_pisa(&input_path, &path("coll"))?;
+
+    // Keeping more terms than any document has changes nothing.
+    prune_documents(&input_path, &path("all.ciff"), 1000, &options)?;
+    ciff_to_pisa(&path("all.ciff"), &path("all"))?;
+    assert_same_collection(temp.path(), "coll", "all")?;
+
+    // Keeping the top term of each document, with a budget of a single document, in memory or
+    // transposed to partitions, keeps exactly the postings with the largest weight of each.
+    let tiny = PruneOptions {
+        memory_budget: 1,
+        ..options.clone()
+    };
+    prune_documents(&input_path, &path("top.ciff"), 1, &options)?;
+    prune_documents(&input_path, &path("top-tiny.ciff"), 1, &tiny)?;
+    assert_eq!(read(path("top.ciff"))?, read(path("top-tiny.ciff"))?);
+    ciff_to_pisa(&path("top.ciff"), &path("top"))?;
+
+    let all = read_postings(temp.path(), "coll")?;
+    let max_weight = |docid: u32| {
+        all.iter()
+            .filter(|posting| posting.1 == docid)
+            .map(|posting| posting.2)
+            .max()
+    };
+    let expected: Vec<_> = all
+        .iter()
+        .filter(|posting| Some(posting.2) == max_weight(posting.1))
+        .cloned()
+        .collect();
+    assert!(expected.len() < all.len());
+    assert_eq!(read_postings(temp.path(), "top")?, expected);
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_tiers() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+    let options = TierOptions { threads: 2 };
+    ciff_to_pisa(&input_path, &path("coll"))?;
+    write_range_collection(&input_path, temp.path())?;
+
+    // The two documents of highest rank form the hot tier, and all of them the cold tier.
+    let split = TierSplit::StaticRank {
+        ranks: vec![0.0, 2.0, 1.0],
+        count: 2,
+    };
+    let input = CollectionInput::Ciff(input_path.clone());
+    split_tiers(&input, &path("rank"), &split, &options)?;
+    assert_same_collection(temp.path(), "rank.hot", "range")?;
+    assert_same_collection(temp.path(), "rank.cold", "coll")?;
+    assert_eq!(std::fs::read_to_string(path("rank.docmap"))?, "1\n2\n");
+
+    // Splits are the same from either input format.
+    let split = TierSplit::MinWeight(2);
+    split_tiers(&input, &path("ciff"), &split, &options)?;
+    split_tiers(
+        &CollectionInput::Pisa(path("coll")),
+        &path("pisa"),
+        &split,
+        &options,
+    )?;
+    assert_same_collection(temp.path(), "ciff.hot", "pisa.hot")?;
+    assert_same_collection(temp.path(), "ciff.cold", "coll")?;
+    assert_same_collection(temp.path(), "pisa.cold", "coll")?;
+    let hot_frequencies = read_collection(&path("ciff.hot.freqs"))?;
+    assert!(!hot_frequencies.is_empty());
+    assert!(hot_frequencies.iter().flatten().all(|&tf| tf >= 2));
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_shards() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+    let input = CollectionInput::Ciff(input_path.clone());
+    let options = ShardOptions {
+        threads: 2,
+        ..ShardOptions::default()
+    };
+    shard_collection(&input, &path("memory"), 2, &options)?;
+    // Forward entries transposed to one partition per document give the same shards.
+    let tiny = ShardOptions {
+        memory_budget: 1,
+        ..options
+    };
+    shard_collection(&input, &path("shard"), 2, &tiny)?;
+    for name in &[
+        "docmap",
+        "summary",
+        "centroids",
+        "0.docs",
+        "1.docs",
+        "1.terms",
+    ] {
+        assert_eq!(
+            read(path(&format!("memory.{}", name)))?,
+            read(path(&format!("shard.{}", name)))?,
+            "{}",
+            name
+        );
+    }
+
+    // Every posting is in the shard of its document, under its new ID.
+    ciff_to_pisa(&input_path, &path("coll"))?;
+    let docmap: Vec<(usize, u32)> = std::fs::read_to_string(path("shard.docmap"))?
+        .lines()
+        .map(|line| {
+            let (shard, docid) = line.split_once('\t').unwrap();
+            (shard.parse().unwrap(), docid.parse().unwrap())
+        })
+        .collect();
+    assert_eq!(docmap.len(), 3);
+    let shards = [
+        read_postings(temp.path(), "shard.0")?,
+        read_postings(temp.path(), "shard.1")?,
+    ];
+    let all = read_postings(temp.path(), "coll")?;
+    assert_eq!(shards[0].len() + shards[1].len(), all.len());
+    for (term, docid, tf) in all {
+        let (shard, id) = docmap[docid as usize];
+        assert!(shards[shard].contains(&(term, id, tf)));
+    }
+    let summary = std::fs::read_to_string(path("shard.summary"))?;
+    let summary_df: usize = summary
+        .lines()
+        .map(|line| line.split('\t').nth(2).unwrap().parse::<usize>().unwrap())
+        .sum();
+    assert_eq!(summary_df, shards[0].len() + shards[1].len());
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_dedup() -> anyhow::Result<()> {
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+    let options = DedupOptions {
+        threads: 2,
+        ..DedupOptions::default()
+    };
+    // Toy documents are too short to be candidates.
+    let toy = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    assert_eq!(
+        find_duplicates(&CollectionInput::Ciff(toy.clone()), &options)?,
+        Deletions::default()
+    );
+    // A collection without documents has no signatures.
+    let no_documents = FilterOptions {
+        documents: Some(0..0),
+        ..FilterOptions::default()
+    };
+    filter_ciff(&toy, &path("empty.ciff"), &no_documents)?;
+    let empty = CollectionInput::Ciff(path("empty.ciff"));
+    assert_eq!(find_duplicates(&empty, &options)?, Deletions::default());
+
+    // Documents 0 and 3 share all their terms, and document 2 all but one of them.
+    let lists: Vec<Vec<u32>> = vec![
+        vec![0, 2, 3],
+        vec![0, 2, 3],
+        vec![0, 1, 2, 3],
+        vec![0, 2, 3],
+        vec![0, 2, 3],
+        vec![0, 1, 3],
+        vec![0, 3],
+    ];
+    let mut documents = Vec::new();
+    encode_u32_sequence(&mut documents, 1, [4])?;
+    let mut frequencies = Vec::new();
+    for list in &lists {
+        let length = u32::try_from(list.len())?;
+        encode_u32_sequence(&mut documents, length, list.iter().copied())?;
+        encode_u32_sequence(&mut frequencies, length, list.iter().map(|_| 1))?;
+    }
+    std::fs::write(path("coll.docs"), documents)?;
+    std::fs::write(path("coll.freqs"), frequencies)?;
+    let mut sizes = Vec::new();
+    encode_u32_sequence(&mut sizes, 4, [7, 2, 6, 7])?;
+    std::fs::write(path("coll.sizes"), sizes)?;
+    std::fs::write(path("coll.terms"), "a\nb\nc\nd\ne\nf\ng\n")?;
+    std::fs::write(path("coll.documents"), "d0\nd1\nd2\nd3\n")?;
+    let input = CollectionInput::Pisa(path("coll"));
+    let exact = DedupOptions {
+        threshold: 1.0,
+        ..options.clone()
+    };
+    assert_eq!(
+        find_duplicates(&input, &exact)?,
+        Deletions::from_docids([3])
+    );
+    // Forward entries are spilled to one partition per document, and shorter bands catch
+    // documents of lower similarity.
+    let near = DedupOptions {
+        bands: 32,
+        rows: 2,
+        threshold: 0.5,
+        memory_budget: 1,
+        ..options
+    };
+    let duplicates = find_duplicates(&input, &near)?;
+    assert_eq!(duplicates, Deletions::from_docids([2, 3]));
+    duplicates.write_docids(&path("duplicates"))?;
+    assert_eq!(Deletions::read_docids(&path("duplicates"))?, duplicates);
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_document_lengths() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let path = |name: &str| temp.path().join(name);
+    let options = CiffToPisaOptions {
+        document_lengths: DocumentLengths::Recompute,
+        deletions: Some(Deletions::from_docids([1])),
+        ..CiffToPisaOptions::default()
+    };
+    ciff_to_pisa_with_options(&input_path, &path("recomputed"), &options)?;
+    let documents = read_collection(&path("recomputed.docs"))?;
+    let frequencies = read_collection(&path("recomputed.freqs"))?;
+    let mut sums = vec![0; 2];
+    for (docids, tfs) in documents[1..].iter().zip(&frequencies) {
+        for (&docid, &tf) in docids.iter().zip(tfs) {
+            sums[docid as usize] += tf;
+        }
+    }
+    assert_eq!(read_collection(&path("recomputed.sizes"))?, vec![sums]);
+
+    // Records pass verification if and only if they match the recomputed lengths.
+    ciff_to_pisa_with_options(
+        &input_path,
+        &path("records"),
+        &CiffToPisaOptions {
+            document_lengths: DocumentLengths::Records,
+            ..options.clone()
+        },
+    )?;
+    let verified = ciff_to_pisa_with_options(
+        &input_path,
+        &path("verified"),
+        &CiffToPisaOptions {
+            document_lengths: DocumentLengths::Verify,
+            ..options.clone()
+        },
+    );
+    let records = read(path("records.sizes"))?;
+    assert_eq!(read(path("verified.sizes"))?, records);
+    assert_eq!(verified.is_ok(), records == read(path("recomputed.sizes"))?);
+
+    // Scores need lengths before postings.
+    let scores = CiffToPisaOptions {
+        scores: Some(ScoreQuantization {
+            bm25: Bm25::default(),
+            bits: 8,
+        }),
+        ..options
+    };
+    assert!(ciff_to_pisa_with_options(&input_path, &path("scores"), &scores).is_err());
+    Ok(())
+}
+
+#[test]
+fn test_toy_index_lookup() -> anyhow::Result<()> {
+    let input_path = PathBuf::from("tests/test_data/toy-complete-20200309.ciff");
+    let temp = TempDir::new().unwrap();
+    let output_path = temp.path().join("coll");
+    ciff_to_pisa(&input_path, &output_path)?;
+    let documents = read_collection(&temp.path().join("coll.docs"))?;
+    let frequencies = read_collection(&temp.path().join("coll.freqs"))?;
+    let terms = std::fs::read_to_string(temp.path().join("coll.terms"))?;
+
+    let reader = CiffReader::open(&input_path, &CiffReaderOptions::default())?;
+    assert_eq!(reader.num_documents(), 3);
+    assert_eq!(reader.num_lists() as usize, terms.lines().count());
+    // Every list is read once, then served from the cache.
+    for _ in 0..2 {
+        for ((docids, tfs), term) in documents[1..].iter().zip(&frequencies).zip(terms.lines()) {
+            let list = reader.list(term)?.unwrap();
+            assert_eq!(&list.docids, docids);
+            assert_eq!(&list.tfs, tfs);
+        }
+    }
+    assert!(reader.list("missing")?.is_none());
+    assert!(reader.list_by_id(reader.num_lists()).is_err());
+    let stats = reader.cache_stats();
+    assert_eq!(stats.misses, u64::from(reader.num_lists()));
+    assert_eq!(stats.hits, stats.misses);
+    assert_eq!(stats.lists, stats.misses);
+
+    // Without room for any list, every lookup reads the file.
+    let uncached = CiffReader::open(
+        &input_path,
+        &CiffReaderOptions {
+            cache_bytes: 0,
+            ..CiffReaderOptions::default()
+        },
+    )?;
+    let term = terms.lines().next().unwrap();
+    assert_eq!(uncached.list(term)?, reader.list(term)?);
+    assert_eq!(uncached.list(term)?, reader.list(term)?);
+    assert_eq!(uncached.cache_stats().misses, 2);
+    assert_eq!(uncached.cache_stats().bytes, 0);
+    Ok(())
+}